@@ -1937,6 +1937,21 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_sparam());
+    add_opt(common_arg(
+        {"--logits-subset"}, "TOKEN_ID,...",
+        "compute the logits only for the given tokens, all other tokens are never produced,\n"
+        "i.e. `--logits-subset 3869,1939` to answer with ' Yes' or ' No'",
+        [](common_params & params, const std::string & value) {
+            params.sampling.logits_subset.clear();
+            for (const auto & token : string_split<std::string>(value, ',')) {
+                try {
+                    params.sampling.logits_subset.push_back(std::stoi(token));
+                } catch (const std::exception &) {
+                    throw std::invalid_argument("invalid token id: " + token);
+                }
+            }
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}).set_sparam());
     add_opt(common_arg(
         {"--grammar"}, "GRAMMAR",
         string_format("BNF-like grammar to constrain generations (see samples in grammars/ dir) (default: '%s')", params.sampling.grammar.c_str()),
@@ -2109,6 +2124,70 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.cache_type_v = kv_cache_type_from_str(value);
         }
     ).set_env("LLAMA_ARG_CACHE_TYPE_V"));
+    add_opt(common_arg(
+        {"--kv-hot"}, "N",
+        string_format(
+            "number of recent KV cells kept in the --cache-type-k/v types, older cells are requantized to\n"
+            "the --cache-type-k-cold/v-cold types (default: %d, 0 = disabled, requires --flash-attn, CPU only)", params.n_kv_hot),
+        [](common_params & params, int value) {
+            params.n_kv_hot = value;
+        }
+    ).set_env("LLAMA_ARG_KV_HOT"));
+    add_opt(common_arg(
+        {"--stream-window"}, "N",
+        string_format(
+            "streaming KV cache: keep the --stream-sink first tokens and the N most recent tokens, the tokens in between\n"
+            "are evicted one by one instead of shifting the context (default: %d, 0 = disabled)", params.n_stream_window),
+        [](common_params & params, int value) {
+            params.n_stream_window = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_STREAM_WINDOW"));
+    add_opt(common_arg(
+        {"--stream-sink"}, "N",
+        string_format("streaming KV cache: number of attention sink tokens kept at the start (default: %d)", params.n_stream_sink),
+        [](common_params & params, int value) {
+            params.n_stream_sink = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_STREAM_SINK"));
+    add_opt(common_arg(
+        {"--logits-top-k"}, "N",
+        string_format(
+            "select the N largest logits of each output in the graph and copy only those out of it,\n"
+            "the samplers see only these candidates, not supported with grammars\n"
+            "(default: %d, 0 = all logits, 1 = greedy)", params.n_logits_top_k),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_logits_top_k = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_MAIN, LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_LOGITS_TOP_K"));
+    add_opt(common_arg(
+        {"-ctkc", "--cache-type-k-cold"}, "TYPE",
+        string_format(
+            "KV cache data type for the older K cells (see --kv-hot)\n"
+            "allowed values: %s\n"
+            "(default: %s)",
+            get_all_kv_cache_types().c_str(),
+            ggml_type_name(params.cache_type_k_cold)
+        ),
+        [](common_params & params, const std::string & value) {
+            params.cache_type_k_cold = kv_cache_type_from_str(value);
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_K_COLD"));
+    add_opt(common_arg(
+        {"-ctvc", "--cache-type-v-cold"}, "TYPE",
+        string_format(
+            "KV cache data type for the older V cells (see --kv-hot)\n"
+            "allowed values: %s\n"
+            "(default: %s)",
+            get_all_kv_cache_types().c_str(),
+            ggml_type_name(params.cache_type_v_cold)
+        ),
+        [](common_params & params, const std::string & value) {
+            params.cache_type_v_cold = kv_cache_type_from_str(value);
+        }
+    ).set_env("LLAMA_ARG_CACHE_TYPE_V_COLD"));
     add_opt(common_arg(
         {"--hellaswag"},
         "compute HellaSwag score over random tasks from datafile supplied with -f",
@@ -2186,6 +2265,17 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.defrag_thold = std::stof(value);
         }
     ).set_env("LLAMA_ARG_DEFRAG_THOLD"));
+    add_opt(common_arg(
+        {"--defrag-step"}, "N",
+        string_format("max MiB of KV cache data moved per defragmentation step, the defragmentation is spread\n"
+                      "over the following decodes (default: %d, 0 = unbounded)", params.defrag_step_mib),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.defrag_step_mib = value;
+        }
+    ).set_env("LLAMA_ARG_DEFRAG_STEP"));
     add_opt(common_arg(
         {"-np", "--parallel"}, "N",
         string_format("number of parallel sequences to decode (default: %d)", params.n_parallel),
@@ -2274,6 +2364,31 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.use_mmap = false;
         }
     ).set_env("LLAMA_ARG_NO_MMAP"));
+    add_opt(common_arg(
+        {"--hugepages"}, "TYPE",
+        "back the memory-mapped weights with huge pages to reduce TLB misses (Linux only)\n"
+        "- none: regular pages (default)\n"
+        "- file: map the model file with transparent huge pages, if the filesystem supports them\n"
+        "- anon: copy the model into anonymous memory, from the hugetlb pool if it has enough free pages,\n"
+        "  otherwise with transparent huge pages",
+        [](common_params & params, const std::string & value) {
+            /**/ if (value == "none") { params.hugepages = LLAMA_HUGEPAGES_TYPE_NONE; }
+            else if (value == "file") { params.hugepages = LLAMA_HUGEPAGES_TYPE_FILE; }
+            else if (value == "anon") { params.hugepages = LLAMA_HUGEPAGES_TYPE_ANON; }
+            else { throw std::invalid_argument("invalid value"); }
+        }
+    ).set_env("LLAMA_ARG_HUGEPAGES"));
+    add_opt(common_arg(
+        {"--expert-budget"}, "N",
+        "max MiB of MoE expert weights kept in memory, the other experts are read from the memory-mapped\n"
+        "model file when the router selects them (default: 0 = all, Linux only)",
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.expert_budget = (size_t) value * 1024 * 1024;
+        }
+    ).set_env("LLAMA_ARG_EXPERT_BUDGET"));
     add_opt(common_arg(
         {"--numa"}, "TYPE",
         "attempt optimizations that help on some NUMA systems\n"
@@ -2819,6 +2934,50 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             params.n_cache_reuse = value;
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_CACHE_REUSE"));
+    add_opt(common_arg(
+        {"--sched-budget"}, "N",
+        string_format(
+            "max number of tokens decoded per iteration; the tokens of the generating slots are added first,\n"
+            "the rest of the budget is filled with prompt chunks (default: %d, 0 = batch size)", params.n_sched_budget
+        ),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_sched_budget = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SCHED_BUDGET"));
+    add_opt(common_arg(
+        {"--prefill-chunk"}, "N",
+        string_format("max number of prompt tokens of a single slot per iteration (default: %d, 0 = unlimited)", params.n_prefill_chunk),
+        [](common_params & params, int value) {
+            if (value < 0) {
+                throw std::invalid_argument("invalid value");
+            }
+            params.n_prefill_chunk = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_PREFILL_CHUNK"));
+    add_opt(common_arg(
+        {"--sched-policy"}, "POLICY",
+        "order in which the pending prompts are processed; one of:\n"
+        "- fifo: in order of arrival of the requests, regardless of the slot they are assigned to\n"
+        "- sjf: shortest remaining prompt first\n"
+        "- fair: the prompt budget of each iteration is split equally between the pending prompts\n"
+        "(default: fifo)",
+        [](common_params & params, const std::string & value) {
+            /**/ if (value == "fifo") { params.sched_policy = COMMON_SCHED_POLICY_FIFO; }
+            else if (value == "sjf")  { params.sched_policy = COMMON_SCHED_POLICY_SJF; }
+            else if (value == "fair") { params.sched_policy = COMMON_SCHED_POLICY_FAIR; }
+            else { throw std::invalid_argument("invalid value"); }
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SCHED_POLICY"));
+    add_opt(common_arg(
+        {"--sched-max-wait"}, "N",
+        string_format("pending prompts that have not been processed for more than N ms are processed first, regardless of the policy (default: %d, -1 = disabled)", params.sched_max_wait),
+        [](common_params & params, int value) {
+            params.sched_max_wait = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_SCHED_MAX_WAIT"));
     add_opt(common_arg(
         {"--metrics"},
         string_format("enable prometheus compatible metrics endpoint (default: %s)", params.endpoint_metrics ? "enabled" : "disabled"),
@@ -2858,6 +3017,21 @@ common_params_context common_params_parser_init(common_params & params, llama_ex
             }
         }
     ).set_examples({LLAMA_EXAMPLE_SERVER}));
+    add_opt(common_arg(
+        {"--kv-spill-idle"}, "N",
+        string_format("move the KV cache of slots that have been idle for more than N seconds to a memory-mapped file on disk,\n"
+                      "it is read back when the slot is used again (default: %d, -1 = disabled)", params.kv_spill_idle),
+        [](common_params & params, int value) {
+            params.kv_spill_idle = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_IDLE"));
+    add_opt(common_arg(
+        {"--kv-spill-dir"}, "PATH",
+        "directory of the temporary file used to hold the spilled KV cache (default: $TMPDIR)",
+        [](common_params & params, const std::string & value) {
+            params.kv_spill_dir = value;
+        }
+    ).set_examples({LLAMA_EXAMPLE_SERVER}).set_env("LLAMA_ARG_KV_SPILL_DIR"));
     add_opt(common_arg(
         {"--jinja"},
         "use jinja template for chat (default: disabled)",
@@ -925,6 +925,13 @@ struct common_init_result common_init_from_params(common_params & params) {
         params.ctx_shift = false;
     }
 
+    if (params.n_logits_top_k > 0 && !params.sampling.grammar.empty()) {
+        LOG_ERR("%s: grammars are not supported with n_logits_top_k > 0\n", __func__);
+        llama_free(lctx);
+        llama_model_free(model);
+        return iparams;
+    }
+
     if (!params.control_vectors.empty()) {
         if (params.control_vector_layer_start <= 0) params.control_vector_layer_start = 1;
         if (params.control_vector_layer_end   <= 0) params.control_vector_layer_end   = llama_model_n_layer(model);
@@ -1105,6 +1112,8 @@ struct llama_model_params common_model_params_to_llama(common_params & params) {
     mparams.split_mode      = params.split_mode;
     mparams.tensor_split    = params.tensor_split;
     mparams.use_mmap        = params.use_mmap;
+    mparams.hugepages       = params.hugepages;
+    mparams.expert_budget   = params.expert_budget;
     mparams.use_mlock       = params.use_mlock;
     mparams.check_tensors   = params.check_tensors;
 
@@ -1150,6 +1159,11 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.pooling_type      = params.pooling_type;
     cparams.attention_type    = params.attention_type;
     cparams.defrag_thold      = params.defrag_thold;
+    cparams.defrag_step_mib   = params.defrag_step_mib;
+    cparams.n_kv_hot          = params.n_kv_hot;
+    cparams.n_stream_sink     = params.n_stream_sink;
+    cparams.n_stream_window   = params.n_stream_window;
+    cparams.n_logits_top_k    = params.n_logits_top_k;
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv       = !params.no_kv_offload;
@@ -1161,6 +1175,11 @@ struct llama_context_params common_context_params_to_llama(const common_params &
     cparams.type_k = params.cache_type_k;
     cparams.type_v = params.cache_type_v;
 
+    cparams.type_k_cold = params.cache_type_k_cold;
+    cparams.type_v_cold = params.cache_type_v_cold;
+
+    cparams.kv_spill_dir = params.kv_spill_dir.empty() ? nullptr : params.kv_spill_dir.c_str();
+
     return cparams;
 }
 
@@ -1303,6 +1322,50 @@ std::vector<llama_token> common_tokenize(
     return result;
 }
 
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+               const struct llama_vocab * vocab,
+       const std::vector<std::string> & texts,
+                                  bool   add_special,
+                                  bool   parse_special,
+                               int32_t   n_threads) {
+    std::vector<const char *> text_ptrs;
+    std::vector<int32_t>      text_lens;
+
+    // upper limit for the number of tokens
+    size_t n_tokens_max = 0;
+    for (const auto & text : texts) {
+        text_ptrs.push_back(text.data());
+        text_lens.push_back(text.length());
+        n_tokens_max += text.length() + 2 * add_special;
+    }
+    if (n_tokens_max >= (size_t) std::numeric_limits<int32_t>::max()) {
+        throw std::runtime_error("Tokenization failed: input text too large, tokenization result exceeds int32_t limit");
+    }
+
+    std::vector<llama_token> tokens(n_tokens_max);
+    std::vector<int32_t>     n_tokens(texts.size());
+
+    int32_t n_total = llama_tokenize_batch(vocab, text_ptrs.data(), text_lens.data(), texts.size(), tokens.data(), tokens.size(), n_tokens.data(), add_special, parse_special, n_threads);
+    if (n_total == std::numeric_limits<int32_t>::min()) {
+        throw std::runtime_error("Tokenization failed: input text too large, tokenization result exceeds int32_t limit");
+    }
+    if (n_total < 0) {
+        tokens.resize(-n_total);
+        int check = llama_tokenize_batch(vocab, text_ptrs.data(), text_lens.data(), texts.size(), tokens.data(), tokens.size(), n_tokens.data(), add_special, parse_special, n_threads);
+        GGML_ASSERT(check == -n_total);
+    }
+
+    std::vector<std::vector<llama_token>> result(texts.size());
+
+    size_t offset = 0;
+    for (size_t i = 0; i < texts.size(); ++i) {
+        result[i].assign(tokens.begin() + offset, tokens.begin() + offset + n_tokens[i]);
+        offset += n_tokens[i];
+    }
+
+    return result;
+}
+
 std::string common_token_to_piece(const struct llama_context * ctx, llama_token token, bool special) {
     const llama_model * model = llama_get_model(ctx);
     const llama_vocab * vocab = llama_model_get_vocab(model);
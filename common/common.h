@@ -176,7 +176,8 @@ struct common_params_sampling {
     std::vector<common_grammar_trigger> grammar_triggers; // optional triggers (for lazy grammars)
     std::set<llama_token>               preserved_tokens;
 
-    std::vector<llama_logit_bias> logit_bias; // logit biases to apply
+    std::vector<llama_logit_bias> logit_bias;    // logit biases to apply
+    std::vector<llama_token>      logits_subset; // compute the logits only for these tokens (empty: all tokens)
 
     // print the parameters into a string
     std::string print() const;
@@ -222,6 +223,13 @@ enum common_reasoning_format {
     COMMON_REASONING_FORMAT_DEEPSEEK,        // Extract thinking tag contents and return as `message.reasoning_content`, including in streaming deltas.
 };
 
+// order in which the server processes the pending prompts
+enum common_sched_policy {
+    COMMON_SCHED_POLICY_FIFO, // in order of arrival of the requests (not in slot order)
+    COMMON_SCHED_POLICY_SJF,  // shortest remaining prompt first
+    COMMON_SCHED_POLICY_FAIR, // the prompt budget of each iteration is split equally between the pending prompts
+};
+
 struct common_params {
     int32_t n_predict             =    -1; // new tokens to predict
     int32_t n_ctx                 =  4096; // context size
@@ -242,6 +250,11 @@ struct common_params {
     float   yarn_beta_slow        =  1.0f; // YaRN high correction dim
     int32_t yarn_orig_ctx         =     0; // YaRN original context length
     float   defrag_thold          =  0.1f; // KV cache defragmentation threshold
+    int32_t defrag_step_mib       =     0; // max MiB of KV data moved per defragmentation step (0 = unbounded)
+    int32_t n_kv_hot              =     0; // number of recent KV cells kept in cache_type_k/v (0 = tiered KV cache disabled)
+    int32_t n_stream_sink         =     4; // streaming KV cache: number of attention sink tokens kept at the start
+    int32_t n_stream_window       =     0; // streaming KV cache: number of recent tokens kept (0 = disabled)
+    int32_t n_logits_top_k        =     0; // number of largest logits of each output selected in the graph (0 = all logits)
 
     // offload params
     std::vector<ggml_backend_dev_t> devices; // devices to use for offloading
@@ -260,6 +273,10 @@ struct common_params {
 
     ggml_numa_strategy numa = GGML_NUMA_STRATEGY_DISABLED;
 
+    enum llama_hugepages_type hugepages = LLAMA_HUGEPAGES_TYPE_NONE; // huge pages for the mmap-ed weights
+
+    size_t expert_budget = 0; // max bytes of resident MoE expert weights (0 = all)
+
     enum llama_rope_scaling_type rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED;
     enum llama_pooling_type      pooling_type      = LLAMA_POOLING_TYPE_UNSPECIFIED; // pooling type for embeddings
     enum llama_attention_type    attention_type    = LLAMA_ATTENTION_TYPE_UNSPECIFIED; // attention type for embeddings
@@ -345,6 +362,9 @@ struct common_params {
     ggml_type cache_type_k = GGML_TYPE_F16; // KV cache data type for the K
     ggml_type cache_type_v = GGML_TYPE_F16; // KV cache data type for the V
 
+    ggml_type cache_type_k_cold = GGML_TYPE_Q8_0; // KV cache data type for the older K cells (see n_kv_hot)
+    ggml_type cache_type_v_cold = GGML_TYPE_Q8_0; // KV cache data type for the older V cells (see n_kv_hot)
+
     common_conversation_mode conversation_mode = COMMON_CONVERSATION_MODE_AUTO;
 
     // multimodal models (see tools/mtmd)
@@ -367,6 +387,12 @@ struct common_params {
     int32_t n_threads_http = -1;           // number of threads to process HTTP requests (TODO: support threadpool)
     int32_t n_cache_reuse  = 0;            // min chunk size to reuse from the cache via KV shifting
 
+    // continuous batching scheduler
+    int32_t n_sched_budget  = 0;  // max tokens per iteration, the tokens of the generating slots are reserved first (0 = n_batch)
+    int32_t n_prefill_chunk = 0;  // max prompt tokens of a single slot per iteration (0 = unlimited)
+    int32_t sched_max_wait  = -1; // pending prompts that waited more than N ms are processed first (-1 = disabled)
+    common_sched_policy sched_policy = COMMON_SCHED_POLICY_FIFO;
+
     std::string hostname      = "127.0.0.1";
     std::string public_path   = "";                                                                         // NOLINT
     std::string chat_template = "";                                                                         // NOLINT
@@ -391,6 +417,9 @@ struct common_params {
 
     std::string slot_save_path;
 
+    int32_t     kv_spill_idle = -1; // spill the KV state of slots idle for more than N seconds to disk (-1 = disabled)
+    std::string kv_spill_dir;       // directory of the scratch file for spilled KV state (empty = $TMPDIR)
+
     float slot_prompt_similarity = 0.5f;
 
     // batched-bench params
@@ -602,6 +631,15 @@ std::vector<llama_token> common_tokenize(
                         bool   add_special,
                         bool   parse_special = false);
 
+// tokenizes several strings at once, the long strings are split and tokenized on n_threads threads (<= 0: all)
+// the result is the same as calling common_tokenize on each string
+std::vector<std::vector<llama_token>> common_tokenize_batch(
+               const struct llama_vocab * vocab,
+       const std::vector<std::string> & texts,
+                                  bool   add_special,
+                                  bool   parse_special = false,
+                               int32_t   n_threads = -1);
+
 // tokenizes a token into a piece, optionally renders special/control tokens
 // should work similar to Python's `tokenizer.id_to_piece`
 std::string common_token_to_piece(
@@ -2,10 +2,12 @@
 
 #include "common.h"
 #include "log.h"
+#include "thread-pool.h"
 
 #include <cmath>
 #include <unordered_map>
 #include <algorithm>
+#include <thread>
 
 // the ring buffer works similarly to std::deque, but with a fixed capacity
 // TODO: deduplicate with llama-impl.h
@@ -112,13 +114,47 @@ struct common_sampler {
 
     llama_token_data_array cur_p;
 
-    void set_logits(struct llama_context * ctx, int idx) {
-        const auto * logits = llama_get_logits_ith(ctx, idx);
+    // the logits of the output to sample, looked up by fetch_logits()
+    const llama_token * top_k_ids    = nullptr;
+    const float       * top_k_logits = nullptr;
 
+    int32_t n_top_k = 0;
+
+    const float * logits = nullptr;
+
+    int32_t n_vocab = 0;
+
+    void fetch_logits(struct llama_context * ctx, int idx) {
         const llama_model * model = llama_get_model(ctx);
         const llama_vocab * vocab = llama_model_get_vocab(model);
 
-        const int n_vocab = llama_vocab_n_tokens(vocab);
+        n_vocab = llama_vocab_n_tokens(vocab);
+
+        // only the candidates selected in the graph are available (sorted by descending logit)
+        n_top_k = llama_get_logits_top_k_ith(ctx, idx, &top_k_ids, &top_k_logits);
+        if (n_top_k > 0) {
+            // the logits of the other tokens are not known, so a grammar that rejects all candidates could not sample
+            // from the rest of the vocab
+            GGML_ASSERT(params.grammar.empty() && "grammars are not supported with n_logits_top_k > 0");
+            return;
+        }
+
+        logits = llama_get_logits_ith(ctx, idx);
+    }
+
+    // does not access the context
+    void set_logits() {
+        if (n_top_k > 0) {
+            cur.resize(n_top_k);
+
+            for (int32_t i = 0; i < n_top_k; i++) {
+                cur[i] = llama_token_data{top_k_ids[i], top_k_logits[i], 0.0f};
+            }
+
+            cur_p = { cur.data(), cur.size(), -1, true };
+
+            return;
+        }
 
         cur.resize(n_vocab);
 
@@ -335,8 +371,9 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
     }
 }
 
-llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
-    gsmpl->set_logits(ctx, idx);
+// sample from the logits looked up by fetch_logits()
+static llama_token common_sampler_sample_fetched(struct common_sampler * gsmpl, bool grammar_first) {
+    gsmpl->set_logits();
 
     auto & grmr  = gsmpl->grmr;
     auto & chain = gsmpl->chain;
@@ -371,7 +408,7 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
 
     // resampling:
     // if the token is not valid, sample again, but first apply the grammar sampler and then the sampling chain
-    gsmpl->set_logits(ctx, idx);
+    gsmpl->set_logits();
 
     llama_sampler_apply(grmr,  &cur_p);
     llama_sampler_apply(chain, &cur_p);
@@ -381,6 +418,31 @@ llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_co
     return cur_p.data[cur_p.selected].id;
 }
 
+llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first) {
+    gsmpl->fetch_logits(ctx, idx);
+
+    return common_sampler_sample_fetched(gsmpl, grammar_first);
+}
+
+std::vector<llama_token> common_sampler_sample_batch(struct common_thread_pool & pool, const std::vector<struct common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, bool grammar_first) {
+    GGML_ASSERT(gsmpls.size() == idxs.size());
+
+    const int n = gsmpls.size();
+
+    // the outputs are looked up on this thread - afterwards, the samplers do not touch the context
+    for (int i = 0; i < n; ++i) {
+        gsmpls[i]->fetch_logits(ctx, idxs[i]);
+    }
+
+    std::vector<llama_token> result(n);
+
+    pool.parallel_for(n, [&](int64_t i) {
+        result[i] = common_sampler_sample_fetched(gsmpls[i], grammar_first);
+    }, llama_n_threads_batch(ctx));
+
+    return result;
+}
+
 std::vector<llama_token> common_sampler_sample_and_accept_n(struct common_sampler * gsmpl, struct llama_context * ctx, const std::vector<int> & idxs, const llama_tokens & draft, bool grammar_first) {
     GGML_ASSERT(idxs.size() == draft.size() + 1 && "idxs.size() must be draft.size() + 1");
 
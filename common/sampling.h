@@ -7,6 +7,8 @@
 #include <string>
 #include <vector>
 
+struct common_thread_pool;
+
 // common_sampler extends llama_sampler with additional functionality:
 //
 //  - grammar support
@@ -60,6 +62,14 @@ void common_perf_print(const struct llama_context * ctx, const struct common_sam
 //
 llama_token common_sampler_sample(struct common_sampler * gsmpl, struct llama_context * ctx, int idx, bool grammar_first = false);
 
+// sample the outputs idxs[i] of the last evaluation with gsmpls[i], e.g. one output per sequence
+//
+// same as calling common_sampler_sample for each pair, but the samplers run concurrently on the calling thread and the
+// threads of the pool, up to n_threads_batch threads
+// the samplers must be distinct; the sampled tokens are not accepted
+//
+std::vector<llama_token> common_sampler_sample_batch(struct common_thread_pool & pool, const std::vector<struct common_sampler *> & gsmpls, struct llama_context * ctx, const std::vector<int> & idxs, bool grammar_first = false);
+
 // generalized version of common_sampler_sample
 //
 // will cross-reference the sampled tokens with a batch of draft tokens and accept those that match
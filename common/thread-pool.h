@@ -0,0 +1,44 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// common_thread_pool
+//
+
+// a fixed set of worker threads for the parallel loops of the tools and of common, e.g. batched sampling, the imatrix
+// accumulation or the shards of gguf-split
+// the threads are created once and sleep while there is no work
+struct common_thread_pool {
+    // n_threads worker threads, in addition to the threads that call parallel_for()
+    explicit common_thread_pool(int n_threads);
+
+    ~common_thread_pool();
+
+    common_thread_pool(const common_thread_pool &) = delete;
+    common_thread_pool & operator=(const common_thread_pool &) = delete;
+
+    int n_threads() const;
+
+    // run fn(i) for i in [0, n) on the calling thread and up to n_threads_max - 1 worker threads, and return when all
+    // items are done (n_threads_max <= 0: all workers)
+    // after the first exception thrown by fn the remaining items are skipped, and the exception is rethrown
+    void parallel_for(int64_t n, const std::function<void(int64_t)> & fn, int n_threads_max = 0);
+
+private:
+    void worker();
+
+    std::vector<std::thread> threads;
+
+    std::mutex                        mutex;
+    std::condition_variable           cv;
+    std::deque<std::function<void()>> queue;
+
+    bool stop = false;
+};
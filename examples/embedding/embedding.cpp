@@ -137,12 +137,9 @@ int main(int argc, char ** argv) {
     const std::string added_sep_token = llama_vocab_get_add_sep(vocab) ? llama_vocab_get_text(vocab, llama_vocab_sep(vocab)) : "";
     const std::string added_eos_token = llama_vocab_get_add_eos(vocab) ? llama_vocab_get_text(vocab, llama_vocab_eos(vocab)) : "";
 
-    // tokenize the prompts and trim
-    std::vector<std::vector<int32_t>> inputs;
+    // split classification pairs and insert expected separator tokens
+    std::vector<std::string> texts;
     for (const auto & prompt : prompts) {
-        std::vector<llama_token> inp;
-
-        // split classification pairs and insert expected separator tokens
         if (pooling_type == LLAMA_POOLING_TYPE_RANK && prompt.find(params.cls_sep) != std::string::npos) {
             std::vector<std::string> pairs = split_lines(prompt, params.cls_sep);
             std::string final_prompt;
@@ -159,16 +156,20 @@ int main(int argc, char ** argv) {
                 }
             }
 
-            inp = common_tokenize(ctx, final_prompt, true, true);
+            texts.push_back(final_prompt);
         } else {
-            inp = common_tokenize(ctx, prompt, true, true);
+            texts.push_back(prompt);
         }
+    }
+
+    // tokenize the prompts and trim
+    std::vector<std::vector<int32_t>> inputs = common_tokenize_batch(vocab, texts, true, true, params.cpuparams_batch.n_threads);
+    for (const auto & inp : inputs) {
         if (inp.size() > n_batch) {
             LOG_ERR("%s: number of tokens in input line (%lld) exceeds batch size (%lld), increase batch size and re-run\n",
                     __func__, (long long int) inp.size(), (long long int) n_batch);
             return 1;
         }
-        inputs.push_back(inp);
     }
 
     // check if the last token is SEP/EOS
@@ -186,8 +186,16 @@ int main(int argc, char ** argv) {
     GGML_ASSERT(params.n_batch >= params.n_ctx);
 
     // tokenize the prompts and trim
-    for (auto & chunk : chunks) {
-        auto inp = common_tokenize(ctx, chunk.textdata, true, false);
+    std::vector<std::string> chunk_texts;
+    for (const auto & chunk : chunks) {
+        chunk_texts.push_back(chunk.textdata);
+    }
+
+    std::vector<std::vector<llama_token>> chunk_tokens = common_tokenize_batch(vocab, chunk_texts, true, false, params.cpuparams_batch.n_threads);
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        auto & chunk = chunks[i];
+        auto & inp   = chunk_tokens[i];
         if (inp.size() > n_batch) {
             LOG_ERR("%s: chunk size (%lld) exceeds batch size (%lld), increase batch size and re-run\n",
                     __func__, (long long int) inp.size(), (long long int) n_batch);
@@ -197,7 +205,7 @@ int main(int argc, char ** argv) {
         if (llama_vocab_eos(vocab) >= 0 && (inp.empty() || inp.back() != llama_vocab_eos(vocab))) {
             inp.push_back(llama_vocab_eos(vocab));
         }
-        chunk.tokens = inp;
+        chunk.tokens = std::move(inp);
     }
 
     // tokenization stats
@@ -133,6 +133,15 @@ extern "C" {
 
     GGML_BACKEND_API ggml_backend_reg_t ggml_backend_cpu_reg(void);
 
+    // repacked weights - obtained with ggml_backend_reg_get_proc_address, NULL when the CPU backend is built without repacking
+    //  - "ggml_backend_cpu_repack_buffer_type"       : buffer type that interleaves the data of the weights in set_tensor
+    //  - "ggml_backend_cpu_repacked_buffer_type"     : same, for data that is already interleaved (copied as-is)
+    //  - "ggml_backend_cpu_repacked_buffer_from_ptr" : repacked buffer on top of existing memory, e.g. a mmap-ed file
+    //  - "ggml_backend_cpu_repack_layout"            : name of the layout used for the tensor on this CPU, NULL if not repacked
+    typedef ggml_backend_buffer_type_t (*ggml_backend_cpu_repack_buffer_type_t)(void);
+    typedef ggml_backend_buffer_t      (*ggml_backend_cpu_repacked_buffer_from_ptr_t)(void * ptr, size_t size);
+    typedef const char *               (*ggml_backend_cpu_repack_layout_t)(const struct ggml_tensor * tensor);
+
     GGML_BACKEND_API void ggml_cpu_fp32_to_fp16(const float *, ggml_fp16_t *, int64_t);
     GGML_BACKEND_API void ggml_cpu_fp16_to_fp32(const ggml_fp16_t *, float *, int64_t);
     GGML_BACKEND_API void ggml_cpu_fp32_to_bf16(const float *, ggml_bf16_t *, int64_t);
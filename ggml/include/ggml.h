@@ -493,6 +493,7 @@ extern "C" {
         GGML_OP_ARANGE,
         GGML_OP_TIMESTEP_EMBEDDING,
         GGML_OP_ARGSORT,
+        GGML_OP_ARGSORT_TOP_K,
         GGML_OP_LEAKY_RELU,
 
         GGML_OP_FLASH_ATTN_EXT,
@@ -1845,6 +1846,13 @@ extern "C" {
             struct ggml_tensor  * a,
             int                   k);
 
+    // indices of the top k elements per row, in descending order of their values
+    // same result as ggml_top_k, but the rest of the row is not sorted
+    GGML_API struct ggml_tensor * ggml_argsort_top_k(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            int                   k);
+
 #define GGML_KQ_MASK_PAD 64
 
     // q:    [n_embd_k, n_batch,     n_head,    1]
@@ -1862,6 +1870,25 @@ extern "C" {
             float                 max_bias,
             float                 logit_softcap);
 
+    // same as ggml_flash_attn_ext, but the KV data is split in two tiers that may use different types
+    // the mask covers the concatenation of both tiers - the first k0->ne[1] columns belong to k0/v0
+    // k0:   [n_embd_k, n_kv0,       n_head_kv, 1]
+    // v0:   [n_embd_v, n_kv0,       n_head_kv, 1]
+    // k1:   [n_embd_k, n_kv1,       n_head_kv, 1]
+    // v1:   [n_embd_v, n_kv1,       n_head_kv, 1]
+    // mask: [n_kv0 + n_kv1, n_batch_pad, 1,    1]
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext_tiered(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k0,
+            struct ggml_tensor  * v0,
+            struct ggml_tensor  * k1,
+            struct ggml_tensor  * v1,
+            struct ggml_tensor  * mask,
+            float                 scale,
+            float                 max_bias,
+            float                 logit_softcap);
+
     GGML_API void ggml_flash_attn_ext_set_prec(
             struct ggml_tensor * a,
             enum ggml_prec       prec);
@@ -118,6 +118,10 @@ extern "C" {
     // get ith C string from array with given key_id
     GGML_API const char * gguf_get_arr_str (const struct gguf_context * ctx, int64_t key_id, size_t i);
 
+    // get ith string from array with given key_id and its length in bytes, the string is not necessarily NUL-terminated
+    // for files read with gguf_init_from_file, this points into the file mapping and avoids copying the string
+    GGML_API const char * gguf_get_arr_str_n(const struct gguf_context * ctx, int64_t key_id, size_t i, size_t * n);
+
     GGML_API int64_t        gguf_get_n_tensors    (const struct gguf_context * ctx);
     GGML_API int64_t        gguf_find_tensor      (const struct gguf_context * ctx, const char * name); // returns -1 if the tensor is not found
     GGML_API size_t         gguf_get_tensor_offset(const struct gguf_context * ctx, int64_t tensor_id);
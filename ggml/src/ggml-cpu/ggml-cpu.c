@@ -2153,6 +2153,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             {
                 ggml_compute_forward_argsort(params, tensor);
             } break;
+        case GGML_OP_ARGSORT_TOP_K:
+            {
+                ggml_compute_forward_argsort_top_k(params, tensor);
+            } break;
         case GGML_OP_LEAKY_RELU:
             {
                 ggml_compute_forward_leaky_relu(params, tensor);
@@ -2336,6 +2340,14 @@ static void ggml_compute_haibin_forward(struct ggml_compute_params * params, str
             {
                 ggml_compute_forward_soft_max(params, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                ggml_compute_forward_flash_attn_ext(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor);
+            } break;
+        case GGML_OP_ARGSORT_TOP_K:
+            {
+                ggml_compute_forward_argsort_top_k(params, tensor);
+            } break;
         case GGML_OP_ROPE:
             {// use!
                 ggml_compute_forward_rope(params, tensor);
@@ -2577,6 +2589,7 @@ static int ggml_get_n_tasks(struct ggml_tensor * node, int n_threads) {
         case GGML_OP_ARANGE:
         case GGML_OP_TIMESTEP_EMBEDDING:
         case GGML_OP_ARGSORT:
+        case GGML_OP_ARGSORT_TOP_K:
         case GGML_OP_FLASH_ATTN_EXT:
         case GGML_OP_FLASH_ATTN_BACK:
         case GGML_OP_SSM_CONV:
@@ -3101,7 +3114,9 @@ struct ggml_cplan ggml_graph_plan(
                         const int64_t ne10 = node->src[1]->ne[0]; // DK
                         const int64_t ne20 = node->src[2]->ne[0]; // DV
 
-                        cur = sizeof(float)*(1*ne10 + 2*ne20)*n_tasks; // 1x head size K + 2x head size V (per thread)
+                        const int64_t n_tier = node->src[4] ? 2 : 1; // see ggml_flash_attn_ext_tiered
+
+                        cur = sizeof(float)*(n_tier*ne10 + 2*ne20)*n_tasks; // 1x head size K per KV tier + 2x head size V (per thread)
                     } break;
                 case GGML_OP_FLASH_ATTN_BACK:
                     {
@@ -3124,6 +3139,10 @@ struct ggml_cplan ggml_graph_plan(
                     {
                         cur = ggml_type_size(node->type)*(n_tasks + node->src[0]->ne[0]*n_tasks);
                     } break;
+                case GGML_OP_ARGSORT_TOP_K:
+                    {
+                        cur = sizeof(int32_t)*node->ne[0]*ggml_nrows(node)*n_tasks; // k candidates per row (per thread)
+                    } break;
                 case GGML_OP_COUNT:
                     {
                         GGML_ABORT("fatal error");
@@ -77,6 +77,12 @@ static bool ggml_backend_cpu_is_extra_buffer_type(ggml_backend_buffer_type_t buf
             return true;
         }
     }
+#ifdef GGML_USE_CPU_REPACK
+    // not offered as an extra buffer type: only used for weights stored in the repacked layout
+    if (buft == ggml_backend_cpu_repacked_buffer_type()) {
+        return true;
+    }
+#endif
     return false;
 }
 
@@ -631,6 +637,24 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_cpu_is_numa") == 0) {
         return (void *)ggml_is_numa;
     }
+#ifdef GGML_USE_CPU_REPACK
+    if (strcmp(name, "ggml_backend_cpu_repack_buffer_type") == 0) {
+        ggml_backend_cpu_repack_buffer_type_t fct = ggml_backend_cpu_repack_buffer_type;
+        return (void *)fct;
+    }
+    if (strcmp(name, "ggml_backend_cpu_repacked_buffer_type") == 0) {
+        ggml_backend_cpu_repack_buffer_type_t fct = ggml_backend_cpu_repacked_buffer_type;
+        return (void *)fct;
+    }
+    if (strcmp(name, "ggml_backend_cpu_repacked_buffer_from_ptr") == 0) {
+        ggml_backend_cpu_repacked_buffer_from_ptr_t fct = ggml_backend_cpu_repacked_buffer_from_ptr;
+        return (void *)fct;
+    }
+    if (strcmp(name, "ggml_backend_cpu_repack_layout") == 0) {
+        ggml_backend_cpu_repack_layout_t fct = ggml_backend_cpu_repack_layout;
+        return (void *)fct;
+    }
+#endif
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "ggml_threadpool_new") == 0) {
@@ -13,6 +13,8 @@
 
 #include <float.h>
 
+#include <algorithm>
+
 #include <x86intrin.h>
 // #include "ggml-threadpool.h"
 
@@ -7716,6 +7718,109 @@ void ggml_compute_forward_argsort(
     }
 }
 
+// ggml_compute_forward_argsort_top_k
+
+static void ggml_compute_forward_argsort_top_k_f32(
+    const ggml_compute_params * params,
+    ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = dst->src[0];
+
+    GGML_TENSOR_UNARY_OP_LOCALS
+
+    GGML_ASSERT(nb00 == sizeof(float));
+    GGML_ASSERT(nb0  == sizeof(int32_t));
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t nr = ggml_nrows(src0);
+    const int64_t k  = ne0;
+
+    // the candidates found by each thread in each row: [nr][nth][k], -1 for the unused slots
+    int32_t * cand = (int32_t *) params->wdata;
+
+    // each thread scans a slice of every row, so that a single row is also processed in parallel
+    const int64_t dc = (ne00 + nth - 1)/nth;
+    const int64_t c0 = std::min<int64_t>(dc*ith, ne00);
+    const int64_t c1 = std::min<int64_t>(c0 + dc, ne00);
+
+    for (int64_t i = 0; i < nr; i++) {
+        const int64_t i03 = i/(ne02*ne01);
+        const int64_t i02 = (i - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (i - i03*ne02*ne01 - i02*ne01);
+
+        const float * src_data = (const float *)((const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+        // larger values first, ties are broken by the lower index
+        auto greater = [src_data](int32_t a, int32_t b) {
+            return src_data[a] > src_data[b] || (src_data[a] == src_data[b] && a < b);
+        };
+
+        // min-heap of the k largest elements seen so far
+        int32_t * heap = cand + (i*nth + ith)*k;
+        int64_t   n    = 0;
+
+        for (int64_t j = c0; j < c1; j++) {
+            if (n < k) {
+                heap[n++] = j;
+                std::push_heap(heap, heap + n, greater);
+                continue;
+            }
+
+            if (greater(j, heap[0])) {
+                std::pop_heap(heap, heap + n, greater);
+                heap[n - 1] = j;
+                std::push_heap(heap, heap + n, greater);
+            }
+        }
+
+        std::fill(heap + n, heap + k, -1);
+    }
+
+    ggml_barrier(params->threadpool);
+
+    // merge the candidates of all threads
+    for (int64_t i = ith; i < nr; i += nth) {
+        const int64_t i03 = i/(ne02*ne01);
+        const int64_t i02 = (i - i03*ne02*ne01)/ne01;
+        const int64_t i01 = (i - i03*ne02*ne01 - i02*ne01);
+
+        const float * src_data = (const float *)((const char *) src0->data + i01*nb01 + i02*nb02 + i03*nb03);
+
+        auto greater = [src_data](int32_t a, int32_t b) {
+            return src_data[a] > src_data[b] || (src_data[a] == src_data[b] && a < b);
+        };
+
+        int32_t * c0 = cand + i*nth*k;
+        int32_t * c1 = std::remove(c0, c0 + nth*k, -1);
+
+        GGML_ASSERT(c1 - c0 >= k);
+
+        std::partial_sort(c0, c0 + k, c1, greater);
+
+        memcpy((char *) dst->data + i01*nb1 + i02*nb2 + i03*nb3, c0, k*sizeof(int32_t));
+    }
+}
+
+void ggml_compute_forward_argsort_top_k(
+    const ggml_compute_params * params,
+    ggml_tensor * dst) {
+
+    const ggml_tensor * src0 = dst->src[0];
+
+    switch (src0->type) {
+        case GGML_TYPE_F32:
+            {
+                ggml_compute_forward_argsort_top_k_f32(params, dst);
+            } break;
+        default:
+            {
+                GGML_ABORT("fatal error");
+            }
+    }
+}
+
 // ggml_compute_forward_flash_attn_ext
 
 static void ggml_compute_forward_flash_attn_ext_f16(
@@ -7762,6 +7867,18 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     GGML_ASSERT(nb1 <= nb2);
     GGML_ASSERT(nb2 <= nb3);
 
+    // KV tiers (see ggml_flash_attn_ext_tiered)
+    // the mask columns of tier t start at the end of the columns of tier t - 1
+    const ggml_tensor * ks[2] = { k, dst->src[4] };
+    const ggml_tensor * vs[2] = { v, dst->src[5] };
+
+    const int n_tier = ks[1] ? 2 : 1;
+
+    for (int t = 1; t < n_tier; ++t) {
+        GGML_ASSERT(ks[t]->nb[0] == ggml_type_size(ks[t]->type));
+        GGML_ASSERT(vs[t]->nb[0] == ggml_type_size(vs[t]->type));
+    }
+
     // broadcast factors
     const int64_t rk2 = neq2/nek2;
     const int64_t rk3 = neq3/nek3;
@@ -7799,13 +7916,26 @@ static void ggml_compute_forward_flash_attn_ext_f16(
     const float m0 = powf(2.0f, -(max_bias       ) / n_head_log2);
     const float m1 = powf(2.0f, -(max_bias / 2.0f) / n_head_log2);
 
-    ggml_type    const k_vec_dot_type      = ggml_get_type_traits_cpu(k->type)->vec_dot_type;
-    ggml_from_float_t const q_to_vec_dot   = ggml_get_type_traits_cpu(k_vec_dot_type)->from_float;
-    ggml_vec_dot_t    const kq_vec_dot     = ggml_get_type_traits_cpu(k->type)->vec_dot;
-    ggml_to_float_t   const v_to_float     = ggml_get_type_traits(v->type)->to_float;
+    ggml_from_float_t q_to_vec_dot[2] = {};
+    ggml_vec_dot_t    kq_vec_dot[2]   = {};
+    ggml_to_float_t   v_to_float[2]   = {};
+
+    for (int t = 0; t < n_tier; ++t) {
+        ggml_type const k_vec_dot_type = ggml_get_type_traits_cpu(ks[t]->type)->vec_dot_type;
+
+        q_to_vec_dot[t] = ggml_get_type_traits_cpu(k_vec_dot_type)->from_float;
+        kq_vec_dot[t]   = ggml_get_type_traits_cpu(ks[t]->type)->vec_dot;
+        v_to_float[t]   = ggml_get_type_traits(vs[t]->type)->to_float;
+
+        GGML_ASSERT((                                q_to_vec_dot[t]) && "fattn: unsupported K-type");
+        GGML_ASSERT((vs[t]->type == GGML_TYPE_F32 || v_to_float[t]  ) && "fattn: unsupported V-type");
+    }
 
-    GGML_ASSERT((                            q_to_vec_dot) && "fattn: unsupported K-type");
-    GGML_ASSERT((v->type == GGML_TYPE_F32 || v_to_float  ) && "fattn: unsupported V-type");
+    // the FP16 accumulator can only be used if all V data is FP16
+    bool v_f16 = true;
+    for (int t = 0; t < n_tier; ++t) {
+        v_f16 = v_f16 && vs[t]->type == GGML_TYPE_F16;
+    }
 
     // loop over n_batch and n_head
     for (int ir = ir0; ir < ir1; ++ir) {
@@ -7820,12 +7950,11 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         float S = 0.0f;      // sum
         float M = -INFINITY; // maximum KQ value
 
-        float       * VKQ32 = (float       *) params->wdata + ith*(1*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
+        float       * VKQ32 = (float       *) params->wdata + ith*(n_tier*DK + 2*DV + CACHE_LINE_SIZE_F32); // FP32 VKQ accumulator
         float       * V32   =                 (VKQ32 + 1*DV); // (temporary) FP32 V buffer
         ggml_fp16_t * VKQ16 = (ggml_fp16_t *) (VKQ32 + 1*DV); // (temporary) FP16 VKQ accumulator
-        ggml_fp16_t * Q_q   = (ggml_fp16_t *) (VKQ32 + 2*DV); // (temporary) buffer for Q converted to quantized/FP16
 
-        if (v->type == GGML_TYPE_F16) {
+        if (v_f16) {
             memset(VKQ16, 0, DV*sizeof(ggml_fp16_t));
         } else {
             memset(VKQ32, 0, DV*sizeof(float));
@@ -7842,79 +7971,91 @@ static void ggml_compute_forward_flash_attn_ext_f16(
         const int iv2 = iq2 / rv2;
 
         const float * pq = (const float *) ((char *) q->data + (iq1*nbq1 + iq2*nbq2 + iq3*nbq3));
-        q_to_vec_dot(pq, Q_q, DK);
-
-        // online softmax / attention
-        // loop over n_kv and n_head_kv
-        // ref: https://arxiv.org/pdf/2112.05682.pdf
-        for (int64_t ic = 0; ic < nek1; ++ic) {
-            const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
-            if (mv == -INFINITY) {
-                continue;
-            }
 
-            float s; // KQ value
+        for (int t = 0; t < n_tier; ++t) {
+            const ggml_tensor * kt = ks[t];
+            const ggml_tensor * vt = vs[t];
 
-            const char * k_data = (const char *) k->data + ( ic*nbk1 + ik2*nbk2 + ik3*nbk3);
-            kq_vec_dot(DK, &s, 0, k_data, 0, Q_q, 0, 1);
+            // (temporary) buffer for Q converted to the quantized/FP16 type of this tier
+            ggml_fp16_t * Q_q = (ggml_fp16_t *) (VKQ32 + 2*DV + t*DK);
+            q_to_vec_dot[t](pq, Q_q, DK);
 
-            s = s*scale; // scale KQ value
+            // online softmax / attention
+            // loop over n_kv and n_head_kv
+            // ref: https://arxiv.org/pdf/2112.05682.pdf
+            for (int64_t ic = 0; ic < kt->ne[1]; ++ic) {
+                const float mv = mp ? slope*GGML_FP16_TO_FP32(mp[ic]) : 0.0f;
+                if (mv == -INFINITY) {
+                    continue;
+                }
 
-            if (logit_softcap != 0.0f) {
-                s = logit_softcap*tanhf(s);
-            }
+                float s; // KQ value
 
-            s += mv; // apply mask
+                const char * k_data = (const char *) kt->data + ( ic*kt->nb[1] + ik2*kt->nb[2] + ik3*kt->nb[3]);
+                kq_vec_dot[t](DK, &s, 0, k_data, 0, Q_q, 0, 1);
 
-            const float Mold = M;
+                s = s*scale; // scale KQ value
 
-            float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
-            float vs = 1.0f; // post-softmax KQ value, expf(s - M)
+                if (logit_softcap != 0.0f) {
+                    s = logit_softcap*tanhf(s);
+                }
 
-            const char * v_data = ((const char *) v->data + (ic*nbv1 + iv2*nbv2 + iv3*nbv3));
+                s += mv; // apply mask
 
-            if (v->type == GGML_TYPE_F16) {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                const float Mold = M;
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f16(DV, VKQ16, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+                float ms = 1.0f; // upon new higher max val, scale VKQ and KQ sum with this value
+                float vs = 1.0f; // post-softmax KQ value, expf(s - M)
 
-                // V += v*expf(s - M)
-                ggml_vec_mad_f16(DV, VKQ16, (const ggml_fp16_t *) v_data, vs);
-            } else {
-                if (s > M) {
-                    // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
-                    M = s;
-                    ms = expf(Mold - M);
+                const char * v_data = ((const char *) vt->data + (ic*vt->nb[1] + iv2*vt->nb[2] + iv3*vt->nb[3]));
 
-                    // V = V*expf(Mold - M)
-                    ggml_vec_scale_f32(DV, VKQ32, ms);
-                } else {
-                    // no new maximum, ms == 1.0f, vs != 1.0f
-                    vs = expf(s - M);
-                }
+                if (v_f16) {
+                    if (s > M) {
+                        // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                        M = s;
+                        ms = expf(Mold - M);
 
-                // V += v*expf(s - M)
-                if (v_to_float) {
-                    v_to_float(v_data, V32, DV);
-                    ggml_vec_mad_f32(DV, VKQ32, V32, vs);
+                        // V = V*expf(Mold - M)
+                        ggml_vec_scale_f16(DV, VKQ16, ms);
+                    } else {
+                        // no new maximum, ms == 1.0f, vs != 1.0f
+                        vs = expf(s - M);
+                    }
+
+                    // V += v*expf(s - M)
+                    ggml_vec_mad_f16(DV, VKQ16, (const ggml_fp16_t *) v_data, vs);
                 } else {
-                    // V is F32
-                    ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
+                    if (s > M) {
+                        // s is new maximum, ms < 1.0f, vs == expf(s - s) == 1.0f
+                        M = s;
+                        ms = expf(Mold - M);
+
+                        // V = V*expf(Mold - M)
+                        ggml_vec_scale_f32(DV, VKQ32, ms);
+                    } else {
+                        // no new maximum, ms == 1.0f, vs != 1.0f
+                        vs = expf(s - M);
+                    }
+
+                    // V += v*expf(s - M)
+                    if (v_to_float[t]) {
+                        v_to_float[t](v_data, V32, DV);
+                        ggml_vec_mad_f32(DV, VKQ32, V32, vs);
+                    } else {
+                        // V is F32
+                        ggml_vec_mad_f32(DV, VKQ32, (const float *) v_data, vs);
+                    }
                 }
+
+                S = S*ms + vs; // scale and increment sum with partial sum
             }
 
-            S = S*ms + vs; // scale and increment sum with partial sum
+            if (mp) {
+                mp += kt->ne[1];
+            }
         }
 
-        if (v->type == GGML_TYPE_F16) {
+        if (v_f16) {
             for (int64_t d = 0; d < DV; ++d) {
                 VKQ32[d] = GGML_FP16_TO_FP32(VKQ16[d]);
             }
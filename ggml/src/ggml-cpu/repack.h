@@ -10,6 +10,13 @@
 
 ggml_backend_buffer_type_t ggml_backend_cpu_repack_buffer_type(void);
 
+// same as the repack buffer type, for tensors whose data is already stored in the repacked layout
+ggml_backend_buffer_type_t ggml_backend_cpu_repacked_buffer_type(void);
+ggml_backend_buffer_t      ggml_backend_cpu_repacked_buffer_from_ptr(void * ptr, size_t size);
+
+// name of the layout that the repack buffer type uses for the tensor on this CPU, NULL if it is not repacked
+const char * ggml_backend_cpu_repack_layout(const struct ggml_tensor * tensor);
+
 template <int K> constexpr int QK_0() {
     if constexpr (K == 4) {
         return QK4_0;
@@ -3279,6 +3279,10 @@ static bool ggml_backend_cuda_device_supports_op(ggml_backend_dev_t dev, const g
 #ifndef FLASH_ATTN_AVAILABLE
             return false;
 #endif // FLASH_ATTN_AVAILABLE
+            if (op->src[4]) {
+                // tiered KV (ggml_flash_attn_ext_tiered) is only implemented on the CPU
+                return false;
+            }
             if (op->src[1]->ne[0] != op->src[2]->ne[0]) {
                 const int cc = ggml_cuda_info().devices[dev_ctx->device].cc;
                 if (!new_mma_available(cc)) {
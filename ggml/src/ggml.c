@@ -835,6 +835,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "ARANGE",
     "TIMESTEP_EMBEDDING",
     "ARGSORT",
+    "ARGSORT_TOP_K",
     "LEAKY_RELU",
 
     "FLASH_ATTN_EXT",
@@ -862,7 +863,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "OPT_STEP_ADAMW",
 };
 
-static_assert(GGML_OP_COUNT == 83, "GGML_OP_COUNT != 83");
+static_assert(GGML_OP_COUNT == 84, "GGML_OP_COUNT != 84");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -931,6 +932,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "arange(start, stop, step)",
     "timestep_embedding(timesteps, dim, max_period)",
     "argsort(x)",
+    "argsort_top_k(x)",
     "leaky_relu(x)",
 
     "flash_attn_ext(x)",
@@ -958,7 +960,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "adamw(x)",
 };
 
-static_assert(GGML_OP_COUNT == 83, "GGML_OP_COUNT != 83");
+static_assert(GGML_OP_COUNT == 84, "GGML_OP_COUNT != 84");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -4329,6 +4331,23 @@ struct ggml_tensor * ggml_top_k(
     return result;
 }
 
+// ggml_argsort_top_k
+
+struct ggml_tensor * ggml_argsort_top_k(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   k) {
+    GGML_ASSERT(a->ne[0] >= k && k > 0);
+    GGML_ASSERT(a->ne[0] <= INT32_MAX);
+
+    struct ggml_tensor * result = ggml_new_tensor_4d(ctx, GGML_TYPE_I32, k, a->ne[1], a->ne[2], a->ne[3]);
+
+    result->op     = GGML_OP_ARGSORT_TOP_K;
+    result->src[0] = a;
+
+    return result;
+}
+
 // ggml_flash_attn_ext
 
 struct ggml_tensor * ggml_flash_attn_ext(
@@ -4372,6 +4391,34 @@ struct ggml_tensor * ggml_flash_attn_ext(
     return result;
 }
 
+struct ggml_tensor * ggml_flash_attn_ext_tiered(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k0,
+        struct ggml_tensor  * v0,
+        struct ggml_tensor  * k1,
+        struct ggml_tensor  * v1,
+        struct ggml_tensor  * mask,
+        float                 scale,
+        float                 max_bias,
+        float                 logit_softcap) {
+    GGML_ASSERT(k1->ne[0] == k0->ne[0] && k1->ne[2] == k0->ne[2] && k1->ne[3] == k0->ne[3]);
+    GGML_ASSERT(v1->ne[0] == v0->ne[0] && v1->ne[2] == v0->ne[2] && v1->ne[3] == v0->ne[3]);
+    GGML_ASSERT(v0->ne[1] == k0->ne[1]);
+    GGML_ASSERT(v1->ne[1] == k1->ne[1]);
+
+    if (mask) {
+        GGML_ASSERT(mask->ne[0] == k0->ne[1] + k1->ne[1]);
+    }
+
+    struct ggml_tensor * result = ggml_flash_attn_ext(ctx, q, k0, v0, mask, scale, max_bias, logit_softcap);
+
+    result->src[4] = k1;
+    result->src[5] = v1;
+
+    return result;
+}
+
 void ggml_flash_attn_ext_set_prec(
         struct ggml_tensor * a,
         enum ggml_prec       prec) {
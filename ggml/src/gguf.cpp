@@ -10,11 +10,31 @@
 #include <cstdlib>
 #include <cstring>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <new>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+    #include <io.h>
+#elif defined(__has_include)
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+            #include <sys/stat.h>
+        #endif
+    #endif
+#endif
+
 template <typename T>
 struct type_to_gguf_type;
 
@@ -126,6 +146,11 @@ struct gguf_kv {
     std::vector<int8_t>      data;
     std::vector<std::string> data_string;
 
+    // string arrays read from a file mapping point into the mapping,
+    // the NUL-terminated copies returned by gguf_get_arr_str are only made on demand
+    std::vector<std::string_view>    data_string_view;
+    mutable std::vector<std::string> data_string_copy;
+
     template <typename T>
     gguf_kv(const std::string & key, const T value)
             : key(key), is_array(false), type(type_to_gguf_type<T>::value) {
@@ -157,6 +182,15 @@ struct gguf_kv {
         data_string = value;
     }
 
+    gguf_kv(const std::string & key, std::vector<std::string_view> && value)
+            : key(key), is_array(true), type(GGUF_TYPE_STRING), data_string_view(std::move(value)) {
+        GGML_ASSERT(!key.empty());
+    }
+
+    bool is_mapped() const {
+        return !data_string_view.empty();
+    }
+
     const std::string & get_key() const {
         return key;
     }
@@ -167,7 +201,7 @@ struct gguf_kv {
 
     size_t get_ne() const {
         if (type == GGUF_TYPE_STRING) {
-            const size_t ne = data_string.size();
+            const size_t ne = is_mapped() ? data_string_view.size() : data_string.size();
             GGML_ASSERT(is_array || ne == 1);
             return ne;
         }
@@ -182,6 +216,7 @@ struct gguf_kv {
     const T & get_val(const size_t i = 0) const {
         GGML_ASSERT(type_to_gguf_type<T>::value == type);
         if constexpr (std::is_same<T, std::string>::value) {
+            GGML_ASSERT(!is_mapped());
             GGML_ASSERT(data_string.size() >= i+1);
             return data_string[i];
         }
@@ -191,6 +226,16 @@ struct gguf_kv {
         return reinterpret_cast<const T *>(data.data())[i];
     }
 
+    std::string_view get_str(const size_t i) const {
+        GGML_ASSERT(type == GGUF_TYPE_STRING);
+        if (is_mapped()) {
+            GGML_ASSERT(data_string_view.size() >= i+1);
+            return data_string_view[i];
+        }
+        GGML_ASSERT(data_string.size() >= i+1);
+        return data_string[i];
+    }
+
     void cast(const enum gguf_type new_type) {
         const size_t new_type_size = gguf_type_size(new_type);
         GGML_ASSERT(data.size() % new_type_size == 0);
@@ -203,6 +248,60 @@ struct gguf_tensor_info {
     uint64_t offset;      // offset from start of `data`, must be a multiple of `ALIGNMENT`
 };
 
+// read-only mapping of a whole GGUF file, addr is nullptr if the file could not be mapped
+struct gguf_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    gguf_mmap(FILE * file) {
+#if defined(_POSIX_MAPPED_FILES)
+        struct stat st;
+        if (fstat(fileno(file), &st) != 0 || st.st_size <= 0) {
+            return;
+        }
+        void * ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (ptr == MAP_FAILED) {
+            return;
+        }
+        addr = ptr;
+        size = st.st_size;
+#elif defined(_WIN32)
+        HANDLE hFile = (HANDLE) _get_osfhandle(_fileno(file));
+
+        LARGE_INTEGER li;
+        if (!GetFileSizeEx(hFile, &li) || li.QuadPart <= 0 || (uint64_t) li.QuadPart > SIZE_MAX) {
+            return;
+        }
+
+        HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping == NULL) {
+            return;
+        }
+        addr = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+        CloseHandle(hMapping);
+        if (addr != NULL) {
+            size = li.QuadPart;
+        }
+#else
+        GGML_UNUSED(file);
+#endif
+    }
+
+    ~gguf_mmap() {
+        if (addr == nullptr) {
+            return;
+        }
+#if defined(_POSIX_MAPPED_FILES)
+        munmap(addr, size);
+#elif defined(_WIN32)
+        UnmapViewOfFile(addr);
+#endif
+    }
+
+    gguf_mmap(const gguf_mmap &) = delete;
+    gguf_mmap & operator=(const gguf_mmap &) = delete;
+};
+
 struct gguf_context {
     uint32_t version = GGUF_VERSION;
 
@@ -214,20 +313,43 @@ struct gguf_context {
     size_t size      = 0; // size of `data` in bytes
 
     void * data = nullptr;
+
+    // the file the context was read from, referenced by the mapped string arrays
+    std::unique_ptr<gguf_mmap> mapping;
+
+    // guards the on demand copies of the mapped strings
+    mutable std::mutex mutex;
 };
 
 struct gguf_reader {
-    FILE * file;
+    FILE * file = nullptr;
+
+    // when reading from a mapping instead of a file
+    const uint8_t * buf  = nullptr;
+    size_t          size = 0;
+    mutable size_t  pos  = 0;
 
     gguf_reader(FILE * file) : file(file) {}
+    gguf_reader(const void * buf, size_t size) : buf((const uint8_t *) buf), size(size) {}
+
+    size_t n_remain() const {
+        return pos < size ? size - pos : 0;
+    }
 
     template <typename T>
     bool read(T & dst) const {
-        return fread(&dst, 1, sizeof(dst), file) == sizeof(dst);
+        return read(&dst, sizeof(dst));
     }
 
     template <typename T>
     bool read(std::vector<T> & dst, const size_t n) const {
+        if constexpr (std::is_arithmetic<T>::value && !std::is_same<T, bool>::value) {
+            if (buf && n > n_remain()/sizeof(T)) {
+                return false;
+            }
+            dst.resize(n);
+            return read(dst.data(), n*sizeof(T));
+        }
         dst.resize(n);
         for (size_t i = 0; i < dst.size(); ++i) {
             if constexpr (std::is_same<T, bool>::value) {
@@ -245,6 +367,24 @@ struct gguf_reader {
         return true;
     }
 
+    // reference the strings in the mapping instead of copying them
+    bool read(std::vector<std::string_view> & dst, const size_t n) const {
+        GGML_ASSERT(buf);
+        if (n > n_remain()/sizeof(uint64_t)) {
+            return false;
+        }
+        dst.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t len = -1;
+            if (!read(len) || len > n_remain()) {
+                return false;
+            }
+            dst[i] = std::string_view((const char *) buf + pos, len);
+            pos += len;
+        }
+        return true;
+    }
+
     bool read(bool & dst) const {
         int8_t tmp = -1;
         if (!read(tmp)) {
@@ -277,13 +417,36 @@ struct gguf_reader {
         if (!read(size)) {
             return false;
         }
+        if (buf && size > n_remain()) {
+            return false;
+        }
         dst.resize(size);
-        return fread(dst.data(), 1, dst.length(), file) == dst.length();
+        return read(dst.data(), dst.length());
     }
 
     bool read(void * dst, const size_t size) const {
+        if (buf) {
+            if (size > n_remain()) {
+                return false;
+            }
+            memcpy(dst, buf + pos, size);
+            pos += size;
+            return true;
+        }
         return fread(dst, 1, size, file) == size;
     }
+
+    size_t tell() const {
+        return buf ? pos : ftell(file);
+    }
+
+    bool seek(size_t offset) const {
+        if (buf) {
+            pos = offset;
+            return true;
+        }
+        return fseek(file, offset, SEEK_SET) == 0;
+    }
 };
 
 struct gguf_context * gguf_init_empty(void) {
@@ -292,6 +455,21 @@ struct gguf_context * gguf_init_empty(void) {
 
 template<typename T>
 bool gguf_read_emplace_helper(const struct gguf_reader & gr, std::vector<struct gguf_kv> & kv, const std::string & key, const bool is_array, const size_t n) {
+    if constexpr (std::is_same<T, std::string>::value) {
+        if (is_array && gr.buf) {
+            std::vector<std::string_view> value;
+            try {
+                if (!gr.read(value, n)) {
+                    return false;
+                }
+            } catch (std::bad_alloc &) {
+                GGML_LOG_ERROR("%s: encountered bad_alloc error while reading value for key '%s'\n", __func__, key.c_str());
+                return false;
+            }
+            kv.emplace_back(key, std::move(value));
+            return true;
+        }
+    }
     if (is_array) {
         std::vector<T> value;
         try {
@@ -316,8 +494,7 @@ bool gguf_read_emplace_helper(const struct gguf_reader & gr, std::vector<struct
     return true;
 }
 
-struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_params params) {
-    const struct gguf_reader gr(file);
+static struct gguf_context * gguf_init_from_reader(const struct gguf_reader & gr, struct gguf_init_params params) {
     struct gguf_context * ctx = new gguf_context;
 
     bool ok = true;
@@ -606,14 +783,14 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
     GGML_ASSERT(int64_t(ctx->info.size()) == n_tensors);
 
     // we require the data section to be aligned, so take into account any padding
-    if (fseek(file, GGML_PAD(ftell(file), ctx->alignment), SEEK_SET) != 0) {
+    if (!gr.seek(GGML_PAD(gr.tell(), ctx->alignment))) {
         GGML_LOG_ERROR("%s: failed to seek to beginning of data section\n", __func__);
         gguf_free(ctx);
         return nullptr;
     }
 
     // store the current file offset - this is where the data section starts
-    ctx->offset = ftell(file);
+    ctx->offset = gr.tell();
 
     // compute the total size of the data section, taking into account the alignment
     {
@@ -719,6 +896,28 @@ struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_par
     return ctx;
 }
 
+struct gguf_context * gguf_init_from_file_impl(FILE * file, struct gguf_init_params params) {
+    const struct gguf_reader gr(file);
+    return gguf_init_from_reader(gr, params);
+}
+
+struct gguf_context * gguf_init_from_file_mmap_impl(FILE * file, struct gguf_init_params params) {
+    // parse the metadata in place, the string arrays (e.g. the vocabulary) then reference the mapping instead of
+    // being copied into individually allocated strings
+    auto mapping = std::make_unique<gguf_mmap>(file);
+    if (!mapping->addr) {
+        return gguf_init_from_file_impl(file, params);
+    }
+
+    const struct gguf_reader gr(mapping->addr, mapping->size);
+
+    struct gguf_context * ctx = gguf_init_from_reader(gr, params);
+    if (ctx) {
+        ctx->mapping = std::move(mapping);
+    }
+    return ctx;
+}
+
 struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_params params) {
     FILE * file = ggml_fopen(fname, "rb");
 
@@ -727,7 +926,7 @@ struct gguf_context * gguf_init_from_file(const char * fname, struct gguf_init_p
         return nullptr;
     }
 
-    struct gguf_context * result = gguf_init_from_file_impl(file, params);
+    struct gguf_context * result = gguf_init_from_file_mmap_impl(file, params);
     fclose(file);
     return result;
 }
@@ -801,14 +1000,38 @@ const void * gguf_get_arr_data(const struct gguf_context * ctx, int64_t key_id)
 const char * gguf_get_arr_str(const struct gguf_context * ctx, int64_t key_id, size_t i) {
     GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
     GGML_ASSERT(ctx->kv[key_id].get_type() == GGUF_TYPE_STRING);
-    return ctx->kv[key_id].data_string[i].c_str();
+
+    const struct gguf_kv & kv = ctx->kv[key_id];
+    if (!kv.is_mapped()) {
+        return kv.data_string[i].c_str();
+    }
+
+    // the strings in the mapping are not NUL-terminated, copy them on first use
+    const std::string_view str = kv.get_str(i);
+
+    std::lock_guard<std::mutex> lock(ctx->mutex);
+    if (kv.data_string_copy.empty()) {
+        kv.data_string_copy.resize(kv.data_string_view.size());
+    }
+    if (kv.data_string_copy[i].size() != str.size()) {
+        kv.data_string_copy[i] = str;
+    }
+    return kv.data_string_copy[i].c_str();
+}
+
+const char * gguf_get_arr_str_n(const struct gguf_context * ctx, int64_t key_id, size_t i, size_t * n) {
+    GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
+    GGML_ASSERT(ctx->kv[key_id].get_type() == GGUF_TYPE_STRING);
+    const std::string_view str = ctx->kv[key_id].get_str(i);
+    *n = str.size();
+    return str.data();
 }
 
 size_t gguf_get_arr_n(const struct gguf_context * ctx, int64_t key_id) {
     GGML_ASSERT(key_id >= 0 && key_id < gguf_get_n_kv(ctx));
 
     if (ctx->kv[key_id].type == GGUF_TYPE_STRING) {
-        return ctx->kv[key_id].data_string.size();
+        return ctx->kv[key_id].get_ne();
     }
 
     const size_t type_size = gguf_type_size(ctx->kv[key_id].type);
@@ -935,10 +1158,29 @@ size_t gguf_get_tensor_size(const struct gguf_context * ctx, int64_t tensor_id)
     return ggml_nbytes(&ctx->info[tensor_id].t);
 }
 
+// the data written by gguf_write_to_file is padded with ctx->alignment, keep it in sync with the KV pair
+static void gguf_update_alignment(struct gguf_context * ctx, const size_t alignment) {
+    // same check as when reading a file, GGML_PAD only works with a nonzero power of 2
+    GGML_ASSERT(alignment > 0 && (alignment & (alignment - 1)) == 0 && GGUF_KEY_GENERAL_ALIGNMENT " must be power of 2");
+
+    if (ctx->alignment == alignment) {
+        return;
+    }
+    ctx->alignment = alignment;
+
+    const int64_t n_tensors = gguf_get_n_tensors(ctx);
+    for (int64_t i = 1; i < n_tensors; ++i) {
+        ctx->info[i].offset = ctx->info[i - 1].offset + GGML_PAD(ggml_nbytes(&ctx->info[i - 1].t), ctx->alignment);
+    }
+}
+
 int64_t gguf_remove_key(struct gguf_context * ctx, const char * key) {
     const int64_t key_id = gguf_find_key(ctx, key);
     if (key_id >= 0) {
         ctx->kv.erase(ctx->kv.begin() + key_id);
+        if (strcmp(key, GGUF_KEY_GENERAL_ALIGNMENT) == 0) {
+            gguf_update_alignment(ctx, GGUF_DEFAULT_ALIGNMENT);
+        }
     }
     return key_id;
 }
@@ -983,6 +1225,9 @@ void gguf_set_val_u32(struct gguf_context * ctx, const char * key, uint32_t val)
     gguf_check_reserved_keys(key, val);
     gguf_remove_key(ctx, key);
     ctx->kv.emplace_back(key, val);
+    if (strcmp(key, GGUF_KEY_GENERAL_ALIGNMENT) == 0) {
+        gguf_update_alignment(ctx, val);
+    }
 }
 
 void gguf_set_val_i32(struct gguf_context * ctx, const char * key, int32_t val) {
@@ -1094,11 +1339,12 @@ void gguf_set_kv(struct gguf_context * ctx, const struct gguf_context * src) {
                 gguf_set_arr_data(ctx, kv.get_key().c_str(), kv.get_type(), kv.data.data(), ne);
             } break;
             case GGUF_TYPE_STRING: {
-                std::vector<const char *> tmp(ne);
+                std::vector<std::string> tmp(ne);
                 for (size_t j = 0; j < ne; ++j) {
-                    tmp[j] = kv.data_string[j].c_str();
+                    tmp[j] = kv.get_str(j);
                 }
-                gguf_set_arr_str(ctx, kv.get_key().c_str(), tmp.data(), ne);
+                gguf_remove_key(ctx, kv.get_key().c_str());
+                ctx->kv.emplace_back(kv.get_key(), tmp);
             } break;
             case GGUF_TYPE_ARRAY:
             default: GGML_ABORT("invalid type");
@@ -1176,14 +1422,16 @@ struct gguf_writer {
         write(val8);
     }
 
-    void write(const std::string & val) const {
+    void write(std::string_view val) const {
         {
             const uint64_t n = val.length();
             write(n);
         }
-        for (size_t i = 0; i < val.length(); ++i) {
-            buf.push_back(reinterpret_cast<const int8_t *>(val.data())[i]);
-        }
+        buf.insert(buf.end(), reinterpret_cast<const int8_t *>(val.data()), reinterpret_cast<const int8_t *>(val.data()) + val.length());
+    }
+
+    void write(const std::string & val) const {
+        write(std::string_view(val));
     }
 
     void write(const char * val) const {
@@ -1231,7 +1479,7 @@ struct gguf_writer {
             } break;
             case GGUF_TYPE_STRING: {
                 for (size_t i = 0; i < ne; ++i) {
-                    write(kv.get_val<std::string>(i));
+                    write(kv.get_str(i));
                 }
             } break;
             case GGUF_TYPE_ARRAY:
@@ -215,6 +215,13 @@ extern "C" {
         LLAMA_SPLIT_MODE_ROW   = 2, // split layers and KV across GPUs, use tensor parallelism if supported
     };
 
+    // huge pages used to back the mmap-ed weights, reduces the TLB misses of large models
+    enum llama_hugepages_type {
+        LLAMA_HUGEPAGES_TYPE_NONE = 0, // regular pages
+        LLAMA_HUGEPAGES_TYPE_FILE = 1, // map the file at a huge page aligned address with transparent huge pages, if the filesystem supports them
+        LLAMA_HUGEPAGES_TYPE_ANON = 2, // copy the file into anonymous memory, from the hugetlb pool if available, otherwise with transparent huge pages
+    };
+
     // TODO: simplify (https://github.com/ggml-org/llama.cpp/pull/9294#pullrequestreview-2286561979)
     typedef struct llama_token_data {
         llama_token id; // token id
@@ -312,6 +319,12 @@ extern "C" {
         // override key-value pairs of the model meta data
         const struct llama_model_kv_override * kv_overrides;
 
+        enum llama_hugepages_type hugepages; // huge pages for the mmap-ed weights, Linux only
+
+        // max bytes of MoE expert weights kept in memory when using mmap, the other experts are paged in from the
+        // model file when the router selects them and the least recently used ones are released (0 = all, Linux only)
+        size_t expert_budget;
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool vocab_only;    // only load the vocabulary, no weights
         bool use_mmap;      // use mmap if possible
@@ -342,6 +355,23 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, <= 0 disabled (default)
+                                   // with the KV cache in host memory and no SWA, the cells are copied in the background
+        uint32_t defrag_step_mib;  // max amount of KV data (in MiB) moved by a single defragmentation step, the rest of
+                                   // the moves are done by the next llama_decode() calls, 0 = unbounded (default)
+        uint32_t n_kv_hot;         // keep only the most recent n_kv_hot KV cells in type_k/type_v, the older cells are
+                                   // requantized to type_k_cold/type_v_cold in the background, 0 = disabled (default)
+                                   // requires flash_attn and the KV cache in host memory (CPU or offload_kqv = false)
+                                   // [EXPERIMENTAL]
+        uint32_t n_stream_sink;    // streaming KV cache: keep the first n_stream_sink (attention sink) tokens and the last
+        uint32_t n_stream_window;  // n_stream_window tokens of each sequence, the tokens in between are evicted and the
+                                   // positions are compacted - use llama_memory_seq_pos_max() to get the next position
+                                   // or a batch without positions, not supported with recurrent, hybrid, SWA models or
+                                   // n_kv_hot (a warning is logged), n_stream_window = 0 disables it (default) [EXPERIMENTAL]
+        uint32_t n_logits_top_k;   // select the n_logits_top_k largest logits of each output in the graph and extract only
+                                   // those - use llama_get_logits_top_k_ith() to access them, llama_get_logits[_ith]()
+                                   // return rows where the other logits are -INFINITY, grammar samplers are not
+                                   // supported (llama_sampler_sample() aborts), 1 = greedy, 0 = disabled (default)
+                                   // [EXPERIMENTAL]
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -349,6 +379,13 @@ extern "C" {
         enum ggml_type type_k; // data type for K cache [EXPERIMENTAL]
         enum ggml_type type_v; // data type for V cache [EXPERIMENTAL]
 
+        enum ggml_type type_k_cold; // data type for the older cells of the K cache, used when n_kv_hot > 0 [EXPERIMENTAL]
+        enum ggml_type type_v_cold; // data type for the older cells of the V cache, used when n_kv_hot > 0 [EXPERIMENTAL]
+
+        const char * kv_spill_dir;  // directory of the scratch file for sequences moved out of the memory with
+                                    // llama_state_seq_spill(), the file is created with a unique name and removed
+                                    // right away - NULL = $TMPDIR [EXPERIMENTAL]
+
         // Abort callback
         // if it returns true, execution of llama_decode() will be aborted
         // currently works only with CPU execution
@@ -377,6 +414,7 @@ extern "C" {
         bool only_copy;                       // only copy tensors - ftype, allow_requantize and quantize_output_tensor are ignored
         bool pure;                            // quantize all tensors to the default type
         bool keep_split;                      // quantize to the same number of shards
+        uint64_t split_max_size;              // split the output in shards of at most this many bytes, 0 = no limit (ignored with keep_split)
         void * imatrix;                       // pointer to importance matrix data
         void * kv_overrides;                  // pointer to vector containing overrides
         void * tensor_types;                  // pointer to vector containing tensor types
@@ -688,6 +726,9 @@ extern "C" {
     // Check if the memory supports shifting
     LLAMA_API bool llama_memory_can_shift(llama_memory_t mem);
 
+    // Fraction of the cells below the last used cell that are empty (0.0f = no fragmentation)
+    LLAMA_API float llama_memory_fragmentation(llama_memory_t mem);
+
     //
     // KV cache for self-attention (TODO: deprecate in favor of llama_memory)
     //
@@ -891,6 +932,35 @@ extern "C" {
                           size_t   n_token_capacity,
                           size_t * n_token_count_out);
 
+    // Move the state of an idle sequence out of the memory and into a memory-mapped scratch file (see kv_spill_dir)
+    // The sequence is removed from the memory - the freed cells can be used by other sequences
+    // A spilled sequence is restored automatically when a batch that references it is passed to llama_decode()
+    // or when it is passed to llama_memory_seq_cp/add/div() or to a partial llama_memory_seq_rm()
+    // llama_memory_clear(), llama_memory_seq_keep() of another sequence, a full llama_memory_seq_rm() and loading a
+    // state into the sequence discard the spilled state
+    // Note: llama_memory_seq_pos_min/max() return -1 for a spilled sequence
+    // Returns true on success (or if the sequence is already spilled)
+    LLAMA_API bool llama_state_seq_spill(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
+    // Start reading the spilled state of the sequence in the background
+    // Call this as soon as it is known that the sequence will be resumed to hide the disk latency
+    LLAMA_API void llama_state_seq_prefetch(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
+    // Load the spilled state of the sequence back into the memory
+    // Returns true on success (or if the sequence is not spilled)
+    // On failure (e.g. not enough free cells) the spilled state is discarded and the sequence is left empty
+    LLAMA_API bool llama_state_seq_restore(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
+    LLAMA_API bool llama_state_seq_is_spilled(
+            const struct llama_context * ctx,
+                          llama_seq_id   seq_id);
+
     //
     // Decoding
     //
@@ -946,6 +1016,21 @@ extern "C" {
             struct llama_context * ctx,
               struct llama_batch   batch);
 
+    // Start processing the batch on a background thread and return immediately
+    // Until llama_decode_wait() returns, the output getters (llama_get_logits*, llama_get_embeddings*) and the
+    // llama_sampler_sample* functions read the outputs of the previous decode, so the tokens of some sequences can
+    // be sampled while the next batch is being computed
+    // No other function may be called with the context in the meantime, and the batch must remain valid
+    // Returns 0 if the batch was submitted, -1 if a decode is already in progress
+    LLAMA_API int32_t llama_decode_async(
+            struct llama_context * ctx,
+              struct llama_batch   batch);
+
+    // Wait for the batch submitted with llama_decode_async()
+    // Returns the same values as llama_decode(), or 0 if no batch was submitted
+    // On failure, the outputs of the previous decode remain available
+    LLAMA_API int32_t llama_decode_wait(struct llama_context * ctx);
+
     // Set the number of threads used for decoding
     // n_threads is the number of threads used for generation (single token)
     // n_threads_batch is the number of threads used for prompt and batch processing (multiple tokens)
@@ -975,6 +1060,7 @@ extern "C" {
     // Wait until all computations are finished
     // This is automatically done when using one of the functions below to obtain the computation results
     // and is not necessary to call it explicitly in most cases
+    // It does not wait for a batch submitted with llama_decode_async() - use llama_decode_wait() for that
     LLAMA_API void llama_synchronize(struct llama_context * ctx);
 
     // Token logits obtained from the last call to llama_decode()
@@ -982,6 +1068,8 @@ extern "C" {
     // in the order they have appeared in the batch.
     // Rows: number of tokens for which llama_batch.logits[i] != 0
     // Cols: n_vocab
+    // With n_logits_top_k > 0, the rows are built from the selected candidates on first access and all other logits
+    // are -INFINITY
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
     // Logits for the ith token. For positive indices, Equivalent to:
@@ -990,6 +1078,31 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Largest logits of the ith token when the context was created with n_logits_top_k > 0
+    // The candidates are sorted by descending logit
+    // Returns the number of candidates, 0 if n_logits_top_k == 0 or for invalid ids
+    LLAMA_API int32_t llama_get_logits_top_k_ith(
+            struct llama_context * ctx,
+                         int32_t   i,
+             const llama_token ** tokens,
+                   const float ** logits);
+
+    // Compute the logits of the outputs of the given sequence only for a subset of the vocab (e.g. a set of labels)
+    // Only the rows of the output matrix needed by the outputs of a ubatch are multiplied, the logits of the other
+    // tokens are set to -INFINITY. The full LM head is used when the subsets of a ubatch are too large to benefit,
+    // or when one of its outputs belongs to multiple sequences or to a sequence without a subset - the logits of the
+    // outputs of the sequences with a subset are still restricted to it (outputs of multiple sequences are not).
+    // n_tokens == 0 clears the subset of the sequence
+    // The subset is also cleared when the memory ops remove all cells of the sequence (llama_memory_clear(),
+    // llama_memory_seq_rm() of all positions, llama_memory_seq_keep() of another sequence)
+    // Must not be called while an asynchronous decode is pending
+    // Returns 0 on success, -1 for an invalid seq_id or token, -2 if not supported (n_logits_top_k > 0, output bias)
+    LLAMA_API int32_t llama_set_logits_subset(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+               const llama_token * tokens,
+                          size_t   n_tokens);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -1094,6 +1207,26 @@ extern "C" {
                             bool   add_special,
                             bool   parse_special);
 
+    /// @details Convert several texts into tokens, with the same result as calling llama_tokenize() on each text
+    /// The texts are split at the special tokens and the long pieces of plain text between words, and the pieces are
+    /// tokenized concurrently on n_threads threads (<= 0: all hardware threads)
+    /// @param tokens The tokens of all texts, one text after the other
+    /// @param n_tokens The number of tokens of each text, set also on failure
+    /// @return Returns the total number of tokens on success, no more than n_tokens_max
+    /// @return Returns a negative number on failure - the total number of tokens that would have been returned
+    /// @return Returns INT32_MIN on overflow (e.g., tokenization result size exceeds int32_t limit)
+    LLAMA_API int32_t llama_tokenize_batch(
+        const struct llama_vocab * vocab,
+                     const char ** texts,
+                  const int32_t  * text_lens,
+                         int32_t   n_texts,
+                     llama_token * tokens,
+                         int32_t   n_tokens_max,
+                         int32_t * n_tokens,
+                            bool   add_special,
+                            bool   parse_special,
+                         int32_t   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -1381,6 +1514,22 @@ extern "C" {
     // Returns the sampled token
     LLAMA_API llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx);
 
+    /// @details Sample and accept the tokens of several outputs of the last evaluation, e.g. one per sequence
+    //
+    // Equivalent to:
+    //    for (int32_t i = 0; i < n; i++) {
+    //        tokens[i] = llama_sampler_sample(smpls[i], ctx, idxs[i]);
+    //    }
+    //
+    // The samplers are run concurrently on the calling thread and the worker threads of the context (n_threads_batch - 1
+    // threads, created on first use), so each sampler can appear only once
+    LLAMA_API void llama_sampler_sample_batch(
+            struct llama_sampler ** smpls,
+            struct llama_context  * ctx,
+                   const int32_t  * idxs,
+                     llama_token  * tokens,
+                         int32_t    n);
+
     // TODO: extend in the future
     //LLAMA_API void llama_decode_with_sampler(struct llama_context * ctx, struct llama_sampler * smpl, struct llama_batch batch, ...);
 
@@ -1419,6 +1568,7 @@ extern "C" {
 
         int32_t n_p_eval;
         int32_t n_eval;
+        int32_t n_reused; // number of ubatches computed with the graph of the previous ubatch
     };
 
     struct llama_perf_sampler_data {
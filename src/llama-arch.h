@@ -168,6 +168,9 @@ enum llm_kv {
     LLM_KV_SPLIT_COUNT,
     LLM_KV_SPLIT_TENSORS_COUNT,
 
+    LLM_KV_REPACK_TENSORS,
+    LLM_KV_REPACK_LAYOUTS,
+
     LLM_KV_SSM_INNER_SIZE,
     LLM_KV_SSM_CONV_KERNEL,
     LLM_KV_SSM_STATE_SIZE,
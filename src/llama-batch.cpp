@@ -13,11 +13,11 @@ llama_batch_allocr::llama_batch_allocr(uint32_t n_pos_per_embd) : n_pos_per_embd
     const char * LLAMA_BATCH_DEBUG = getenv("LLAMA_BATCH_DEBUG");
     debug = LLAMA_BATCH_DEBUG ? atoi(LLAMA_BATCH_DEBUG) : 0;
 
-    seq_pos.resize(LLAMA_MAX_SEQ);
-    seq_cpl.resize(LLAMA_MAX_SEQ);
-    for (auto & cur : seq_cpl) {
-        cur.resize(LLAMA_MAX_SEQ);
-    }
+    seq_idxs  .resize(LLAMA_MAX_SEQ);
+    seq_pos_lo.resize(LLAMA_MAX_SEQ, -1);
+    seq_pos_hi.resize(LLAMA_MAX_SEQ, -1);
+
+    seq_set_single.fill(-1);
 
     seq_idx.resize(LLAMA_MAX_SEQ, -1);
 }
@@ -150,45 +150,83 @@ bool llama_batch_allocr::init(
         n_outputs += batch.logits[i] != 0;
     }
 
-    // determine coupled sequences
-    // these are pairs of sequences that have at least one token in the input batch that is assigned to both of them
+    // build the per-sequence index lists and determine coupled sequences
+    // coupled sequences are pairs of sequences that have at least one token in the input batch that is assigned to both of them
     for (int32_t i = 0; i < batch.n_tokens; ++i) {
         const llama_seq_id s0 = batch.seq_id[i][0];
+        const llama_pos    p  = batch.pos[i];
 
         for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
             const llama_seq_id s1 = batch.seq_id[i][s];
 
-            seq_pos[s1].insert(batch.pos[i]);
+            if (seq_idxs[s1].empty()) {
+                seq_pos_lo[s1] = p;
+                seq_pos_hi[s1] = p;
+            } else {
+                seq_pos_lo[s1] = std::min(seq_pos_lo[s1], p);
+                seq_pos_hi[s1] = std::max(seq_pos_hi[s1], p);
+            }
+
+            seq_idxs[s1].push_back(i);
 
             if (s > 0) {
                 // mark that sequence s1 is coupled to s0
-                seq_cpl[s1][s0] = true;
+                seq_cpl.emplace_back(s1, s0);
 
                 // note: tracking the other way around is not necessary for now
-                //seq_cpl[s0][s1] = true;
+                //seq_cpl.emplace_back(s0, s1);
             }
         }
     }
 
+    std::sort(seq_cpl.begin(), seq_cpl.end());
+    seq_cpl.erase(std::unique(seq_cpl.begin(), seq_cpl.end()), seq_cpl.end());
+
     // precompute the sequence sets for each token and determine the unique sequence ids that participate in the batch
     {
-        seq_set_t seq_set_unq;
+        seq_set.resize(batch.n_tokens);
+
+        int32_t k_prev = -1;
 
         for (int32_t i = 0; i < batch.n_tokens; ++i) {
             seq_set_t cur;
             for (int32_t s = 0; s < batch.n_seq_id[i]; ++s) {
-                const llama_seq_id seq_id = batch.seq_id[i][s];
+                cur.set(batch.seq_id[i][s]);
+            }
+
+            seq_set[i] = cur;
+
+            // fast paths for runs of the same set and for single-sequence sets, to avoid hashing the bitset
+            int32_t k = -1;
+            if (k_prev >= 0 && seq_sets[k_prev].set == cur) {
+                k = k_prev;
+            } else if (batch.n_seq_id[i] == 1) {
+                k = seq_set_single[batch.seq_id[i][0]];
+            } else {
+                const auto it = seq_set_map.find(cur);
+                if (it != seq_set_map.end()) {
+                    k = it->second;
+                }
+            }
+
+            if (k < 0) {
+                k = seq_sets.size();
+                seq_sets.push_back({ cur, {}, 0 });
 
-                cur        .set(seq_id);
-                seq_set_unq.set(seq_id);
+                if (batch.n_seq_id[i] == 1) {
+                    seq_set_single[batch.seq_id[i][0]] = k;
+                } else {
+                    seq_set_map[cur] = k;
+                }
             }
 
-            seq_set.push_back(cur);
-            seq_set_map[cur].push_back(i);
+            seq_sets[k].idxs.push_back(i);
+
+            k_prev = k;
         }
 
         for (int32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
-            if (seq_set_unq.test(s)) {
+            if (!seq_idxs[s].empty()) {
                 seq_idx[s] = seq_id_unq.size();
                 seq_id_unq.push_back(s);
             }
@@ -204,6 +242,7 @@ bool llama_batch_allocr::init(
             /*.n_seq_tokens =*/ (uint32_t) 1,
             /*.n_seqs       =*/ (uint32_t) batch.n_tokens,
             /*.n_seqs_unq   =*/ (uint32_t) this->seq_id_unq.size(),
+            /*.n_seq_ranges =*/ 0,
             /*.token        =*/ batch.token,
             /*.embd         =*/ batch.embd,
             /*.pos          =*/ batch.pos,
@@ -212,20 +251,21 @@ bool llama_batch_allocr::init(
             /*.seq_id_unq   =*/ this->seq_id_unq.data(),
             /*.seq_idx      =*/ this->seq_idx.data(),
             /*.output       =*/ batch.logits,
+            /*.seq_ranges   =*/ nullptr,
         };
 
         ubatch_print(ubatch, debug);
 
         LLAMA_LOG_DEBUG("%s:   seq       = [\n", __func__);
-        for (int s0 = 0; s0 < (int) seq_pos.size(); ++s0) {
-            if (seq_pos[s0].empty()) {
+        for (int s0 = 0; s0 < LLAMA_MAX_SEQ; ++s0) {
+            if (seq_idxs[s0].empty()) {
                 continue;
             }
 
             std::stringstream ss;
-            for (int s1 = 0; s1 < (int) seq_cpl[s0].size(); ++s1) {
-                if (seq_cpl[s0][s1]) {
-                    ss << s1 << " ";
+            for (const auto & [s1, s2] : seq_cpl) {
+                if (s1 == s0) {
+                    ss << s2 << " ";
                 }
             }
 
@@ -240,7 +280,7 @@ bool llama_batch_allocr::init(
     //
 
     for (int32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
-        if (seq_pos[s].empty()) {
+        if (seq_idxs[s].empty()) {
             continue;
         }
 
@@ -275,22 +315,18 @@ bool llama_batch_allocr::init(
             }
         }
 
-        if (seq_pos_max(s) - seq_pos_min(s) + 1 > (int) seq_pos[s].size()) {
+        if (seq_pos_max(s) - seq_pos_min(s) + 1 > seq_n_pos(s)) {
             LLAMA_LOG_ERROR("%s: sequence %d positions are not continuous\n", __func__, s);
             return false;
         }
     }
 
     if (memory) {
-        for (int32_t s0 = 0; s0 < LLAMA_MAX_SEQ; ++s0) {
-            for (int32_t s1 = 0; s1 < LLAMA_MAX_SEQ; ++s1) {
-                if (seq_cpl[s0][s1]) {
-                    if (memory->seq_pos_min(s0) != memory->seq_pos_min(s1) ||
-                        memory->seq_pos_max(s0) != memory->seq_pos_max(s1)) {
-                        LLAMA_LOG_ERROR("%s: sequence %d is coupled to %d in the input batch, but have divereged\n", __func__, s0, s1);
-                        return false;
-                    }
-                }
+        for (const auto & [s0, s1] : seq_cpl) {
+            if (memory->seq_pos_min(s0) != memory->seq_pos_min(s1) ||
+                memory->seq_pos_max(s0) != memory->seq_pos_max(s1)) {
+                LLAMA_LOG_ERROR("%s: sequence %d is coupled to %d in the input batch, but have divereged\n", __func__, s0, s1);
+                return false;
             }
         }
     }
@@ -367,6 +403,7 @@ llama_ubatch llama_batch_allocr::ubatch_reserve(uint32_t n_seq_tokens, uint32_t
     ubatch.seq_id_unq.resize(0);
     ubatch.seq_idx   .resize(LLAMA_MAX_SEQ, -1);
     ubatch.output    .resize(n_tokens);
+    ubatch.seq_ranges.clear();
 
     for (uint32_t s = 0; s < n_seqs; ++s) {
         ubatch.seq_idx[s] = s;
@@ -379,6 +416,7 @@ llama_ubatch llama_batch_allocr::ubatch_reserve(uint32_t n_seq_tokens, uint32_t
         /*.n_seq_tokens =*/ n_seq_tokens,
         /*.n_seqs       =*/ n_seqs,
         /*.n_seqs_unq   =*/ n_seqs,
+        /*.n_seq_ranges =*/ 0,
 
         /*.token        =*/ ubatch.token.data(),
         /*.embd         =*/ nullptr,
@@ -388,6 +426,7 @@ llama_ubatch llama_batch_allocr::ubatch_reserve(uint32_t n_seq_tokens, uint32_t
         /*.seq_id_unq   =*/ ubatch.seq_id_unq.data(),
         /*.seq_idx      =*/ ubatch.seq_idx.data(),
         /*.output       =*/ ubatch.output.data(),
+        /*.seq_ranges   =*/ nullptr,
     };
 
     return res;
@@ -410,11 +449,42 @@ std::vector<int32_t> & llama_batch_allocr::get_out_ids() {
 }
 
 llama_pos llama_batch_allocr::seq_pos_min(llama_seq_id seq_id) const {
-    return seq_pos[seq_id].empty() ? -1 : *seq_pos[seq_id].begin();
+    return seq_pos_lo[seq_id];
 }
 
 llama_pos llama_batch_allocr::seq_pos_max(llama_seq_id seq_id) const {
-    return seq_pos[seq_id].empty() ? -1 : *seq_pos[seq_id].rbegin();
+    return seq_pos_hi[seq_id];
+}
+
+int32_t llama_batch_allocr::seq_n_pos(llama_seq_id seq_id) const {
+    const auto & idxs = seq_idxs[seq_id];
+
+    // the positions of a sequence are typically non-decreasing in the batch - count the distinct ones in a single pass
+    int32_t res = 0;
+
+    llama_pos p_prev = -1;
+
+    for (size_t k = 0; k < idxs.size(); ++k) {
+        const llama_pos p = batch.pos[idxs[k]];
+
+        if (k > 0 && p < p_prev) {
+            // out of order positions - fall back to sorting
+            std::vector<llama_pos> ps(idxs.size());
+            for (size_t j = 0; j < idxs.size(); ++j) {
+                ps[j] = batch.pos[idxs[j]];
+            }
+
+            std::sort(ps.begin(), ps.end());
+
+            return std::unique(ps.begin(), ps.end()) - ps.begin();
+        }
+
+        res += k == 0 || p != p_prev;
+
+        p_prev = p;
+    }
+
+    return res;
 }
 
 void llama_batch_allocr::split_reset() {
@@ -423,16 +493,23 @@ void llama_batch_allocr::split_reset() {
     used.clear();
     used.resize(get_n_tokens(), false);
 
+    used_first = 0;
+
+    for (auto & cur : seq_sets) {
+        cur.next = 0;
+    }
+
     ubatches.clear();
 }
 
 llama_ubatch llama_batch_allocr::split_simple(uint32_t n_ubatch) {
     // find the first unused token
-    uint32_t cur_idx = 0;
-    while (cur_idx < used.size() && used[cur_idx]) {
-        ++cur_idx;
+    while (used_first < used.size() && used[used_first]) {
+        ++used_first;
     }
 
+    uint32_t cur_idx = used_first;
+
     // we are done
     if (cur_idx >= used.size()) {
         return {};
@@ -460,26 +537,36 @@ llama_ubatch llama_batch_allocr::split_simple(uint32_t n_ubatch) {
 }
 
 llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch) {
-    std::vector<seq_set_t> cur_seq_set;
+    // the sequence sets that still have unused tokens, ordered by their first unused token
+    std::vector<int32_t> cand;
+    cand.reserve(seq_sets.size());
 
-    // determine the non-overlapping sequence sets participating in this ubatch
-    for (int32_t i = 0; i < batch.n_tokens; ++i) {
-        if (used[i]) {
-            continue;
-        }
+    for (int32_t k = 0; k < (int32_t) seq_sets.size(); ++k) {
+        auto & cur = seq_sets[k];
 
-        bool add = true;
+        while (cur.next < cur.idxs.size() && used[cur.idxs[cur.next]]) {
+            ++cur.next;
+        }
 
-        for (uint32_t s = 0; s < cur_seq_set.size(); ++s) {
-            // no overlap with existing sequence sets:
-            if (!(cur_seq_set[s] & seq_set[i]).none()) {
-                add = false;
-                break;
-            }
+        if (cur.next < cur.idxs.size()) {
+            cand.push_back(k);
         }
+    }
+
+    std::sort(cand.begin(), cand.end(), [&](int32_t a, int32_t b) {
+        return seq_sets[a].idxs[seq_sets[a].next] < seq_sets[b].idxs[seq_sets[b].next];
+    });
+
+    // determine the non-overlapping sequence sets participating in this ubatch
+    std::vector<int32_t> cur_seq_set;
+
+    seq_set_t cur_seq_set_all;
 
-        if (add) {
-            cur_seq_set.push_back(seq_set[i]);
+    for (const int32_t k : cand) {
+        // no overlap with existing sequence sets:
+        if ((cur_seq_set_all & seq_sets[k].set).none()) {
+            cur_seq_set.push_back(k);
+            cur_seq_set_all |= seq_sets[k].set;
 
             if (cur_seq_set.size() > n_ubatch) {
                 break;
@@ -494,67 +581,42 @@ llama_ubatch llama_batch_allocr::split_equal(uint32_t n_ubatch) {
         return {};
     }
 
-    // the current batch index of each sequence set
-    std::vector<int32_t> cur_idx(n_seqs, 0);
+    // the number of tokens to take from each sequence set: limited by the shortest set and by n_ubatch
+    uint32_t n_seq_tokens = UINT32_MAX;
 
-    for (uint32_t s = 0; s < n_seqs; ++s) {
-        while (used[seq_set_map[cur_seq_set[s]][cur_idx[s]]]) {
-            ++cur_idx[s];
-        }
+    for (const int32_t k : cur_seq_set) {
+        n_seq_tokens = std::min<uint32_t>(n_seq_tokens, seq_sets[k].idxs.size() - seq_sets[k].next);
     }
 
-    // the list of batch indices for each sequence set
-    // at the end we will concat these to get the final ubatch
-    std::vector<idx_vec_t> idxs_per_seq(n_seqs);
-
-    while (true) {
-        // we can only add new n_seq_tokens tokens if all the sequence sets have at least one more unused token and
-        //   if we haven't reached n_ubatch
-        bool can_expand = true;
+    n_seq_tokens = std::min(n_seq_tokens, std::max(1u, n_ubatch/n_seqs));
 
-        for (uint32_t s = 0; s < n_seqs; ++s) {
-            if (cur_idx[s] >= (int32_t) seq_set_map[cur_seq_set[s]].size()) {
-                can_expand = false;
-                break;
-            }
-        }
+    // slice the per-sequence-set index lists and concat them to get the final ubatch
+    std::vector<int32_t> idxs;
+    idxs.reserve(n_seq_tokens*n_seqs);
 
-        if (!can_expand) {
-            break;
-        }
+    for (const int32_t k : cur_seq_set) {
+        auto & cur = seq_sets[k];
 
-        for (uint32_t s = 0; s < n_seqs; ++s) {
-            const int32_t idx = seq_set_map[cur_seq_set[s]][cur_idx[s]];
+        for (uint32_t j = 0; j < n_seq_tokens; ++j) {
+            const int32_t idx = cur.idxs[cur.next++];
 
-            idxs_per_seq[s].push_back(idx);
+            idxs.push_back(idx);
 
             used[idx] = true;
-
-            ++cur_idx[s];
-        }
-
-        if  ((idxs_per_seq[0].size() + 1)*n_seqs > n_ubatch) {
-            break;
         }
     }
 
-    // concat the per-sequence-set lists
-    std::vector<int32_t> idxs;
-
-    for (uint32_t s = 0; s < n_seqs; ++s) {
-        idxs.insert(idxs.end(), idxs_per_seq[s].begin(), idxs_per_seq[s].end());
-    }
-
     return ubatch_add(idxs, n_seqs, true);
 }
 
 llama_ubatch llama_batch_allocr::split_seq(uint32_t n_ubatch) {
     // find the first unused token
-    uint32_t cur_idx = 0;
-    while (cur_idx < used.size() && used[cur_idx]) {
-        ++cur_idx;
+    while (used_first < used.size() && used[used_first]) {
+        ++used_first;
     }
 
+    uint32_t cur_idx = used_first;
+
     // we are done
     if (cur_idx >= used.size()) {
         return {};
@@ -564,6 +626,21 @@ llama_ubatch llama_batch_allocr::split_seq(uint32_t n_ubatch) {
     // we allow adding tokens only if their sequence set is a subset of the current sequence set
     auto cur_seq_set = seq_set[cur_idx];
 
+    // the sequence sets that are subsets of the current sequence set
+    // the next token is the first unused one after cur_idx among their index lists
+    std::vector<int32_t> cand;
+
+    auto update_cand = [&]() {
+        cand.clear();
+        for (int32_t k = 0; k < (int32_t) seq_sets.size(); ++k) {
+            if ((cur_seq_set & seq_sets[k].set) == seq_sets[k].set) {
+                cand.push_back(k);
+            }
+        }
+    };
+
+    update_cand();
+
     std::vector<int32_t> idxs;
 
     while (true) {
@@ -575,15 +652,31 @@ llama_ubatch llama_batch_allocr::split_seq(uint32_t n_ubatch) {
             break;
         }
 
-        do {
-            ++cur_idx;
-        } while (cur_idx < get_n_tokens() && (used[cur_idx] || ((cur_seq_set & seq_set[cur_idx]) != seq_set[cur_idx])));
+        uint32_t next_idx = get_n_tokens();
+
+        for (const int32_t k : cand) {
+            const auto & cur = seq_sets[k].idxs;
+
+            auto it = std::upper_bound(cur.begin(), cur.end(), (int32_t) cur_idx);
+            while (it != cur.end() && used[*it]) {
+                ++it;
+            }
 
-        if (cur_idx == get_n_tokens()) {
+            if (it != cur.end()) {
+                next_idx = std::min<uint32_t>(next_idx, *it);
+            }
+        }
+
+        if (next_idx == get_n_tokens()) {
             break;
         }
 
-        cur_seq_set = seq_set[cur_idx];
+        cur_idx = next_idx;
+
+        if (seq_set[cur_idx] != cur_seq_set) {
+            cur_seq_set = seq_set[cur_idx];
+            update_cand();
+        }
     }
 
     return ubatch_add(idxs, 1, true);
@@ -600,18 +693,21 @@ void llama_batch_allocr::clear() {
     seq_id_unq.clear();
     output    .clear();
 
-    for (auto & cur : seq_pos) {
-        cur.clear();
+    for (int32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
+        seq_idxs  [s].clear();
+        seq_pos_lo[s] = -1;
+        seq_pos_hi[s] = -1;
     }
 
-    for (auto & cur : seq_cpl) {
-        std::fill(cur.begin(), cur.end(), false);
-    }
+    seq_cpl.clear();
 
     seq_set.clear();
+    seq_sets.clear();
 
     seq_set_map.clear();
 
+    seq_set_single.fill(-1);
+
     std::fill(seq_idx.begin(), seq_idx.end(), -1);
 }
 
@@ -637,6 +733,7 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
     ubatch.seq_id_unq.resize(0);
     ubatch.seq_idx   .resize(LLAMA_MAX_SEQ, -1);
     ubatch.output    .resize(n_tokens);
+    ubatch.seq_ranges.clear();
 
     seq_set_t seq_set_unq;
 
@@ -664,6 +761,12 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
         if (ubatch.output[i]) {
             out_ids.push_back(idxs[i]);
         }
+
+        if (ubatch.seq_ranges.empty() || ubatch.seq_ranges.back().seq_id != ubatch.seq_id[i][0]) {
+            ubatch.seq_ranges.push_back({ ubatch.seq_id[i][0], (uint32_t) i, (uint32_t) i + 1 });
+        } else {
+            ubatch.seq_ranges.back().i1 = i + 1;
+        }
     }
 
     for (int32_t s = 0; s < LLAMA_MAX_SEQ; ++s) {
@@ -679,6 +782,7 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
         /*.n_seq_tokens =*/ n_tokens/n_seqs,
         /*.n_seqs       =*/ n_seqs,
         /*.n_seqs_unq   =*/ (uint32_t) ubatch.seq_id_unq.size(),
+        /*.n_seq_ranges =*/ (uint32_t) ubatch.seq_ranges.size(),
 
         /*.token        =*/ batch.token ? ubatch.token.data() : nullptr,
         /*.embd         =*/ batch.embd ? ubatch.embd.data() : nullptr,
@@ -688,6 +792,7 @@ llama_ubatch llama_batch_allocr::ubatch_add(const std::vector<int32_t> & idxs, u
         /*.seq_id_unq   =*/ ubatch.seq_id_unq.data(),
         /*.seq_idx      =*/ ubatch.seq_idx.data(),
         /*.output       =*/ ubatch.output.data(),
+        /*.seq_ranges   =*/ ubatch.seq_ranges.data(),
     };
 
     if (debug > 0) {
@@ -706,6 +811,7 @@ void llama_batch_allocr::ubatch_print(const llama_ubatch & ubatch, int debug) {
         LLAMA_LOG_DEBUG("%s:   n_seq_tokens = %d\n", __func__, ubatch.n_seq_tokens);
         LLAMA_LOG_DEBUG("%s:   n_seqs       = %d\n", __func__, ubatch.n_seqs);
         LLAMA_LOG_DEBUG("%s:   n_seqs_unq   = %d\n", __func__, ubatch.n_seqs_unq);
+        LLAMA_LOG_DEBUG("%s:   n_seq_ranges = %d\n", __func__, ubatch.n_seq_ranges);
 
         std::stringstream ss_seq_id_unq;
         std::stringstream ss_seq_idx;
@@ -5,11 +5,19 @@
 #include "llama-cparams.h"
 
 #include <array>
+#include <utility>
 #include <vector>
-#include <set>
 #include <bitset>
 #include <unordered_map>
 
+// a run of consecutive tokens in a ubatch that have the same first sequence id
+// tokens in a run attend to the same KV cells (up to causality), so the KV masks can be built per run
+struct llama_seq_range {
+    llama_seq_id seq_id;
+    uint32_t     i0; // first token of the run
+    uint32_t     i1; // one past the last token of the run
+};
+
 // keep this struct lightweight
 // it points to data in `llama_batch_allocr`
 struct llama_ubatch {
@@ -20,6 +28,7 @@ struct llama_ubatch {
     uint32_t n_seq_tokens; // tokens per sequence set
     uint32_t n_seqs;       // sequence sets in the ubatch
     uint32_t n_seqs_unq;   // unique sequence ids in the ubatch
+    uint32_t n_seq_ranges; // runs of tokens with the same first sequence id
 
     // seq_id_unq: unique sequence ids in the ubatch
     // seq_idx:    indices of the unique sequence ids in the ubatch in [0, n_seqs_unq)
@@ -34,6 +43,8 @@ struct llama_ubatch {
     llama_seq_id *  seq_id_unq; // [n_seqs_unq]       | s   | seq_id
     int32_t      *  seq_idx;    // [LLAMA_MAX_SEQ]    | -   | seq_idx
     int8_t       *  output;     // [n_tokens]         | i   | -
+
+    llama_seq_range * seq_ranges; // [n_seq_ranges]   | -   | seq_id, i0, i1
 };
 
 // a helper for sanitizing, fulfilling and splitting a batch
@@ -81,6 +92,9 @@ public:
 private:
     void clear();
 
+    // number of distinct positions of the sequence in the batch
+    int32_t seq_n_pos(llama_seq_id seq_id) const;
+
     // create the next ubatch based on the provided batch indices (idxs) and the number of sequence sets (n_seqs)
     // return llama_ubatch.n_tokens == 0 if the entire batch was consumed
     llama_ubatch ubatch_add(const std::vector<int32_t> & idxs, uint32_t n_seqs, bool equal_seqs);
@@ -109,18 +123,30 @@ private:
     std::vector<int32_t>        seq_idx;
     std::vector<int8_t>         output;
 
-    using pos_set_t = std::set<llama_pos>;
-    using seq_cpl_t = std::vector<bool>;
-
-    std::vector<pos_set_t> seq_pos; // seq_pos[s]: the set of positions in sequence s
-    std::vector<seq_cpl_t> seq_cpl; // seq_cpl[s0][s1]: if sequence s0 is coupled to sequence s1
-
     using idx_vec_t = std::vector<int32_t>;
     using seq_set_t = std::bitset<LLAMA_MAX_SEQ>;
 
+    std::vector<idx_vec_t> seq_idxs;   // seq_idxs[s]: the batch indices of the tokens in sequence s
+    std::vector<llama_pos> seq_pos_lo; // seq_pos_lo[s]: the min position in sequence s (-1 if not in the batch)
+    std::vector<llama_pos> seq_pos_hi; // seq_pos_hi[s]: the max position in sequence s (-1 if not in the batch)
+
+    // (s1, s0): sequence s1 is coupled to sequence s0
+    std::vector<std::pair<llama_seq_id, llama_seq_id>> seq_cpl;
+
     std::vector<seq_set_t> seq_set; // seq_set[i]: the sequence set of token i
 
-    std::unordered_map<seq_set_t, idx_vec_t> seq_set_map; // the indices at which the sequence set appears
+    struct seq_set_info {
+        seq_set_t set;
+        idx_vec_t idxs; // the batch indices at which the sequence set appears
+        uint32_t  next; // the first entry in idxs that has not been split yet (used by split_equal)
+    };
+
+    // the unique sequence sets in the order of their first appearance in the batch
+    std::vector<seq_set_info> seq_sets;
+
+    std::unordered_map<seq_set_t, int32_t> seq_set_map; // sequence set -> index in seq_sets
+
+    std::array<int32_t, LLAMA_MAX_SEQ> seq_set_single; // seq_set_single[s]: index in seq_sets of the set {s}, or -1
 
     // batch indices of the output
     std::vector<int32_t> out_ids;
@@ -128,6 +154,9 @@ private:
     // used[i] indicates if token i has already been used in a previous ubatch
     std::vector<bool> used;
 
+    // all tokens before this index have been used
+    uint32_t used_first = 0;
+
     // llama_ubatch points to this data:
     struct ubatch {
         std::vector<llama_token>    token;
@@ -138,6 +167,7 @@ private:
         std::vector<llama_seq_id>   seq_id_unq;
         std::vector<int32_t>        seq_idx;
         std::vector<int8_t>         output;
+        std::vector<llama_seq_range> seq_ranges;
     };
 
     // current splitting state:
@@ -2,15 +2,21 @@
 
 #include "llama-impl.h"
 #include "llama-batch.h"
+#include "llama-expert-pager.h"
 #include "llama-io.h"
+#include "llama-kv-spill.h"
 #include "llama-memory.h"
 #include "llama-mmap.h"
 #include "llama-model.h"
+#include "llama-thread-pool.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <cmath>
 #include <cstring>
 #include <limits>
 #include <stdexcept>
+#include <utility>
 
 //
 // llama_context
@@ -40,6 +46,9 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.defrag_step_mib  = params.defrag_step_mib;
+    cparams.n_logits_top_k   = std::min(params.n_logits_top_k, model.vocab.n_tokens());
+    cparams.n_stream_window  = 0;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
@@ -58,6 +67,8 @@ llama_context::llama_context(
     cparams.cb_eval           = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
 
+    kv_spill_dir = params.kv_spill_dir ? params.kv_spill_dir : "";
+
     auto rope_scaling_type = params.rope_scaling_type;
     if (rope_scaling_type == LLAMA_ROPE_SCALING_TYPE_UNSPECIFIED) {
         rope_scaling_type = hparams.rope_scaling_type_train;
@@ -103,6 +114,11 @@ llama_context::llama_context(
 
     cparams.op_offload = params.op_offload;
 
+    {
+        const char * LLAMA_GRAPH_REUSE_DISABLE = getenv("LLAMA_GRAPH_REUSE_DISABLE");
+        graph_reuse = LLAMA_GRAPH_REUSE_DISABLE ? atoi(LLAMA_GRAPH_REUSE_DISABLE) == 0 : true;
+    }
+
     const uint32_t n_ctx_per_seq = cparams.n_ctx / cparams.n_seq_max;
 
     LLAMA_LOG_INFO("%s: n_seq_max     = %u\n",   __func__, cparams.n_seq_max);
@@ -189,12 +205,48 @@ llama_context::llama_context(
     // init the memory module
     if (!hparams.vocab_only) {
         llama_memory_params params_mem = {
-            /*.type_k   =*/ params.type_k,
-            /*.type_v   =*/ params.type_v,
-            /*.swa_full =*/ params.swa_full,
+            /*.type_k          =*/ params.type_k,
+            /*.type_v          =*/ params.type_v,
+            /*.n_kv_hot        =*/ params.n_kv_hot,
+            /*.type_k_cold     =*/ params.type_k_cold,
+            /*.type_v_cold     =*/ params.type_v_cold,
+            /*.n_stream_sink   =*/ params.n_stream_sink,
+            /*.n_stream_window =*/ params.n_stream_window,
+            /*.swa_full        =*/ params.swa_full,
         };
 
         memory.reset(model.create_memory(params_mem, cparams));
+
+        if (memory) {
+            // note: state_seq_restore() reports its errors
+            memory->spill.restore = [this](llama_seq_id seq_id) {
+                for (llama_seq_id s = 0; s < (llama_seq_id) cparams.n_seq_max; ++s) {
+                    if (seq_id < 0 || s == seq_id) {
+                        state_seq_restore(s);
+                    }
+                }
+            };
+            memory->spill.drop = [this](llama_seq_id seq_id) {
+                state_seq_drop(seq_id);
+
+                // the logits subset belongs to the content of the sequence as well
+                if (seq_id < 0) {
+                    logits_subsets.clear();
+                } else if ((size_t) seq_id < logits_subsets.size()) {
+                    logits_subsets[seq_id].clear();
+                }
+            };
+            // note: the op restores the kept sequence first
+            memory->spill.keep = [this](llama_seq_id seq_id) {
+                state_seq_drop(-1);
+
+                for (size_t s = 0; s < logits_subsets.size(); ++s) {
+                    if ((llama_seq_id) s != seq_id) {
+                        logits_subsets[s].clear();
+                    }
+                }
+            };
+        }
     }
 
     // init backends
@@ -263,6 +315,13 @@ llama_context::llama_context(
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(sched.get()));
         }
+
+        // with pipeline parallelism, the scheduler rotates the copies of the inputs at every compute, so the inputs
+        // set for a kept graph would not be the ones it reads
+        if (ggml_backend_sched_get_n_copies(sched.get()) > 1 && graph_reuse) {
+            LLAMA_LOG_INFO("%s: graph reuse disabled with pipeline parallelism\n", __func__);
+            graph_reuse = false;
+        }
     }
 
     // reserve worst-case graph
@@ -342,13 +401,33 @@ llama_context::llama_context(
     }
 }
 
+// set on the thread that runs a decode_async()
+static thread_local bool llama_decode_worker = false;
+
 llama_context::~llama_context() {
+    if (decode_task) {
+        try {
+            llama_thread_pool::wait(decode_task);
+        } catch (const std::exception & err) {
+            LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        }
+    }
+
     ggml_opt_free(opt_ctx);
 }
 
 void llama_context::synchronize() {
+    // while a decode_async() is pending, the backends are used by the decode thread and this does not wait for it:
+    // the outputs that can be read in the meantime are those of the previous decode, which were synchronized when the
+    // decode was submitted - decode_wait() waits for the pending decode
+    if (!llama_decode_worker && decode_task) {
+        return;
+    }
+
     ggml_backend_sched_synchronize(sched.get());
 
+    output_scatter_rows();
+
     // FIXME: if multiple single tokens are evaluated without a synchronization,
     // the stats will be added to the prompt evaluation stats
     // this should only happen when using batch size 1 to evaluate a batch
@@ -424,6 +503,15 @@ llama_memory_t llama_context::get_memory() const {
     return memory.get();
 }
 
+llama_thread_pool * llama_context::get_workers() {
+    std::call_once(workers_once, [this]() {
+        // the calling thread takes part in the parallel loops
+        workers = std::make_unique<llama_thread_pool>(std::max<int>(1, cparams.n_threads_batch - 1));
+    });
+
+    return workers.get();
+}
+
 // deprecated
 void llama_context::kv_self_defrag_sched() {
     if (!memory) {
@@ -492,37 +580,35 @@ enum llama_pooling_type llama_context::pooling_type() const {
 }
 
 float * llama_context::get_logits() {
-    return logits;
+    const auto out = output_get();
+
+    if (out.logits == nullptr && out.logits_top_k != nullptr) {
+        // only the top-k candidates were extracted - expand all rows
+        for (int64_t j = 0; j < out.n_outputs; ++j) {
+            output_expand_logits(out, j);
+        }
+
+        return out.logits_expanded.data();
+    }
+
+    return out.logits;
 }
 
 float * llama_context::get_logits_ith(int32_t i) {
-    int64_t j = -1;
+    const auto out = output_get();
 
     try {
-        if (logits == nullptr) {
+        if (out.logits == nullptr && out.logits_top_k == nullptr) {
             throw std::runtime_error("no logits");
         }
 
-        if (i < 0) {
-            j = n_outputs + i;
-            if (j < 0) {
-                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
-            }
-        } else if ((size_t) i >= output_ids.size()) {
-            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
-        } else {
-            j = output_ids[i];
-        }
+        const int64_t j = output_index(out, i);
 
-        if (j < 0) {
-            throw std::runtime_error(format("batch.logits[%d] != true", i));
-        }
-        if (j >= n_outputs) {
-            // This should not happen
-            throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, n_outputs));
+        if (out.logits == nullptr) {
+            return output_expand_logits(out, j);
         }
 
-        return logits + j*model.vocab.n_tokens();
+        return out.logits + j*model.vocab.n_tokens();
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
 #ifndef NDEBUG
@@ -533,38 +619,108 @@ float * llama_context::get_logits_ith(int32_t i) {
     }
 }
 
+int32_t llama_context::get_logits_top_k_ith(int32_t i, const llama_token ** tokens, const float ** logits) {
+    if (cparams.n_logits_top_k == 0) {
+        return 0;
+    }
+
+    const auto out = output_get();
+
+    try {
+        if (out.logits_top_k == nullptr) {
+            throw std::runtime_error("no logits");
+        }
+
+        const int64_t j = output_index(out, i);
+
+        const uint32_t n_top_k = cparams.n_logits_top_k;
+
+        *tokens = out.logits_top_k_ids + j*n_top_k;
+        *logits = out.logits_top_k     + j*n_top_k;
+
+        return n_top_k;
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d, reason: %s\n", __func__, i, err.what());
+#ifndef NDEBUG
+        GGML_ABORT("fatal error");
+#else
+        return 0;
+#endif
+    }
+}
+
+int32_t llama_context::set_logits_subset(llama_seq_id seq_id, const llama_token * tokens, size_t n_tokens) {
+    if (cparams.n_logits_top_k > 0 || model.output_b != nullptr) {
+        return -2;
+    }
+
+    if (decode_pending()) {
+        LLAMA_LOG_ERROR("%s: cannot change the logits subsets while a decode is pending\n", __func__);
+        return -1;
+    }
+
+    if (seq_id < 0 || (uint32_t) seq_id >= cparams.n_seq_max) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id = %d\n", __func__, seq_id);
+        return -1;
+    }
+
+    const int32_t n_vocab = model.vocab.n_tokens();
+
+    for (size_t i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            LLAMA_LOG_ERROR("%s: invalid token[%zu] = %d\n", __func__, i, tokens[i]);
+            return -1;
+        }
+    }
+
+    if (logits_subsets.size() < cparams.n_seq_max) {
+        logits_subsets.resize(cparams.n_seq_max);
+    }
+
+    auto & subset = logits_subsets[seq_id];
+
+    subset.assign(tokens, tokens + n_tokens);
+
+    std::sort(subset.begin(), subset.end());
+    subset.erase(std::unique(subset.begin(), subset.end()), subset.end());
+
+    return 0;
+}
+
 float * llama_context::get_embeddings() {
-    return embd;
+    return output_get().embd;
 }
 
 float * llama_context::get_embeddings_ith(int32_t i) {
+    const auto out = output_get();
+
     int64_t j = -1;
 
     try {
-        if (embd == nullptr) {
+        if (out.embd == nullptr) {
             throw std::runtime_error("no embeddings");
         }
 
         if (i < 0) {
-            j = n_outputs + i;
+            j = out.n_outputs + i;
             if (j < 0) {
-                throw std::runtime_error(format("negative index out of range [0, %d)", n_outputs));
+                throw std::runtime_error(format("negative index out of range [0, %d)", out.n_outputs));
             }
-        } else if ((size_t) i >= output_ids.size()) {
-            throw std::runtime_error(format("out of range [0, %zu)", output_ids.size()));
+        } else if ((size_t) i >= out.output_ids.size()) {
+            throw std::runtime_error(format("out of range [0, %zu)", out.output_ids.size()));
         } else {
-            j = output_ids[i];
+            j = out.output_ids[i];
         }
 
         if (j < 0) {
             throw std::runtime_error(format("batch.logits[%d] != true", i));
         }
-        if (j >= n_outputs) {
+        if (j >= out.n_outputs) {
             // This should not happen
-            throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, n_outputs));
+            throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, out.n_outputs));
         }
 
-        return embd + j*model.hparams.n_embd;
+        return out.embd + j*model.hparams.n_embd;
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("%s: invalid embeddings id %d, reason: %s\n", __func__, i, err.what());
 #ifndef NDEBUG
@@ -576,8 +732,10 @@ float * llama_context::get_embeddings_ith(int32_t i) {
 }
 
 float * llama_context::get_embeddings_seq(llama_seq_id seq_id) {
-    auto it = embd_seq.find(seq_id);
-    if (it == embd_seq.end()) {
+    const auto out = output_get();
+
+    auto it = out.embd_seq.find(seq_id);
+    if (it == out.embd_seq.end()) {
         return nullptr;
     }
 
@@ -646,6 +804,8 @@ void llama_context::set_adapter_lora(
     LLAMA_LOG_DEBUG("%s: adapter = %p, scale = %f\n", __func__, (void *) adapter, scale);
 
     loras[adapter] = scale;
+
+    gf_res_prev.reset();
 }
 
 bool llama_context::rm_adapter_lora(
@@ -655,6 +815,7 @@ bool llama_context::rm_adapter_lora(
     auto pos = loras.find(adapter);
     if (pos != loras.end()) {
         loras.erase(pos);
+        gf_res_prev.reset();
         return true;
     }
 
@@ -665,6 +826,8 @@ void llama_context::clear_adapter_lora() {
     LLAMA_LOG_DEBUG("%s: call\n", __func__);
 
     loras.clear();
+
+    gf_res_prev.reset();
 }
 
 bool llama_context::apply_adapter_cvec(
@@ -675,50 +838,68 @@ bool llama_context::apply_adapter_cvec(
                 int32_t   il_end) {
     LLAMA_LOG_DEBUG("%s: il_start = %d, il_end = %d\n", __func__, il_start, il_end);
 
+    // the graph references the tensors of the control vector
+    gf_res_prev.reset();
+
     return cvec.apply(model, data, len, n_embd, il_start, il_end);
 }
 
-llm_graph_result_ptr llama_context::process_ubatch(const llama_ubatch & ubatch, llm_graph_type gtype, llama_memory_context_i * mctx, ggml_status & ret) {
+llm_graph_result_i * llama_context::process_ubatch(const llama_ubatch & ubatch, llm_graph_type gtype, llama_memory_context_i * mctx, ggml_status & ret) {
     if (mctx && !mctx->apply()) {
         LLAMA_LOG_ERROR("%s: failed to apply memory context\n", __func__);
         ret = GGML_STATUS_FAILED;
         return nullptr;
     }
 
-    auto * gf = graph_init();
-    if (!gf) {
-        LLAMA_LOG_ERROR("%s: failed to initialize graph\n", __func__);
-        ret = GGML_STATUS_FAILED;
-        return nullptr;
-    }
+    // during steady decoding, consecutive ubatches differ only in the data of the inputs (and in the KV cells they
+    // are stored to) - in that case the graph of the previous ubatch is computed again, without building and
+    // allocating a new one
+    const auto cb = graph_get_cb();
 
-    auto res = graph_build(ctx_compute.get(), gf, ubatch, gtype, mctx);
-    if (!res) {
-        LLAMA_LOG_ERROR("%s: failed to build graph\n", __func__);
-        ret = GGML_STATUS_FAILED;
-        return nullptr;
-    }
+    if (graph_reuse && gf_res_prev && gf_res_prev->can_reuse(graph_params(ctx_compute.get(), ubatch, gtype, mctx, cb))) {
+        n_reused++;
+    } else {
+        ggml_backend_sched_reset(sched.get());
 
-    // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+        auto * gf = graph_init();
+        if (!gf) {
+            LLAMA_LOG_ERROR("%s: failed to initialize graph\n", __func__);
+            ret = GGML_STATUS_FAILED;
+            return nullptr;
+        }
 
-    if (!ggml_backend_sched_alloc_graph(sched.get(), gf)) {
-        LLAMA_LOG_ERROR("%s: failed to allocate graph\n", __func__);
-        ret = GGML_STATUS_ALLOC_FAILED;
-        return nullptr;
+        auto res = graph_build(ctx_compute.get(), gf, ubatch, gtype, mctx);
+        if (!res) {
+            LLAMA_LOG_ERROR("%s: failed to build graph\n", __func__);
+            ret = GGML_STATUS_FAILED;
+            return nullptr;
+        }
+
+        // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
+
+        if (!ggml_backend_sched_alloc_graph(sched.get(), gf)) {
+            LLAMA_LOG_ERROR("%s: failed to allocate graph\n", __func__);
+            ret = GGML_STATUS_ALLOC_FAILED;
+            return nullptr;
+        }
+
+        gf_res_prev = std::move(res);
+        gf_prev     = gf;
     }
 
-    res->set_inputs(&ubatch);
+    gf_res_prev->set_inputs(&ubatch);
 
-    const auto status = graph_compute(gf, ubatch.n_tokens > 1);
+    const auto status = graph_compute(gf_prev, ubatch.n_tokens > 1);
     if (status != GGML_STATUS_SUCCESS) {
         LLAMA_LOG_ERROR("%s: failed to compute graph, compute status: %d\n", __func__, status);
+        gf_res_prev.reset();
         ret = status;
         return nullptr;
     }
 
     ret = GGML_STATUS_SUCCESS;
 
-    return res;
+    return gf_res_prev.get();
 }
 
 int llama_context::encode(const llama_batch & batch_inp) {
@@ -767,8 +948,7 @@ int llama_context::encode(const llama_batch & batch_inp) {
 
     n_outputs = n_tokens;
 
-    ggml_backend_sched_reset(sched.get());
-    ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    graph_set_eval_cb();
 
     const auto causal_attn_org = cparams.causal_attn;
 
@@ -844,9 +1024,8 @@ int llama_context::encode(const llama_batch & batch_inp) {
         }
     }
 
-    // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
-    // overlap with device computation.
-    ggml_backend_sched_reset(sched.get());
+    // note: the scheduler is not reset here - the allocation of the graph is kept, so that the graph can be reused
+    //       for the next ubatch (see process_ubatch)
 
     // TODO: hacky solution
     if (model.arch == LLM_ARCH_T5 && t_embd) {
@@ -899,6 +1078,33 @@ int llama_context::decode(const llama_batch & batch_inp) {
     // when computing embeddings, all tokens are output
     const bool output_all = cparams.embeddings;
 
+    // bring back the sequences of the batch that have been spilled to disk
+    if (kv_spill && kv_spill->n_seq() > 0) {
+        for (int32_t i = 0; i < batch_inp.n_tokens; ++i) {
+            const int32_t n_seq_id = batch_inp.seq_id ? batch_inp.n_seq_id[i] : 1;
+
+            for (int32_t s = 0; s < n_seq_id; ++s) {
+                const llama_seq_id seq_id = batch_inp.seq_id ? batch_inp.seq_id[i][s] : 0;
+
+                // invalid ids are reported by the batch allocator below
+                if (seq_id < 0 || seq_id >= (llama_seq_id) cparams.n_seq_max || !kv_spill->has(seq_id)) {
+                    continue;
+                }
+
+                if (!state_seq_restore(seq_id)) {
+                    LLAMA_LOG_ERROR("%s: failed to restore spilled sequence %d\n", __func__, seq_id);
+                    return -1;
+                }
+            }
+        }
+    }
+
+    // the streaming cache moves the positions of the cached tokens in the update, so it has to be applied before the
+    // batch positions are determined
+    if (cparams.n_stream_window > 0) {
+        kv_self_update(false);
+    }
+
     if (!balloc->init(batch_inp, vocab, memory.get(), n_embd, output_all)) {
         LLAMA_LOG_ERROR("%s: failed to initialize batch\n", __func__);
         return -1;
@@ -931,7 +1137,9 @@ int llama_context::decode(const llama_batch & batch_inp) {
     bool did_optimize = false;
 
     // handle any pending defrags/shifts
-    kv_self_update(false);
+    if (cparams.n_stream_window == 0) {
+        kv_self_update(false);
+    }
 
     llama_memory_context_ptr mctx;
 
@@ -1005,8 +1213,7 @@ int llama_context::decode(const llama_batch & batch_inp) {
             n_outputs = n_outputs_new;
         }
 
-        ggml_backend_sched_reset(sched.get());
-        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+        graph_set_eval_cb();
 
         ggml_status status;
         const auto res = process_ubatch(ubatch, LLM_GRAPH_TYPE_DECODER, mctx.get(), status);
@@ -1054,6 +1261,26 @@ int llama_context::decode(const llama_batch & batch_inp) {
             t_embd = res->get_embd_pooled();
         }
 
+        // extract the top-k logits
+        if (res->get_logits_top_k() && n_outputs > 0) {
+            auto * t_top_k     = res->get_logits_top_k();
+            auto * t_top_k_ids = res->get_logits_top_k_ids();
+
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_top_k);
+            GGML_ASSERT(backend_res != nullptr);
+            GGML_ASSERT(logits_top_k != nullptr);
+
+            const int64_t n_top_k = cparams.n_logits_top_k;
+
+            GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
+            GGML_ASSERT((n_outputs_prev + n_outputs)*n_top_k <= (int64_t) logits_top_k_size);
+
+            ggml_backend_tensor_get_async(backend_res, t_top_k,     logits_top_k     + n_outputs_prev*n_top_k, 0, n_outputs*n_top_k*sizeof(float));
+            ggml_backend_tensor_get_async(backend_res, t_top_k_ids, logits_top_k_ids + n_outputs_prev*n_top_k, 0, n_outputs*n_top_k*sizeof(llama_token));
+
+            t_logits = nullptr;
+        }
+
         // extract logits
         if (t_logits && n_outputs > 0) {
             ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
@@ -1062,11 +1289,52 @@ int llama_context::decode(const llama_batch & batch_inp) {
 
             float * logits_out = logits + n_outputs_prev*n_vocab;
 
-            if (n_outputs) {
-                GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
-                GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_size);
+            GGML_ASSERT( n_outputs_prev + n_outputs <= n_outputs_all);
+            GGML_ASSERT((n_outputs_prev + n_outputs)*n_vocab <= (int64_t) logits_size);
+
+            const auto & rows = res->get_logits_rows();
+
+            if (!rows.empty()) {
+                const int64_t n_rows = rows.size();
+
+                // only the rows of the subsets were computed - they are copied to the end of the logits of the ubatch
+                float * rows_out = logits_out + n_outputs*(n_vocab - n_rows);
+
+                ggml_backend_tensor_get_async(backend_res, t_logits, rows_out, 0, n_outputs*n_rows*sizeof(float));
+            } else {
                 ggml_backend_tensor_get_async(backend_res, t_logits, logits_out, 0, n_outputs*n_vocab*sizeof(float));
             }
+
+            // the logits of the subsets are scattered into the full rows after the next synchronization, so that the
+            // backend can proceed with the next ubatch
+            if (!logits_subsets.empty()) {
+                logits_scatter scatter;
+                scatter.i_output = n_outputs_prev;
+                scatter.rows     = rows;
+                scatter.subsets.reserve(n_outputs);
+
+                bool has_subset = false;
+
+                for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+                    if (n_outputs < ubatch.n_tokens && !ubatch.output[i]) {
+                        continue;
+                    }
+
+                    // the logits of a token shared by multiple sequences are not restricted
+                    if (ubatch.n_seq_id[i] == 1) {
+                        scatter.subsets.push_back(logits_subsets[ubatch.seq_id[i][0]]);
+                    } else {
+                        scatter.subsets.emplace_back();
+                    }
+
+                    has_subset = has_subset || !scatter.subsets.back().empty();
+                }
+                GGML_ASSERT((int64_t) scatter.subsets.size() == n_outputs);
+
+                if (has_subset) {
+                    logits_scatters.push_back(std::move(scatter));
+                }
+            }
         }
 
         // extract embeddings
@@ -1149,6 +1417,12 @@ int llama_context::decode(const llama_batch & batch_inp) {
         // make the outputs have the same order they had in the user-provided batch
         // note: this is mostly relevant for recurrent models atm
         if (!sorted_output) {
+            // the rows are moved below, so the logits of the subsets must be in place
+            if (!logits_scatters.empty()) {
+                ggml_backend_sched_synchronize(sched.get());
+                output_scatter_rows();
+            }
+
             const uint32_t n_vocab = model.vocab.n_tokens();
             const uint64_t n_embd  = model.hparams.n_embd;
 
@@ -1177,6 +1451,13 @@ int llama_context::decode(const llama_batch & batch_inp) {
                         std::swap(embd[i*n_embd + k], embd[j_min*n_embd + k]);
                     }
                 }
+                if (logits_top_k_size > 0) {
+                    const uint32_t n_top_k = cparams.n_logits_top_k;
+                    for (uint32_t k = 0; k < n_top_k; k++) {
+                        std::swap(logits_top_k    [i*n_top_k + k], logits_top_k    [j_min*n_top_k + k]);
+                        std::swap(logits_top_k_ids[i*n_top_k + k], logits_top_k_ids[j_min*n_top_k + k]);
+                    }
+                }
             }
 
             std::fill(output_ids.begin(), output_ids.end(), -1);
@@ -1190,13 +1471,77 @@ int llama_context::decode(const llama_batch & batch_inp) {
     // wait for the computation to finish (automatically done when obtaining the model output)
     //synchronize();
 
-    // Reset state for the next token before backend sync, to allow the CPU activities in the reset to
-    // overlap with device computation.
-    ggml_backend_sched_reset(sched.get());
+    // note: the scheduler is not reset here - the allocation of the graph is kept, so that the graph can be reused
+    //       for the next ubatch (see process_ubatch)
+
+    return 0;
+}
+
+int llama_context::decode_async(const llama_batch & batch_inp) {
+    if (decode_task) {
+        LLAMA_LOG_ERROR("%s: a decode is already in progress\n", __func__);
+        return -1;
+    }
+
+    // the outputs of the previous decode must be complete before the worker takes over the backends
+    synchronize();
+
+    // keep the outputs of the previous decode readable - the batch is decoded into the other buffer
+    output_swap(output_prev);
+
+    decode_ret = 0;
+
+    if (!decode_thread) {
+        decode_thread = std::make_unique<llama_thread_pool>(1);
+    }
+
+    decode_task = decode_thread->submit([this, batch_inp]() {
+        // note: decode_wait() runs the decode on the calling thread if it has not started yet
+        const bool worker_prev = std::exchange(llama_decode_worker, true);
+
+        try {
+            decode_ret = decode(batch_inp);
+        } catch (...) {
+            llama_decode_worker = worker_prev;
+            throw;
+        }
+
+        llama_decode_worker = worker_prev;
+    });
 
     return 0;
 }
 
+int llama_context::decode_wait() {
+    if (!decode_task) {
+        return 0;
+    }
+
+    try {
+        llama_thread_pool::wait(decode_task);
+    } catch (...) {
+        decode_task = nullptr;
+
+        // same as a failed decode(): the outputs of the previous decode remain available
+        logits_scatters.clear();
+        output_swap(output_prev);
+        throw;
+    }
+
+    decode_task = nullptr;
+
+    if (decode_ret != 0) {
+        logits_scatters.clear();
+        output_swap(output_prev);
+    }
+
+    return decode_ret;
+}
+
+bool llama_context::decode_pending() const {
+    return decode_task != nullptr;
+}
+
 //
 // output
 //
@@ -1220,8 +1565,17 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
         has_embd   = true;
     }
 
-    logits_size = has_logits ? n_vocab*n_outputs_max : 0;
-    embd_size   = has_embd   ?  n_embd*n_outputs_max : 0;
+    // only the selected candidates are extracted from the graph
+    const auto n_top_k = cparams.n_logits_top_k;
+
+    const bool has_top_k = has_logits && n_top_k > 0;
+    if (has_top_k) {
+        has_logits = false;
+    }
+
+    logits_size       = has_logits ? n_vocab*n_outputs_max : 0;
+    embd_size         = has_embd   ?  n_embd*n_outputs_max : 0;
+    logits_top_k_size = has_top_k  ? n_top_k*n_outputs_max : 0;
 
     if (output_ids.empty()) {
         // init, never resized afterwards
@@ -1229,7 +1583,7 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
     }
 
     const size_t prev_size = buf_output ? ggml_backend_buffer_get_size(buf_output.get()) : 0;
-    const size_t new_size  = (logits_size + embd_size) * sizeof(float);
+    const size_t new_size  = (logits_size + embd_size) * sizeof(float) + logits_top_k_size * (sizeof(float) + sizeof(llama_token));
 
     // alloc only when more than the current capacity is required
     // TODO: also consider shrinking the buffer
@@ -1242,6 +1596,8 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
             buf_output = nullptr;
             logits = nullptr;
             embd = nullptr;
+            logits_top_k = nullptr;
+            logits_top_k_ids = nullptr;
         }
 
         auto * buft = ggml_backend_cpu_buffer_type();
@@ -1263,6 +1619,13 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
     logits = has_logits ? output_base               : nullptr;
     embd   = has_embd   ? output_base + logits_size : nullptr;
 
+    logits_top_k     = has_top_k ?                 output_base + logits_size + embd_size                      : nullptr;
+    logits_top_k_ids = has_top_k ? (llama_token *) (output_base + logits_size + embd_size + logits_top_k_size) : nullptr;
+
+    // the expanded rows and the pending scatters belong to the previous outputs
+    logits_expanded_rows.clear();
+    logits_scatters.clear();
+
     // set all ids as invalid (negative)
     std::fill(output_ids.begin(), output_ids.end(), -1);
 
@@ -1271,6 +1634,156 @@ uint32_t llama_context::output_reserve(int32_t n_outputs) {
     return n_outputs_max;
 }
 
+llama_context::output_view llama_context::output_get() {
+    // note: the decode thread does not read decode_task, which is assigned after the task is submitted
+    if (!llama_decode_worker && decode_task) {
+        return {
+            /* .logits               = */ output_prev.logits,
+            /* .logits_top_k         = */ output_prev.logits_top_k,
+            /* .logits_top_k_ids     = */ output_prev.logits_top_k_ids,
+            /* .embd                 = */ output_prev.embd,
+            /* .logits_expanded      = */ output_prev.logits_expanded,
+            /* .logits_expanded_rows = */ output_prev.logits_expanded_rows,
+            /* .embd_seq             = */ output_prev.embd_seq,
+            /* .n_outputs            = */ output_prev.n_outputs,
+            /* .output_ids           = */ output_prev.output_ids,
+        };
+    }
+
+    return {
+        /* .logits               = */ logits,
+        /* .logits_top_k         = */ logits_top_k,
+        /* .logits_top_k_ids     = */ logits_top_k_ids,
+        /* .embd                 = */ embd,
+        /* .logits_expanded      = */ logits_expanded,
+        /* .logits_expanded_rows = */ logits_expanded_rows,
+        /* .embd_seq             = */ embd_seq,
+        /* .n_outputs            = */ n_outputs,
+        /* .output_ids           = */ output_ids,
+    };
+}
+
+void llama_context::output_swap(output_state & other) {
+    std::swap(buf_output,           other.buf_output);
+    std::swap(logits_size,          other.logits_size);
+    std::swap(logits,               other.logits);
+    std::swap(logits_top_k_size,    other.logits_top_k_size);
+    std::swap(logits_top_k,         other.logits_top_k);
+    std::swap(logits_top_k_ids,     other.logits_top_k_ids);
+    std::swap(logits_expanded,      other.logits_expanded);
+    std::swap(logits_expanded_rows, other.logits_expanded_rows);
+    std::swap(embd_size,            other.embd_size);
+    std::swap(embd,                 other.embd);
+    std::swap(embd_seq,             other.embd_seq);
+    std::swap(n_outputs,            other.n_outputs);
+    std::swap(output_ids,           other.output_ids);
+}
+
+void llama_context::output_scatter_rows() {
+    const int64_t n_vocab = model.vocab.n_tokens();
+
+    for (const auto & scatter : logits_scatters) {
+        const auto & rows = scatter.rows;
+
+        const int64_t n_outputs = scatter.subsets.size();
+        const int64_t n_rows    = rows.size();
+
+        float * logits_out = logits + scatter.i_output*n_vocab;
+
+        // the full rows were computed - mask the tokens outside of the subsets
+        if (rows.empty()) {
+            for (int64_t j = 0; j < n_outputs; ++j) {
+                const auto & subset = scatter.subsets[j];
+                if (subset.empty()) {
+                    continue;
+                }
+
+                float * dst = logits_out + j*n_vocab;
+
+                logits_rows_buf.resize(subset.size());
+                for (size_t k = 0; k < subset.size(); ++k) {
+                    logits_rows_buf[k] = dst[subset[k]];
+                }
+
+                std::fill(dst, dst + n_vocab, -INFINITY);
+
+                for (size_t k = 0; k < subset.size(); ++k) {
+                    dst[subset[k]] = logits_rows_buf[k];
+                }
+            }
+
+            continue;
+        }
+
+        const float * rows_out = logits_out + n_outputs*(n_vocab - n_rows);
+
+        for (int64_t j = 0; j < n_outputs; ++j) {
+            // the full row of output j ends before the logits of the subsets of the next outputs start, so only the
+            // logits of output j itself have to be saved before the row is written
+            logits_rows_buf.assign(rows_out + j*n_rows, rows_out + (j + 1)*n_rows);
+
+            float * dst = logits_out + j*n_vocab;
+
+            std::fill(dst, dst + n_vocab, -INFINITY);
+
+            for (const llama_token token : scatter.subsets[j]) {
+                dst[token] = logits_rows_buf[std::lower_bound(rows.begin(), rows.end(), token) - rows.begin()];
+            }
+        }
+    }
+
+    logits_scatters.clear();
+}
+
+int64_t llama_context::output_index(const output_view & out, int32_t i) const {
+    int64_t j = -1;
+
+    if (i < 0) {
+        j = out.n_outputs + i;
+        if (j < 0) {
+            throw std::runtime_error(format("negative index out of range [0, %d)", out.n_outputs));
+        }
+    } else if ((size_t) i >= out.output_ids.size()) {
+        throw std::runtime_error(format("out of range [0, %zu)", out.output_ids.size()));
+    } else {
+        j = out.output_ids[i];
+    }
+
+    if (j < 0) {
+        throw std::runtime_error(format("batch.logits[%d] != true", i));
+    }
+    if (j >= out.n_outputs) {
+        // This should not happen
+        throw std::runtime_error(format("corrupt output buffer (j=%" PRId64 ", n_outputs=%d)", j, out.n_outputs));
+    }
+
+    return j;
+}
+
+float * llama_context::output_expand_logits(const output_view & out, int64_t j) {
+    const int64_t n_vocab = model.vocab.n_tokens();
+    const int64_t n_top_k = cparams.n_logits_top_k;
+
+    if (out.logits_expanded_rows.size() < out.n_outputs) {
+        out.logits_expanded_rows.resize(out.n_outputs, false);
+        out.logits_expanded.resize(out.n_outputs*n_vocab);
+    }
+
+    float * row = out.logits_expanded.data() + j*n_vocab;
+
+    if (!out.logits_expanded_rows[j]) {
+        std::fill(row, row + n_vocab, -INFINITY);
+
+        for (int64_t k = 0; k < n_top_k; ++k) {
+            row[out.logits_top_k_ids[j*n_top_k + k]] = out.logits_top_k[j*n_top_k + k];
+        }
+
+        out.logits_expanded_rows[j] = true;
+    }
+
+    return row;
+}
+
 //
 // graph
 //
@@ -1280,6 +1793,10 @@ int32_t llama_context::graph_max_nodes() const {
 }
 
 ggml_cgraph * llama_context::graph_init() {
+    // the previous graph is allocated in ctx_compute
+    gf_res_prev.reset();
+    gf_prev = nullptr;
+
     ggml_init_params params = {
         /*.mem_size   =*/ buf_compute_meta.size(),
         /*.mem_buffer =*/ buf_compute_meta.data(),
@@ -1331,28 +1848,41 @@ ggml_cgraph * llama_context::graph_reserve(uint32_t n_tokens, uint32_t n_seqs, u
     return gf;
 }
 
+llm_graph_params llama_context::graph_params(
+                      ggml_context * ctx,
+                const llama_ubatch & ubatch,
+                    llm_graph_type   gtype,
+      const llama_memory_context_i * mctx,
+                const llm_graph_cb & cb) const {
+    return {
+        /*.ctx         =*/ ctx,
+        /*.arch        =*/ model.arch,
+        /*.gtype       =*/ gtype,
+        /*.hparams     =*/ model.hparams,
+        /*.cparams     =*/ cparams,
+        /*.ubatch      =*/ ubatch,
+        /*.sched       =*/ sched.get(),
+        /*.backend_cpu =*/ backend_cpu,
+        /*.cvec        =*/ &cvec,
+        /*.loras       =*/ &loras,
+        /*.mctx        =*/ mctx,
+        /*.cross       =*/ &cross,
+        /*.logits_subsets =*/ &logits_subsets,
+        /*.w_output    =*/ model.output_b ? nullptr : model.output,
+        /*.n_outputs   =*/ n_outputs,
+        /*.cb          =*/ cb,
+    };
+}
+
 llm_graph_result_ptr llama_context::graph_build(
                       ggml_context * ctx,
                        ggml_cgraph * gf,
                 const llama_ubatch & ubatch,
                     llm_graph_type   gtype,
       const llama_memory_context_i * mctx) {
-    return model.build_graph(
-            {
-                /*.ctx         =*/ ctx,
-                /*.arch        =*/ model.arch,
-                /*.hparams     =*/ model.hparams,
-                /*.cparams     =*/ cparams,
-                /*.ubatch      =*/ ubatch,
-                /*.sched       =*/ sched.get(),
-                /*.backend_cpu =*/ backend_cpu,
-                /*.cvec        =*/ &cvec,
-                /*.loras       =*/ &loras,
-                /*.mctx        =*/ mctx,
-                /*.cross       =*/ &cross,
-                /*.n_outputs   =*/ n_outputs,
-                /*.cb          =*/ graph_get_cb(),
-            }, gf, gtype);
+    const auto cb = graph_get_cb();
+
+    return model.build_graph(graph_params(ctx, ubatch, gtype, mctx, cb), gf, gtype);
 }
 
 ggml_status llama_context::graph_compute(
@@ -1382,6 +1912,57 @@ ggml_status llama_context::graph_compute(
     return status;
 }
 
+void llama_context::graph_set_eval_cb() {
+    if (model.get_expert_pager()) {
+        ggml_backend_sched_set_eval_callback(sched.get(), graph_eval_cb, this);
+    } else {
+        ggml_backend_sched_set_eval_callback(sched.get(), cparams.cb_eval, cparams.cb_eval_user_data);
+    }
+}
+
+bool llama_context::graph_eval_cb(ggml_tensor * t, bool ask, void * user_data) {
+    auto * lctx = (llama_context *) user_data;
+
+    const auto & cparams = lctx->cparams;
+
+    const bool user_ask = cparams.cb_eval && cparams.cb_eval(t, true, cparams.cb_eval_user_data);
+
+    // the ids of the experts selected for each token, [n_expert_used, n_tokens]
+    int il = -1;
+    if (strncmp(t->name, "ffn_moe_topk-", 13) != 0 || sscanf(t->name + 13, "%d", &il) != 1) {
+        il = -1;
+    }
+
+    if (ask) {
+        return il >= 0 || user_ask;
+    }
+
+    if (il >= 0) {
+        GGML_ASSERT(t->type == GGML_TYPE_I32);
+
+        // the top-k is a view of the sorted expert ids
+        auto & buf = lctx->buf_expert_ids;
+        buf.resize(ggml_nbytes(t));
+        ggml_backend_tensor_get(t, buf.data(), 0, buf.size());
+
+        auto & ids = lctx->expert_ids;
+        ids.clear();
+        for (int64_t i1 = 0; i1 < t->ne[1]; ++i1) {
+            for (int64_t i0 = 0; i0 < t->ne[0]; ++i0) {
+                ids.push_back(*(const int32_t *) (buf.data() + i0*t->nb[0] + i1*t->nb[1]));
+            }
+        }
+
+        lctx->model.get_expert_pager()->use(il, ids.data(), ids.size());
+    }
+
+    if (user_ask) {
+        return cparams.cb_eval(t, false, cparams.cb_eval_user_data);
+    }
+
+    return true;
+}
+
 llm_graph_cb llama_context::graph_get_cb() const {
     return [&](const llama_ubatch & ubatch, ggml_tensor * cur, const char * name, int il) {
         if (il >= 0) {
@@ -1439,10 +2020,11 @@ private:
     size_t size_written = 0;
 };
 
+// the tensor data is copied in parallel by flush()
 class llama_io_write_buffer : public llama_io_write_i {
 public:
     llama_io_write_buffer(
-            uint8_t * p, size_t len) : ptr(p), buf_size(len) {}
+            uint8_t * p, size_t len, llama_thread_pool * workers = nullptr) : ptr(p), buf_size(len), workers(workers) {}
 
     void write(const void * src, size_t size) override {
         if (size > buf_size) {
@@ -1458,12 +2040,17 @@ public:
         if (size > buf_size) {
             throw std::runtime_error("unexpectedly reached end of buffer");
         }
-        ggml_backend_tensor_get(tensor, ptr, offset, size);
+        copies.push_back({ const_cast<ggml_tensor *>(tensor), offset, size, ptr });
         ptr += size;
         size_written += size;
         buf_size -= size;
     }
 
+    void flush() override {
+        llama_io_tensor_copies(copies, false, workers);
+        copies.clear();
+    }
+
     size_t n_bytes() override {
         return size_written;
     }
@@ -1472,11 +2059,16 @@ private:
     uint8_t * ptr;
     size_t buf_size = 0;
     size_t size_written = 0;
+
+    llama_thread_pool * workers;
+
+    std::vector<llama_io_tensor_copy> copies;
 };
 
+// the tensor data is copied in parallel by flush()
 class llama_io_read_buffer : public llama_io_read_i {
 public:
-    llama_io_read_buffer(const uint8_t * p, size_t len) : ptr(p), buf_size(len) {}
+    llama_io_read_buffer(const uint8_t * p, size_t len, llama_thread_pool * workers = nullptr) : ptr(p), buf_size(len), workers(workers) {}
 
     const uint8_t * read(size_t size) override {
         const uint8_t * base_ptr = ptr;
@@ -1493,6 +2085,15 @@ public:
         memcpy(dst, read(size), size);
     }
 
+    void read_to_tensor(ggml_tensor * tensor, size_t offset, size_t size) override {
+        copies.push_back({ tensor, offset, size, const_cast<uint8_t *>(read(size)) });
+    }
+
+    void flush() override {
+        llama_io_tensor_copies(copies, true, workers);
+        copies.clear();
+    }
+
     size_t n_bytes() override {
         return size_read;
     }
@@ -1501,6 +2102,10 @@ private:
     const uint8_t * ptr;
     size_t buf_size = 0;
     size_t size_read = 0;
+
+    llama_thread_pool * workers;
+
+    std::vector<llama_io_tensor_copy> copies;
 };
 
 class llama_io_write_file : public llama_io_write_i {
@@ -1513,6 +2118,12 @@ public:
     }
 
     void write_tensor(const ggml_tensor * tensor, size_t offset, size_t size) override {
+        // host buffers can be written without the temporary copy
+        if (tensor->buffer && ggml_backend_buffer_is_host(tensor->buffer)) {
+            write((const uint8_t *) tensor->data + offset, size);
+            return;
+        }
+
         temp_buffer.resize(size);
         ggml_backend_tensor_get(tensor, temp_buffer.data(), offset, size);
         write(temp_buffer.data(), temp_buffer.size());
@@ -1543,6 +2154,16 @@ public:
         return temp_buffer.data();
     }
 
+    void read_to_tensor(ggml_tensor * tensor, size_t offset, size_t size) override {
+        // host buffers can be read into without the temporary copy
+        if (tensor->buffer && ggml_backend_buffer_is_host(tensor->buffer)) {
+            read_to((uint8_t *) tensor->data + offset, size);
+            return;
+        }
+
+        llama_io_read_i::read_to_tensor(tensor, offset, size);
+    }
+
     size_t n_bytes() override {
         return size_read;
     }
@@ -1564,7 +2185,7 @@ size_t llama_context::state_get_size() {
 }
 
 size_t llama_context::state_get_data(uint8_t * dst, size_t size) {
-    llama_io_write_buffer io(dst, size);
+    llama_io_write_buffer io(dst, size, get_workers());
     try {
         return state_write_data(io);
     } catch (const std::exception & err) {
@@ -1574,7 +2195,7 @@ size_t llama_context::state_get_data(uint8_t * dst, size_t size) {
 }
 
 size_t llama_context::state_set_data(const uint8_t * src, size_t size) {
-    llama_io_read_buffer io(src, size);
+    llama_io_read_buffer io(src, size, get_workers());
     try {
         return state_read_data(io);
     } catch (const std::exception & err) {
@@ -1594,7 +2215,7 @@ size_t llama_context::state_seq_get_size(llama_seq_id seq_id) {
 }
 
 size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, size_t size) {
-    llama_io_write_buffer io(dst, size);
+    llama_io_write_buffer io(dst, size, get_workers());
     try {
         return state_seq_write_data(io, seq_id);
     } catch (const std::exception & err) {
@@ -1604,7 +2225,9 @@ size_t llama_context::state_seq_get_data(llama_seq_id seq_id, uint8_t * dst, siz
 }
 
 size_t llama_context::state_seq_set_data(llama_seq_id seq_id, const uint8_t * src, size_t size) {
-    llama_io_read_buffer io(src, size);
+    state_seq_drop(seq_id);
+
+    llama_io_read_buffer io(src, size, get_workers());
     try {
         return state_seq_read_data(io, seq_id);
     } catch (const std::exception & err) {
@@ -1674,6 +2297,8 @@ bool llama_context::state_save_file(const char * filepath, const llama_token * t
 }
 
 size_t llama_context::state_seq_load_file(llama_seq_id seq_id, const char * filepath, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out) {
+    state_seq_drop(seq_id);
+
     llama_file file(filepath, "rb");
 
     // version checks
@@ -1807,12 +2432,17 @@ size_t llama_context::state_write_data(llama_io_write_i & io) {
         memory->state_write(io);
     }
 
+    io.flush();
+
     return io.n_bytes();
 }
 
 size_t llama_context::state_read_data(llama_io_read_i & io) {
     LLAMA_LOG_DEBUG("%s: reading state\n", __func__);
 
+    // the loaded state replaces all sequences
+    state_seq_drop(-1);
+
     // read model info
     {
         LLAMA_LOG_DEBUG("%s: - reading model info\n", __func__);
@@ -1894,9 +2524,100 @@ size_t llama_context::state_read_data(llama_io_read_i & io) {
         memory->state_read(io);
     }
 
+    io.flush();
+
     return io.n_bytes();
 }
 
+bool llama_context::state_seq_spill(llama_seq_id seq_id) {
+    if (!memory) {
+        return false;
+    }
+
+    if (kv_spill && kv_spill->has(seq_id)) {
+        return true;
+    }
+
+    const size_t n_bytes = state_seq_get_size(seq_id);
+    if (n_bytes == 0) {
+        return false;
+    }
+
+    try {
+        if (!kv_spill) {
+            kv_spill = std::make_unique<llama_kv_spill>(kv_spill_dir.c_str());
+        }
+
+        // serialize straight into the mapping of the scratch file
+        uint8_t * dst = kv_spill->alloc(seq_id, n_bytes);
+
+        try {
+            llama_io_write_buffer io(dst, n_bytes, get_workers());
+            state_seq_write_data(io, seq_id);
+        } catch (...) {
+            kv_spill->release(seq_id);
+            throw;
+        }
+
+        kv_spill->evict(seq_id);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error spilling sequence %d: %s\n", __func__, seq_id, err.what());
+        return false;
+    }
+
+    memory->seq_rm(seq_id, -1, -1);
+
+    LLAMA_LOG_DEBUG("%s: spilled sequence %d (%.2f MiB), total spilled = %.2f MiB\n", __func__,
+            seq_id, n_bytes/1024.0/1024.0, kv_spill->total_size()/1024.0/1024.0);
+
+    return true;
+}
+
+void llama_context::state_seq_prefetch(llama_seq_id seq_id) const {
+    if (kv_spill && kv_spill->has(seq_id)) {
+        kv_spill->prefetch(seq_id);
+    }
+}
+
+bool llama_context::state_seq_restore(llama_seq_id seq_id) {
+    if (!kv_spill || !kv_spill->has(seq_id)) {
+        return true;
+    }
+
+    // pages that are not resident yet are faulted in while reading
+    llama_io_read_buffer io(kv_spill->data(seq_id), kv_spill->size(seq_id), get_workers());
+    try {
+        state_seq_read_data(io, seq_id);
+    } catch (const std::exception & err) {
+        LLAMA_LOG_ERROR("%s: error restoring sequence %d: %s\n", __func__, seq_id, err.what());
+        kv_spill->release(seq_id);
+        memory->seq_rm(seq_id, -1, -1);
+        return false;
+    }
+
+    kv_spill->release(seq_id);
+
+    return true;
+}
+
+bool llama_context::state_seq_is_spilled(llama_seq_id seq_id) const {
+    return kv_spill && kv_spill->has(seq_id);
+}
+
+void llama_context::state_seq_drop(llama_seq_id seq_id) {
+    if (!kv_spill) {
+        return;
+    }
+
+    for (llama_seq_id s = 0; s < (llama_seq_id) cparams.n_seq_max; ++s) {
+        if ((seq_id < 0 || s == seq_id) && kv_spill->has(s)) {
+            LLAMA_LOG_DEBUG("%s: dropping the spilled state of sequence %d\n", __func__, s);
+
+            kv_spill->release(s);
+        }
+    }
+}
+
 size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id seq_id) {
     GGML_UNUSED(seq_id);
 
@@ -1904,6 +2625,8 @@ size_t llama_context::state_seq_write_data(llama_io_write_i & io, llama_seq_id s
         memory->state_write(io, seq_id);
     }
 
+    io.flush();
+
     return io.n_bytes();
 }
 
@@ -1914,6 +2637,8 @@ size_t llama_context::state_seq_read_data(llama_io_read_i & io, llama_seq_id seq
         memory->state_read(io, seq_id);
     }
 
+    io.flush();
+
     return io.n_bytes();
 }
 
@@ -1930,6 +2655,7 @@ llama_perf_context_data llama_context::perf_get_data() const {
     data.t_eval_ms   = 1e-3 * t_eval_us;
     data.n_p_eval    = std::max(1, n_p_eval);
     data.n_eval      = std::max(1, n_eval);
+    data.n_reused    = std::max(0, n_reused);
 
     return data;
 }
@@ -1938,6 +2664,7 @@ void llama_context::perf_reset() {
     t_start_us  = ggml_time_us();
     t_eval_us   = n_eval = 0;
     t_p_eval_us = n_p_eval = 0;
+    n_reused    = 0;
 }
 
 //
@@ -2175,10 +2902,18 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/ 1.0f,
         /*.yarn_orig_ctx               =*/ 0,
         /*.defrag_thold                =*/ -1.0f,
+        /*.defrag_step_mib             =*/ 0,
+        /*.n_kv_hot                    =*/ 0,
+        /*.n_stream_sink               =*/ 4,
+        /*.n_stream_window             =*/ 0,
+        /*.n_logits_top_k              =*/ 0,
         /*.cb_eval                     =*/ nullptr,
         /*.cb_eval_user_data           =*/ nullptr,
         /*.type_k                      =*/ GGML_TYPE_F16,
         /*.type_v                      =*/ GGML_TYPE_F16,
+        /*.type_k_cold                 =*/ GGML_TYPE_Q8_0,
+        /*.type_v_cold                 =*/ GGML_TYPE_Q8_0,
+        /*.kv_spill_dir                =*/ nullptr,
         /*.abort_callback              =*/ nullptr,
         /*.abort_callback_data         =*/ nullptr,
         /*.embeddings                  =*/ false,
@@ -2220,6 +2955,22 @@ llama_context * llama_init_from_model(
         return nullptr;
     }
 
+    if (params.n_kv_hot > 0 && !params.flash_attn) {
+        LLAMA_LOG_ERROR("%s: tiered KV cache (n_kv_hot > 0) requires flash_attn\n", __func__);
+        return nullptr;
+    }
+
+    // the attention over both tiers and the migration between them are only implemented on the CPU
+    if (params.n_kv_hot > 0 && params.offload_kqv) {
+        for (uint32_t il = 0; il < model->hparams.n_layer; ++il) {
+            if (ggml_backend_dev_type(model->dev_layer(il)) != GGML_BACKEND_DEVICE_TYPE_CPU) {
+                LLAMA_LOG_ERROR("%s: tiered KV cache (n_kv_hot > 0) is not supported with the KV cache on %s - disable offload_kqv\n",
+                        __func__, ggml_backend_dev_name(model->dev_layer(il)));
+                return nullptr;
+            }
+        }
+    }
+
     try {
         auto * ctx = new llama_context(*model, params);
         return ctx;
@@ -2330,6 +3081,16 @@ float * llama_get_logits_ith(llama_context * ctx, int32_t i) {
     return ctx->get_logits_ith(i);
 }
 
+int32_t llama_get_logits_top_k_ith(llama_context * ctx, int32_t i, const llama_token ** tokens, const float ** logits) {
+    ctx->synchronize();
+
+    return ctx->get_logits_top_k_ith(i, tokens, logits);
+}
+
+int32_t llama_set_logits_subset(llama_context * ctx, llama_seq_id seq_id, const llama_token * tokens, size_t n_tokens) {
+    return ctx->set_logits_subset(seq_id, tokens, n_tokens);
+}
+
 float * llama_get_embeddings(llama_context * ctx) {
     ctx->synchronize();
 
@@ -2396,6 +3157,10 @@ void llama_memory_clear(llama_memory_t mem, bool data) {
         return;
     }
 
+    if (mem->spill.drop) {
+        mem->spill.drop(-1);
+    }
+
     mem->clear(data);
 }
 
@@ -2408,6 +3173,14 @@ bool llama_memory_seq_rm(
         return true;
     }
 
+    if (p0 <= 0 && p1 < 0) {
+        if (mem->spill.drop) {
+            mem->spill.drop(seq_id);
+        }
+    } else if (mem->spill.restore) {
+        mem->spill.restore(seq_id);
+    }
+
     return mem->seq_rm(seq_id, p0, p1);
 }
 
@@ -2421,6 +3194,11 @@ void llama_memory_seq_cp(
         return;
     }
 
+    if (mem->spill.restore) {
+        mem->spill.restore(seq_id_src);
+        mem->spill.restore(seq_id_dst);
+    }
+
     mem->seq_cp(seq_id_src, seq_id_dst, p0, p1);
 }
 
@@ -2431,6 +3209,14 @@ void llama_memory_seq_keep(
         return;
     }
 
+    if (mem->spill.restore) {
+        mem->spill.restore(seq_id);
+    }
+
+    if (mem->spill.keep) {
+        mem->spill.keep(seq_id);
+    }
+
     mem->seq_keep(seq_id);
 }
 
@@ -2444,6 +3230,10 @@ void llama_memory_seq_add(
         return;
     }
 
+    if (mem->spill.restore) {
+        mem->spill.restore(seq_id);
+    }
+
     mem->seq_add(seq_id, p0, p1, delta);
 }
 
@@ -2457,6 +3247,10 @@ void llama_memory_seq_div(
         return;
     }
 
+    if (mem->spill.restore) {
+        mem->spill.restore(seq_id);
+    }
+
     mem->seq_div(seq_id, p0, p1, d);
 }
 
@@ -2488,6 +3282,14 @@ bool llama_memory_can_shift(llama_memory_t mem) {
     return mem->get_can_shift();
 }
 
+float llama_memory_fragmentation(llama_memory_t mem) {
+    if (!mem) {
+        return 0.0f;
+    }
+
+    return mem->get_fragmentation();
+}
+
 //
 // kv cache
 //
@@ -2756,11 +3558,36 @@ size_t llama_state_seq_load_file(llama_context * ctx, const char * filepath, lla
     }
 }
 
+bool llama_state_seq_spill(llama_context * ctx, llama_seq_id seq_id) {
+    ctx->synchronize();
+
+    return ctx->state_seq_spill(seq_id);
+}
+
+void llama_state_seq_prefetch(llama_context * ctx, llama_seq_id seq_id) {
+    ctx->state_seq_prefetch(seq_id);
+}
+
+bool llama_state_seq_restore(llama_context * ctx, llama_seq_id seq_id) {
+    ctx->synchronize();
+
+    return ctx->state_seq_restore(seq_id);
+}
+
+bool llama_state_seq_is_spilled(const llama_context * ctx, llama_seq_id seq_id) {
+    return ctx->state_seq_is_spilled(seq_id);
+}
+
 ///
 
 int32_t llama_encode(
         llama_context * ctx,
           llama_batch   batch) {
+    if (ctx->decode_pending()) {
+        LLAMA_LOG_ERROR("%s: an asynchronous decode is in progress - call llama_decode_wait() first\n", __func__);
+        return -1;
+    }
+
     const int ret = ctx->encode(batch);
     if (ret != 0) {
         LLAMA_LOG_ERROR("%s: failed to encode, ret = %d\n", __func__, ret);
@@ -2772,6 +3599,11 @@ int32_t llama_encode(
 int32_t llama_decode(
         llama_context * ctx,
           llama_batch   batch) {
+    if (ctx->decode_pending()) {
+        LLAMA_LOG_ERROR("%s: an asynchronous decode is in progress - call llama_decode_wait() first\n", __func__);
+        return -1;
+    }
+
     const int ret = ctx->decode(batch);
     if (ret != 0 && ret != 1) {
         LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
@@ -2780,6 +3612,21 @@ int32_t llama_decode(
     return ret;
 }
 
+int32_t llama_decode_async(
+        llama_context * ctx,
+          llama_batch   batch) {
+    return ctx->decode_async(batch);
+}
+
+int32_t llama_decode_wait(llama_context * ctx) {
+    const int ret = ctx->decode_wait();
+    if (ret != 0 && ret != 1) {
+        LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
+    }
+
+    return ret;
+}
+
 //
 // perf
 //
@@ -2807,6 +3654,13 @@ void llama_perf_context_print(const llama_context * ctx) {
     LLAMA_LOG_INFO("%s:        eval time = %10.2f ms / %5d runs   (%8.2f ms per token, %8.2f tokens per second)\n",
             __func__, data.t_eval_ms, data.n_eval, data.t_eval_ms / data.n_eval, 1e3 / data.t_eval_ms * data.n_eval);
     LLAMA_LOG_INFO("%s:       total time = %10.2f ms / %5d tokens\n", __func__, (t_end_ms - data.t_start_ms), (data.n_p_eval + data.n_eval));
+    LLAMA_LOG_INFO("%s:    graphs reused = %10d\n", __func__, data.n_reused);
+
+    if (const auto * pager = ctx->get_model().get_expert_pager()) {
+        const auto stats = pager->get_stats();
+        LLAMA_LOG_INFO("%s:   expert pager = %10.2f MiB resident / %.2f MiB budget, %" PRIu64 " page-ins, %" PRIu64 " evictions\n",
+                __func__, stats.size_resident/1024.0/1024.0, stats.budget/1024.0/1024.0, stats.n_page_in, stats.n_evict);
+    }
 }
 
 void llama_perf_context_reset(llama_context * ctx) {
@@ -4,14 +4,19 @@
 #include "llama-cparams.h"
 #include "llama-graph.h"
 #include "llama-adapter.h"
+#include "llama-thread-pool.h"
 
 #include "ggml-cpp.h"
 #include "ggml-opt.h"
 
+#include <exception>
 #include <map>
+#include <mutex>
+#include <string>
 #include <vector>
 
 struct llama_model;
+struct llama_kv_spill;
 class llama_batch_allocr;
 
 class llama_io_read_i;
@@ -48,6 +53,9 @@ struct llama_context {
 
     llama_memory_t get_memory() const;
 
+    // worker threads for the CPU work that runs next to the graph compute, created on first use
+    llama_thread_pool * get_workers();
+
     // return true of the KV cache was updated
     // TODO: remove
     bool kv_self_update(bool optimize);
@@ -58,6 +66,10 @@ struct llama_context {
     float * get_logits();
     float * get_logits_ith(int32_t i);
 
+    int32_t get_logits_top_k_ith(int32_t i, const llama_token ** tokens, const float ** logits);
+
+    int32_t set_logits_subset(llama_seq_id seq_id, const llama_token * tokens, size_t n_tokens);
+
     float * get_embeddings();
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
@@ -96,7 +108,8 @@ struct llama_context {
     // if memory_context is provided, it will be applied first to the context's memory
     // ret contains the status of the graph computation
     // returns nullptr only if ret != GGML_STATUS_SUCCESS
-    llm_graph_result_ptr process_ubatch(
+    // the result is owned by the context and remains valid until the next graph is built
+    llm_graph_result_i * process_ubatch(
                 const llama_ubatch & ubatch,
                     llm_graph_type   gtype,
             llama_memory_context_i * mctx,
@@ -105,6 +118,16 @@ struct llama_context {
     int encode(const llama_batch & batch_inp);
     int decode(const llama_batch & batch_inp);
 
+    // start decoding the batch on a background thread
+    // until decode_wait(), the output getters return the outputs of the previous decode
+    // returns -1 if a decode is already in progress
+    int decode_async(const llama_batch & batch_inp);
+
+    // returns the result of the batch submitted with decode_async(), 0 if there is none
+    int decode_wait();
+
+    bool decode_pending() const;
+
     //
     // state save/load
     //
@@ -141,6 +164,14 @@ struct llama_context {
      const llama_token * tokens,
                 size_t   n_token_count);
 
+    bool state_seq_spill     (llama_seq_id seq_id);
+    void state_seq_prefetch  (llama_seq_id seq_id) const;
+    bool state_seq_restore   (llama_seq_id seq_id);
+    bool state_seq_is_spilled(llama_seq_id seq_id) const;
+
+    // discard the spilled state of the sequence (seq_id < 0: all sequences)
+    void state_seq_drop      (llama_seq_id seq_id);
+
     //
     // perf
     //
@@ -179,6 +210,61 @@ private:
     // output
     //
 
+    // the outputs of a decode
+    struct output_state {
+        ggml_backend_buffer_ptr buf_output;
+
+        size_t  logits_size = 0;
+        float * logits      = nullptr;
+
+        size_t        logits_top_k_size = 0;
+        float       * logits_top_k      = nullptr;
+        llama_token * logits_top_k_ids  = nullptr;
+
+        std::vector<float> logits_expanded;
+        std::vector<bool>  logits_expanded_rows;
+
+        size_t  embd_size = 0;
+        float * embd      = nullptr;
+
+        std::map<llama_seq_id, std::vector<float>> embd_seq;
+
+        uint32_t n_outputs = 0;
+
+        std::vector<int32_t> output_ids;
+    };
+
+    struct output_view {
+        float       * logits;
+        float       * logits_top_k;
+        llama_token * logits_top_k_ids;
+        float       * embd;
+
+        std::vector<float> & logits_expanded;
+        std::vector<bool>  & logits_expanded_rows;
+
+        std::map<llama_seq_id, std::vector<float>> & embd_seq;
+
+        uint32_t n_outputs;
+
+        const std::vector<int32_t> & output_ids;
+    };
+
+    // the outputs of the last completed decode (the previous one while a decode_async() is in progress)
+    output_view output_get();
+
+    // exchange the current outputs with the given ones
+    void output_swap(output_state & other);
+
+    // scatter the logits of the subsets into the full logits rows - the backend must be synchronized
+    void output_scatter_rows();
+
+    // index of the ith output in the output buffers, throws for invalid ids
+    int64_t output_index(const output_view & out, int32_t i) const;
+
+    // full logits row of the jth output, expanded from its top-k candidates on first use
+    float * output_expand_logits(const output_view & out, int64_t j);
+
     // Make sure enough space is available for outputs.
     // Returns max number of outputs for which space was reserved.
     uint32_t output_reserve(int32_t n_outputs);
@@ -191,6 +277,7 @@ public:
     int32_t graph_max_nodes() const;
 
     // zero-out inputs and create the ctx_compute for the compute graph
+    // the graph of the previous ubatch is no longer reusable after this call
     ggml_cgraph * graph_init();
 
     // returns the result of ggml_backend_sched_graph_compute_async execution
@@ -200,6 +287,13 @@ public:
     ggml_cgraph * graph_reserve(uint32_t n_tokens, uint32_t n_seqs, uint32_t n_outputs, const llama_memory_context_i * mctx);
 
 private:
+    llm_graph_params graph_params(
+                      ggml_context * ctx,
+                const llama_ubatch & ubatch,
+                    llm_graph_type   gtype,
+      const llama_memory_context_i * mctx,
+                const llm_graph_cb & cb) const;
+
     llm_graph_result_ptr graph_build(
                       ggml_context * ctx,
                        ggml_cgraph * gf,
@@ -209,6 +303,12 @@ private:
 
     llm_graph_cb graph_get_cb() const;
 
+    // installs graph_eval_cb when the experts of the model are paged, otherwise cparams.cb_eval
+    void graph_set_eval_cb();
+
+    // pages in the MoE experts selected by the router before they are used, then forwards to cparams.cb_eval
+    static bool graph_eval_cb(ggml_tensor * t, bool ask, void * user_data);
+
     // TODO: read/write lora adapters and cvec
     size_t state_write_data(llama_io_write_i & io);
     size_t state_read_data (llama_io_read_i  & io);
@@ -233,10 +333,48 @@ private:
     // TODO: temporary, until the llama_kv_self_defrag() API is removed
     bool memory_force_optimize = false;
 
+    // note: destroyed before the memory, the tasks of the memory are completed by then
+    std::unique_ptr<llama_thread_pool> workers;
+    std::once_flag                     workers_once;
+
+    // state of the sequences moved out of the memory with state_seq_spill(), created on first use
+    std::unique_ptr<llama_kv_spill> kv_spill;
+    std::string kv_spill_dir;
+
     // decode output (2-dimensional array: [n_outputs][n_vocab])
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // top-k decode output, used instead of the logits when n_logits_top_k > 0
+    // (2-dimensional arrays: [n_outputs][n_logits_top_k])
+    size_t        logits_top_k_size = 0; // capacity (of candidates) for the top-k logits
+    float       * logits_top_k      = nullptr;
+    llama_token * logits_top_k_ids  = nullptr;
+
+    // full rows of the top-k output, built on request by get_logits()/get_logits_ith() for the callers that need all
+    // logits - the tokens that were not selected are -INFINITY
+    std::vector<float> logits_expanded;
+    std::vector<bool>  logits_expanded_rows;
+
+    // per-sequence vocab subsets for which the logits are computed (see llama_set_logits_subset)
+    llama_logits_subsets logits_subsets;
+
+    // the logits of the subsets of a ubatch, scattered into the full rows once the backend is synchronized (see
+    // output_scatter_rows) - when only the rows of the subsets were computed, they are copied to the end of the logits
+    // of the ubatch, otherwise the tokens outside of the subsets are masked
+    struct logits_scatter {
+        int64_t i_output; // first output of the ubatch
+
+        std::vector<llama_token> rows; // the tokens of the computed logits (sorted, empty: all tokens)
+
+        std::vector<std::vector<llama_token>> subsets; // the subset of each output of the ubatch
+    };
+
+    std::vector<logits_scatter> logits_scatters;
+
+    // the logits of the subset of one output, while its row is scattered
+    std::vector<float> logits_rows_buf;
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -260,6 +398,13 @@ private:
 
     ggml_context_ptr ctx_compute;
 
+    // the graph of the last processed ubatch, allocated in ctx_compute and by the scheduler
+    // it is computed again for the next ubatch if only the data of its inputs differs
+    llm_graph_result_ptr gf_res_prev;
+    ggml_cgraph *        gf_prev = nullptr;
+
+    bool graph_reuse = true; // disabled with LLAMA_GRAPH_REUSE_DISABLE=1 and with pipeline parallelism
+
     // training
     ggml_opt_context_t opt_ctx = nullptr;
 
@@ -281,8 +426,22 @@ private:
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_ptr buf_output;
 
+    // decode_async() state
+    // the decode runs on a thread of its own (created on first use), so that it does not occupy the workers
+    std::unique_ptr<llama_thread_pool> decode_thread;
+    llama_thread_pool::task_ptr        decode_task;
+    int                                decode_ret = 0;
+
+    // the outputs of the previous decode, readable while the worker computes the next batch
+    // the buffers are swapped back and forth, so that they are allocated only once
+    output_state output_prev;
+
     bool has_evaluated_once = false;
 
+    // host copy of the router output, see graph_eval_cb
+    std::vector<uint8_t> buf_expert_ids;
+    std::vector<int32_t> expert_ids;
+
     // perf
     mutable int64_t t_start_us  = 0;
     mutable int64_t t_load_us   = 0;
@@ -294,4 +453,6 @@ private:
 
     mutable int32_t n_p_eval = 0; // number of tokens in eval calls for the prompt (with batch size > 1)
     mutable int32_t n_eval   = 0; // number of eval calls
+
+    mutable int32_t n_reused = 0; // number of ubatches computed with the graph of the previous ubatch
 };
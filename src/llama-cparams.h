@@ -26,6 +26,10 @@ struct llama_cparams {
     float yarn_beta_slow;
     float defrag_thold;
 
+    uint32_t defrag_step_mib;
+    uint32_t n_logits_top_k;
+    uint32_t n_stream_window; // the streaming KV cache is active (set by the memory module, 0 = disabled)
+
     bool embeddings;
     bool causal_attn;
     bool offload_kqv;
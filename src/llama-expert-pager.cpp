@@ -0,0 +1,143 @@
+#include "llama-expert-pager.h"
+
+#include "llama-impl.h"
+
+#include "ggml.h"
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+llama_expert_pager::llama_expert_pager(size_t budget, uint32_t n_layer, uint32_t n_expert) :
+    budget(budget), n_expert(n_expert), slices(n_layer), size_expert(n_layer, 0), experts((size_t) n_layer*n_expert) {
+#ifdef __linux__
+    page_size = sysconf(_SC_PAGESIZE);
+#endif
+}
+
+void llama_expert_pager::add_tensor(uint32_t il, const ggml_tensor * t) {
+    GGML_ASSERT(il < slices.size());
+    GGML_ASSERT(t->ne[2] == n_expert);
+
+    slices[il].push_back({ (uint8_t *) t->data, t->nb[2] });
+    size_expert[il] += t->nb[2];
+    n_tensors_added++;
+
+#ifdef __linux__
+    // the experts are read in random order, readahead would only page in the neighbours of the selected ones
+    const uintptr_t first = GGML_PAD((uintptr_t) t->data, page_size);
+    const uintptr_t last  = ((uintptr_t) t->data + ggml_nbytes(t)) & ~(page_size - 1);
+    if (last > first && madvise((void *) first, last - first, MADV_RANDOM)) {
+        LLAMA_LOG_WARN("%s: madvise(.., MADV_RANDOM) failed: %s\n", __func__, strerror(errno));
+    }
+#endif
+}
+
+void llama_expert_pager::advise(uint32_t il, uint32_t ie, bool need) {
+#ifdef __linux__
+    for (const auto & s : slices[il]) {
+        uintptr_t first = (uintptr_t) (s.data + (size_t) ie*s.size);
+        uintptr_t last  = first + s.size;
+
+        if (need) {
+            // page in the whole expert, including the pages shared with its neighbours
+            first = first & ~(page_size - 1);
+        } else {
+            // only release the pages that belong to this expert alone
+            first = GGML_PAD(first, page_size);
+            last  = last & ~(page_size - 1);
+            if (last <= first) {
+                continue;
+            }
+        }
+
+        int ret = madvise((void *) first, last - first, need ? MADV_WILLNEED : MADV_DONTNEED);
+#ifdef MADV_PAGEOUT
+        if (!need && ret == 0) {
+            // MADV_DONTNEED only unmaps the pages, also drop them from the page cache
+            ret = madvise((void *) first, last - first, MADV_PAGEOUT);
+        }
+#endif
+        if (ret && !warned) {
+            LLAMA_LOG_WARN("%s: madvise failed: %s\n", __func__, strerror(errno));
+            warned = true;
+        }
+    }
+#else
+    GGML_UNUSED(il);
+    GGML_UNUSED(ie);
+    GGML_UNUSED(need);
+#endif
+}
+
+void llama_expert_pager::use(uint32_t il, const int32_t * ids, size_t n) {
+    if (il >= slices.size() || slices[il].empty()) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    t_use++;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (ids[i] < 0 || (uint32_t) ids[i] >= n_expert) {
+            continue;
+        }
+
+        const uint32_t key = il*n_expert + ids[i];
+
+        expert & ex = experts[key];
+        if (ex.t_used == t_use) {
+            continue;
+        }
+        ex.t_used = t_use;
+
+        if (ex.resident) {
+            lru.splice(lru.begin(), lru, ex.it_lru);
+            continue;
+        }
+
+        advise(il, ids[i], true);
+
+        ex.resident = true;
+        lru.push_front(key);
+        ex.it_lru = lru.begin();
+
+        size_resident += size_expert[il];
+        n_page_in++;
+    }
+
+    // the experts used by this call are at the front and are never evicted, even if they exceed the budget
+    while (size_resident > budget && !lru.empty()) {
+        const uint32_t key = lru.back();
+
+        expert & ex = experts[key];
+        if (ex.t_used == t_use) {
+            break;
+        }
+
+        advise(key / n_expert, key % n_expert, false);
+
+        ex.resident = false;
+        lru.pop_back();
+
+        size_resident -= size_expert[key / n_expert];
+        n_evict++;
+    }
+}
+
+llama_expert_pager::stats llama_expert_pager::get_stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    return { budget, size_resident, n_page_in, n_evict };
+}
+
+#ifdef __linux__
+const bool llama_expert_pager::SUPPORTED = true;
+#else
+const bool llama_expert_pager::SUPPORTED = false;
+#endif
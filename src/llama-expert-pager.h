@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <vector>
+
+struct ggml_tensor;
+
+// keeps a budget of the MoE expert weights that are memory-mapped from the model file resident:
+// the experts selected by the router are paged in with MADV_WILLNEED before they are used, and the least
+// recently used experts are released with MADV_DONTNEED when the resident size exceeds the budget
+struct llama_expert_pager {
+    llama_expert_pager(size_t budget, uint32_t n_layer, uint32_t n_expert);
+
+    // register a [n_embd, n_ff, n_expert] tensor of layer il, its data must be mapped from the model file
+    void add_tensor(uint32_t il, const ggml_tensor * t);
+
+    // the router of layer il selected the experts ids[0..n), can be called from multiple contexts
+    void use(uint32_t il, const int32_t * ids, size_t n);
+
+    size_t n_tensors() const { return n_tensors_added; }
+
+    struct stats {
+        size_t   budget;
+        size_t   size_resident;
+        uint64_t n_page_in;
+        uint64_t n_evict;
+    };
+
+    stats get_stats() const;
+
+    static const bool SUPPORTED;
+
+private:
+    struct slice {
+        uint8_t * data; // expert 0
+        size_t    size; // size of each expert, nb[2]
+    };
+
+    struct expert {
+        bool     resident = false;
+        uint64_t t_used   = 0;
+
+        std::list<uint32_t>::iterator it_lru;
+    };
+
+    void advise(uint32_t il, uint32_t ie, bool need);
+
+    const size_t   budget;
+    const uint32_t n_expert;
+
+    size_t page_size = 4096;
+
+    std::vector<std::vector<slice>> slices;      // per layer
+    std::vector<size_t>             size_expert; // per layer, sum of the slices
+    std::vector<expert>             experts;     // il*n_expert + ie
+
+    // most recently used first
+    std::list<uint32_t> lru;
+
+    size_t   n_tensors_added = 0;
+    size_t   size_resident   = 0;
+    uint64_t t_use           = 0;
+    uint64_t n_page_in       = 0;
+    uint64_t n_evict         = 0;
+    bool     warned          = false;
+
+    mutable std::mutex mutex;
+};
@@ -6,6 +6,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <mutex>
 #include <stdexcept>
 
 //
@@ -903,6 +904,261 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
     return rejects;
 }
 
+//
+// token trie
+//
+
+static std::shared_ptr<const llama_grammar_token_trie> llama_grammar_token_trie_build(const llama_vocab & vocab) {
+    const uint32_t n_vocab = vocab.n_tokens();
+
+    std::vector<std::pair<std::vector<uint32_t>, llama_grammar_token_trie::token>> decoded;
+    decoded.reserve(n_vocab);
+
+    for (uint32_t id = 0; id < n_vocab; ++id) {
+        const std::string & piece = vocab.token_to_piece(id);
+
+        if (vocab.is_eog(id) || piece.empty() || piece[0] == 0) {
+            continue;
+        }
+
+        auto dec = decode_utf8(piece, {});
+        dec.first.pop_back(); // terminating 0
+
+        decoded.push_back({ std::move(dec.first), { (llama_token) id, dec.second } });
+    }
+
+    // with the tokens sorted, the common prefix with the previous token is always on the last path of the trie
+    std::sort(decoded.begin(), decoded.end(), [](const auto & a, const auto & b) {
+        return a.first < b.first;
+    });
+
+    struct node_build {
+        std::vector<std::pair<uint32_t, uint32_t>> children; // (code point, node)
+        std::vector<llama_grammar_token_trie::token> tokens;
+    };
+
+    std::vector<node_build> nodes(1);
+    std::vector<uint32_t>   path = { 0 };
+
+    const std::vector<uint32_t> * prev = nullptr;
+
+    for (const auto & [cps, tok] : decoded) {
+        size_t n_common = 0;
+        if (prev) {
+            while (n_common < cps.size() && n_common < prev->size() && cps[n_common] == (*prev)[n_common]) {
+                n_common++;
+            }
+        }
+
+        path.resize(n_common + 1);
+
+        for (size_t i = n_common; i < cps.size(); ++i) {
+            const uint32_t id = nodes.size();
+            nodes[path.back()].children.emplace_back(cps[i], id);
+            nodes.emplace_back();
+            path.push_back(id);
+        }
+
+        nodes[path.back()].tokens.push_back(tok);
+
+        prev = &cps;
+    }
+
+    auto trie = std::make_shared<llama_grammar_token_trie>();
+
+    trie->n_vocab = n_vocab;
+    trie->nodes.resize(nodes.size());
+    trie->tokens.reserve(decoded.size());
+    trie->child_cp.reserve(nodes.size() - 1);
+    trie->child_node.reserve(nodes.size() - 1);
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        auto & node = trie->nodes[i];
+
+        node.child_begin = trie->child_cp.size();
+        for (const auto & [cp, id] : nodes[i].children) {
+            trie->child_cp.push_back(cp);
+            trie->child_node.push_back(id);
+        }
+        node.child_end = trie->child_cp.size();
+
+        node.token_begin = trie->tokens.size();
+        trie->tokens.insert(trie->tokens.end(), nodes[i].tokens.begin(), nodes[i].tokens.end());
+        node.token_end = trie->tokens.size();
+    }
+
+    LLAMA_LOG_DEBUG("%s: built token trie with %zu nodes for %zu tokens\n", __func__, trie->nodes.size(), trie->tokens.size());
+
+    return trie;
+}
+
+// the trie is built once per vocab and shared by all grammars that use it
+static std::shared_ptr<const llama_grammar_token_trie> llama_grammar_token_trie_get(const llama_vocab * vocab) {
+    if (vocab == nullptr) {
+        return nullptr;
+    }
+
+    static std::mutex mutex;
+    static std::map<const llama_vocab *, std::weak_ptr<const llama_grammar_token_trie>> tries;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    // forget the vocabs whose grammars have all been freed - the vocab itself may be gone, and its address reused
+    for (auto it = tries.begin(); it != tries.end();) {
+        it = it->second.expired() ? tries.erase(it) : std::next(it);
+    }
+
+    auto & entry = tries[vocab];
+
+    auto trie = entry.lock();
+    if (!trie) {
+        trie  = llama_grammar_token_trie_build(*vocab);
+        entry = trie;
+    }
+
+    return trie;
+}
+
+static inline void llama_grammar_mask_set(std::vector<uint32_t> & mask, llama_token id) {
+    mask[id >> 5] |= 1u << (id & 31);
+}
+
+// marks the tokens in the subtree of the node that the stack accepts, starting at the node's code point position
+// equivalent to llama_grammar_reject_candidates_for_stack() for all tokens of the subtree at once
+static void llama_grammar_trie_walk(
+        const llama_grammar_rules      & rules,
+        const llama_grammar_token_trie & trie,
+        uint32_t                         node_id,
+        const llama_grammar_stack      & stack,
+              std::vector<uint32_t>    & mask) {
+    const auto & node = trie.nodes[node_id];
+
+    if (stack.empty()) {
+        // the grammar is complete - only tokens without a trailing partial sequence end here
+        for (uint32_t i = node.token_begin; i < node.token_end; ++i) {
+            if (trie.tokens[i].partial_utf8.n_remain == 0) {
+                llama_grammar_mask_set(mask, trie.tokens[i].id);
+            }
+        }
+        return;
+    }
+
+    const llama_grammar_element * stack_pos = stack.back();
+
+    for (uint32_t i = node.token_begin; i < node.token_end; ++i) {
+        const auto & tok = trie.tokens[i];
+        if (tok.partial_utf8.n_remain == 0 || llama_grammar_match_partial_char(stack_pos, tok.partial_utf8)) {
+            llama_grammar_mask_set(mask, tok.id);
+        }
+    }
+
+    if (node.child_begin == node.child_end) {
+        return;
+    }
+
+    uint32_t child_begin = node.child_begin;
+    uint32_t child_end   = node.child_end;
+
+    // a single char only matches one child
+    if (stack_pos->type == LLAMA_GRETYPE_CHAR && stack_pos[1].type != LLAMA_GRETYPE_CHAR_RNG_UPPER && stack_pos[1].type != LLAMA_GRETYPE_CHAR_ALT) {
+        const auto it = std::lower_bound(trie.child_cp.begin() + child_begin, trie.child_cp.begin() + child_end, stack_pos->value);
+        if (it == trie.child_cp.begin() + child_end || *it != stack_pos->value) {
+            return;
+        }
+        child_begin = it - trie.child_cp.begin();
+        child_end   = child_begin + 1;
+    }
+
+    // the stacks after the char are the same for all children, compute them once
+    llama_grammar_stacks next_stacks;
+    bool next_stacks_init = false;
+
+    for (uint32_t c = child_begin; c < child_end; ++c) {
+        if (!llama_grammar_match_char(stack_pos, trie.child_cp[c]).first) {
+            continue;
+        }
+
+        if (!next_stacks_init) {
+            const auto * stack_pos_after = llama_grammar_match_char(stack_pos, 0).second;
+
+            llama_grammar_stack stack_after(stack.begin(), stack.end() - 1);
+            if (!llama_grammar_is_end_of_sequence(stack_pos_after)) {
+                stack_after.push_back(stack_pos_after);
+            }
+            llama_grammar_advance_stack(rules, stack_after, next_stacks);
+
+            next_stacks_init = true;
+        }
+
+        for (const auto & next_stack : next_stacks) {
+            llama_grammar_trie_walk(rules, trie, trie.child_node[c], next_stack, mask);
+        }
+    }
+}
+
+// bitmask of the tokens allowed by the current stacks of the grammar, including EOG
+// requires that the grammar is not in the middle of a UTF-8 sequence
+static std::vector<uint32_t> llama_grammar_compute_mask(const struct llama_grammar & grammar) {
+    const auto & trie = *grammar.trie;
+
+    std::vector<uint32_t> mask((trie.n_vocab + 31)/32, 0);
+
+    bool allow_eog = false;
+
+    for (const auto & stack : grammar.stacks) {
+        allow_eog = allow_eog || stack.empty();
+
+        llama_grammar_trie_walk(grammar.rules, trie, 0, stack, mask);
+    }
+
+    if (allow_eog) {
+        for (uint32_t id = 0; id < trie.n_vocab; ++id) {
+            if (grammar.vocab->is_eog(id)) {
+                llama_grammar_mask_set(mask, id);
+            }
+        }
+    }
+
+    return mask;
+}
+
+//
+// llama_grammar_mask_cache
+//
+
+const std::vector<uint32_t> * llama_grammar_mask_cache::get(const llama_grammar_stacks & stacks) {
+    auto it = masks.find(stacks);
+    if (it == masks.end()) {
+        return nullptr;
+    }
+
+    lru.splice(lru.begin(), lru, it->second.it_lru);
+
+    return &it->second.mask;
+}
+
+const std::vector<uint32_t> & llama_grammar_mask_cache::put(const llama_grammar_stacks & stacks, std::vector<uint32_t> mask) {
+    auto it = masks.find(stacks);
+    if (it != masks.end()) {
+        it->second.mask = std::move(mask);
+        lru.splice(lru.begin(), lru, it->second.it_lru);
+
+        return it->second.mask;
+    }
+
+    if (masks.size() >= LLAMA_GRAMMAR_MAX_MASKS) {
+        masks.erase(*lru.back());
+        lru.pop_back();
+    }
+
+    it = masks.emplace(stacks, entry { std::move(mask), {} }).first;
+
+    lru.push_front(&it->first);
+    it->second.it_lru = lru.begin();
+
+    return it->second.mask;
+}
+
 ////////////////////
 
 struct llama_grammar * llama_grammar_init_impl(
@@ -970,6 +1226,8 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         /* .trigger_tokens   = */ {},
         /* .trigger_patterns    = */ {},
+        /* .trie             = */ llama_grammar_token_trie_get(vocab),
+        /* .masks            = */ {},
     };
 }
 
@@ -1075,6 +1333,8 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        /* .trie = */             llama_grammar_token_trie_get(vocab),
+        /* .masks = */            {},
     };
 }
 
@@ -1097,6 +1357,8 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        grammar.trie,
+        {},
     };
 
     // redirect elements in stacks to point to new rules
@@ -1115,13 +1377,38 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
     return result;
 }
 
-void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
+void llama_grammar_apply_impl(struct llama_grammar & grammar, llama_token_data_array * cur_p) {
     GGML_ASSERT(grammar.vocab != nullptr);
 
     if (grammar.awaiting_trigger) {
         return;
     }
 
+    // outside of a partial UTF-8 sequence, the allowed tokens depend only on the stacks, so the mask can be
+    // computed over the token trie and reused whenever the grammar is back in the same state
+    if (grammar.trie && grammar.partial_utf8.n_remain <= 0) {
+        const std::vector<uint32_t> * cached = grammar.masks.get(grammar.stacks);
+
+        // for a small number of candidates, checking them one by one is cheaper than walking the trie
+        if (cached == nullptr && 4*cur_p->size >= grammar.trie->n_vocab) {
+            cached = &grammar.masks.put(grammar.stacks, llama_grammar_compute_mask(grammar));
+        }
+
+        if (cached != nullptr) {
+            const uint32_t * mask    = cached->data();
+            const int32_t    n_vocab = grammar.trie->n_vocab;
+
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                const llama_token id = cur_p->data[i].id;
+                if (id < 0 || id >= n_vocab || !((mask[id >> 5] >> (id & 31)) & 1)) {
+                    cur_p->data[i].logit = -INFINITY;
+                }
+            }
+
+            return;
+        }
+    }
+
     bool allow_eog = false;
     for (const auto & stack : grammar.stacks) {
         if (stack.empty()) {
@@ -2,7 +2,9 @@
 
 #include "llama.h"
 
+#include <list>
 #include <map>
+#include <memory>
 #include <regex>
 #include <string>
 #include <vector>
@@ -111,6 +113,62 @@ struct llama_grammar_trigger_pattern {
     std::regex  regex;
 };
 
+// trie of the decoded code points of the vocab tokens
+// tokens with a common prefix share the nodes of the prefix, so that it is matched against the grammar only once
+// EOG tokens and tokens with an empty piece are not part of the trie
+struct llama_grammar_token_trie {
+    struct node {
+        uint32_t child_begin; // children in [child_begin, child_end), sorted by code point
+        uint32_t child_end;
+        uint32_t token_begin; // tokens whose code points end at this node in [token_begin, token_end)
+        uint32_t token_end;
+    };
+
+    struct token {
+        llama_token        id;
+        llama_partial_utf8 partial_utf8; // trailing incomplete UTF-8 sequence
+    };
+
+    std::vector<node>     nodes; // nodes[0] is the root
+    std::vector<uint32_t> child_cp;
+    std::vector<uint32_t> child_node;
+    std::vector<token>    tokens;
+
+    uint32_t n_vocab = 0;
+};
+
+// maximum number of cached token masks per grammar
+// a mask takes n_vocab/8 bytes, so a full cache takes 1 MiB per grammar for a 32k vocab and 8 MiB for a 256k vocab
+#define LLAMA_GRAMMAR_MAX_MASKS 256
+
+// bitmasks of the allowed tokens, keyed by the set of stacks they were computed for
+// holds at most LLAMA_GRAMMAR_MAX_MASKS masks and evicts the least recently used one
+struct llama_grammar_mask_cache {
+    llama_grammar_mask_cache() = default;
+
+    // the recency list points to the keys of the map
+    llama_grammar_mask_cache(const llama_grammar_mask_cache &) = delete;
+    llama_grammar_mask_cache & operator=(const llama_grammar_mask_cache &) = delete;
+
+    // nullptr if there is no mask for the stacks, otherwise the mask becomes the most recently used one
+    const std::vector<uint32_t> * get(const llama_grammar_stacks & stacks);
+
+    const std::vector<uint32_t> & put(const llama_grammar_stacks & stacks, std::vector<uint32_t> mask);
+
+    size_t size() const { return masks.size(); }
+
+private:
+    struct entry {
+        std::vector<uint32_t> mask;
+
+        std::list<const llama_grammar_stacks *>::iterator it_lru;
+    };
+
+    std::map<llama_grammar_stacks, entry> masks;
+
+    std::list<const llama_grammar_stacks *> lru; // most recently used first
+};
+
 struct llama_grammar {
     // note: allow null vocab for testing (not great)
     const llama_vocab * vocab;
@@ -132,6 +190,12 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    // shared by all grammars of the same vocab, nullptr without vocab
+    std::shared_ptr<const llama_grammar_token_trie> trie;
+
+    // the stacks point into the rules of this grammar, so the masks are not shared with clones
+    llama_grammar_mask_cache masks;
+
 };
 
 //
@@ -161,7 +225,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
 
 // TODO: move the API below as member functions of llama_grammar
 void llama_grammar_apply_impl(
-        const struct llama_grammar & grammar,
+              struct llama_grammar & grammar,
             llama_token_data_array * cur_p);
 
 void llama_grammar_accept_impl(
@@ -9,6 +9,7 @@
 #include "llama-memory-hybrid.h"
 #include "llama-memory-recurrent.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -28,6 +29,15 @@ void llm_graph_input_embd::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_embd::can_reuse(const llm_graph_params & params) {
+    bool res = true;
+
+    res &= (!tokens && !params.ubatch.token) || (tokens && tokens->ne[0] == params.ubatch.n_tokens);
+    res &= (!embd   && !params.ubatch.embd)  || (embd   &&   embd->ne[1] == params.ubatch.n_tokens);
+
+    return res;
+}
+
 void llm_graph_input_pos::set_input(const llama_ubatch * ubatch) {
     if (ubatch->pos && pos) {
         const int64_t n_tokens = ubatch->n_tokens;
@@ -50,6 +60,10 @@ void llm_graph_input_pos::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_pos::can_reuse(const llm_graph_params & params) {
+    return pos->ne[0] == (int64_t) params.ubatch.n_tokens*n_pos_per_embd;
+}
+
 // llm_graph_input_attn_temp 是一个继承自 llm_graph_input_i 的 C++ 类，
 // 用于 Llama4 的温度调节。它包含注意力缩放相关的成员变量和方法，包括构造函数、析构函数以及重写的 set_input 方法，并定义了 attn_scale 张量以及两个常量成员变量 n_attn_temp_floor_scale 和 f_attn_temp_scale。
 void llm_graph_input_attn_temp::set_input(const llama_ubatch * ubatch) {
@@ -68,6 +82,10 @@ void llm_graph_input_attn_temp::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_attn_temp::can_reuse(const llm_graph_params & params) {
+    return attn_scale->ne[2] == params.ubatch.n_tokens;
+}
+
 void llm_graph_input_pos_bucket::set_input(const llama_ubatch * ubatch) {
     if (pos_bucket) {
         const int64_t n_tokens = ubatch->n_tokens;
@@ -120,6 +138,18 @@ void llm_graph_input_out_ids::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+bool llm_graph_input_out_ids::can_reuse(const llm_graph_params & params) {
+    return n_outputs == (int32_t) params.n_outputs;
+}
+
+void llm_graph_input_out_rows::set_input(const llama_ubatch * ubatch) {
+    GGML_UNUSED(ubatch);
+
+    GGML_ASSERT(out_rows);
+
+    ggml_backend_tensor_set(out_rows, rows.data(), 0, rows.size()*ggml_element_size(out_rows));
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -286,6 +316,25 @@ void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
     if (self_kq_mask) {
         mctx->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
     }
+
+    for (const auto & cpy : self_kv_cpy) {
+        mctx->set_input_k_cpy(cpy.k, cpy.il);
+        mctx->set_input_v_cpy(cpy.v, cpy.il);
+    }
+}
+
+bool llm_graph_input_attn_kv_unified::can_reuse(const llm_graph_params & params) {
+    const auto * mctx_new = static_cast<const llama_kv_cache_unified_context *>(params.mctx);
+
+    // the views of the cache depend on the number of attended cells
+    // the tiered cache is not supported - the cold tier can be rearranged between ubatches
+    if (n_kv_cold > 0 || mctx_new->get_n_kv_cold() > 0 || self_kq_mask->ne[0] != mctx_new->get_n_kv()) {
+        return false;
+    }
+
+    mctx = mctx_new;
+
+    return true;
 }
 
 void llm_graph_input_attn_kv_unified_iswa::set_input(const llama_ubatch * ubatch) {
@@ -296,6 +345,26 @@ void llm_graph_input_attn_kv_unified_iswa::set_input(const llama_ubatch * ubatch
     if (self_kq_mask_swa) {
         mctx->get_swa()->set_input_kq_mask(self_kq_mask_swa, ubatch, cparams.causal_attn);
     }
+
+    for (const auto & cpy : self_kv_cpy) {
+        const auto * mctx_cur = hparams.is_swa(cpy.il) ? mctx->get_swa() : mctx->get_base();
+
+        mctx_cur->set_input_k_cpy(cpy.k, cpy.il);
+        mctx_cur->set_input_v_cpy(cpy.v, cpy.il);
+    }
+}
+
+bool llm_graph_input_attn_kv_unified_iswa::can_reuse(const llm_graph_params & params) {
+    const auto * mctx_new = static_cast<const llama_kv_cache_unified_iswa_context *>(params.mctx);
+
+    if (self_kq_mask->ne[0]     != mctx_new->get_base()->get_n_kv() ||
+        self_kq_mask_swa->ne[0] != mctx_new->get_swa ()->get_n_kv()) {
+        return false;
+    }
+
+    mctx = mctx_new;
+
+    return true;
 }
 
 void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
@@ -352,6 +421,76 @@ void llm_graph_input_mem_hybrid::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+//
+// llm_graph_result
+//
+
+void llm_graph_result::set_params(const llm_graph_params & params) {
+    arch  = params.arch;
+    gtype = params.gtype;
+
+    ubatch_token        = params.ubatch.token != nullptr;
+    ubatch_equal_seqs   = params.ubatch.equal_seqs;
+    ubatch_n_tokens     = params.ubatch.n_tokens;
+    ubatch_n_seq_tokens = params.ubatch.n_seq_tokens;
+    ubatch_n_seqs       = params.ubatch.n_seqs;
+    ubatch_n_seqs_unq   = params.ubatch.n_seqs_unq;
+
+    n_outputs = params.n_outputs;
+
+    causal_attn = params.cparams.causal_attn;
+    embeddings  = params.cparams.embeddings;
+    warmup      = params.cparams.warmup;
+
+    cvec  = params.cvec;
+    loras = params.loras;
+    cross = params.cross;
+}
+
+bool llm_graph_result::can_reuse(const llm_graph_params & params) {
+    bool res = true;
+
+    res &= arch  == params.arch;
+    res &= gtype == params.gtype;
+
+    res &= ubatch_token        == (params.ubatch.token != nullptr);
+    res &= ubatch_equal_seqs   == params.ubatch.equal_seqs;
+    res &= ubatch_n_tokens     == params.ubatch.n_tokens;
+    res &= ubatch_n_seq_tokens == params.ubatch.n_seq_tokens;
+    res &= ubatch_n_seqs       == params.ubatch.n_seqs;
+    res &= ubatch_n_seqs_unq   == params.ubatch.n_seqs_unq;
+
+    res &= n_outputs == params.n_outputs;
+
+    res &= causal_attn == params.cparams.causal_attn;
+    res &= embeddings  == params.cparams.embeddings;
+    res &= warmup      == params.cparams.warmup;
+
+    res &= cvec  == params.cvec;
+    res &= loras == params.loras;
+    res &= cross == params.cross;
+
+    // the rows of the output matrix are baked into the graph
+    if (params.logits_subsets) {
+        for (const auto & subset : *params.logits_subsets) {
+            res &= subset.empty();
+        }
+    }
+
+    if (!res) {
+        return false;
+    }
+
+    // all inputs must support the reuse - the graph can contain inputs that depend on the ubatch in other ways
+    for (auto & input : inputs) {
+        if (!input->can_reuse(params)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 //
 // llm_graph_context
 //
@@ -395,8 +534,11 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     loras            (params.loras),
     mctx             (params.mctx),
     cross            (params.cross),
+    logits_subsets   (params.logits_subsets),
+    w_output         (params.w_output),
     cb_func          (params.cb),
     res              (std::make_unique<llm_graph_result>()) {
+        res->set_params(params);
     }
 
     // 是一个常量成员函数，用于调用回调函数 cb_func（如果存在）。它接受三个参数：
@@ -418,6 +560,19 @@ ggml_tensor * llm_graph_context::build_lora_mm(
           ggml_tensor * w,
           ggml_tensor * cur) const {
     printf("llm_graph_context::build_lora_mm:554545\n");
+    if (w == w_output) {
+        bool has_lora = false;
+        for (const auto & lora : *loras) {
+            has_lora = has_lora || lora.first->get_weight(w) != nullptr;
+        }
+
+        // compute only the rows of the LM head that are needed for the logits subsets
+        ggml_tensor * rows = has_lora ? nullptr : build_inp_out_rows();
+        if (rows) {
+            return ggml_mul_mat(ctx0, ggml_get_rows(ctx0, w, rows), cur);
+        }
+    }
+
     ggml_tensor * res = ggml_mul_mat(ctx0, w, cur);
 
     for (const auto & lora : *loras) {
@@ -909,6 +1064,62 @@ ggml_tensor * llm_graph_context::build_inp_out_ids() const {
     return cur;
 }
 
+ggml_tensor * llm_graph_context::build_inp_out_rows() const {
+    if (!logits_subsets || !w_output || n_outputs == 0) {
+        return nullptr;
+    }
+
+    const int64_t n_vocab = w_output->ne[1];
+
+    // union of the subsets of all output tokens
+    std::vector<llama_token> rows;
+
+    llama_seq_id seq_id_prev = -1;
+
+    for (int i = 0; i < n_tokens; ++i) {
+        if (n_outputs < n_tokens && !ubatch.output[i]) {
+            continue;
+        }
+
+        // the logits of a token shared by multiple sequences are not restricted
+        if (ubatch.n_seq_id[i] != 1) {
+            return nullptr;
+        }
+
+        const llama_seq_id seq_id = ubatch.seq_id[i][0];
+        if (seq_id < 0 || (size_t) seq_id >= logits_subsets->size() || (*logits_subsets)[seq_id].empty()) {
+            return nullptr;
+        }
+
+        if (seq_id != seq_id_prev) {
+            const auto & subset = (*logits_subsets)[seq_id];
+            rows.insert(rows.end(), subset.begin(), subset.end());
+            seq_id_prev = seq_id;
+        }
+    }
+
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+
+    // gathering the rows is only worth it when the union is small compared to the full vocab
+    if (rows.empty() || 2*(int64_t) rows.size() > n_vocab) {
+        return nullptr;
+    }
+
+    res->logits_rows = rows;
+
+    auto inp = std::make_unique<llm_graph_input_out_rows>(std::move(rows));
+
+    auto & cur = inp->out_rows;
+
+    cur = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, inp->rows.size());
+    ggml_set_input(cur);
+
+    res->add_input(std::move(inp));
+
+    return cur;
+}
+
 ggml_tensor * llm_graph_context::build_inp_mean() const {
     printf("llm_graph_context::build_inp_mean\n");
     auto inp = std::make_unique<llm_graph_input_mean>(cparams);
@@ -1068,38 +1279,36 @@ ggml_tensor * llm_graph_context::build_attn_mha(
 
     // TODO: replace hardcoded padding with ggml-provided padding
     if (cparams.flash_attn && (n_kv % 256 == 0) && kq_b == nullptr) {
-        // printf("Using flash attention\n");
-        // GGML_ASSERT(kq_b == nullptr && "Flash attention does not support KQ bias yet");
+        GGML_ASSERT(kq_b == nullptr && "Flash attention does not support KQ bias yet");
 
-        // if (v_trans) {
-        //     v = ggml_transpose(ctx0, v);
-        // }
+        if (v_trans) {
+            v = ggml_transpose(ctx0, v);
+        }
 
-        // // this can happen when KV cache is not used (e.g. an embedding model with non-causal attn)
-        // if (k->type == GGML_TYPE_F32) {
-        //     k = ggml_cast(ctx0, k, GGML_TYPE_F16);
-        // }
+        // this can happen when KV cache is not used (e.g. an embedding model with non-causal attn)
+        if (k->type == GGML_TYPE_F32) {
+            k = ggml_cast(ctx0, k, GGML_TYPE_F16);
+        }
 
-        // if (v->type == GGML_TYPE_F32) {
-        //     v = ggml_cast(ctx0, v, GGML_TYPE_F16);
-        // }
+        if (v->type == GGML_TYPE_F32) {
+            v = ggml_cast(ctx0, v, GGML_TYPE_F16);
+        }
 
-        // cur = ggml_flash_attn_ext(ctx0, q, k, v, kq_mask, kq_scale, hparams.f_max_alibi_bias,
-        //                           hparams.attn_soft_cap ? hparams.f_attn_logit_softcapping : 0.0f);
+        cur = ggml_flash_attn_ext(ctx0, q, k, v, kq_mask, kq_scale, hparams.f_max_alibi_bias,
+                                  hparams.attn_soft_cap ? hparams.f_attn_logit_softcapping : 0.0f);
 
-        // ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
+        ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
 
-        // if (v_mla) {
-        //     printf("Using MLA with absorption optimization in flash attention\n");
-        //     // It's preferable to do the calculation as a matrix-matrix multiplication with n_tokens in dimension 1.
-        //     // The permutations are noops and only change how the tensor data is interpreted.
-        //     cur = ggml_permute(ctx0, cur, 0, 2, 1, 3);
-        //     cur = ggml_mul_mat(ctx0, v_mla, cur);
-        //     cur = ggml_permute(ctx0, cur, 0, 2, 1, 3);
-        //     cur = ggml_cont(ctx0, cur); // Needed because ggml_reshape_2d expects contiguous inputs.
-        // }
+        if (v_mla) {
+            // It's preferable to do the calculation as a matrix-matrix multiplication with n_tokens in dimension 1.
+            // The permutations are noops and only change how the tensor data is interpreted.
+            cur = ggml_permute(ctx0, cur, 0, 2, 1, 3);
+            cur = ggml_mul_mat(ctx0, v_mla, cur);
+            cur = ggml_permute(ctx0, cur, 0, 2, 1, 3);
+            cur = ggml_cont(ctx0, cur); // Needed because ggml_reshape_2d expects contiguous inputs.
+        }
 
-        // cur = ggml_reshape_2d(ctx0, cur, cur->ne[0]*n_head, n_tokens);
+        cur = ggml_reshape_2d(ctx0, cur, cur->ne[0]*n_head, n_tokens);
     } else {
         printf("Using standard attention\n");
         ggml_tensor * kq = ggml_mul_mat(ctx0, k, q);
@@ -1158,6 +1367,41 @@ ggml_tensor * llm_graph_context::build_attn_mha(
     return cur;
 }
 
+ggml_tensor * llm_graph_context::build_attn_mha_tiered(
+         ggml_cgraph * gf,
+         ggml_tensor * q,
+         ggml_tensor * k0,
+         ggml_tensor * v0,
+         ggml_tensor * k1,
+         ggml_tensor * v1,
+         ggml_tensor * kq_mask,
+             float     kq_scale) const {
+    q  = ggml_permute(ctx0, q,  0, 2, 1, 3);
+    k0 = ggml_permute(ctx0, k0, 0, 2, 1, 3);
+    v0 = ggml_permute(ctx0, v0, 0, 2, 1, 3);
+    k1 = ggml_permute(ctx0, k1, 0, 2, 1, 3);
+    v1 = ggml_permute(ctx0, v1, 0, 2, 1, 3);
+
+    const auto n_tokens = q->ne[1];
+    const auto n_head   = q->ne[2];
+
+    ggml_tensor * cur = ggml_flash_attn_ext_tiered(ctx0, q, k0, v0, k1, v1, kq_mask, kq_scale, hparams.f_max_alibi_bias,
+                                                   hparams.attn_soft_cap ? hparams.f_attn_logit_softcapping : 0.0f);
+
+    ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
+
+    cur = ggml_reshape_2d(ctx0, cur, cur->ne[0]*n_head, n_tokens);
+
+    if (!cparams.offload_kqv) {
+        // all nodes between the KV store and the attention output are run on the CPU
+        ggml_backend_sched_set_tensor_backend(sched, cur, backend_cpu);
+    }
+
+    ggml_build_forward_expand(gf, cur);
+
+    return cur;
+}
+
 llm_graph_input_attn_no_cache * llm_graph_context::build_attn_inp_no_cache() const {
     printf("llm_graph_context::build_attn_inp_no_cache\n");
     auto inp = std::make_unique<llm_graph_input_attn_no_cache>(hparams, cparams);
@@ -1227,7 +1471,10 @@ llm_graph_input_attn_kv_unified * llm_graph_context::build_attn_inp_kv_unified()
     {
         GGML_ASSERT(hparams.swa_type == LLAMA_SWA_TYPE_NONE && "Use llama_kv_cache_unified_iswa for SWA");
 
-        const auto n_kv = mctx_cur->get_n_kv();
+        inp->n_kv_cold = mctx_cur->get_n_kv_cold();
+
+        // with a tiered cache, the mask covers the cells of both tiers
+        const auto n_kv = mctx_cur->get_n_kv_cold() + mctx_cur->get_n_kv();
 
         inp->self_kq_mask = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD));
         //cb(inp->self_kq_mask, "KQ_mask", -1);
@@ -1263,8 +1510,13 @@ ggml_tensor * llm_graph_context::build_attn(
 
     // store to KV cache
     {
-        ggml_build_forward_expand(gf, mctx_cur->cpy_k(ctx0, k_cur, il));
-        ggml_build_forward_expand(gf, mctx_cur->cpy_v(ctx0, v_cur, il));
+        ggml_tensor * k_cpy = mctx_cur->cpy_k(ctx0, k_cur, il);
+        ggml_tensor * v_cpy = mctx_cur->cpy_v(ctx0, v_cur, il);
+
+        inp->self_kv_cpy.push_back({ il, k_cpy, v_cpy });
+
+        ggml_build_forward_expand(gf, k_cpy);
+        ggml_build_forward_expand(gf, v_cpy);
     }
 
     const auto & kq_mask = inp->get_kq_mask();
@@ -1273,7 +1525,15 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * k = mctx_cur->get_k(ctx0, il);
     ggml_tensor * v = mctx_cur->get_v(ctx0, il);
 
-    ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    ggml_tensor * cur;
+
+    if (mctx_cur->get_n_kv_cold() > 0) {
+        GGML_ASSERT(kq_b == nullptr && v_mla == nullptr && "the tiered KV cache does not support KQ bias and MLA");
+
+        cur = build_attn_mha_tiered(gf, q, mctx_cur->get_k_cold(ctx0, il), mctx_cur->get_v_cold(ctx0, il), k, v, kq_mask, kq_scale);
+    } else {
+        cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
+    }
     cb(cur, "kqv_out", il);
 
     if (wo) {
@@ -1319,8 +1579,13 @@ ggml_tensor * llm_graph_context::build_attn(
 
     // store to KV cache
     {
-        ggml_build_forward_expand(gf, mctx_cur->cpy_k(ctx0, k_cur, il));
-        ggml_build_forward_expand(gf, mctx_cur->cpy_v(ctx0, v_cur, il));
+        ggml_tensor * k_cpy = mctx_cur->cpy_k(ctx0, k_cur, il);
+        ggml_tensor * v_cpy = mctx_cur->cpy_v(ctx0, v_cur, il);
+
+        inp->self_kv_cpy.push_back({ il, k_cpy, v_cpy });
+
+        ggml_build_forward_expand(gf, k_cpy);
+        ggml_build_forward_expand(gf, v_cpy);
     }
 
     const auto & kq_mask = is_swa ? inp->get_kq_mask_swa() : inp->get_kq_mask();
@@ -1708,6 +1973,32 @@ void llm_graph_context::build_pooling(
     ggml_build_forward_expand(gf, cur);
 }
 
+void llm_graph_context::build_logits_top_k(ggml_cgraph * gf) const {
+    const int64_t k = cparams.n_logits_top_k;
+
+    ggml_tensor * logits = res->t_logits;
+
+    if (k == 0 || logits == nullptr) {
+        return;
+    }
+
+    // [k, n_outputs]
+    ggml_tensor * ids = ggml_argsort_top_k(ctx0, logits, k);
+    cb(ids, "result_output_top_k_ids", -1);
+
+    // gather the selected logits from each row
+    ggml_tensor * cur = ggml_reshape_3d(ctx0, logits, 1, logits->ne[0], logits->ne[1]);
+
+    cur = ggml_get_rows(ctx0, cur, ids);
+    cur = ggml_reshape_2d(ctx0, cur, k, logits->ne[1]);
+    cb(cur, "result_output_top_k", -1);
+
+    res->t_logits_top_k     = cur;
+    res->t_logits_top_k_ids = ids;
+
+    ggml_build_forward_expand(gf, cur);
+}
+
 int32_t llama_relative_position_bucket(llama_pos x, llama_pos y, uint64_t n_buckets, bool bidirectional) {
     // TODO move to hparams if a T5 variant appears that uses a different value
     const int64_t max_distance = 128;
@@ -19,6 +19,8 @@ struct llama_cparams;
 
 struct llama_memory_context_i;
 
+struct llm_graph_params;
+
 class llama_kv_cache_unified_context;
 class llama_kv_cache_unified_iswa_context;
 class llama_memory_recurrent_context;
@@ -51,6 +53,9 @@ enum llm_norm_type {
     LLM_NORM_GROUP,
 };
 
+// per-sequence subsets of the vocab for which the logits are computed (sorted, empty: all tokens)
+using llama_logits_subsets = std::vector<std::vector<llama_token>>;
+
 // TODO: tmp - need something better to pass the data from the encoder to the decoder
 struct llama_cross {
     // the output embeddings from the encoder as a ggml tensor
@@ -77,6 +82,13 @@ public:
     virtual ~llm_graph_input_i() = default;
 
     virtual void set_input(const llama_ubatch * ubatch) = 0;
+
+    // check if the input tensor can be used as-is for a graph with the given parameters
+    // can update the references to the per-ubatch state (e.g. the memory context)
+    virtual bool can_reuse(const llm_graph_params & params) {
+        GGML_UNUSED(params);
+        return false;
+    }
 };
 
 using llm_graph_input_ptr = std::unique_ptr<llm_graph_input_i>;
@@ -89,6 +101,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * tokens = nullptr; // I32 [n_batch]
     ggml_tensor * embd   = nullptr; // F32 [n_embd, n_batch]
 };
@@ -100,6 +114,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * pos = nullptr; // I32 [n_batch]
 
     const uint32_t n_pos_per_embd = 1;
@@ -114,6 +130,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * attn_scale = nullptr; // F32 [n_batch]
 
     const uint32_t n_attn_temp_floor_scale;
@@ -158,6 +176,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * out_ids; // I32 [n_outputs]
 
     const llama_hparams & hparams;
@@ -166,6 +186,19 @@ public:
     const int32_t n_outputs;
 };
 
+// the rows of the output matrix needed for the logits subsets of the outputs of the ubatch
+class llm_graph_input_out_rows : public llm_graph_input_i {
+public:
+    llm_graph_input_out_rows(std::vector<llama_token> rows) : rows(std::move(rows)) {}
+    virtual ~llm_graph_input_out_rows() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    ggml_tensor * out_rows; // I32 [n_rows]
+
+    const std::vector<llama_token> rows;
+};
+
 class llm_graph_input_mean : public llm_graph_input_i {
 public:
     llm_graph_input_mean(const llama_cparams & cparams) : cparams(cparams) {}
@@ -234,6 +267,14 @@ public:
     const llama_cparams & cparams;
 };
 
+// the K and V stores of a layer, these are views of the cache at the head of the ubatch
+struct llm_graph_kv_cpy {
+    int32_t il;
+
+    ggml_tensor * k;
+    ggml_tensor * v;
+};
+
 class llm_graph_input_attn_kv_unified : public llm_graph_input_i {
 public:
     llm_graph_input_attn_kv_unified(
@@ -248,11 +289,18 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * get_kq_mask() const { return self_kq_mask_cnv; }
 
     ggml_tensor * self_kq_mask     = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_cnv = nullptr; //     [n_kv, n_batch]
 
+    // the stores of the ubatch into the cache - moved to the head of the current ubatch by set_input()
+    std::vector<llm_graph_kv_cpy> self_kv_cpy;
+
+    uint32_t n_kv_cold = 0;
+
     const llama_hparams & hparams;
     const llama_cparams & cparams;
 
@@ -273,6 +321,8 @@ public:
 
     void set_input(const llama_ubatch * ubatch) override;
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     ggml_tensor * get_kq_mask()     const { return self_kq_mask_cnv; }
     ggml_tensor * get_kq_mask_swa() const { return self_kq_mask_swa_cnv; }
 
@@ -281,6 +331,9 @@ public:
     ggml_tensor * self_kq_mask_swa     = nullptr; // F32 [n_kv, n_batch]
     ggml_tensor * self_kq_mask_swa_cnv = nullptr; //     [n_kv, n_batch]
 
+    // the stores of the ubatch into the base and the SWA caches
+    std::vector<llm_graph_kv_cpy> self_kv_cpy;
+
     const llama_hparams & hparams;
     const llama_cparams & cparams;
 
@@ -348,7 +401,16 @@ public:
     virtual ggml_tensor * get_embd()        = 0;
     virtual ggml_tensor * get_embd_pooled() = 0;
 
+    virtual ggml_tensor * get_logits_top_k()     = 0;
+    virtual ggml_tensor * get_logits_top_k_ids() = 0;
+
+    // the tokens of the rows of the logits, if only a subset of the vocab was computed
+    virtual const std::vector<llama_token> & get_logits_rows() = 0;
+
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
+
+    // check if the graph can be computed again for a ubatch with the given parameters, after calling set_inputs()
+    virtual bool can_reuse(const llm_graph_params & params) = 0;
 };
 
 using llm_graph_result_ptr = std::unique_ptr<llm_graph_result_i>;
@@ -363,24 +425,61 @@ public:
     ggml_tensor * get_embd()        override { return t_embd; }
     ggml_tensor * get_embd_pooled() override { return t_embd_pooled; }
 
+    ggml_tensor * get_logits_top_k()     override { return t_logits_top_k; }
+    ggml_tensor * get_logits_top_k_ids() override { return t_logits_top_k_ids; }
+
+    const std::vector<llama_token> & get_logits_rows() override { return logits_rows; }
+
     void set_inputs(const llama_ubatch * ubatch) override {
         for (auto & input : inputs) {
             input->set_input(ubatch);
         }
     }
 
+    bool can_reuse(const llm_graph_params & params) override;
+
     llm_graph_input_i * add_input(llm_graph_input_ptr input) {
         inputs.emplace_back(std::move(input));
         return inputs.back().get();
     }
 
+    // remember the parameters that determine the topology of the graph
+    void set_params(const llm_graph_params & params);
+
     // important graph nodes
     ggml_tensor * t_tokens      = nullptr;
     ggml_tensor * t_logits      = nullptr;
     ggml_tensor * t_embd        = nullptr;
     ggml_tensor * t_embd_pooled = nullptr;
 
+    ggml_tensor * t_logits_top_k     = nullptr; // F32 [n_logits_top_k, n_outputs]
+    ggml_tensor * t_logits_top_k_ids = nullptr; // I32 [n_logits_top_k, n_outputs]
+
+    // t_logits is F32 [logits_rows.size(), n_outputs] when not empty
+    std::vector<llama_token> logits_rows;
+
     std::vector<llm_graph_input_ptr> inputs;
+
+    // the parameters the graph was built for
+    llm_arch       arch  = LLM_ARCH_UNKNOWN;
+    llm_graph_type gtype = LLM_GRAPH_TYPE_DEFAULT;
+
+    bool     ubatch_token        = false;
+    bool     ubatch_equal_seqs   = false;
+    uint32_t ubatch_n_tokens     = 0;
+    uint32_t ubatch_n_seq_tokens = 0;
+    uint32_t ubatch_n_seqs       = 0;
+    uint32_t ubatch_n_seqs_unq   = 0;
+
+    uint32_t n_outputs = 0;
+
+    bool causal_attn = false;
+    bool embeddings  = false;
+    bool warmup      = false;
+
+    const llama_adapter_cvec  * cvec  = nullptr;
+    const llama_adapter_loras * loras = nullptr;
+    const llama_cross         * cross = nullptr;
 };
 
 //
@@ -394,6 +493,7 @@ struct llm_graph_params {
     ggml_context * ctx;
 
     const llm_arch arch;
+    const llm_graph_type gtype;
 
     const llama_hparams & hparams;
     const llama_cparams & cparams;
@@ -407,6 +507,11 @@ struct llm_graph_params {
     const llama_memory_context_i * mctx;
     const llama_cross            * cross;
 
+    const llama_logits_subsets * logits_subsets;
+
+    // output projection whose rows can be gathered for the logits subsets (nullptr: not supported by the model)
+    const ggml_tensor * w_output;
+
     uint32_t n_outputs;
 
     const llm_graph_cb & cb;
@@ -459,6 +564,9 @@ struct llm_graph_context {
     const llama_memory_context_i * mctx;
     const llama_cross            * cross;
 
+    const llama_logits_subsets * logits_subsets;
+    const ggml_tensor          * w_output;
+
     const llm_graph_cb & cb_func;
 
     std::unique_ptr<llm_graph_result> res;
@@ -476,6 +584,8 @@ struct llm_graph_context {
                      int   il) const;
 
     // do mat_mul, while optionally apply lora
+    // for w == w_output, only the rows of the logits subsets are multiplied (see build_inp_out_rows) - the model graphs
+    // must compute the logits with build_lora_mm(model.output, cur), which is checked in llama_model::build_graph
     ggml_tensor * build_lora_mm(
               ggml_tensor * w,
               ggml_tensor * cur) const;
@@ -533,6 +643,7 @@ struct llm_graph_context {
     ggml_tensor * build_inp_pos() const;
     ggml_tensor * build_inp_attn_scale() const;
     ggml_tensor * build_inp_out_ids() const;
+    ggml_tensor * build_inp_out_rows() const;
     ggml_tensor * build_inp_mean() const;
     ggml_tensor * build_inp_cls() const;
 
@@ -557,6 +668,18 @@ struct llm_graph_context {
              ggml_tensor * v_mla,   // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
                    float   kq_scale) const;
 
+    // flash attention over the two tiers of a tiered KV cache (k0/v0 - cold, k1/v1 - hot)
+    // the kq_mask columns of the k0/v0 cells come first
+    ggml_tensor * build_attn_mha_tiered(
+             ggml_cgraph * gf,
+             ggml_tensor * q,       // [n_embd_head_q, n_head_q, n_tokens]
+             ggml_tensor * k0,      // [n_embd_head_k, n_head_k, n_kv0]
+             ggml_tensor * v0,      // [n_embd_head_v, n_head_v, n_kv0]
+             ggml_tensor * k1,      // [n_embd_head_k, n_head_k, n_kv1]
+             ggml_tensor * v1,      // [n_embd_head_v, n_head_v, n_kv1]
+             ggml_tensor * kq_mask,
+                   float   kq_scale) const;
+
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
 
     ggml_tensor * build_attn(
@@ -690,6 +813,13 @@ struct llm_graph_context {
             ggml_tensor * cls_b,
             ggml_tensor * cls_out,
             ggml_tensor * cls_out_b) const;
+
+    //
+    // sampling
+    //
+
+    // select the cparams.n_logits_top_k largest logits of each output
+    void build_logits_top_k(ggml_cgraph * gf) const;
 };
 
 // TODO: better name
@@ -129,7 +129,7 @@ static std::string gguf_data_to_str(enum gguf_type type, const void * data, int
     }
 }
 
-std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i) {
+std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i, size_t n_max) {
     const enum gguf_type type = gguf_get_kv_type(ctx_gguf, i);
 
     switch (type) {
@@ -144,7 +144,9 @@ std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i) {
                 ss << "[";
                 for (int j = 0; j < arr_n; j++) {
                     if (arr_type == GGUF_TYPE_STRING) {
-                        std::string val = gguf_get_arr_str(ctx_gguf, i, j);
+                        size_t len = 0;
+                        const char * str = gguf_get_arr_str_n(ctx_gguf, i, j, &len);
+                        std::string val(str, len);
                         // escape quotes
                         replace_all(val, "\\", "\\\\");
                         replace_all(val, "\"", "\\\"");
@@ -156,6 +158,10 @@ std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i) {
                     }
                     if (j < arr_n - 1) {
                         ss << ", ";
+                        if ((size_t) ss.tellp() > n_max) {
+                            ss << "...";
+                            break;
+                        }
                     }
                 }
                 ss << "]";
@@ -58,4 +58,5 @@ std::string format(const char * fmt, ...);
 std::string llama_format_tensor_shape(const std::vector<int64_t> & ne);
 std::string llama_format_tensor_shape(const struct ggml_tensor * t);
 
-std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i);
+// arrays are cut short once the result is longer than n_max characters
+std::string gguf_kv_to_str(const struct gguf_context * ctx_gguf, int i, size_t n_max = SIZE_MAX);
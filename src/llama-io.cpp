@@ -1,4 +1,10 @@
 #include "llama-io.h"
+#include "llama-thread-pool.h"
+
+#include "ggml-backend.h"
+
+#include <algorithm>
+#include <cstring>
 
 void llama_io_write_i::write_string(const std::string & str) {
     uint32_t str_size = str.size();
@@ -7,9 +13,77 @@ void llama_io_write_i::write_string(const std::string & str) {
     write(str.data(), str_size);
 }
 
+void llama_io_read_i::read_to_tensor(ggml_tensor * tensor, size_t offset, size_t size) {
+    ggml_backend_tensor_set(tensor, read(size), offset, size);
+}
+
 void llama_io_read_i::read_string(std::string & str) {
     uint32_t str_size;
     read_to(&str_size, sizeof(str_size));
 
     str.assign((const char *) read(str_size), str_size);
 }
+
+void llama_io_tensor_copies(const std::vector<llama_io_tensor_copy> & copies, bool to_tensor, llama_thread_pool * workers) {
+    // not worth waking up a thread for less than this
+    constexpr size_t min_bytes_per_thread = 4u*1024*1024;
+
+    std::vector<const llama_io_tensor_copy *> host;
+
+    // prefix sums of the sizes of the host copies
+    std::vector<size_t> offs = { 0 };
+
+    for (const auto & c : copies) {
+        if (c.size == 0) {
+            continue;
+        }
+
+        if (c.tensor->buffer && ggml_backend_buffer_is_host(c.tensor->buffer)) {
+            host.push_back(&c);
+            offs.push_back(offs.back() + c.size);
+            continue;
+        }
+
+        if (to_tensor) {
+            ggml_backend_tensor_set(c.tensor, c.data, c.offset, c.size);
+        } else {
+            ggml_backend_tensor_get(c.tensor, c.data, c.offset, c.size);
+        }
+    }
+
+    const size_t n_bytes = offs.back();
+
+    const int n_threads = (int) std::max<size_t>(1, std::min<size_t>(workers ? workers->n_threads() + 1 : 1, n_bytes/min_bytes_per_thread));
+
+    // each thread copies the bytes [n_bytes*ith/n_threads, n_bytes*(ith + 1)/n_threads) of the concatenated copies
+    auto worker = [&](int64_t ith) {
+        const size_t b0 = n_bytes*(ith + 0)/n_threads;
+        const size_t b1 = n_bytes*(ith + 1)/n_threads;
+
+        size_t i = std::upper_bound(offs.begin(), offs.end(), b0) - offs.begin() - 1;
+
+        for (size_t b = b0; b < b1; ++i) {
+            const auto & c = *host[i];
+
+            const size_t i0 = b - offs[i];
+            const size_t i1 = std::min(b1, offs[i + 1]) - offs[i];
+
+            uint8_t * t = (uint8_t *) c.tensor->data + c.offset + i0;
+
+            if (to_tensor) {
+                memcpy(t, c.data + i0, i1 - i0);
+            } else {
+                memcpy(c.data + i0, t, i1 - i0);
+            }
+
+            b = offs[i] + i1;
+        }
+    };
+
+    if (n_threads == 1) {
+        worker(0);
+        return;
+    }
+
+    workers->parallel_for(n_threads, worker);
+}
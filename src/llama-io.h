@@ -3,17 +3,25 @@
 #include <cstddef>
 #include <cstdint>
 #include <string>
+#include <vector>
 
 struct ggml_tensor;
 
+class llama_thread_pool;
+
 class llama_io_write_i {
 public:
     llama_io_write_i() = default;
     virtual ~llama_io_write_i() = default;
 
     virtual void write(const void * src, size_t size) = 0;
+
+    // note: the data of the tensor can be copied later, but not after flush() returns
     virtual void write_tensor(const ggml_tensor * tensor, size_t offset, size_t size) = 0;
 
+    // complete the pending tensor copies
+    virtual void flush() {}
+
     // bytes written so far
     virtual size_t n_bytes() = 0;
 
@@ -28,8 +36,26 @@ public:
     virtual const uint8_t * read(size_t size) = 0;
     virtual void read_to(void * dst, size_t size) = 0;
 
+    // note: the data of the tensor can be set later, but not after flush() returns
+    virtual void read_to_tensor(ggml_tensor * tensor, size_t offset, size_t size);
+
+    // complete the pending tensor copies
+    virtual void flush() {}
+
     // bytes read so far
     virtual size_t n_bytes() = 0;
 
     void read_string(std::string & str);
 };
+
+// a copy between a range of a tensor and host memory, recorded by the buffer readers/writers
+struct llama_io_tensor_copy {
+    ggml_tensor * tensor;
+    size_t        offset;
+    size_t        size;
+    uint8_t     * data;
+};
+
+// perform the copies (to_tensor ? data -> tensor : tensor -> data)
+// the copies from/to host buffers are split evenly by size between the calling thread and the workers (can be null)
+void llama_io_tensor_copies(const std::vector<llama_io_tensor_copy> & copies, bool to_tensor, llama_thread_pool * workers);
@@ -16,6 +16,28 @@
 // llama_kv_cache_unified
 //
 
+// a CPU backend for the copies that are computed next to the graph of the context
+// a single thread, so that the copies do not compete with the compute threads of the context
+static ggml_backend_ptr llama_kv_cache_init_copy_backend() {
+    auto * dev_cpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!dev_cpu) {
+        return nullptr;
+    }
+
+    ggml_backend_ptr backend(ggml_backend_dev_init(dev_cpu, nullptr));
+    if (!backend) {
+        return nullptr;
+    }
+
+    auto * reg = ggml_backend_dev_backend_reg(dev_cpu);
+    auto * set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
+    if (set_n_threads_fn) {
+        set_n_threads_fn(backend.get(), 1);
+    }
+
+    return backend;
+}
+
 llama_kv_cache_unified::llama_kv_cache_unified(
         const llama_model &  model,
           layer_filter_cb && filter,
@@ -27,9 +49,15 @@ llama_kv_cache_unified::llama_kv_cache_unified(
                  uint32_t    n_seq_max,
                  uint32_t    n_pad,
                  uint32_t    n_swa,
-           llama_swa_type    swa_type) :
+           llama_swa_type    swa_type,
+                 uint32_t    kv_size_cold,
+                ggml_type    type_k_cold,
+                ggml_type    type_v_cold,
+                 uint32_t    n_stream_sink,
+                 uint32_t    n_stream_window) :
     model(model), hparams(model.hparams), v_trans(v_trans),
-    n_seq_max(n_seq_max), n_pad(n_pad), n_swa(n_swa), swa_type(swa_type) {
+    n_seq_max(n_seq_max), n_pad(n_pad), n_swa(n_swa),
+    n_stream_sink(n_stream_sink), n_stream_window(n_stream_window), swa_type(swa_type) {
 
     GGML_ASSERT(kv_size % n_pad == 0);
 
@@ -130,9 +158,70 @@ llama_kv_cache_unified::llama_kv_cache_unified(
 
     const char * LLAMA_KV_CACHE_DEBUG = getenv("LLAMA_KV_CACHE_DEBUG");
     debug = LLAMA_KV_CACHE_DEBUG ? atoi(LLAMA_KV_CACHE_DEBUG) : 0;
+
+    if (kv_size_cold > 0) {
+        // the cells are moved between the tiers row by row
+        GGML_ASSERT(!v_trans && "the cold KV cache tier requires flash attention");
+
+        LLAMA_LOG_INFO("%s: creating cold KV cache tier, size = %u cells\n", __func__, kv_size_cold);
+
+        layer_filter_cb filter_cold = filter;
+
+        cold = std::make_unique<llama_kv_cache_unified>(
+                model, std::move(filter_cold), type_k_cold, type_v_cold,
+                v_trans, offload, kv_size_cold, n_seq_max, n_pad,
+                n_swa, swa_type, 0, type_k_cold, type_v_cold, 0, 0);
+
+        // the copies to the cold tier are computed by a CPU backend of their own, next to the graph of the context
+        for (const auto * kv : { this, cold.get() }) {
+            for (const auto & buf : kv->bufs) {
+                if (!ggml_backend_buffer_is_host(buf.get())) {
+                    throw std::runtime_error("the cold KV cache tier requires the KV cache in host memory");
+                }
+            }
+        }
+
+        migrate_backend = llama_kv_cache_init_copy_backend();
+        if (!migrate_backend) {
+            throw std::runtime_error("failed to initialize the CPU backend for the cold KV cache tier");
+        }
+    }
+
+    // the SWA and streaming caches place new tokens in occupied cells, and the migration invalidates the moves
+    defrag_can_background = n_swa == 0 && n_stream_window == 0 && !cold;
+    for (const auto & buf : bufs) {
+        defrag_can_background = defrag_can_background && ggml_backend_buffer_is_host(buf.get());
+    }
+
+    if (n_stream_window > 0) {
+        GGML_ASSERT(!cold && "the streaming cache is not supported with a cold tier");
+
+        LLAMA_LOG_INFO("%s: streaming cache, n_sink = %u, n_window = %u\n", __func__, n_stream_sink, n_stream_window);
+    }
+}
+
+llama_kv_cache_unified::~llama_kv_cache_unified() {
+    if (migrate_pending) {
+        try {
+            llama_thread_pool::wait(migrate_pending->task);
+        } catch (const std::exception & err) {
+            LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        }
+    }
+
+    if (defrag_pending) {
+        try {
+            llama_thread_pool::wait(defrag_pending->task);
+        } catch (const std::exception & err) {
+            LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        }
+    }
 }
 
 void llama_kv_cache_unified::clear(bool data) {
+    migrate_commit();
+    defrag_commit();
+
     cells.reset();
 
     head = 0;
@@ -142,9 +231,16 @@ void llama_kv_cache_unified::clear(bool data) {
             ggml_backend_buffer_clear(buf.get(), 0);
         }
     }
+
+    if (cold) {
+        cold->clear(data);
+    }
 }
 
 bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    migrate_commit();
+    defrag_commit();
+
     uint32_t new_head = cells.size();
 
     if (p0 < 0) {
@@ -187,10 +283,17 @@ bool llama_kv_cache_unified::seq_rm(llama_seq_id seq_id, llama_pos p0, llama_pos
         head = new_head;
     }
 
+    if (cold) {
+        cold->seq_rm(seq_id, p0, p1);
+    }
+
     return true;
 }
 
 void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    migrate_commit();
+    defrag_commit();
+
     if (seq_id_src == seq_id_dst) {
         return;
     }
@@ -212,9 +315,16 @@ void llama_kv_cache_unified::seq_cp(llama_seq_id seq_id_src, llama_seq_id seq_id
             cells.seq_add(i, seq_id_dst);
         }
     }
+
+    if (cold) {
+        cold->seq_cp(seq_id_src, seq_id_dst, p0, p1);
+    }
 }
 
 void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
+    migrate_commit();
+    defrag_commit();
+
     uint32_t new_head = cells.size();
 
     for (uint32_t i = 0; i < cells.size(); ++i) {
@@ -229,9 +339,16 @@ void llama_kv_cache_unified::seq_keep(llama_seq_id seq_id) {
     if (new_head != cells.size() && new_head < head) {
         head = new_head;
     }
+
+    if (cold) {
+        cold->seq_keep(seq_id);
+    }
 }
 
 void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_pos p1, llama_pos shift) {
+    migrate_commit();
+    defrag_commit();
+
     if (shift == 0) {
         return;
     }
@@ -268,9 +385,16 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
     // If we freed up a slot, set head to it so searching can start there.
     // Otherwise we just start the next search from the beginning.
     head = new_head != cells.size() ? new_head : 0;
+
+    if (cold) {
+        cold->seq_add(seq_id, p0, p1, shift);
+    }
 }
 
 void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_pos p1, int d) {
+    migrate_commit();
+    defrag_commit();
+
     if (d == 1) {
         return;
     }
@@ -297,14 +421,34 @@ void llama_kv_cache_unified::seq_div(llama_seq_id seq_id, llama_pos p0, llama_po
             cells.pos_div(i, d);
         }
     }
+
+    if (cold) {
+        cold->seq_div(seq_id, p0, p1, d);
+    }
 }
 
 llama_pos llama_kv_cache_unified::seq_pos_min(llama_seq_id seq_id) const {
-    return cells.seq_pos_min(seq_id);
+    llama_pos res = cells.seq_pos_min(seq_id);
+
+    if (cold) {
+        const llama_pos res_cold = cold->seq_pos_min(seq_id);
+
+        if (res_cold >= 0 && (res < 0 || res_cold < res)) {
+            res = res_cold;
+        }
+    }
+
+    return res;
 }
 
 llama_pos llama_kv_cache_unified::seq_pos_max(llama_seq_id seq_id) const {
-    return cells.seq_pos_max(seq_id);
+    llama_pos res = cells.seq_pos_max(seq_id);
+
+    if (cold) {
+        res = std::max(res, cold->seq_pos_max(seq_id));
+    }
+
+    return res;
 }
 
 llama_memory_context_ptr llama_kv_cache_unified::init_batch(
@@ -344,13 +488,43 @@ llama_memory_context_ptr llama_kv_cache_unified::init_full() {
 }
 
 llama_memory_context_ptr llama_kv_cache_unified::init_update(llama_context * lctx, bool optimize) {
+    // note: when optimizing, the positions of the current batch have already been assigned, so they cannot move
+    if (!optimize) {
+        stream_shift();
+    }
+
     bool do_shift = get_has_shift();
 
-    defrag_info dinfo;
+    // the cells of a background defrag are moved once its copies are done, or right away if the cells are needed
+    // note: only the metadata of the cells changes here
+    if (defrag_pending && (optimize || do_shift || defrag_pending->task->done())) {
+        defrag_commit();
+    }
+
+    defrag_info  dinfo;
+    migrate_info minfo;
+
+    // see if we need to move cells to the cold tier
+    // keep enough free cells in the hot tier for the next batch
+    if (cold) {
+        // the cells of a background migration are moved once its copies are done, or right away if the cells are needed
+        if (migrate_pending) {
+            minfo.commit = optimize || do_shift || migrate_pending->task->done();
+        }
+
+        // only one migration at a time
+        if (!migrate_pending || minfo.commit) {
+            minfo.ids = migrate_prepare(std::min(lctx->get_cparams().n_batch, cells.size()), lctx->graph_max_nodes()).ids;
+
+            // when optimizing, the current batch needs the cells now
+            minfo.background = !optimize;
+        }
+    }
 
     // see if we need to defrag
-    {
-        bool do_defrag = optimize;
+    // note: the migration invalidates the defrag plan, so the defrag is postponed until there is nothing to migrate
+    if (minfo.empty() && !migrate_pending && !defrag_pending) {
+        bool do_defrag = optimize || defrag_partial;
 
         const auto thold = lctx->get_cparams().defrag_thold;
 
@@ -369,11 +543,26 @@ llama_memory_context_ptr llama_kv_cache_unified::init_update(llama_context * lct
         }
 
         if (do_defrag) {
-            dinfo = defrag_prepare(lctx->graph_max_nodes());
+            // bound the amount of data moved per step, so that the defrag does not stall the decode
+            uint32_t max_cells = cells.size();
+
+            const uint32_t step_mib = lctx->get_cparams().defrag_step_mib;
+            if (step_mib > 0) {
+                const size_t cell_bytes = (size_k_bytes() + size_v_bytes())/cells.size();
+
+                max_cells = std::max<size_t>(1, std::min<size_t>(max_cells, (size_t(step_mib) << 20)/std::max<size_t>(1, cell_bytes)));
+            }
+
+            dinfo = defrag_prepare(lctx->graph_max_nodes(), max_cells);
+
+            defrag_partial = dinfo.partial;
+
+            // when optimizing, the current batch needs the cells now
+            dinfo.background = defrag_can_background && !optimize;
         }
     }
 
-    return std::make_unique<llama_kv_cache_unified_context>(this, lctx, do_shift, std::move(dinfo));
+    return std::make_unique<llama_kv_cache_unified_context>(this, lctx, do_shift, std::move(dinfo), std::move(minfo));
 }
 
 llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare(const std::vector<llama_ubatch> & ubatches) {
@@ -416,17 +605,28 @@ llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare(const std::
     }
 
     if (!success) {
+        // the destination cells of a background defrag are free once it is committed
+        if (defrag_pending) {
+            defrag_commit();
+
+            return prepare(ubatches);
+        }
+
         return {};
     }
 
     return res;
 }
 
-bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const defrag_info & dinfo) {
+bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const defrag_info & dinfo, const migrate_info & minfo) {
     bool updated = false;
 
     auto * sched = lctx->get_sched();
 
+    if (minfo.commit) {
+        migrate_commit();
+    }
+
     if (do_shift) {
         if (!get_can_shift()) {
             GGML_ABORT("The current KV cache / model configuration does not support K-shift");
@@ -462,9 +662,29 @@ bool llama_kv_cache_unified::update(llama_context * lctx, bool do_shift, const d
         }
 
         cells.reset_shift();
+
+        if (cold && cold->get_has_shift()) {
+            updated = cold->update(lctx, true, {}, {}) || updated;
+        }
     }
 
-    if (!dinfo.empty()) {
+    if (!minfo.ids.empty()) {
+        // the K-shift above must be done before its data is copied
+        ggml_backend_sched_synchronize(sched);
+
+        if (!migrate_start(lctx, minfo)) {
+            return updated;
+        }
+    }
+
+    if (!dinfo.empty() && dinfo.background) {
+        // the K-shift above must be done before its data is copied
+        ggml_backend_sched_synchronize(sched);
+
+        if (!defrag_start(lctx, dinfo)) {
+            return updated;
+        }
+    } else if (!dinfo.empty()) {
         LLAMA_LOG_DEBUG("%s: defragmenting KV cache\n", __func__);
 
         // apply moves:
@@ -609,6 +829,11 @@ int32_t llama_kv_cache_unified::find_slot(const llama_ubatch & ubatch) const {
             //                always insert in the cell with minimum pos
             bool can_use = cells.is_empty(head_cur + i);
 
+            // the destination cells of a background defrag are reserved
+            if (can_use && defrag_pending && defrag_pending->dst[head_cur + i]) {
+                can_use = false;
+            }
+
             if (!can_use && cells.seq_count(head_cur + i) == 1) {
                 const llama_pos pos_cell = cells.pos_get(head_cur + i);
 
@@ -700,12 +925,96 @@ bool llama_kv_cache_unified::get_can_shift() const {
     return true;
 }
 
+void llama_kv_cache_unified::stream_evict(const llama_ubatch & ubatch) {
+    if (n_stream_window == 0) {
+        return;
+    }
+
+    const uint32_t n_max = n_stream_sink + n_stream_window;
+
+    for (uint32_t s = 0; s < ubatch.n_seqs_unq; ++s) {
+        const llama_seq_id seq_id = ubatch.seq_id_unq[s];
+
+        const uint32_t n_cur = cells.seq_pos_count(seq_id);
+        if (n_cur <= n_stream_sink) {
+            continue;
+        }
+
+        uint32_t n_new = 0;
+        for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+            for (int32_t j = 0; j < ubatch.n_seq_id[i]; ++j) {
+                if (ubatch.seq_id[i][j] == seq_id) {
+                    n_new++;
+                    break;
+                }
+            }
+        }
+
+        if (n_cur + n_new <= n_max) {
+            continue;
+        }
+
+        // the oldest cells after the sinks
+        const uint32_t n_evict = std::min(n_cur - n_stream_sink, n_cur + n_new - n_max);
+
+        const llama_pos p0 = cells.seq_pos_nth(seq_id, n_stream_sink);
+        const llama_pos p1 = cells.seq_pos_nth(seq_id, n_stream_sink + n_evict - 1) + 1;
+
+        seq_rm(seq_id, p0, p1);
+    }
+}
+
+bool llama_kv_cache_unified::stream_shift() {
+    if (n_stream_window == 0) {
+        return false;
+    }
+
+    // moving the positions requires a K-shift of all cells, so it is done in bulk
+    const llama_pos n_gap_min = std::max<llama_pos>(1, n_stream_window/2);
+
+    bool res = false;
+
+    for (uint32_t s = 0; s < n_seq_max; ++s) {
+        const llama_seq_id seq_id = s;
+
+        if (cells.seq_pos_count(seq_id) <= n_stream_sink) {
+            continue;
+        }
+
+        const llama_pos p_sink = n_stream_sink > 0 ? cells.seq_pos_nth(seq_id, n_stream_sink - 1) + 1 : 0;
+        const llama_pos p_win  = cells.seq_pos_nth(seq_id, n_stream_sink);
+
+        const llama_pos n_gap = p_win - p_sink;
+        if (n_gap < n_gap_min) {
+            continue;
+        }
+
+        LLAMA_LOG_DEBUG("%s: seq %d: moving positions [%d, %d] by %d\n", __func__, seq_id, p_win, cells.seq_pos_max(seq_id), -n_gap);
+
+        seq_add(seq_id, p_win, -1, -n_gap);
+
+        res = true;
+    }
+
+    return res;
+}
+
+float llama_kv_cache_unified::get_fragmentation() const {
+    const uint32_t n_kv = cells.used_max_p1();
+
+    return n_kv > 0 ? 1.0f - float(cells.get_used())/n_kv : 0.0f;
+}
+
 uint32_t llama_kv_cache_unified::get_size() const {
     return cells.size();
 }
 
 bool llama_kv_cache_unified::get_has_shift() const {
-    return cells.get_has_shift();
+    return cells.get_has_shift() || (cold && cold->get_has_shift());
+}
+
+const llama_kv_cache_unified * llama_kv_cache_unified::get_cold() const {
+    return cold.get();
 }
 
 uint32_t llama_kv_cache_unified::get_n_kv() const {
@@ -755,7 +1064,7 @@ ggml_tensor * llama_kv_cache_unified::cpy_k(ggml_context * ctx, ggml_tensor * k_
 
     ggml_tensor * k_view = ggml_view_1d(ctx, k,
             n_tokens*hparams.n_embd_k_gqa(il),
-            ggml_row_size(k->type, hparams.n_embd_k_gqa(il))*head_cur);
+            cpy_k_offs(il, head_cur));
 
     return ggml_cpy(ctx, k_cur, k_view);
 }
@@ -774,12 +1083,12 @@ ggml_tensor * llama_kv_cache_unified::cpy_v(ggml_context * ctx, ggml_tensor * v_
     if (!v_trans) {
         v_view = ggml_view_1d(ctx, v,
                 n_tokens*hparams.n_embd_v_gqa(il),
-                ggml_row_size(v->type, hparams.n_embd_v_gqa(il))*head_cur);
+                cpy_v_offs(il, head_cur));
     } else {
         // note: the V cache is transposed when not using flash attention
         v_view = ggml_view_2d(ctx, v, n_tokens, hparams.n_embd_v_gqa(il),
                 (v->ne[1])*ggml_element_size(v),
-                (head_cur)*ggml_element_size(v));
+                cpy_v_offs(il, head_cur));
 
         v_cur = ggml_transpose(ctx, v_cur);
     }
@@ -787,14 +1096,64 @@ ggml_tensor * llama_kv_cache_unified::cpy_v(ggml_context * ctx, ggml_tensor * v_
     return ggml_cpy(ctx, v_cur, v_view);
 }
 
-void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
-    const uint32_t n_tokens = ubatch->n_tokens;
+size_t llama_kv_cache_unified::cpy_k_offs(int32_t il, uint32_t head_cur) const {
+    const int32_t ikv = map_layer_ids.at(il);
 
+    auto * k = layers[ikv].k;
+
+    return ggml_row_size(k->type, hparams.n_embd_k_gqa(il))*head_cur;
+}
+
+size_t llama_kv_cache_unified::cpy_v_offs(int32_t il, uint32_t head_cur) const {
+    const int32_t ikv = map_layer_ids.at(il);
+
+    auto * v = layers[ikv].v;
+
+    if (!v_trans) {
+        return ggml_row_size(v->type, hparams.n_embd_v_gqa(il))*head_cur;
+    }
+
+    return head_cur*ggml_element_size(v);
+}
+
+// the result of ggml_cpy() and its destination are both views of the cache tensor
+static void set_cpy_view_offs(ggml_tensor * cpy, size_t offs) {
+    GGML_ASSERT(cpy->op == GGML_OP_CPY);
+
+    for (ggml_tensor * t : { cpy, cpy->src[1] }) {
+        GGML_ASSERT(t->view_src != nullptr && t->view_src->data != nullptr);
+
+        t->view_offs = offs;
+        t->data      = (char *) t->view_src->data + offs;
+    }
+}
+
+void llama_kv_cache_unified::set_input_k_cpy(ggml_tensor * dst, int32_t il, uint32_t head_cur) const {
+    set_cpy_view_offs(dst, cpy_k_offs(il, head_cur));
+}
+
+void llama_kv_cache_unified::set_input_v_cpy(ggml_tensor * dst, int32_t il, uint32_t head_cur) const {
+    set_cpy_view_offs(dst, cpy_v_offs(il, head_cur));
+}
+
+void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, uint32_t n_kv_cold) const {
     GGML_ASSERT(ggml_backend_buffer_is_host(dst->buffer));
+    GGML_ASSERT(n_kv_cold == 0 || cold);
+
     float * data = (float *) dst->data;
 
     const int64_t n_kv = dst->ne[0];
 
+    if (n_kv_cold > 0) {
+        cold->fill_kq_mask(data, n_kv, 0, n_kv_cold, ubatch, causal_attn);
+    }
+
+    fill_kq_mask(data, n_kv, n_kv_cold, n_kv - n_kv_cold, ubatch, causal_attn);
+}
+
+void llama_kv_cache_unified::fill_kq_mask(float * data, int64_t n_kv, uint32_t j0, uint32_t n_cells, const llama_ubatch * ubatch, bool causal_attn) const {
+    const uint32_t n_tokens = ubatch->n_tokens;
+
     // Use only the previous KV cells of the correct sequence for each token of the ubatch.
     // It's assumed that if a token in the batch has multiple sequences, they are equivalent.
     // Example with a cache of 10 tokens, 2 tokens populated in cache and 3 tokens in batch:
@@ -807,24 +1166,32 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
     //      xxxxx-----
     //      xxxxx-----
     // To visualize the mask, see https://github.com/ggml-org/llama.cpp/pull/12615
+    // the cells of this cache occupy the columns [j0, j0 + n_cells) of the mask
+    //
+    // the cells visible to a sequence are the same for all tokens in a run of the sequence, so they are determined
+    // once per run and only the position-dependent part of the mask is evaluated per token
+    std::vector<llama_pos> cell_pos(n_cells); // position of the cell, -1 if not visible to the sequence
+
     for (uint32_t h = 0; h < 1; ++h) {
-        for (uint32_t i = 0; i < n_tokens; ++i) {
-            const llama_seq_id seq_id = ubatch->seq_id[i][0];
+        for (uint32_t r = 0; r < ubatch->n_seq_ranges; ++r) {
+            const auto & range = ubatch->seq_ranges[r];
 
-            const llama_pos p1 = ubatch->pos[i];
+            for (uint32_t j = 0; j < n_cells; ++j) {
+                // mask the token if the cell is empty or not the same sequence
+                cell_pos[j] = !cells.is_empty(j) && cells.seq_has(j, range.seq_id) ? cells.pos_get(j) : -1;
+            }
 
-            for (uint32_t j = 0; j < n_kv; ++j) {
-                float f = 0.0f;
+            for (uint32_t i = range.i0; i < range.i1; ++i) {
+                const llama_pos p1 = ubatch->pos[i];
 
-                bool masked = false;
+                float * row = data + h*(n_kv*n_tokens) + i*n_kv + j0;
 
-                if (cells.is_empty(j)) {
-                    masked = true;
-                } else {
-                    const llama_pos p0 = cells.pos_get(j);
+                for (uint32_t j = 0; j < n_cells; ++j) {
+                    const llama_pos p0 = cell_pos[j];
 
-                    // mask the token if not the same sequence
-                    masked = masked || (!cells.seq_has(j, seq_id));
+                    float f = 0.0f;
+
+                    bool masked = p0 < 0;
 
                     // mask future tokens
                     masked = masked || (causal_attn && p0 > p1);
@@ -835,21 +1202,21 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor * dst, const llama_ub
                     if (!masked && hparams.use_alibi) {
                         f = -std::abs(p0 - p1);
                     }
-                }
 
-                if (masked) {
-                    f = -INFINITY;
-                }
+                    if (masked) {
+                        f = -INFINITY;
+                    }
 
-                data[h*(n_kv*n_tokens) + i*n_kv + j] = f;
+                    row[j] = f;
+                }
             }
         }
 
         // mask padded tokens
         if (data) {
             for (uint32_t i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                for (uint32_t j = 0; j < n_kv; ++j) {
-                    data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
+                for (uint32_t j = 0; j < n_cells; ++j) {
+                    data[h*(n_kv*n_tokens) + i*n_kv + j0 + j] = -INFINITY;
                 }
             }
         }
@@ -1178,7 +1545,62 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_defrag(
     return res;
 }
 
-llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) const {
+void llama_kv_cache_unified::build_graph_migrate(
+                       ggml_context * ctx,
+                        ggml_cgraph * gf,
+                 const migrate_info & minfo) const {
+    const auto & ids = minfo.ids;
+
+    for (size_t k = 0; k < ids.size(); ++k) {
+        const uint32_t i  = ids[k].first;
+        const uint32_t id = ids[k].second;
+
+        uint32_t nm = 1;
+
+        while (k + nm < ids.size() && ids[k + nm].first == i + nm && ids[k + nm].second == id + nm) {
+            nm++;
+        }
+
+        for (size_t ikv = 0; ikv < layers.size(); ++ikv) {
+            const auto & layer_src = layers[ikv];
+            const auto & layer_dst = cold->layers[ikv];
+
+            const uint32_t il = layer_src.il;
+
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            // note: the V cache is not transposed (see constructor)
+            ggml_tensor * view_k_src = ggml_view_2d(ctx, layer_src.k,
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(layer_src.k->type, n_embd_k_gqa),
+                    ggml_row_size(layer_src.k->type, n_embd_k_gqa*i));
+
+            ggml_tensor * view_k_dst = ggml_view_2d(ctx, layer_dst.k,
+                    n_embd_k_gqa, nm,
+                    ggml_row_size(layer_dst.k->type, n_embd_k_gqa),
+                    ggml_row_size(layer_dst.k->type, n_embd_k_gqa*id));
+
+            ggml_tensor * view_v_src = ggml_view_2d(ctx, layer_src.v,
+                    n_embd_v_gqa, nm,
+                    ggml_row_size(layer_src.v->type, n_embd_v_gqa),
+                    ggml_row_size(layer_src.v->type, n_embd_v_gqa*i));
+
+            ggml_tensor * view_v_dst = ggml_view_2d(ctx, layer_dst.v,
+                    n_embd_v_gqa, nm,
+                    ggml_row_size(layer_dst.v->type, n_embd_v_gqa),
+                    ggml_row_size(layer_dst.v->type, n_embd_v_gqa*id));
+
+            // requantize into the cold tier
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_k_src, view_k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_v_src, view_v_dst));
+        }
+
+        k += nm - 1;
+    }
+}
+
+llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes, uint32_t max_cells) const {
     const uint32_t n_layer = layers.size();
 
     const uint32_t n_kv   = cells.used_max_p1();
@@ -1188,9 +1610,12 @@ llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32
 
     //const int64_t t_start = ggml_time_us();
 
-    // number of cells moved
+    // number of cell moves (continuous blocks)
     uint32_t n_moves = 0;
 
+    // number of cells moved
+    uint32_t n_moved = 0;
+
     // each move requires 6*n_layer tensors (see graph_build_kv_self_defrag)
     //   - source view, destination view, copy operation
     //   - x2 for keys and values
@@ -1262,8 +1687,14 @@ llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32
                 continue;
             }
 
+            if (n_moved == max_cells) {
+                stop = true;
+                break;
+            }
+
             // this cell goes to (i0 + nf)
             ids[i1] = i0 + nf;
+            n_moved++;
 
             if (!cont) {
                 n_moves++;
@@ -1277,7 +1708,8 @@ llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32
             }
         }
 
-        if (stop || n_moves == max_moves) {
+        if (stop || n_moves == max_moves || n_moved == max_cells) {
+            res.partial = true;
             break;
         }
 
@@ -1290,13 +1722,299 @@ llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32
         return {};
     }
 
-    LLAMA_LOG_DEBUG("%s: (tmp log) KV defrag cell moves: %u\n", __func__, n_moves);
+    LLAMA_LOG_DEBUG("%s: (tmp log) KV defrag cell moves: %u, cells moved: %u%s\n", __func__, n_moves, n_moved, res.partial ? " (partial)" : "");
 
     LLAMA_LOG_DEBUG("%s: expected gf nodes: %u\n", __func__, 6*n_moves*n_layer);
 
     return res;
 }
 
+llama_kv_cache_unified::migrate_info llama_kv_cache_unified::migrate_prepare(uint32_t n_free, int32_t n_max_nodes) const {
+    const uint32_t n_layer = layers.size();
+
+    // the cells of the pending migration, sorted by the hot and by the cold cell index
+    static const std::vector<std::pair<uint32_t, uint32_t>> no_ids;
+    const auto & ids_pending = migrate_pending ? migrate_pending->minfo.ids : no_ids;
+
+    const auto is_pending_hot = [&](uint32_t i) {
+        return std::binary_search(ids_pending.begin(), ids_pending.end(), std::make_pair(i, 0u),
+                [](const auto & a, const auto & b) { return a.first < b.first; });
+    };
+
+    const auto is_pending_cold = [&](uint32_t j) {
+        return std::binary_search(ids_pending.begin(), ids_pending.end(), std::make_pair(0u, j),
+                [](const auto & a, const auto & b) { return a.second < b.second; });
+    };
+
+    const uint32_t n_used = cells.get_used() - ids_pending.size();
+    const uint32_t n_keep = cells.size() - n_free;
+
+    if (n_used <= n_keep) {
+        return {};
+    }
+
+    // each move of a continuous block of cells requires 6*n_layer tensors (see build_graph_migrate)
+    const uint32_t max_moves = (n_max_nodes - 2*n_layer)/(6*n_layer);
+
+    // the age of a cell is the distance to the last position of the most recent sequence that uses it
+    std::vector<std::pair<llama_pos, uint32_t>> cands; // (age, cell)
+    cands.reserve(n_used);
+
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (cells.is_empty(i) || is_pending_hot(i)) {
+            continue;
+        }
+
+        const llama_pos pos = cells.pos_get(i);
+
+        llama_pos age = std::numeric_limits<llama_pos>::max();
+
+        for (llama_seq_id s = 0; s < (llama_seq_id) n_seq_max; ++s) {
+            if (cells.seq_has(i, s)) {
+                age = std::min(age, cells.seq_pos_max(s) - pos);
+            }
+        }
+
+        cands.emplace_back(age, i);
+    }
+
+    // move the oldest cells, in the order of the hot cells so that continuous blocks can be moved together
+    const uint32_t n_move = n_used - n_keep;
+
+    std::nth_element(cands.begin(), cands.begin() + (n_move - 1), cands.end(),
+            [](const auto & a, const auto & b) { return a.first > b.first; });
+
+    cands.resize(n_move);
+
+    std::sort(cands.begin(), cands.end(),
+            [](const auto & a, const auto & b) { return a.second < b.second; });
+
+    migrate_info res;
+
+    // number of continuous blocks moved
+    uint32_t n_moves = 0;
+
+    uint32_t j = 0;
+
+    for (const auto & cand : cands) {
+        const uint32_t i = cand.second;
+
+        while (j < cold->cells.size() && (!cold->cells.is_empty(j) || is_pending_cold(j))) {
+            j++;
+        }
+
+        if (j == cold->cells.size()) {
+            LLAMA_LOG_WARN("%s: the cold KV cache tier is full\n", __func__);
+            break;
+        }
+
+        const bool cont = !res.ids.empty() && res.ids.back().first + 1 == i && res.ids.back().second + 1 == j;
+
+        if (!cont) {
+            if (n_moves == max_moves) {
+                break;
+            }
+
+            n_moves++;
+        }
+
+        res.ids.emplace_back(i, j);
+
+        j++;
+    }
+
+    LLAMA_LOG_DEBUG("%s: cells to move to the cold tier: %zu, continuous blocks: %u\n", __func__, res.ids.size(), n_moves);
+
+    return res;
+}
+
+bool llama_kv_cache_unified::migrate_start(llama_context * lctx, const migrate_info & minfo) {
+    GGML_ASSERT(!migrate_pending);
+
+    // each continuous block of cells requires 6*n_layer tensors (see build_graph_migrate)
+    size_t n_moves = 0;
+
+    for (size_t k = 0; k < minfo.ids.size(); ++k) {
+        if (k == 0 || minfo.ids[k].first != minfo.ids[k - 1].first + 1 || minfo.ids[k].second != minfo.ids[k - 1].second + 1) {
+            n_moves++;
+        }
+    }
+
+    const size_t n_tensors = 6*layers.size()*n_moves;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ n_tensors*ggml_tensor_overhead() + ggml_graph_overhead_custom(n_tensors, false),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    auto job = std::make_unique<migrate_job>();
+
+    job->minfo = minfo;
+    job->ctx.reset(ggml_init(params));
+    if (!job->ctx) {
+        LLAMA_LOG_ERROR("%s: failed to create ggml context for KV tier migration\n", __func__);
+        return false;
+    }
+
+    job->gf = ggml_new_graph_custom(job->ctx.get(), n_tensors, false);
+
+    build_graph_migrate(job->ctx.get(), job->gf, minfo);
+
+    auto compute = [backend = migrate_backend.get(), gf = job->gf]() {
+        if (ggml_backend_graph_compute(backend, gf) != GGML_STATUS_SUCCESS) {
+            throw std::runtime_error("failed to compute KV tier migration");
+        }
+    };
+
+    LLAMA_LOG_DEBUG("%s: copying %zu cells to the cold tier%s\n", __func__, minfo.ids.size(), minfo.background ? " in the background" : "");
+
+    if (minfo.background) {
+        job->task = lctx->get_workers()->submit(std::move(compute));
+    } else {
+        // run by migrate_commit() on this thread
+        job->task = std::make_shared<llama_thread_pool::task>(std::move(compute));
+    }
+
+    migrate_pending = std::move(job);
+
+    if (!minfo.background) {
+        migrate_commit();
+    }
+
+    return true;
+}
+
+void llama_kv_cache_unified::migrate_commit() {
+    if (!migrate_pending) {
+        return;
+    }
+
+    auto job = std::move(migrate_pending);
+
+    try {
+        llama_thread_pool::wait(job->task);
+    } catch (const std::exception & err) {
+        // nothing is lost - the cells are still in the hot tier
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        return;
+    }
+
+    const auto & ids = job->minfo.ids;
+
+    LLAMA_LOG_DEBUG("%s: moving %zu cells to the cold tier\n", __func__, ids.size());
+
+    for (const auto & [i, j] : ids) {
+        cold->cells.pos_set(j, cells.pos_get(i));
+
+        for (llama_seq_id s = 0; s < (llama_seq_id) n_seq_max; ++s) {
+            if (cells.seq_has(i, s)) {
+                cold->cells.seq_add(j, s);
+            }
+        }
+
+        cells.rm(i);
+    }
+
+    // start the search for free cells from the first vacated cell
+    head = ids.front().first;
+}
+
+bool llama_kv_cache_unified::defrag_start(llama_context * lctx, const defrag_info & dinfo) {
+    GGML_ASSERT(!defrag_pending);
+
+    if (!defrag_backend) {
+        defrag_backend = llama_kv_cache_init_copy_backend();
+        if (!defrag_backend) {
+            LLAMA_LOG_ERROR("%s: failed to initialize the CPU backend for the KV cache defrag\n", __func__);
+            return false;
+        }
+    }
+
+    const auto & ids = dinfo.ids;
+
+    auto job = std::make_unique<defrag_job>();
+
+    job->dinfo = dinfo;
+    job->dst.resize(cells.size(), false);
+
+    // each continuous block of cells requires 6*n_layer tensors (see build_graph_defrag)
+    size_t n_moves = 0;
+
+    for (uint32_t i = 0; i < ids.size(); ++i) {
+        if (ids[i] == i || ids[i] == ids.size()) {
+            continue;
+        }
+
+        job->dst[ids[i]] = true;
+
+        if (i == 0 || ids[i - 1] != ids[i] - 1) {
+            n_moves++;
+        }
+    }
+
+    const size_t n_tensors = 6*layers.size()*n_moves;
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ n_tensors*ggml_tensor_overhead() + ggml_graph_overhead_custom(n_tensors, false),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    job->ctx.reset(ggml_init(params));
+    if (!job->ctx) {
+        LLAMA_LOG_ERROR("%s: failed to create ggml context for KV cache defrag\n", __func__);
+        return false;
+    }
+
+    job->gf = ggml_new_graph_custom(job->ctx.get(), n_tensors, false);
+
+    build_graph_defrag(lctx->get_cparams(), job->ctx.get(), job->gf, dinfo);
+
+    LLAMA_LOG_DEBUG("%s: defragmenting KV cache in the background\n", __func__);
+
+    job->task = lctx->get_workers()->submit([backend = defrag_backend.get(), gf = job->gf]() {
+        if (ggml_backend_graph_compute(backend, gf) != GGML_STATUS_SUCCESS) {
+            throw std::runtime_error("failed to compute KV cache defrag");
+        }
+    });
+
+    defrag_pending = std::move(job);
+
+    return true;
+}
+
+void llama_kv_cache_unified::defrag_commit() {
+    if (!defrag_pending) {
+        return;
+    }
+
+    auto job = std::move(defrag_pending);
+
+    try {
+        llama_thread_pool::wait(job->task);
+    } catch (const std::exception & err) {
+        // nothing is lost - the cells are still in place
+        LLAMA_LOG_ERROR("%s: %s\n", __func__, err.what());
+        return;
+    }
+
+    const auto & ids = job->dinfo.ids;
+
+    const uint32_t n_kv = ids.size();
+
+    for (uint32_t i = 0; i < n_kv; ++i) {
+        if (ids[i] == n_kv || ids[i] == i) {
+            continue;
+        }
+
+        cells.mv(i, ids[i]);
+    }
+
+    // reset the head so we can find the first free slot during the next ubatch
+    head = 0;
+}
+
 bool llama_kv_cache_unified::is_masked_swa(llama_pos p0, llama_pos p1) const {
     assert(p0 >= 0 && p1 >= 0);
 
@@ -1360,9 +2078,16 @@ void llama_kv_cache_unified::state_write(llama_io_write_i & io, llama_seq_id seq
 
     state_write_meta(io, cell_ranges, seq_id);
     state_write_data(io, cell_ranges);
+
+    if (cold) {
+        cold->state_write(io, seq_id);
+    }
 }
 
 void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_id) {
+    migrate_commit();
+    defrag_commit();
+
     uint32_t cell_count;
     io.read_to(&cell_count, sizeof(cell_count));
 
@@ -1378,6 +2103,10 @@ void llama_kv_cache_unified::state_read(llama_io_read_i & io, llama_seq_id seq_i
         }
         throw std::runtime_error("failed to restore kv cache");
     }
+
+    if (cold) {
+        cold->state_read(io, seq_id);
+    }
 }
 
 void llama_kv_cache_unified::state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id) const {
@@ -1499,6 +2228,11 @@ bool llama_kv_cache_unified::state_read_meta(llama_io_read_i & io, uint32_t cell
 
         seq_rm(dest_seq_id, -1, -1);
 
+        if (cell_count == 0) {
+            // note: with a cold tier, all cells of the sequence can be in the other tier
+            return true;
+        }
+
         llama_batch_allocr balloc(hparams.n_pos_per_embd());
 
         llama_ubatch ubatch = balloc.ubatch_reserve(cell_count, 1);
@@ -1630,7 +2364,7 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
 
         if (cell_count) {
             // Read and set the keys for the whole cell range
-            ggml_backend_tensor_set(layer.k, io.read(cell_count * k_size_row), head * k_size_row, cell_count * k_size_row);
+            io.read_to_tensor(layer.k, head * k_size_row, cell_count * k_size_row);
         }
     }
 
@@ -1660,7 +2394,7 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
 
             if (cell_count) {
                 // Read and set the values for the whole cell range
-                ggml_backend_tensor_set(layer.v, io.read(cell_count * v_size_row), head * v_size_row, cell_count * v_size_row);
+                io.read_to_tensor(layer.v, head * v_size_row, cell_count * v_size_row);
             }
         }
     } else {
@@ -1700,7 +2434,7 @@ bool llama_kv_cache_unified::state_read_data(llama_io_read_i & io, uint32_t cell
                 // For each row in the transposed matrix, read the values for the whole cell range
                 for (uint32_t j = 0; j < n_embd_v_gqa; ++j) {
                     const size_t dst_offset = (head + j * cells.size()) * v_size_el;
-                    ggml_backend_tensor_set(layer.v, io.read(cell_count * v_size_el), dst_offset, cell_count * v_size_el);
+                    io.read_to_tensor(layer.v, dst_offset, cell_count * v_size_el);
                 }
             }
         }
@@ -1719,14 +2453,17 @@ llama_kv_cache_unified_context::llama_kv_cache_unified_context(
         llama_kv_cache_unified * kv) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv) {
     n_kv = kv->get_size();
     head = 0;
+
+    n_kv_cold = kv->get_cold() ? kv->get_cold()->get_size() : 0;
 }
 
 llama_kv_cache_unified_context::llama_kv_cache_unified_context(
         llama_kv_cache_unified * kv,
         llama_context * lctx,
         bool do_shift,
-        defrag_info dinfo) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), lctx(lctx), do_shift(do_shift), dinfo(std::move(dinfo)) {
-    if (!do_shift && this->dinfo.empty()) {
+        defrag_info dinfo,
+        migrate_info minfo) : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), lctx(lctx), do_shift(do_shift), dinfo(std::move(dinfo)), minfo(std::move(minfo)) {
+    if (!do_shift && this->dinfo.empty() && this->minfo.empty()) {
         status = LLAMA_MEMORY_STATUS_NO_UPDATE;
     }
 }
@@ -1754,16 +2491,19 @@ bool llama_kv_cache_unified_context::apply() {
 
     // no ubatches -> this is a KV cache update
     if (ubatches.empty()) {
-        kv->update(lctx, do_shift, dinfo);
+        kv->update(lctx, do_shift, dinfo, minfo);
 
         return true;
     }
 
+    kv->stream_evict(ubatches[i_next]);
     kv->apply_ubatch(heads[i_next], ubatches[i_next]);
 
     n_kv = kv->get_n_kv();
     head = heads[i_next];
 
+    n_kv_cold = kv->get_cold() ? kv->get_cold()->get_n_kv() : 0;
+
     return true;
 }
 
@@ -1781,6 +2521,10 @@ uint32_t llama_kv_cache_unified_context::get_n_kv() const {
     return n_kv;
 }
 
+uint32_t llama_kv_cache_unified_context::get_n_kv_cold() const {
+    return n_kv_cold;
+}
+
 ggml_tensor * llama_kv_cache_unified_context::get_k(ggml_context * ctx, int32_t il) const {
     return kv->get_k(ctx, il, n_kv);
 }
@@ -1789,6 +2533,14 @@ ggml_tensor * llama_kv_cache_unified_context::get_v(ggml_context * ctx, int32_t
     return kv->get_v(ctx, il, n_kv);
 }
 
+ggml_tensor * llama_kv_cache_unified_context::get_k_cold(ggml_context * ctx, int32_t il) const {
+    return kv->get_cold()->get_k(ctx, il, n_kv_cold);
+}
+
+ggml_tensor * llama_kv_cache_unified_context::get_v_cold(ggml_context * ctx, int32_t il) const {
+    return kv->get_cold()->get_v(ctx, il, n_kv_cold);
+}
+
 ggml_tensor * llama_kv_cache_unified_context::cpy_k(ggml_context * ctx, ggml_tensor * k_cur, int32_t il) const {
     return kv->cpy_k(ctx, k_cur, il, head);
 }
@@ -1802,13 +2554,21 @@ void llama_kv_cache_unified_context::set_input_k_shift(ggml_tensor * dst) const
 }
 
 void llama_kv_cache_unified_context::set_input_kq_mask(ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const {
-    kv->set_input_kq_mask(dst, ubatch, causal_attn);
+    kv->set_input_kq_mask(dst, ubatch, causal_attn, n_kv_cold);
 }
 
 void llama_kv_cache_unified_context::set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const {
     kv->set_input_pos_bucket(dst, ubatch);
 }
 
+void llama_kv_cache_unified_context::set_input_k_cpy(ggml_tensor * dst, int32_t il) const {
+    kv->set_input_k_cpy(dst, il, head);
+}
+
+void llama_kv_cache_unified_context::set_input_v_cpy(ggml_tensor * dst, int32_t il) const {
+    kv->set_input_v_cpy(dst, il, head);
+}
+
 uint32_t llama_kv_cache_unified::get_padding(const llama_cparams & cparams) {
     // the FA kernels require padding to avoid extra runtime boundary checks
     return cparams.flash_attn ? 256u : 32u;
@@ -4,7 +4,11 @@
 #include "llama-graph.h"
 #include "llama-kv-cells.h"
 #include "llama-memory.h"
+#include "llama-thread-pool.h"
 
+#include "ggml-cpp.h"
+
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -35,8 +39,46 @@ public:
         //  - cell i moves to ids[i]
         //  - if ids[i] == i || ids[i] == ids.size(), then cell i is not moved
         std::vector<uint32_t> ids;
+
+        // the moves are only a part of the full defragmentation (see defrag_prepare)
+        bool partial = false;
+
+        // copy the cells in the background - the cells stay in place until the copy is done (see defrag_commit())
+        bool background = false;
     };
 
+    struct migrate_info {
+        bool empty() const {
+            return ids.empty() && !commit;
+        }
+
+        // contains information about which cell of the hot tier moves to which cell of the cold tier:
+        //  - hot cell ids[k].first moves to cold cell ids[k].second
+        //  - sorted by the hot cell index
+        std::vector<std::pair<uint32_t, uint32_t>> ids;
+
+        // copy the cells in the background - the cells stay in the hot tier until the copy is done (see migrate_commit())
+        bool background = false;
+
+        // move the cells of the pending background migration to the cold tier before the new moves
+        bool commit = false;
+    };
+
+    // when kv_size_cold > 0, the cache is split in two tiers:
+    //  - the hot tier (kv_size cells, type_k/type_v) receives all new tokens
+    //  - the cold tier (kv_size_cold cells, type_k_cold/type_v_cold) holds the older tokens, which are
+    //    moved out of the hot tier during the memory updates once the hot tier runs low on space
+    // the cold tier requires flash attention (v_trans == false) and host buffers: the cells are copied to the cold tier
+    // by a CPU backend on the worker threads of the context, while the next batches are computed
+    //
+    // the defragmentation is computed in the same way when the cache is in host memory, without SWA, streaming or cold
+    // tier - the new tokens are then never placed in the occupied cells, so the moved cells stay valid during the copy
+    //
+    // when n_stream_window > 0, the cache works as a streaming (attention sink) cache:
+    //  - each sequence keeps its first n_stream_sink cells plus its n_stream_window most recent cells
+    //  - older cells are evicted before each ubatch is placed (see stream_evict())
+    //  - the positions of the window cells are moved down to the sink cells in bulk, once the gap between them
+    //    reaches n_stream_window/2 - the RoPE delta is then applied by the K-shift of the next update
     llama_kv_cache_unified(
             const llama_model &  model,
               layer_filter_cb && filter,
@@ -48,9 +90,14 @@ public:
                      uint32_t    n_seq_max,
                      uint32_t    n_pad,
                      uint32_t    n_swa,
-               llama_swa_type    swa_type);
+               llama_swa_type    swa_type,
+                     uint32_t    kv_size_cold,
+                    ggml_type    type_k_cold,
+                    ggml_type    type_v_cold,
+                     uint32_t    n_stream_sink,
+                     uint32_t    n_stream_window);
 
-    ~llama_kv_cache_unified() = default;
+    ~llama_kv_cache_unified();
 
     //
     // llama_memory_i
@@ -67,6 +114,8 @@ public:
 
     bool get_can_shift() const override;
 
+    float get_fragmentation() const override;
+
     void clear(bool data) override;
 
     bool seq_rm  (llama_seq_id seq_id,                              llama_pos p0, llama_pos p1) override;
@@ -91,6 +140,9 @@ public:
 
     bool get_has_shift() const;
 
+    // the cold tier of the cache, or nullptr if the cache is not tiered
+    const llama_kv_cache_unified * get_cold() const;
+
     //
     // graph_build API
     //
@@ -113,7 +165,7 @@ public:
     // return empty vector on failure
     ubatch_heads prepare(const std::vector<llama_ubatch> & ubatches);
 
-    bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo);
+    bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo, const migrate_info & minfo);
 
     // return the cell position where we can insert the ubatch
     // return -1 on failure to find a contiguous slot of kv cells
@@ -122,14 +174,24 @@ public:
     // emplace the ubatch context into slot: [head_cur, head_cur + ubatch.n_tokens)
     void apply_ubatch(uint32_t head_cur, const llama_ubatch & ubatch);
 
+    // streaming cache: evict the oldest non-sink cells of the sequences in the ubatch, so that after placing the
+    // ubatch each sequence holds at most n_stream_sink + n_stream_window cells
+    void stream_evict(const llama_ubatch & ubatch);
+
     //
     // set_input API
     //
 
-    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
+    // with a cold tier, the first n_kv_cold columns of the mask correspond to the cold cells
+    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn, uint32_t n_kv_cold = 0) const;
     void set_input_k_shift   (ggml_tensor * dst) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
+    // move the destination of a store created by cpy_k()/cpy_v() to the provided head location
+    // used to store the next ubatch with a reused graph
+    void set_input_k_cpy(ggml_tensor * dst, int32_t il, uint32_t head_cur) const;
+    void set_input_v_cpy(ggml_tensor * dst, int32_t il, uint32_t head_cur) const;
+
 private:
     const llama_model & model;
     const llama_hparams & hparams;
@@ -157,6 +219,10 @@ private:
     // SWA
     const uint32_t n_swa = 0;
 
+    // streaming cache (see constructor)
+    const uint32_t n_stream_sink   = 0;
+    const uint32_t n_stream_window = 0;
+
     int debug = 0;
 
     const llama_swa_type swa_type = LLAMA_SWA_TYPE_NONE;
@@ -171,8 +237,82 @@ private:
     // model layer id -> KV cache layer id
     std::unordered_map<int32_t, int32_t> map_layer_ids;
 
+    // the cold tier (see constructor)
+    std::unique_ptr<llama_kv_cache_unified> cold;
+
+    // the last defrag step was partial - continue with the next update
+    bool defrag_partial = false;
+
+    // the defrag can be computed in the background (see constructor)
+    bool defrag_can_background = false;
+
+    // a defrag whose copies are computed in the background
+    struct defrag_job {
+        defrag_info dinfo;
+
+        ggml_context_ptr ctx; // views and copies of the defrag
+        ggml_cgraph *    gf = nullptr;
+
+        llama_thread_pool::task_ptr task;
+
+        // the destination cells - they are not used for new tokens until the job is committed
+        std::vector<bool> dst;
+    };
+
+    std::unique_ptr<defrag_job> defrag_pending;
+
+    // computes the copies of the background defrags (created on first use)
+    ggml_backend_ptr defrag_backend;
+
+    // a migration to the cold tier whose copies are computed in the background
+    struct migrate_job {
+        migrate_info minfo;
+
+        ggml_context_ptr ctx; // views and copies of the migration
+        ggml_cgraph *    gf = nullptr;
+
+        llama_thread_pool::task_ptr task;
+    };
+
+    std::unique_ptr<migrate_job> migrate_pending;
+
+    // computes the copies of the migrations
+    ggml_backend_ptr migrate_backend;
+
+    // copy the cells of minfo to the cold tier, on the worker threads of lctx if minfo.background is set
+    // return false if the copies could not be started
+    bool migrate_start(llama_context * lctx, const migrate_info & minfo);
+
+    // wait for the pending migration and move its cells to the cold tier
+    // must be called before any other change of the cells
+    void migrate_commit();
+
+    // copy the cells of dinfo on the worker threads of lctx
+    // return false if the copies could not be started
+    bool defrag_start(llama_context * lctx, const defrag_info & dinfo);
+
+    // wait for the pending defrag and move its cells
+    // must be called before any other change of the cells
+    void defrag_commit();
+
+    // streaming cache: close the position gaps left by the evicted cells
+    // return true if any positions were changed
+    bool stream_shift();
+
     // return non-empty vector if cells have been moved
-    defrag_info defrag_prepare(int32_t n_max_nodes) const;
+    // at most max_cells cells are moved - the remaining holes are left for the next steps
+    defrag_info defrag_prepare(int32_t n_max_nodes, uint32_t max_cells) const;
+
+    // select the oldest cells of the hot tier to move to the cold tier, so that at least n_free cells of the hot tier are free
+    // the cells of the pending migration count as moved
+    // return non-empty vector if cells have been moved
+    migrate_info migrate_prepare(uint32_t n_free, int32_t n_max_nodes) const;
+
+    void fill_kq_mask(float * data, int64_t n_kv, uint32_t j0, uint32_t n_cells, const llama_ubatch * ubatch, bool causal_attn) const;
+
+    // offset in bytes of the destination of cpy_k()/cpy_v() for the provided head location
+    size_t cpy_k_offs(int32_t il, uint32_t head_cur) const;
+    size_t cpy_v_offs(int32_t il, uint32_t head_cur) const;
 
     size_t total_size() const;
 
@@ -201,6 +341,11 @@ private:
                     ggml_cgraph * gf,
               const defrag_info & dinfo) const;
 
+    void build_graph_migrate(
+                   ggml_context * ctx,
+                    ggml_cgraph * gf,
+             const migrate_info & minfo) const;
+
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
@@ -213,6 +358,7 @@ public:
     // some shorthands
     using ubatch_heads = llama_kv_cache_unified::ubatch_heads;
     using defrag_info  = llama_kv_cache_unified::defrag_info;
+    using migrate_info = llama_kv_cache_unified::migrate_info;
 
     // used for errors
     llama_kv_cache_unified_context(llama_memory_status status);
@@ -226,7 +372,8 @@ public:
             llama_kv_cache_unified * kv,
             llama_context * lctx,
             bool do_shift,
-            defrag_info dinfo);
+            defrag_info dinfo,
+            migrate_info minfo);
 
     // used to create a batch procesing context from a batch
     llama_kv_cache_unified_context(
@@ -252,10 +399,17 @@ public:
 
     uint32_t get_n_kv() const;
 
+    // number of cells of the cold tier to attend, 0 if the cache is not tiered
+    uint32_t get_n_kv_cold() const;
+
     // get views of the current state of the cache
     ggml_tensor * get_k(ggml_context * ctx, int32_t il) const;
     ggml_tensor * get_v(ggml_context * ctx, int32_t il) const;
 
+    // get views of the current state of the cold tier
+    ggml_tensor * get_k_cold(ggml_context * ctx, int32_t il) const;
+    ggml_tensor * get_v_cold(ggml_context * ctx, int32_t il) const;
+
     // store k_cur and v_cur in the cache based on the provided head location
     ggml_tensor * cpy_k(ggml_context * ctx, ggml_tensor * k_cur, int32_t il) const;
     ggml_tensor * cpy_v(ggml_context * ctx, ggml_tensor * v_cur, int32_t il) const;
@@ -265,6 +419,10 @@ public:
     void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
+    // move the stores of cpy_k()/cpy_v() to the head location of the current ubatch
+    void set_input_k_cpy(ggml_tensor * dst, int32_t il) const;
+    void set_input_v_cpy(ggml_tensor * dst, int32_t il) const;
+
 private:
     llama_memory_status status;
 
@@ -279,6 +437,8 @@ private:
 
     defrag_info dinfo;
 
+    migrate_info minfo;
+
     //
     // batch processing context
     //
@@ -298,6 +458,9 @@ private:
     // as the cache gets filled, the benefit from this heuristic disappears
     int32_t n_kv;
 
+    // same for the cold tier
+    int32_t n_kv_cold = 0;
+
     // the beginning of the current slot in which the ubatch will be inserted
     int32_t head;
 };
@@ -8,6 +8,7 @@
 #include <vector>
 #include <set>
 #include <map>
+#include <iterator>
 
 // meta information about KV cells that can be part of multiple sequences at the same time
 // TODO: add unit tests
@@ -280,6 +281,25 @@ public:
         return seq_pos[seq_id].rbegin()->first;
     }
 
+    // the number of distinct positions of sequence seq_id currently present in the cells
+    uint32_t seq_pos_count(llama_seq_id seq_id) const {
+        assert(seq_id >= 0);
+        assert(seq_id < LLAMA_MAX_SEQ);
+
+        return seq_pos[seq_id].size();
+    }
+
+    // the n-th smallest distinct position of sequence seq_id
+    // note: call only if n < seq_pos_count(seq_id)
+    llama_pos seq_pos_nth(llama_seq_id seq_id, uint32_t n) const {
+        assert(n < seq_pos_count(seq_id));
+
+        auto it = seq_pos[seq_id].begin();
+        std::advance(it, n);
+
+        return it->first;
+    }
+
     // note: call only if the cell is not empty
     llama_pos pos_get(uint32_t i) const {
         assert(i < pos.size());
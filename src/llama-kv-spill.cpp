@@ -0,0 +1,293 @@
+#include "llama-kv-spill.h"
+
+#include "llama-impl.h"
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+            #include <fcntl.h>
+        #endif
+    #endif
+#endif
+
+//
+// llama_kv_spill
+//
+
+#if defined(_POSIX_MAPPED_FILES)
+
+struct llama_kv_spill::impl {
+    struct region {
+        size_t    offs;
+        size_t    size;        // size of the data
+        size_t    size_mapped; // page-aligned size of the region
+        uint8_t * addr;
+    };
+
+    impl(const char * dir) {
+        page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+        std::string dname = dir && dir[0] != '\0' ? dir : "";
+        if (dname.empty()) {
+            const char * tmpdir = getenv("TMPDIR");
+            dname = tmpdir && tmpdir[0] != '\0' ? tmpdir : "/tmp";
+        }
+
+        // a new file with a unique name, so that an existing file is never truncated or removed
+        std::string tmpl = dname + "/llama-kv-spill-XXXXXX";
+
+        std::vector<char> buf(tmpl.begin(), tmpl.end());
+        buf.push_back('\0');
+
+        fd = mkstemp(buf.data());
+        if (fd == -1) {
+            throw std::runtime_error(format("failed to create spill file %s: %s", tmpl.c_str(), strerror(errno)));
+        }
+
+        // the file is removed as soon as it is closed
+        unlink(buf.data());
+
+        LLAMA_LOG_INFO("llama_kv_spill: spilling idle sequences to a temporary file in %s\n", dname.c_str());
+    }
+
+    ~impl() {
+        for (auto & it : regions) {
+            munmap(it.second.addr, it.second.size_mapped);
+        }
+
+        close(fd);
+    }
+
+    uint8_t * alloc(llama_seq_id seq_id, size_t size) {
+        GGML_ASSERT(regions.find(seq_id) == regions.end());
+
+        const size_t n = GGML_PAD(std::max<size_t>(size, 1), page_size);
+
+        size_t offs = SIZE_MAX;
+
+        // first-fit in the free list
+        for (auto it = free_list.begin(); it != free_list.end(); ++it) {
+            if (it->second < n) {
+                continue;
+            }
+
+            offs = it->first;
+
+            if (it->second > n) {
+                free_list.emplace(offs + n, it->second - n);
+            }
+            free_list.erase(it);
+
+            break;
+        }
+
+        if (offs == SIZE_MAX) {
+            offs = file_size;
+
+            if (ftruncate(fd, offs + n) != 0) {
+                throw std::runtime_error(format("failed to grow spill file to %zu bytes: %s", offs + n, strerror(errno)));
+            }
+#if defined(__linux__)
+            // reserve the blocks now - running out of disk space while writing to the mapping would raise SIGBUS
+            const int err = posix_fallocate(fd, offs, n);
+            if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+                if (ftruncate(fd, offs) != 0) {
+                    LLAMA_LOG_WARN("%s: failed to shrink spill file: %s\n", __func__, strerror(errno));
+                }
+                throw std::runtime_error(format("failed to allocate %zu bytes in the spill file: %s", n, strerror(err)));
+            }
+#endif
+            file_size = offs + n;
+        }
+
+        void * addr = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offs);
+        if (addr == MAP_FAILED) {
+            const int err = errno;
+            free_range(offs, n);
+            throw std::runtime_error(format("failed to map %zu bytes of the spill file: %s", n, strerror(err)));
+        }
+
+        regions[seq_id] = { offs, size, n, (uint8_t *) addr };
+
+        return (uint8_t *) addr;
+    }
+
+    void evict(llama_seq_id seq_id) {
+        const auto & r = regions.at(seq_id);
+
+        if (msync(r.addr, r.size_mapped, MS_ASYNC) != 0) {
+            LLAMA_LOG_WARN("%s: msync failed: %s\n", __func__, strerror(errno));
+        }
+#ifdef MADV_DONTNEED
+        // for a shared file mapping this only drops the page table entries - dirty pages are still written back
+        if (madvise(r.addr, r.size_mapped, MADV_DONTNEED) != 0) {
+            LLAMA_LOG_WARN("%s: madvise(.., MADV_DONTNEED) failed: %s\n", __func__, strerror(errno));
+        }
+#endif
+    }
+
+    void prefetch(llama_seq_id seq_id) const {
+        const auto & r = regions.at(seq_id);
+
+#if defined(POSIX_FADV_WILLNEED)
+        // initiates a non-blocking read of the range into the page cache
+        const int err = posix_fadvise(fd, r.offs, r.size_mapped, POSIX_FADV_WILLNEED);
+        if (err != 0) {
+            LLAMA_LOG_WARN("%s: posix_fadvise(.., POSIX_FADV_WILLNEED) failed: %s\n", __func__, strerror(err));
+        }
+#endif
+#ifdef MADV_WILLNEED
+        if (madvise(r.addr, r.size_mapped, MADV_WILLNEED) != 0) {
+            LLAMA_LOG_WARN("%s: madvise(.., MADV_WILLNEED) failed: %s\n", __func__, strerror(errno));
+        }
+#endif
+    }
+
+    void release(llama_seq_id seq_id) {
+        auto it = regions.find(seq_id);
+        if (it == regions.end()) {
+            return;
+        }
+
+        const auto r = it->second;
+        regions.erase(it);
+
+        if (munmap(r.addr, r.size_mapped) != 0) {
+            LLAMA_LOG_WARN("%s: munmap failed: %s\n", __func__, strerror(errno));
+        }
+
+        free_range(r.offs, r.size_mapped);
+    }
+
+    // return the range to the free list, merge it with its neighbours and trim the tail of the file
+    void free_range(size_t offs, size_t n) {
+        auto it = free_list.emplace(offs, n).first;
+
+        {
+            auto next = std::next(it);
+            if (next != free_list.end() && it->first + it->second == next->first) {
+                it->second += next->second;
+                free_list.erase(next);
+            }
+        }
+
+        if (it != free_list.begin()) {
+            auto prev = std::prev(it);
+            if (prev->first + prev->second == it->first) {
+                prev->second += it->second;
+                free_list.erase(it);
+                it = prev;
+            }
+        }
+
+        if (it->first + it->second == file_size) {
+            file_size = it->first;
+            free_list.erase(it);
+
+            if (ftruncate(fd, file_size) != 0) {
+                LLAMA_LOG_WARN("%s: failed to shrink spill file: %s\n", __func__, strerror(errno));
+            }
+        }
+    }
+
+    int fd = -1;
+
+    size_t page_size = 0;
+    size_t file_size = 0;
+
+    std::map<llama_seq_id, region> regions;
+
+    // offset -> size of the unused ranges inside the file
+    std::map<size_t, size_t> free_list;
+};
+
+const bool llama_kv_spill::SUPPORTED = true;
+
+#else
+
+struct llama_kv_spill::impl {
+    struct region {
+        size_t    size;
+        uint8_t * addr;
+    };
+
+    impl(const char * dir) {
+        GGML_UNUSED(dir);
+
+        throw std::runtime_error("spilling sequences to disk is not supported on this platform");
+    }
+
+    uint8_t * alloc(llama_seq_id, size_t) {
+        throw std::runtime_error("spilling sequences to disk is not supported on this platform");
+    }
+
+    void evict(llama_seq_id) {}
+    void prefetch(llama_seq_id) const {}
+    void release(llama_seq_id) {}
+
+    std::map<llama_seq_id, region> regions;
+};
+
+const bool llama_kv_spill::SUPPORTED = false;
+
+#endif
+
+llama_kv_spill::llama_kv_spill(const char * dir) : pimpl(std::make_unique<impl>(dir)) {}
+llama_kv_spill::~llama_kv_spill() = default;
+
+uint8_t * llama_kv_spill::alloc(llama_seq_id seq_id, size_t size) {
+    return pimpl->alloc(seq_id, size);
+}
+
+void llama_kv_spill::evict(llama_seq_id seq_id) {
+    pimpl->evict(seq_id);
+}
+
+void llama_kv_spill::prefetch(llama_seq_id seq_id) const {
+    pimpl->prefetch(seq_id);
+}
+
+void llama_kv_spill::release(llama_seq_id seq_id) {
+    pimpl->release(seq_id);
+}
+
+bool llama_kv_spill::has(llama_seq_id seq_id) const {
+    return pimpl->regions.find(seq_id) != pimpl->regions.end();
+}
+
+const uint8_t * llama_kv_spill::data(llama_seq_id seq_id) const {
+    return pimpl->regions.at(seq_id).addr;
+}
+
+size_t llama_kv_spill::size(llama_seq_id seq_id) const {
+    return pimpl->regions.at(seq_id).size;
+}
+
+size_t llama_kv_spill::n_seq() const {
+    return pimpl->regions.size();
+}
+
+size_t llama_kv_spill::total_size() const {
+    size_t res = 0;
+
+    for (const auto & it : pimpl->regions) {
+        res += it.second.size;
+    }
+
+    return res;
+}
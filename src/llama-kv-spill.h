@@ -0,0 +1,58 @@
+#pragma once
+
+#include "llama.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+//
+// llama_kv_spill
+//
+
+// scratch file that holds the serialized state of idle sequences
+//
+// each spilled sequence owns a page-aligned region of the file, accessed through a shared memory mapping:
+//  - the state is serialized directly into the mapping (no intermediate buffer)
+//  - after the write, the resident pages are released and the kernel writes them back in the background,
+//    so the memory can be reclaimed under pressure
+//  - prefetch() starts an asynchronous read-ahead of the region, so that the data is (mostly) resident
+//    by the time the sequence is restored
+//
+// regions of released sequences are reused (first-fit) before the file is grown
+struct llama_kv_spill {
+    // the file is created with a unique name in dir and removed right away, so that it is deleted when it is closed
+    // dir == nullptr or empty: $TMPDIR (or /tmp)
+    llama_kv_spill(const char * dir);
+    ~llama_kv_spill();
+
+    // map a region of the given size for the sequence and return a writable pointer to it
+    // the sequence must not already have a region
+    uint8_t * alloc(llama_seq_id seq_id, size_t size);
+
+    // the data of the sequence has been written - schedule the write-back and drop the resident pages
+    void evict(llama_seq_id seq_id);
+
+    // start reading the data of the sequence in the background
+    void prefetch(llama_seq_id seq_id) const;
+
+    // unmap the region of the sequence and return it to the free list
+    void release(llama_seq_id seq_id);
+
+    bool has(llama_seq_id seq_id) const;
+
+    const uint8_t * data(llama_seq_id seq_id) const;
+    size_t          size(llama_seq_id seq_id) const;
+
+    // number of spilled sequences
+    size_t n_seq() const;
+
+    // total number of bytes currently held by spilled sequences
+    size_t total_size() const;
+
+    static const bool SUPPORTED;
+
+private:
+    struct impl;
+    std::unique_ptr<impl> pimpl;
+};
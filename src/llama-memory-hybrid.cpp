@@ -42,7 +42,12 @@ llama_memory_hybrid::llama_memory_hybrid(
         n_seq_max,
         n_pad,
         n_swa,
-        swa_type
+        swa_type,
+        0,
+        type_k,
+        type_v,
+        0,
+        0
     )),
     mem_recr(new llama_memory_recurrent(
         model,
@@ -114,6 +119,10 @@ bool llama_memory_hybrid::get_can_shift() const {
     return mem_attn->get_can_shift();
 }
 
+float llama_memory_hybrid::get_fragmentation() const {
+    return mem_attn->get_fragmentation();
+}
+
 void llama_memory_hybrid::clear(bool data) {
     mem_attn->clear(data);
     mem_recr->clear(data);
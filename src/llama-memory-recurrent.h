@@ -61,6 +61,8 @@ public:
 
     bool get_can_shift() const override;
 
+    float get_fragmentation() const override;
+
     // state write/load
 
     void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const override;
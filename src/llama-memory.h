@@ -2,6 +2,7 @@
 
 #include "llama.h"
 
+#include <functional>
 #include <memory>
 
 struct llama_ubatch;
@@ -16,6 +17,15 @@ struct llama_memory_params {
     ggml_type type_k;
     ggml_type type_v;
 
+    // tiered kv cache: number of recent cells kept in type_k/type_v, 0 = disabled
+    uint32_t  n_kv_hot;
+    ggml_type type_k_cold;
+    ggml_type type_v_cold;
+
+    // streaming kv cache: keep the first n_stream_sink + the last n_stream_window cells of each sequence, 0 = disabled
+    uint32_t n_stream_sink;
+    uint32_t n_stream_window;
+
     // use full-size SWA cache
     bool swa_full;
 };
@@ -81,6 +91,9 @@ struct llama_memory_i {
     // getters
     virtual bool get_can_shift() const = 0;
 
+    // fraction of the cells below the last used cell that are empty (0.0f = no holes)
+    virtual float get_fragmentation() const = 0;
+
     //
     // ops
     //
@@ -103,6 +116,25 @@ struct llama_memory_i {
 
     virtual void state_write(llama_io_write_i & io, llama_seq_id seq_id = -1) const = 0;
     virtual void state_read (llama_io_read_i  & io, llama_seq_id seq_id = -1) = 0;
+
+    //
+    // state held outside of the memory
+    //
+
+    // the context can move the state of idle sequences out of the memory (see llama_state_seq_spill)
+    // the public llama_memory_* ops call these hooks first, so that the moved state does not go stale:
+    //  - restore: the op uses the cells of the sequence - move its state back into the memory
+    //  - drop:    the op removes all cells of the sequence - discard its state, and the other per-sequence state of
+    //             the context (e.g. the logits subset)
+    //  - keep:    the op removes the cells of all other sequences - same as drop for each of them
+    // seq_id < 0: all sequences
+    struct spill_hooks {
+        std::function<void(llama_seq_id seq_id)> restore;
+        std::function<void(llama_seq_id seq_id)> drop;
+        std::function<void(llama_seq_id seq_id)> keep;
+    };
+
+    spill_hooks spill;
 };
 
 using llama_memory_ptr = std::unique_ptr<llama_memory_i>;
@@ -17,6 +17,9 @@
             #include <sys/mman.h>
             #include <fcntl.h>
         #endif
+        #if defined(__linux__)
+            #include <dirent.h>
+        #endif
         #if defined(_POSIX_MEMLOCK_RANGE)
             #include <sys/resource.h>
         #endif
@@ -94,6 +97,28 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        const int fd = fileno(fp);
+
+        uint8_t * dst = (uint8_t *) ptr;
+        while (len > 0) {
+            // a single pread transfers at most ~2 GiB on Linux
+            const ssize_t ret = pread(fd, dst, std::min<size_t>(len, 1u << 30), (off_t) offset);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            dst    += ret;
+            len    -= ret;
+            offset += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -146,6 +171,7 @@ int llama_file::file_id() const {
 
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
@@ -158,17 +184,36 @@ struct llama_mmap::impl {
 #ifdef _POSIX_MAPPED_FILES
     std::vector<std::pair<size_t, size_t>> mapped_fragments;
 
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, llama_hugepages_type hugepages) {
         size = file->size();
+        page_size = sysconf(_SC_PAGESIZE);
         int fd = file->file_id();
         int flags = MAP_SHARED;
         if (numa) { prefetch = 0; }
 #ifdef __linux__
+        if (hugepages == LLAMA_HUGEPAGES_TYPE_ANON) {
+            map_anon(file);
+            return;
+        }
         if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL)) {
             LLAMA_LOG_WARN("warning: posix_fadvise(.., POSIX_FADV_SEQUENTIAL) failed: %s\n",
                     strerror(errno));
         }
         if (prefetch) { flags |= MAP_POPULATE; }
+        addr = MAP_FAILED;
+        if (hugepages == LLAMA_HUGEPAGES_TYPE_FILE) {
+            // the page cache folios of the file can only be mapped with a single PMD entry if the
+            // virtual address and the file offset are congruent modulo the huge page size
+            addr = map_aligned(size, thp_page_size(), PROT_READ, flags, fd);
+            if (addr == MAP_FAILED) {
+                LLAMA_LOG_WARN("warning: huge page aligned mmap failed, using regular pages: %s\n", strerror(errno));
+            } else if (madvise(addr, size, MADV_HUGEPAGE)) {
+                LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+            }
+        }
+        if (addr == MAP_FAILED)
+#else
+        GGML_UNUSED(hugepages);
 #endif
         addr = mmap(NULL, file->size(), PROT_READ, flags, fd, 0);
         if (addr == MAP_FAILED) {
@@ -191,6 +236,126 @@ struct llama_mmap::impl {
         mapped_fragments.emplace_back(0, file->size());
     }
 
+#ifdef __linux__
+    static size_t read_sysfs_size(const char * path, size_t def) {
+        FILE * f = fopen(path, "r");
+        if (!f) {
+            return def;
+        }
+        size_t res = def;
+        if (fscanf(f, "%zu", &res) != 1) {
+            res = def;
+        }
+        fclose(f);
+        return res;
+    }
+
+    static size_t thp_page_size() {
+        return read_sysfs_size("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", 2u*1024*1024);
+    }
+
+    // the largest page size of the hugetlb pools with enough free pages to hold len bytes, 0 if there is none
+    static size_t hugetlb_page_size(size_t len) {
+        size_t res = 0;
+
+        DIR * dir = opendir("/sys/kernel/mm/hugepages");
+        if (!dir) {
+            return 0;
+        }
+        while (struct dirent * ent = readdir(dir)) {
+            size_t size_kb = 0;
+            if (sscanf(ent->d_name, "hugepages-%zukB", &size_kb) != 1) {
+                continue;
+            }
+            const size_t hpage = size_kb*1024;
+            const size_t n_free = read_sysfs_size(format("/sys/kernel/mm/hugepages/%s/free_hugepages", ent->d_name).c_str(), 0);
+            if (hpage > res && n_free*hpage >= GGML_PAD(len, hpage)) {
+                res = hpage;
+            }
+        }
+        closedir(dir);
+
+        return res;
+    }
+
+    // map len bytes at an address aligned to align, by reserving a larger range of address space and
+    // replacing the aligned part of it with the actual mapping
+    static void * map_aligned(size_t len, size_t align, int prot, int flags, int fd) {
+        const size_t len_resv = GGML_PAD(len, sysconf(_SC_PAGESIZE)) + align;
+
+        uint8_t * resv = (uint8_t *) mmap(NULL, len_resv, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (resv == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+        uint8_t * res = (uint8_t *) GGML_PAD((uintptr_t) resv, align);
+
+        if (mmap(res, len, prot, flags | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(resv, len_resv);
+            return MAP_FAILED;
+        }
+
+        // release the unused head and tail of the reservation
+        const size_t len_head = res - resv;
+        const size_t len_tail = len_resv - len_head - GGML_PAD(len, sysconf(_SC_PAGESIZE));
+        if (len_head > 0) {
+            munmap(resv, len_head);
+        }
+        if (len_tail > 0) {
+            munmap(resv + len_resv - len_tail, len_tail);
+        }
+
+        return res;
+    }
+
+    // copy the file into private anonymous memory, from a hugetlb pool when one has enough free pages, otherwise
+    // with transparent huge pages - unlike the page cache, this works regardless of the filesystem
+    void map_anon(struct llama_file * file) {
+        const char * kind = nullptr;
+
+        size_t len = 0;
+
+        const size_t hpage = hugetlb_page_size(size);
+        if (hpage > 0) {
+            len  = GGML_PAD(size, hpage);
+            addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (__builtin_ctzll(hpage) << MAP_HUGE_SHIFT), -1, 0);
+            if (addr != MAP_FAILED) {
+                // munmap of hugetlb memory works on whole huge pages
+                page_size = hpage;
+                kind = "hugetlb";
+            } else {
+                LLAMA_LOG_WARN("warning: mmap(.., MAP_HUGETLB) failed: %s\n", strerror(errno));
+            }
+        }
+
+        if (!kind) {
+            len  = GGML_PAD(size, page_size);
+            addr = map_aligned(len, thp_page_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1);
+            if (addr == MAP_FAILED) {
+                throw std::runtime_error(format("mmap failed: %s", strerror(errno)));
+            }
+            if (madvise(addr, len, MADV_HUGEPAGE)) {
+                LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+            }
+            kind = "transparent huge";
+        }
+
+        LLAMA_LOG_INFO("%s: copying %.2f MiB into anonymous memory backed by %s pages\n", __func__, size/1024.0/1024.0, kind);
+
+        try {
+            file->read_raw_at(addr, size, 0);
+        } catch (...) {
+            munmap(addr, len);
+            throw;
+        }
+
+        if (mprotect(addr, len, PROT_READ)) {
+            LLAMA_LOG_WARN("warning: mprotect failed: %s\n", strerror(errno));
+        }
+
+        mapped_fragments.emplace_back(0, len);
+    }
+#endif
+
     static void align_range(size_t * first, size_t * last, size_t page_size) {
         size_t offset_in_page = *first & (page_size - 1);
         size_t offset_to_page = offset_in_page == 0 ? 0 : page_size - offset_in_page;
@@ -204,7 +369,6 @@ struct llama_mmap::impl {
     }
 
     void unmap_fragment(size_t first, size_t last) {
-        int page_size = sysconf(_SC_PAGESIZE);
         align_range(&first, &last, page_size);
         size_t len = last - first;
 
@@ -239,6 +403,20 @@ struct llama_mmap::impl {
         mapped_fragments = std::move(new_mapped_fragments);
     }
 
+    void prefetch(size_t offset, size_t len) {
+        if (offset >= size) {
+            return;
+        }
+
+        const size_t first = offset & ~(page_size - 1);
+        const size_t last  = std::min(size, offset + len);
+
+        if (posix_madvise((uint8_t *) addr + first, last - first, POSIX_MADV_WILLNEED)) {
+            LLAMA_LOG_WARN("warning: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n",
+                    strerror(errno));
+        }
+    }
+
     ~impl() {
         for (const auto & frag : mapped_fragments) {
             if (munmap((char *) addr + frag.first, frag.second - frag.first)) {
@@ -247,8 +425,9 @@ struct llama_mmap::impl {
         }
     }
 #elif defined(_WIN32)
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, llama_hugepages_type hugepages) {
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         size = file->size();
 
@@ -296,6 +475,30 @@ struct llama_mmap::impl {
         GGML_UNUSED(last);
     }
 
+    void prefetch(size_t offset, size_t len) {
+        if (offset >= size) {
+            return;
+        }
+#if _WIN32_WINNT >= 0x602
+        BOOL (WINAPI *pPrefetchVirtualMemory) (HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+        HMODULE hKernel32 = GetModuleHandleW(L"kernel32.dll");
+
+        pPrefetchVirtualMemory = (decltype(pPrefetchVirtualMemory))(void *) GetProcAddress(hKernel32, "PrefetchVirtualMemory");
+
+        if (pPrefetchVirtualMemory) {
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = (uint8_t *) addr + offset;
+            range.NumberOfBytes = (SIZE_T) std::min(size - offset, len);
+            if (!pPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) {
+                LLAMA_LOG_WARN("warning: PrefetchVirtualMemory failed: %s\n",
+                        llama_format_win_err(GetLastError()).c_str());
+            }
+        }
+#else
+        GGML_UNUSED(len);
+#endif
+    }
+
     ~impl() {
         if (!UnmapViewOfFile(addr)) {
             LLAMA_LOG_WARN("warning: UnmapViewOfFile failed: %s\n",
@@ -303,10 +506,11 @@ struct llama_mmap::impl {
         }
     }
 #else
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, llama_hugepages_type hugepages) {
         GGML_UNUSED(file);
         GGML_UNUSED(prefetch);
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         throw std::runtime_error("mmap not supported");
     }
@@ -317,19 +521,26 @@ struct llama_mmap::impl {
 
         throw std::runtime_error("mmap not supported");
     }
+
+    void prefetch(size_t offset, size_t len) {
+        GGML_UNUSED(offset);
+        GGML_UNUSED(len);
+    }
 #endif
 
     void * addr;
     size_t size;
+    size_t page_size = 0; // granularity of unmap_fragment
 };
 
-llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa) : pimpl(std::make_unique<impl>(file, prefetch, numa)) {}
+llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa, llama_hugepages_type hugepages) : pimpl(std::make_unique<impl>(file, prefetch, numa, hugepages)) {}
 llama_mmap::~llama_mmap() = default;
 
 size_t llama_mmap::size() const { return pimpl->size; }
 void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
+void llama_mmap::prefetch(size_t offset, size_t len) { pimpl->prefetch(offset, len); }
 
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "llama.h"
+
 #include <cstdint>
 #include <memory>
 #include <vector>
@@ -24,6 +26,8 @@ struct llama_file {
     void seek(size_t offset, int whence) const;
 
     void read_raw(void * ptr, size_t len) const;
+    // read at an absolute offset without moving the file position - safe to call from multiple threads
+    void read_raw_at(void * ptr, size_t len, size_t offset) const;
     uint32_t read_u32() const;
 
     void write_raw(const void * ptr, size_t len) const;
@@ -36,7 +40,7 @@ private:
 
 struct llama_mmap {
     llama_mmap(const llama_mmap &) = delete;
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false);
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false, llama_hugepages_type hugepages = LLAMA_HUGEPAGES_TYPE_NONE);
     ~llama_mmap();
 
     size_t size() const;
@@ -44,6 +48,9 @@ struct llama_mmap {
 
     void unmap_fragment(size_t first, size_t last);
 
+    // ask the OS to read the range ahead, without waiting for it
+    void prefetch(size_t offset, size_t len);
+
     static const bool SUPPORTED;
 
 private:
@@ -1,11 +1,18 @@
 #include "llama-model-loader.h"
 
 #include "ggml.h"
+#include "llama-thread-pool.h"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstring>
 #include <future>
+#include <mutex>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -316,8 +323,9 @@ namespace GGUFMeta {
             result.clear();
 
             for (size_t i = 0; i < n_items; i++) {
-                const T value = gguf_get_arr_str(ctx, kid, i);
-                result.emplace_back(value);
+                size_t len = 0;
+                const char * str = gguf_get_arr_str_n(ctx, kid, i, &len);
+                result.emplace_back(str, len);
             }
         } else {
             result.resize(arr_info.length);
@@ -360,8 +368,9 @@ namespace GGUFMeta {
             const size_t n_items = gguf_get_arr_n(ctx, kid);
 
             for (size_t i = 0; i < n_items; i++) {
-                const T value = gguf_get_arr_str(ctx, kid, i);
-                result[i] = value;
+                size_t len = 0;
+                const char * str = gguf_get_arr_str_n(ctx, kid, i, &len);
+                result[i].assign(str, len);
             }
         } else {
             std::copy((const T*)arr_info.data, (const T *)arr_info.data + arr_info.length, result.begin());
@@ -686,8 +695,8 @@ llama_model_loader::llama_model_loader(
                 ? format("%s[%s,%zu]", gguf_type_name(type), gguf_type_name(gguf_get_arr_type(meta.get(), i)), gguf_get_arr_n(meta.get(), i))
                 : gguf_type_name(type);
 
-            std::string value          = gguf_kv_to_str(meta.get(), i);
             const size_t MAX_VALUE_LEN = 40;
+            std::string value          = gguf_kv_to_str(meta.get(), i, MAX_VALUE_LEN);
             if (value.size() > MAX_VALUE_LEN) {
                 value = format("%s...", value.substr(0, MAX_VALUE_LEN - 3).c_str());
             }
@@ -706,6 +715,26 @@ llama_model_loader::llama_model_loader(
         }
     }
 
+    // tensors stored in a repacked CPU layout
+    {
+        std::vector<std::string> names;
+        std::vector<std::string> layouts;
+
+        if (get_arr(LLM_KV_REPACK_TENSORS, names, false)) {
+            get_arr(LLM_KV_REPACK_LAYOUTS, layouts, true);
+
+            if (names.size() != layouts.size()) {
+                throw std::runtime_error(format("%s: %zu repacked tensors but %zu layouts", __func__, names.size(), layouts.size()));
+            }
+
+            for (size_t i = 0; i < names.size(); ++i) {
+                repack_layouts[names[i]] = layouts[i];
+            }
+
+            LLAMA_LOG_INFO("%s: %zu tensors are stored in a repacked CPU layout\n", __func__, repack_layouts.size());
+        }
+    }
+
     if (!llama_mmap::SUPPORTED) {
         LLAMA_LOG_WARN("%s: mmap is not supported on this platform\n", __func__);
         use_mmap = false;
@@ -748,6 +777,15 @@ struct ggml_tensor * llama_model_loader::get_tensor_meta(const char * name) cons
     return weight->tensor;
 }
 
+const char * llama_model_loader::get_repack_layout(const std::string & name) const {
+    const auto it = repack_layouts.find(name);
+    if (it == repack_layouts.end()) {
+        return nullptr;
+    }
+
+    return it->second.c_str();
+}
+
 struct ggml_tensor * llama_model_loader::require_tensor_meta(const std::string & name) const {
     struct ggml_tensor * tensor = get_tensor_meta(name.c_str());
     if (!tensor) {
@@ -842,7 +880,11 @@ void llama_model_loader::done_getting_tensors() const {
     }
 }
 
-void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps) {
+void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps, llama_hugepages_type hugepages) {
+    if (!use_mmap && hugepages != LLAMA_HUGEPAGES_TYPE_NONE) {
+        LLAMA_LOG_WARN("%s: huge pages are only used for mmap-ed weights, ignoring\n", __func__);
+    }
+
     if (use_mmap) {
         mappings.reserve(files.size());
         mmaps_used.reserve(files.size());
@@ -858,7 +900,7 @@ void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps
                 }
             }
 
-            std::unique_ptr<llama_mmap> mapping = std::make_unique<llama_mmap>(file.get(), prefetch ? -1 : 0, is_numa);
+            std::unique_ptr<llama_mmap> mapping = std::make_unique<llama_mmap>(file.get(), prefetch ? -1 : 0, is_numa, hugepages);
             mmaps_used.emplace_back(mapping->size(), 0);
             if (mlock_mmaps) {
                 std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
@@ -915,6 +957,26 @@ void llama_model_loader::load_data_for(struct ggml_tensor * cur) const {
     }
 }
 
+void llama_model_loader::prefetch_data_for(const struct ggml_tensor * cur) const {
+    if (!use_mmap) {
+        return;
+    }
+
+    const auto & w = require_weight(ggml_get_name(cur));
+
+    mappings.at(w.idx)->prefetch(w.offs, ggml_nbytes(cur));
+}
+
+// number of threads that read the tensor data when mmap is disabled
+// override with LLAMA_LOAD_THREADS, 0 reads everything on the calling thread
+static int llama_model_loader_n_threads() {
+    if (const char * env = getenv("LLAMA_LOAD_THREADS")) {
+        return std::max(0, atoi(env));
+    }
+
+    return (int) std::min(8u, std::max(1u, std::thread::hardware_concurrency()));
+}
+
 bool llama_model_loader::load_all_data(
         struct ggml_context * ctx,
         llama_buf_map & bufs,
@@ -1015,6 +1077,132 @@ bool llama_model_loader::load_all_data(
             ggml_backend_name(upload_backend));
     }
 
+    // without mmap, the tensors in CPU memory are read by a pool of threads with positional reads, so that many
+    // requests are in flight at once and the validation and the CPU repacking of a tensor overlap with the reads
+    // of the others. the tensors of the other devices are still loaded by this thread, concurrently with the pool
+    const int n_load_threads = use_mmap ? 0 : llama_model_loader_n_threads();
+
+    auto load_in_pool = [&](const ggml_tensor * cur) {
+        if (n_load_threads == 0 || cur->buffer == nullptr) {
+            return false;
+        }
+        if (ggml_backend_buffer_is_host(cur->buffer)) {
+            return true;
+        }
+        // e.g. the repacked CPU buffer types - set_tensor converts the data on the calling thread
+        auto * dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(cur->buffer));
+        return dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU;
+    };
+
+    struct load_job {
+        ggml_tensor       * cur;
+        const llama_file  * file;
+        size_t              offs;
+        size_t              n_size;
+    };
+
+    std::vector<load_job> load_jobs;
+    size_t load_jobs_size = 0;
+
+    for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
+        const auto * weight = get_weight(ggml_get_name(cur));
+        if (weight == nullptr || !load_in_pool(cur)) {
+            continue;
+        }
+
+        load_jobs.push_back({ cur, files.at(weight->idx).get(), weight->offs, ggml_nbytes(cur) });
+        load_jobs_size += ggml_nbytes(cur);
+    }
+
+    // read the files front to back
+    std::sort(load_jobs.begin(), load_jobs.end(), [](const load_job & a, const load_job & b) {
+        return a.file != b.file ? a.file < b.file : a.offs < b.offs;
+    });
+
+    std::atomic<bool>   load_failed    = false;
+    std::atomic<size_t> load_next      = 0;
+    std::atomic<size_t> load_n_done    = 0;
+    std::atomic<size_t> load_size_done = 0;
+
+    std::mutex              load_mutex;
+    std::condition_variable load_cv;
+    std::string             load_error;
+
+    auto load_worker = [&]() {
+        // the reads are split in chunks so that the progress is reported smoothly for large tensors
+        constexpr size_t chunk_size = 16*MiB;
+
+        std::vector<no_init<uint8_t>> buf;
+
+        while (!load_failed) {
+            const size_t i = load_next++;
+            if (i >= load_jobs.size()) {
+                break;
+            }
+
+            const auto & job = load_jobs[i];
+
+            try {
+                const bool is_host = ggml_backend_buffer_is_host(job.cur->buffer);
+
+                uint8_t * dst = (uint8_t *) job.cur->data;
+                if (!is_host) {
+                    buf.resize(job.n_size);
+                    dst = (uint8_t *) buf.data();
+                }
+
+                for (size_t offs = 0; offs < job.n_size && !load_failed; offs += chunk_size) {
+                    const size_t n = std::min(chunk_size, job.n_size - offs);
+
+                    job.file->read_raw_at(dst + offs, n, job.offs + offs);
+                    load_size_done += n;
+                }
+
+                if (check_tensors && !ggml_validate_row_data(job.cur->type, dst, job.n_size)) {
+                    throw std::runtime_error(format("tensor '%s' has invalid data", ggml_get_name(job.cur)));
+                }
+
+                if (!is_host) {
+                    ggml_backend_tensor_set(job.cur, dst, 0, job.n_size);
+                }
+            } catch (const std::exception & err) {
+                std::lock_guard<std::mutex> lock(load_mutex);
+                if (load_error.empty()) {
+                    load_error = err.what();
+                }
+                load_failed = true;
+            }
+
+            load_n_done++;
+            load_cv.notify_one();
+        }
+    };
+
+    const int n_threads = load_jobs.empty() ? 0 : std::min<int>(n_load_threads, load_jobs.size());
+
+    llama_thread_pool pool(n_threads);
+
+    std::vector<llama_thread_pool::task_ptr> load_tasks;
+
+    // stops the reads on every exit path, including cancellation and exceptions - destroyed before the pool, which
+    // then waits for the tasks
+    struct load_stop {
+        std::atomic<bool> & stop;
+
+        ~load_stop() {
+            stop = true;
+        }
+    } stop { load_failed };
+
+    if (n_threads > 0) {
+        LLAMA_LOG_DEBUG("%s: reading %zu tensors (%.2f MiB) with %d threads\n", __func__,
+                load_jobs.size(), load_jobs_size/1024.0/1024.0, n_threads);
+
+        for (int i = 0; i < n_threads; ++i) {
+            load_tasks.push_back(pool.submit(load_worker));
+        }
+    }
+
     for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
         const auto * weight = get_weight(ggml_get_name(cur));
         if (weight == nullptr) {
@@ -1022,8 +1210,12 @@ bool llama_model_loader::load_all_data(
             continue;
         }
 
+        if (load_in_pool(cur)) {
+            continue;
+        }
+
         if (progress_callback) {
-            if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
+            if (!progress_callback((float) (size_done + load_size_done) / size_data, progress_callback_user_data)) {
                 return false;
             }
         }
@@ -1102,6 +1294,31 @@ bool llama_model_loader::load_all_data(
         size_done += n_size;
     }
 
+    while (load_n_done < load_jobs.size() && !load_failed) {
+        {
+            std::unique_lock<std::mutex> lock(load_mutex);
+            load_cv.wait_for(lock, std::chrono::milliseconds(100), [&] {
+                return load_n_done == load_jobs.size() || load_failed;
+            });
+        }
+
+        if (progress_callback) {
+            if (!progress_callback((float) (size_done + load_size_done) / size_data, progress_callback_user_data)) {
+                return false;
+            }
+        }
+    }
+
+    for (const auto & t : load_tasks) {
+        llama_thread_pool::wait(t);
+    }
+
+    if (load_failed) {
+        throw std::runtime_error(load_error);
+    }
+
+    size_done += load_jobs_size;
+
     // free temporary resources used for async uploads
     for (auto * event : events) {
         ggml_backend_event_synchronize(event);
@@ -78,6 +78,9 @@ struct llama_model_loader {
     llama_mmaps mappings;
 
     std::map<std::string, llama_tensor_weight, weight_name_comparer> weights_map;
+
+    // tensor name -> CPU repack layout, for the tensors stored already interleaved (see tools/repack)
+    std::unordered_map<std::string, std::string> repack_layouts;
     std::unordered_map<std::string, llama_model_kv_override> kv_overrides;
     const llama_model_tensor_buft_override * tensor_buft_overrides;
 
@@ -138,6 +141,9 @@ struct llama_model_loader {
 
     struct ggml_tensor * get_tensor_meta(const char * name) const;
 
+    // layout of a tensor stored in the repacked CPU layout, nullptr for the regular tensors
+    const char * get_repack_layout(const std::string & name) const;
+
     struct ggml_tensor * require_tensor_meta(const std::string & name) const;
 
     const struct ggml_tensor * check_tensor_dims(const std::string & name, const std::vector<int64_t> & ne, bool required) const;
@@ -148,13 +154,16 @@ struct llama_model_loader {
 
     void done_getting_tensors() const;
 
-    void init_mappings(bool prefetch = true, llama_mlocks * mlock_mmaps = nullptr);
+    void init_mappings(bool prefetch = true, llama_mlocks * mlock_mmaps = nullptr, llama_hugepages_type hugepages = LLAMA_HUGEPAGES_TYPE_NONE);
 
     void get_mapping_range(size_t * first, size_t * last, void ** addr, int idx, ggml_context * ctx) const;
 
     // for backwards compatibility, does not support ggml-backend
     void load_data_for(struct ggml_tensor * cur) const;
 
+    // with mmap, start reading the data of the tensor in the background so that load_data_for() does not wait for it
+    void prefetch_data_for(const struct ggml_tensor * cur) const;
+
     // Returns false if cancelled by progress_callback
     bool load_all_data(
             struct ggml_context * ctx,
@@ -4,6 +4,7 @@
 #include "llama-mmap.h"
 #include "llama-batch.h"
 #include "llama-cparams.h"
+#include "llama-expert-pager.h"
 #include "llama-model-loader.h"
 
 #include "llama-kv-cache-unified.h"
@@ -12,6 +13,7 @@
 #include "llama-memory-recurrent.h"
 
 #include "ggml-cpp.h"
+#include "ggml-cpu.h"
 
 #include <algorithm>
 #include <cassert>
@@ -383,6 +385,9 @@ struct llama_model::impl {
     llama_mlocks mlock_bufs;
     llama_mlocks mlock_mmaps;
 
+    // residency of the mmap-ed MoE experts, see llama_model_params.expert_budget
+    std::unique_ptr<llama_expert_pager> expert_pager;
+
     // contexts where the model tensors metadata is stored
     std::vector<ggml_context_ptr> ctxs;
 
@@ -1614,6 +1619,30 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
     const auto TENSOR_DUPLICATED   = llama_model_loader::TENSOR_DUPLICATED;
     const auto TENSOR_NOT_REQUIRED = llama_model_loader::TENSOR_NOT_REQUIRED;
 
+    // weights stored in the repacked CPU layout skip the repacking: they are placed in the CPU_REPACKED buffer type,
+    // which takes the data as-is and can be backed directly by the mmap-ed file
+    ggml_backend_buffer_type_t buft_repack   = nullptr;
+    ggml_backend_buffer_type_t buft_repacked = nullptr;
+
+    auto * repack_layout_fn = (ggml_backend_cpu_repack_layout_t)
+        ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), "ggml_backend_cpu_repack_layout");
+    auto * repacked_buffer_from_ptr_fn = (ggml_backend_cpu_repacked_buffer_from_ptr_t)
+        ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), "ggml_backend_cpu_repacked_buffer_from_ptr");
+
+    if (!ml.repack_layouts.empty()) {
+        auto * buft_repack_fn = (ggml_backend_cpu_repack_buffer_type_t)
+            ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), "ggml_backend_cpu_repack_buffer_type");
+        auto * buft_repacked_fn = (ggml_backend_cpu_repack_buffer_type_t)
+            ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), "ggml_backend_cpu_repacked_buffer_type");
+
+        if (!buft_repack_fn || !buft_repacked_fn || !repack_layout_fn || !repacked_buffer_from_ptr_fn) {
+            throw std::runtime_error("the model contains repacked tensors, but the CPU backend was built without repacking support");
+        }
+
+        buft_repack   = buft_repack_fn();
+        buft_repacked = buft_repacked_fn();
+    }
+
     // create tensors for the weights
     {
         // note: cast to int64_t since we will use these for the tensor dimensions
@@ -1758,6 +1787,17 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                 }
             }
 
+            if (const char * layout = ml.get_repack_layout(tn.str())) {
+                // the interleaved data can only be used by the same kernels that would have produced it
+                const char * layout_cur = buft == buft_repack ? repack_layout_fn(t_meta) : nullptr;
+                if (layout_cur == nullptr || strcmp(layout, layout_cur) != 0) {
+                    throw std::runtime_error(format("tensor '%s' is stored in the repacked CPU layout %s, but it would be loaded as %s in buffer type %s"
+                                " - repack the original model on this machine or load it without offloading",
+                                tn.str().c_str(), layout, layout_cur ? layout_cur : "is", ggml_backend_buft_name(buft)));
+                }
+                buft = buft_repacked;
+            }
+
             ggml_context * ctx = ctx_for_buft(buft);
 
             // if duplicated, check if the original tensor was allocated in the same buffer type context and avoid creating a new one
@@ -4285,7 +4325,15 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
     ml.done_getting_tensors();
 
-    ml.init_mappings(true, use_mlock ? &pimpl->mlock_mmaps : nullptr);
+    // the experts can only be paged from a file mapping, the page cache is not shared with an anonymous copy
+    const bool use_expert_pager = params.expert_budget > 0 && hparams.n_expert > 0 && ml.use_mmap && !use_mlock &&
+        params.hugepages != LLAMA_HUGEPAGES_TYPE_ANON && llama_expert_pager::SUPPORTED;
+    if (params.expert_budget > 0 && hparams.n_expert > 0 && !use_expert_pager) {
+        LLAMA_LOG_WARN("%s: expert paging requires mmap without mlock or anonymous huge pages, ignoring the expert budget\n", __func__);
+    }
+
+    // do not prefetch the whole file when only a part of the experts is supposed to be resident
+    ml.init_mappings(!use_expert_pager, use_mlock ? &pimpl->mlock_mmaps : nullptr, params.hugepages);
     pimpl->mappings.reserve(ml.mappings.size());
 
     // create the backend buffers
@@ -4321,8 +4369,9 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         ggml_backend_dev_get_props(dev, &props);
         bool buffer_from_host_ptr_supported = props.caps.buffer_from_host_ptr;
         bool is_default_buft = buft == ggml_backend_dev_buffer_type(dev);
+        bool is_repacked_buft = buft_repacked && buft == buft_repacked;
 
-        if (ml.use_mmap && use_mmap_buffer && buffer_from_host_ptr_supported && is_default_buft) {
+        if (ml.use_mmap && use_mmap_buffer && ((buffer_from_host_ptr_supported && is_default_buft) || is_repacked_buft)) {
             for (uint32_t idx = 0; idx < ml.files.size(); idx++) {
                 // only the mmap region containing the tensors in the model is mapped to the backend buffer
                 // this is important for metal with apple silicon: if the entire model could be mapped to a metal buffer, then we could just use metal for all layers
@@ -4334,7 +4383,9 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
                     continue;
                 }
                 const size_t max_size = ggml_get_max_tensor_size(ctx);
-                ggml_backend_buffer_t buf = ggml_backend_dev_buffer_from_host_ptr(dev, (char *) addr + first, last - first, max_size);
+                ggml_backend_buffer_t buf = is_repacked_buft
+                    ? repacked_buffer_from_ptr_fn((char *) addr + first, last - first)
+                    : ggml_backend_dev_buffer_from_host_ptr(dev, (char *) addr + first, last - first, max_size);
                 if (buf == nullptr) {
                     throw std::runtime_error(format("unable to allocate %s buffer", ggml_backend_buft_name(buft)));
                 }
@@ -4413,6 +4464,39 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
         }
     }
 
+    if (use_expert_pager) {
+        pimpl->expert_pager = std::make_unique<llama_expert_pager>(params.expert_budget, hparams.n_layer, hparams.n_expert);
+
+        // experts offloaded to a device or repacked into a CPU buffer are always resident
+        auto is_mapped = [&](const ggml_tensor * t) {
+            for (const auto & mapping : pimpl->mappings) {
+                const uint8_t * addr = (const uint8_t *) mapping->addr();
+                if ((const uint8_t *) t->data >= addr && (const uint8_t *) t->data + ggml_nbytes(t) <= addr + mapping->size()) {
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        size_t size_paged = 0;
+        for (int il = 0; il < (int) hparams.n_layer; ++il) {
+            for (const ggml_tensor * t : { layers[il].ffn_up_exps, layers[il].ffn_gate_exps, layers[il].ffn_down_exps }) {
+                if (t && t->data && ggml_backend_buffer_is_host(t->buffer) && is_mapped(t)) {
+                    pimpl->expert_pager->add_tensor(il, t);
+                    size_paged += ggml_nbytes(t);
+                }
+            }
+        }
+
+        if (pimpl->expert_pager->n_tensors() == 0) {
+            LLAMA_LOG_WARN("%s: no expert tensor is memory-mapped, expert paging disabled\n", __func__);
+            pimpl->expert_pager.reset();
+        } else {
+            LLAMA_LOG_INFO("%s: paging %zu expert tensors (%.2f MiB) with a budget of %.2f MiB\n", __func__,
+                    pimpl->expert_pager->n_tensors(), size_paged/1024.0/1024.0, params.expert_budget/1024.0/1024.0);
+        }
+    }
+
     return true;
 }
 
@@ -4653,6 +4737,10 @@ bool llama_model::has_tensor_overrides() const {
     return pimpl->has_tensor_overrides;
 }
 
+llama_expert_pager * llama_model::get_expert_pager() const {
+    return pimpl->expert_pager.get();
+}
+
 const ggml_tensor * llama_model::get_tensor(const char * name) const {
     auto it = std::find_if(tensors_by_name.begin(), tensors_by_name.end(),
             [name](const std::pair<std::string, ggml_tensor *> & it) {
@@ -13767,6 +13855,10 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
         // checks
         default:
             {
+                if (params.n_stream_window > 0 && (llm_arch_is_recurrent(arch) || llm_arch_is_hybrid(arch) || hparams.swa_type != LLAMA_SWA_TYPE_NONE)) {
+                    LLAMA_LOG_WARN("%s: the streaming KV cache is not supported with recurrent, hybrid or SWA models - disabled\n", __func__);
+                }
+
                 if (llm_arch_is_recurrent(arch)) {
                     res = new llama_memory_recurrent(
                             *this,
@@ -13819,6 +13911,40 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                     } else {
                         GGML_ASSERT(!hparams.is_swa_any());
 
+                        // tiered cache: the hot tier holds the recent cells plus room for one batch,
+                        //               the cold tier can hold the full context
+                        uint32_t kv_size      = cparams.n_ctx;
+                        uint32_t kv_size_cold = 0;
+
+                        if (params.n_kv_hot > 0) {
+                            const uint32_t kv_size_hot = GGML_PAD(params.n_kv_hot + cparams.n_batch, padding);
+
+                            if (kv_size_hot < cparams.n_ctx) {
+                                kv_size      = kv_size_hot;
+                                kv_size_cold = cparams.n_ctx;
+                            } else {
+                                LLAMA_LOG_WARN("%s: n_kv_hot + n_batch >= n_ctx - the tiered KV cache is disabled\n", __func__);
+                            }
+                        }
+
+                        // streaming cache: between the batches each sequence holds at most n_stream_sink + n_stream_window
+                        //                  cells, the cells of the current batch come on top of that
+                        uint32_t n_stream_window = params.n_stream_window;
+
+                        if (n_stream_window > 0 && kv_size_cold > 0) {
+                            LLAMA_LOG_WARN("%s: the streaming KV cache is not supported with the tiered KV cache - disabled\n", __func__);
+                            n_stream_window = 0;
+                        }
+
+                        if (n_stream_window > 0) {
+                            const uint32_t n_needed = cparams.n_seq_max*(params.n_stream_sink + n_stream_window) + cparams.n_batch;
+
+                            if (n_needed > kv_size) {
+                                LLAMA_LOG_WARN("%s: n_ctx = %u is too small for the streaming KV cache (need %u) - disabled\n", __func__, kv_size, n_needed);
+                                n_stream_window = 0;
+                            }
+                        }
+
                         res = new llama_kv_cache_unified(
                                 *this,
                                 nullptr,
@@ -13826,11 +13952,18 @@ llama_memory_i * llama_model::create_memory(const llama_memory_params & params,
                                 params.type_v,
                                 !cparams.flash_attn,
                                 cparams.offload_kqv,
-                                cparams.n_ctx,
+                                kv_size,
                                 cparams.n_seq_max,
                                 padding,
                                 hparams.n_swa,
-                                hparams.swa_type);
+                                hparams.swa_type,
+                                kv_size_cold,
+                                params.type_k_cold,
+                                params.type_v_cold,
+                                params.n_stream_sink,
+                                n_stream_window);
+
+                        cparams.n_stream_window = n_stream_window;
                     }
                 }
             }
@@ -14126,6 +14259,12 @@ llm_graph_result_ptr llama_model::build_graph(
     // add on pooling layer
     llm->build_pooling(gf, cls, cls_b, cls_out, cls_out_b);
 
+    // the rows of the logits subsets are gathered in build_lora_mm(model.output, ...) - the result must be the logits
+    GGML_ASSERT(llm->res->logits_rows.empty() || (llm->res->t_logits && llm->res->t_logits->ne[0] == (int64_t) llm->res->logits_rows.size()));
+
+    // select the candidates for sampling
+    llm->build_logits_top_k(gf);
+
     return std::move(llm->res);
 }
 
@@ -14144,6 +14283,8 @@ llama_model_params llama_model_default_params() {
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
+        /*.hugepages                   =*/ LLAMA_HUGEPAGES_TYPE_NONE,
+        /*.expert_budget               =*/ 0,
         /*.vocab_only                  =*/ false,
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
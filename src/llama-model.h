@@ -15,6 +15,7 @@
 struct llama_cparams;
 struct llama_ubatch;
 struct llama_model_loader;
+struct llama_expert_pager;
 
 // available models
 enum llm_type {
@@ -402,6 +403,9 @@ struct llama_model {
 
     const struct ggml_tensor * get_tensor(const char * name) const;
 
+    // nullptr if the expert weights are not paged
+    llama_expert_pager * get_expert_pager() const;
+
     float get_rope_freq_base (const llama_cparams & cparams, int il) const;
     float get_rope_freq_scale(const llama_cparams & cparams, int il) const;
 
@@ -2,12 +2,16 @@
 #include "llama-impl.h"
 #include "llama-model.h"
 #include "llama-model-loader.h"
+#include "llama-thread-pool.h"
 
 #include <algorithm>
+#include <array>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
 #include <cinttypes>
 #include <fstream>
+#include <functional>
 #include <mutex>
 #include <regex>
 #include <thread>
@@ -20,9 +24,11 @@ struct tensor_quantization {
 };
 
 static void zeros(std::ofstream & file, size_t n) {
-    char zero = 0;
-    for (size_t i = 0; i < n; ++i) {
-        file.write(&zero, 1);
+    static const char zero[4096] = {};
+    while (n > 0) {
+        const size_t n_cur = std::min(n, sizeof(zero));
+        file.write(zero, n_cur);
+        n -= n_cur;
     }
 }
 
@@ -104,7 +110,7 @@ struct quantize_state_impl {
 };
 
 static void llama_tensor_dequantize_impl(
-    ggml_tensor * tensor, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
+    ggml_tensor * tensor, std::vector<no_init<float>> & output, llama_thread_pool & pool,
     const size_t nelements, const int nthread
 ) {
     if (output.size() < nelements) {
@@ -150,29 +156,21 @@ static void llama_tensor_dequantize_impl(
     size_t blocks_per_thread = nblocks / nthread;
     size_t spare_blocks = nblocks - (blocks_per_thread * nthread); // if blocks aren't divisible by thread count
 
-    size_t in_buff_offs = 0;
-    size_t out_buff_offs = 0;
-
-    for (int tnum = 0; tnum < nthread; tnum++) {
+    pool.parallel_for(nthread, [&](int64_t tnum) {
         size_t thr_blocks = blocks_per_thread + (tnum == nthread - 1 ? spare_blocks : 0); // num blocks for this thread
         size_t thr_elems = thr_blocks * block_size; // number of elements for this thread
-        size_t thr_block_bytes = thr_blocks * block_size_bytes; // number of input bytes for this thread
 
-        auto compute = [qtype] (ggml_type typ, uint8_t * inbuf, float * outbuf, int nels) {
-            if (typ == GGML_TYPE_F16) {
-                ggml_fp16_to_fp32_row((ggml_fp16_t *)inbuf, outbuf, nels);
-            } else if (typ == GGML_TYPE_BF16) {
-                ggml_bf16_to_fp32_row((ggml_bf16_t *)inbuf, outbuf, nels);
-            } else {
-                qtype->to_float(inbuf, outbuf, nels);
-            }
-        };
-        workers.emplace_back(compute, tensor->type, (uint8_t *) tensor->data + in_buff_offs, f32_output + out_buff_offs, thr_elems);
-        in_buff_offs += thr_block_bytes;
-        out_buff_offs += thr_elems;
-    }
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
+        const uint8_t * inbuf  = (const uint8_t *) tensor->data + tnum * blocks_per_thread * block_size_bytes;
+        float         * outbuf = f32_output + tnum * blocks_per_thread * block_size;
+
+        if (tensor->type == GGML_TYPE_F16) {
+            ggml_fp16_to_fp32_row((const ggml_fp16_t *) inbuf, outbuf, thr_elems);
+        } else if (tensor->type == GGML_TYPE_BF16) {
+            ggml_bf16_to_fp32_row((const ggml_bf16_t *) inbuf, outbuf, thr_elems);
+        } else {
+            qtype->to_float(inbuf, outbuf, thr_elems);
+        }
+    }, nthread);
 }
 
 static ggml_type llama_tensor_get_type(quantize_state_impl & qs, ggml_type new_type, const ggml_tensor * tensor, llama_ftype ftype) {
@@ -465,7 +463,7 @@ static ggml_type llama_tensor_get_type(quantize_state_impl & qs, ggml_type new_t
     return new_type;
 }
 
-static size_t llama_tensor_quantize_impl(enum ggml_type new_type, const float * f32_data, void * new_data, const int64_t chunk_size, int64_t nrows, int64_t n_per_row, const float * imatrix, std::vector<std::thread> & workers, const int nthread) {
+static size_t llama_tensor_quantize_impl(enum ggml_type new_type, const float * f32_data, void * new_data, const int64_t chunk_size, int64_t nrows, int64_t n_per_row, const float * imatrix, llama_thread_pool & pool, const int nthread) {
     if (nthread < 2) {
         // single-thread
         size_t new_size = ggml_quantize_chunk(new_type, f32_data, new_data, 0, nrows, n_per_row, imatrix);
@@ -507,12 +505,7 @@ static size_t llama_tensor_quantize_impl(enum ggml_type new_type, const float *
             }
         }
     };
-    for (int it = 0; it < nthread - 1; ++it) {
-        workers.emplace_back(compute);
-    }
-    compute();
-    for (auto & w : workers) { w.join(); }
-    workers.clear();
+    pool.parallel_for(nthread, [&](int64_t) { compute(); }, nthread);
     if (!valid) {
         throw std::runtime_error("quantized data validation failed");
     }
@@ -614,7 +607,6 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         }
     }
 
-    const size_t align = GGUF_DEFAULT_ALIGNMENT;
     gguf_context_ptr ctx_out { gguf_init_empty() };
 
     std::vector<int> prune_list = {};
@@ -720,100 +712,28 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
     size_t total_size_org = 0;
     size_t total_size_new = 0;
 
-    std::vector<std::thread> workers;
-    workers.reserve(nthread);
-
-    int idx = 0;
+    // the output type of every tensor is decided before reading any data, so that the size of each output tensor,
+    // and thus the layout of the shards, is known up front and configuration errors are reported immediately
+    struct quantize_job {
+        const llama_model_loader::llama_tensor_weight * weight;
 
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
-    std::vector<no_init<float>> f32_conv_buf;
-
-    uint16_t n_split = 1;
-
-    // Assume split index is continuous
-    if (params->keep_split) {
-        for (const auto * it : tensors) {
-            n_split = std::max(uint16_t(it->idx + 1), n_split);
-        }
-    }
-    std::vector<gguf_context_ptr> ctx_outs(n_split);
-    ctx_outs[0] = std::move(ctx_out);
-
-    // populate the original tensors so we get an initial meta data
-    for (const auto * it : tensors) {
-        uint16_t i_split = params->keep_split ? it->idx : 0;
-        ggml_tensor * tensor = it->tensor;
-        if (!ctx_outs[i_split]) {
-            ctx_outs[i_split].reset(gguf_init_empty());
-        }
-        gguf_add_tensor(ctx_outs[i_split].get(), tensor);
-    }
-
-    // Set split info if needed
-    if (n_split > 1) {
-        for (size_t i = 0; i < ctx_outs.size(); ++i) {
-            gguf_set_val_u16(ctx_outs[i].get(), ml.llm_kv(LLM_KV_SPLIT_NO).c_str(), i);
-            gguf_set_val_u16(ctx_outs[i].get(), ml.llm_kv(LLM_KV_SPLIT_COUNT).c_str(), n_split);
-            gguf_set_val_i32(ctx_outs[i].get(), ml.llm_kv(LLM_KV_SPLIT_TENSORS_COUNT).c_str(), (int32_t)tensors.size());
-        }
-    }
-
-    int cur_split = -1;
-    std::ofstream fout;
-    auto close_ofstream = [&]() {
-        // Write metadata and close file handler
-        if (fout.is_open()) {
-            fout.seekp(0);
-            std::vector<uint8_t> data(gguf_get_meta_size(ctx_outs[cur_split].get()));
-            gguf_get_meta_data(ctx_outs[cur_split].get(), data.data());
-            fout.write((const char *) data.data(), data.size());
-            fout.close();
-        }
+        bool          quantize;
+        ggml_type     new_type;
+        size_t        new_size;
+        const float * imatrix;
+        int           i_split;
     };
-    auto new_ofstream = [&](int index) {
-        cur_split = index;
-        GGML_ASSERT(ctx_outs[cur_split] && "Find uninitialized gguf_context");
-        std::string fname = fname_out;
-        if (params->keep_split) {
-            std::vector<char> split_path(llama_path_max(), 0);
-            llama_split_path(split_path.data(), split_path.size(), fname_out.c_str(), cur_split, n_split);
-            fname = std::string(split_path.data());
-        }
 
-        fout = std::ofstream(fname, std::ios::binary);
-        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-        const size_t meta_size = gguf_get_meta_size(ctx_outs[cur_split].get());
-        // placeholder for the meta data
-        ::zeros(fout, meta_size);
-    };
+    std::vector<quantize_job> jobs;
+    jobs.reserve(tensors.size());
 
     const auto tn = LLM_TN(model.arch);
-    new_ofstream(0);
+
     for (const auto * it : tensors) {
-        const auto & weight = *it;
-        ggml_tensor * tensor = weight.tensor;
-        if (weight.idx != cur_split && params->keep_split) {
-            close_ofstream();
-            new_ofstream(weight.idx);
-        }
+        ggml_tensor * tensor = it->tensor;
 
         const std::string name = ggml_get_name(tensor);
 
-        if (!ml.use_mmap) {
-            if (read_data.size() < ggml_nbytes(tensor)) {
-                read_data.resize(ggml_nbytes(tensor));
-            }
-            tensor->data = read_data.data();
-        }
-        ml.load_data_for(tensor);
-
-        LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
-               ++idx, ml.n_tensors,
-               ggml_get_name(tensor),
-               llama_format_tensor_shape(tensor).c_str(),
-               ggml_type_name(tensor->type));
-
         // This used to be a regex, but <regex> has an extreme cost to compile times.
         bool quantize = name.rfind("weight") == name.size() - 6; // ends with 'weight'?
 
@@ -858,9 +778,7 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
         // do not quantize relative position bias (T5)
         quantize &= name.find("attn_rel_b.weight") == std::string::npos;
 
-        ggml_type new_type;
-        void * new_data;
-        size_t new_size;
+        ggml_type new_type = tensor->type;
 
         if (quantize) {
             new_type = default_type;
@@ -875,7 +793,7 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
                     for (const auto & [tname, qtype] : tensor_types) {
                         if (std::regex pattern(tname); std::regex_search(tensor_name, pattern)) {
                             if  (qtype != new_type) {
-                                LLAMA_LOG_DEBUG("(overriding %s) ", ggml_type_name(new_type));
+                                LLAMA_LOG_DEBUG("%s: overriding %s for %s\n", __func__, ggml_type_name(new_type), tensor->name);
                                 new_type = qtype;
                                 break; // if two or more types are specified for the tensor, first match wins
                             }
@@ -896,15 +814,11 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
             quantize = tensor->type != new_type;
         }
 
+        const float * imatrix = nullptr;
+
         if (!quantize) {
             new_type = tensor->type;
-            new_data = tensor->data;
-            new_size = ggml_nbytes(tensor);
-            LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
         } else {
-            const int64_t nelements = ggml_nelements(tensor);
-
-            const float * imatrix = nullptr;
             if (imatrix_data) {
                 auto it = imatrix_data->find(remap_imatrix(tensor->name, mapped));
                 if (it == imatrix_data->end()) {
@@ -940,59 +854,285 @@ static void llama_model_quantize_impl(const std::string & fname_inp, const std::
                 throw std::runtime_error(format("Missing importance matrix for tensor %s in a very low-bit quantization", tensor->name));
             }
 
-            float * f32_data;
-
-            if (tensor->type == GGML_TYPE_F32) {
-                f32_data = (float *) tensor->data;
-            } else if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
+            if (ggml_is_quantized(tensor->type) && !params->allow_requantize) {
                 throw std::runtime_error(format("requantizing from type %s is disabled", ggml_type_name(tensor->type)));
-            } else {
-                llama_tensor_dequantize_impl(tensor, f32_conv_buf, workers, nelements, nthread);
-                f32_data = (float *) f32_conv_buf.data();
             }
+        }
+
+        const size_t new_size = ggml_row_size(new_type, tensor->ne[0]) * (ggml_nelements(tensor) / tensor->ne[0]);
+
+        jobs.push_back({ it, quantize, new_type, new_size, imatrix, 0 });
+    }
+
+    // assign the tensors to the output files
+    const bool split_output = params->keep_split || params->split_max_size > 0;
+
+    uint16_t n_split = 1;
+
+    if (params->keep_split) {
+        // Assume split index is continuous
+        for (auto & job : jobs) {
+            job.i_split = job.weight->idx;
+            n_split = std::max(uint16_t(job.i_split + 1), n_split);
+        }
+    } else if (params->split_max_size > 0) {
+        const size_t align = gguf_get_alignment(ctx_out.get());
+
+        size_t size_split = 0;
+        for (auto & job : jobs) {
+            const size_t size_padded = GGML_PAD(job.new_size, align);
+            if (size_split > 0 && size_split + size_padded > params->split_max_size) {
+                n_split++;
+                size_split = 0;
+            }
+            job.i_split = n_split - 1;
+            size_split += size_padded;
+        }
+    }
+
+    std::vector<gguf_context_ptr> ctx_outs(n_split);
+    ctx_outs[0] = std::move(ctx_out);
+
+    // populate the tensors with their output types so that the meta data of every file is complete before writing
+    for (const auto & job : jobs) {
+        ggml_tensor * tensor = job.weight->tensor;
+        if (!ctx_outs[job.i_split]) {
+            ctx_outs[job.i_split].reset(gguf_init_empty());
+            // the shards use the same alignment, e.g. huge page sized (general.alignment), as the first one
+            const size_t align = gguf_get_alignment(ctx_outs[0].get());
+            if (align != GGUF_DEFAULT_ALIGNMENT) {
+                gguf_set_val_u32(ctx_outs[job.i_split].get(), GGUF_KEY_GENERAL_ALIGNMENT, align);
+            }
+        }
+        gguf_add_tensor(ctx_outs[job.i_split].get(), tensor);
+        gguf_set_tensor_type(ctx_outs[job.i_split].get(), tensor->name, job.new_type);
+        GGML_ASSERT(gguf_get_tensor_size(ctx_outs[job.i_split].get(), gguf_find_tensor(ctx_outs[job.i_split].get(), tensor->name)) == job.new_size);
+    }
+
+    // Set split info if needed
+    if (n_split > 1) {
+        for (size_t i = 0; i < ctx_outs.size(); ++i) {
+            gguf_set_val_u16(ctx_outs[i].get(), ml.llm_kv(LLM_KV_SPLIT_NO).c_str(), i);
+            gguf_set_val_u16(ctx_outs[i].get(), ml.llm_kv(LLM_KV_SPLIT_COUNT).c_str(), n_split);
+            gguf_set_val_i32(ctx_outs[i].get(), ml.llm_kv(LLM_KV_SPLIT_TENSORS_COUNT).c_str(), (int32_t)tensors.size());
+        }
+    }
+
+    int cur_split = -1;
+    std::ofstream fout;
+    auto new_ofstream = [&](int index) {
+        cur_split = index;
+        GGML_ASSERT(ctx_outs[cur_split] && "Find uninitialized gguf_context");
+        std::string fname = fname_out;
+        if (split_output) {
+            std::vector<char> split_path(llama_path_max(), 0);
+            llama_split_path(split_path.data(), split_path.size(), fname_out.c_str(), cur_split, n_split);
+            fname = std::string(split_path.data());
+        }
+
+        fout = std::ofstream(fname, std::ios::binary);
+        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
+
+        std::vector<uint8_t> data(gguf_get_meta_size(ctx_outs[cur_split].get()));
+        gguf_get_meta_data(ctx_outs[cur_split].get(), data.data());
+        fout.write((const char *) data.data(), data.size());
+    };
+
+    // the tensors go through three stages that run concurrently: the reader loads tensor i+1 while the thread pool
+    // quantizes tensor i on this thread and the writer writes tensor i-1
+    // a tensor uses the same slot in every stage, the slot is reused once the tensor has been written
+    constexpr size_t n_slots = 3;
+
+    struct quantize_slot {
+        std::vector<no_init<uint8_t>> read_data; // source data when not using mmap
+        std::vector<no_init<uint8_t>> work;      // quantized data
+        const void * data = nullptr;             // data of the output tensor
+    };
+
+    std::array<quantize_slot, n_slots> slots;
+
+    std::mutex              pipe_mutex;
+    std::condition_variable pipe_cv;
+
+    size_t      n_read      = 0;
+    size_t      n_quantized = 0;
+    size_t      n_written   = 0;
+    bool        pipe_failed = false;
+    std::string pipe_error;
+
+    // returns false if another stage failed
+    auto pipe_wait = [&](const std::function<bool()> & ready) {
+        std::unique_lock<std::mutex> lock(pipe_mutex);
+        pipe_cv.wait(lock, [&] { return pipe_failed || ready(); });
+        return !pipe_failed;
+    };
+
+    auto pipe_advance = [&](size_t & n_done) {
+        {
+            std::lock_guard<std::mutex> lock(pipe_mutex);
+            n_done++;
+        }
+        pipe_cv.notify_all();
+    };
+
+    auto pipe_fail = [&](const char * err) {
+        {
+            std::lock_guard<std::mutex> lock(pipe_mutex);
+            if (!pipe_failed) {
+                pipe_failed = true;
+                pipe_error  = err;
+            }
+        }
+        pipe_cv.notify_all();
+    };
 
-            LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(new_type));
-            fflush(stdout);
+    // the threads that dequantize and quantize the tensors, together with this thread
+    // created before the reader and the writer, so that a failure to start the workers does not leave them running
+    llama_thread_pool pool(nthread - 1);
+
+    std::thread reader([&] {
+        try {
+            for (size_t i = 0; i < jobs.size(); ++i) {
+                if (!pipe_wait([&] { return i < n_written + n_slots; })) {
+                    return;
+                }
 
-            if (work.size() < (size_t)nelements * 4) {
-                work.resize(nelements * 4); // upper bound on size
+                ggml_tensor * tensor = jobs[i].weight->tensor;
+                auto & slot = slots[i % n_slots];
+
+                // with mmap, the OS reads the next tensor while this one is validated and quantized
+                if (i + 1 < jobs.size()) {
+                    ml.prefetch_data_for(jobs[i + 1].weight->tensor);
+                }
+
+                if (!ml.use_mmap) {
+                    if (slot.read_data.size() < ggml_nbytes(tensor)) {
+                        slot.read_data.resize(ggml_nbytes(tensor));
+                    }
+                    tensor->data = slot.read_data.data();
+                }
+                // with mmap, the validation of the data (check_tensors) also pages it in
+                ml.load_data_for(tensor);
+
+                pipe_advance(n_read);
+            }
+        } catch (const std::exception & err) {
+            pipe_fail(err.what());
+        }
+    });
+
+    std::thread writer([&] {
+        try {
+            for (size_t i = 0; i < jobs.size(); ++i) {
+                if (!pipe_wait([&] { return i < n_quantized; })) {
+                    return;
+                }
+
+                const auto & job = jobs[i];
+                if (job.i_split != cur_split) {
+                    if (fout.is_open()) {
+                        fout.close();
+                    }
+                    new_ofstream(job.i_split);
+                }
+
+                // write tensor data + padding
+                fout.write((const char *) slots[i % n_slots].data, job.new_size);
+                const size_t align = gguf_get_alignment(ctx_outs[cur_split].get());
+                zeros(fout, GGML_PAD(job.new_size, align) - job.new_size);
+
+                pipe_advance(n_written);
+            }
+            fout.close();
+        } catch (const std::exception & err) {
+            pipe_fail(err.what());
+        }
+    });
+
+    {
+        std::vector<no_init<float>> f32_conv_buf;
+
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            if (!pipe_wait([&] { return i < n_read; })) {
+                break;
             }
-            new_data = work.data();
 
-            const int64_t n_per_row = tensor->ne[0];
-            const int64_t nrows = tensor->ne[1];
+            const auto & job = jobs[i];
+            ggml_tensor * tensor = job.weight->tensor;
+            auto & slot = slots[i % n_slots];
+
+            try {
+                LLAMA_LOG_INFO("[%4zu/%4d] %36s - [%s], type = %6s, ",
+                       i + 1, ml.n_tensors,
+                       ggml_get_name(tensor),
+                       llama_format_tensor_shape(tensor).c_str(),
+                       ggml_type_name(tensor->type));
+
+                if (!job.quantize) {
+                    slot.data = tensor->data;
+                    LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
+                } else {
+                    const int64_t nelements = ggml_nelements(tensor);
+
+                    const float * f32_data;
+
+                    if (tensor->type == GGML_TYPE_F32) {
+                        f32_data = (float *) tensor->data;
+                    } else {
+                        llama_tensor_dequantize_impl(tensor, f32_conv_buf, pool, nelements, nthread);
+                        f32_data = (float *) f32_conv_buf.data();
+                    }
+
+                    LLAMA_LOG_INFO("converting to %s .. ", ggml_type_name(job.new_type));
+                    fflush(stdout);
 
-            static const int64_t min_chunk_size = 32 * 512;
-            const int64_t chunk_size = (n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row));
+                    if (slot.work.size() < job.new_size) {
+                        slot.work.resize(job.new_size);
+                    }
+                    void * new_data = slot.work.data();
+
+                    const int64_t n_per_row = tensor->ne[0];
+                    const int64_t nrows = tensor->ne[1];
+
+                    static const int64_t min_chunk_size = 32 * 512;
+                    const int64_t chunk_size = (n_per_row >= min_chunk_size ? n_per_row : n_per_row * ((min_chunk_size + n_per_row - 1)/n_per_row));
 
-            const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
-            const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
-            const int64_t nthread_use = nthread > 1 ? std::max((int64_t)1, std::min((int64_t)nthread, nchunk)) : 1;
+                    const int64_t nelements_matrix = tensor->ne[0] * tensor->ne[1];
+                    const int64_t nchunk = (nelements_matrix + chunk_size - 1)/chunk_size;
+                    const int64_t nthread_use = nthread > 1 ? std::max((int64_t)1, std::min((int64_t)nthread, nchunk)) : 1;
 
-            // quantize each expert separately since they have different importance matrices
-            new_size = 0;
-            for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
-                const float * f32_data_03 = f32_data + i03 * nelements_matrix;
-                void * new_data_03 = (char *)new_data + ggml_row_size(new_type, n_per_row) * i03 * nrows;
-                const float * imatrix_03 = imatrix ? imatrix + i03 * n_per_row : nullptr;
+                    // quantize each expert separately since they have different importance matrices
+                    size_t new_size = 0;
+                    for (int64_t i03 = 0; i03 < tensor->ne[2]; ++i03) {
+                        const float * f32_data_03 = f32_data + i03 * nelements_matrix;
+                        void * new_data_03 = (char *)new_data + ggml_row_size(job.new_type, n_per_row) * i03 * nrows;
+                        const float * imatrix_03 = job.imatrix ? job.imatrix + i03 * n_per_row : nullptr;
+
+                        new_size += llama_tensor_quantize_impl(job.new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, pool, nthread_use);
+                    }
+                    GGML_ASSERT(new_size == job.new_size);
 
-                new_size += llama_tensor_quantize_impl(new_type, f32_data_03, new_data_03, chunk_size, nrows, n_per_row, imatrix_03, workers, nthread_use);
+                    slot.data = new_data;
+                    LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
+                }
+            } catch (const std::exception & err) {
+                pipe_fail(err.what());
+                break;
             }
-            LLAMA_LOG_INFO("size = %8.2f MiB -> %8.2f MiB\n", ggml_nbytes(tensor)/1024.0/1024.0, new_size/1024.0/1024.0);
+
+            total_size_org += ggml_nbytes(tensor);
+            total_size_new += job.new_size;
+
+            pipe_advance(n_quantized);
         }
-        total_size_org += ggml_nbytes(tensor);
-        total_size_new += new_size;
+    }
 
-        // update the gguf meta data as we go
-        gguf_set_tensor_type(ctx_outs[cur_split].get(), name.c_str(), new_type);
-        GGML_ASSERT(gguf_get_tensor_size(ctx_outs[cur_split].get(), gguf_find_tensor(ctx_outs[cur_split].get(), name.c_str())) == new_size);
-        gguf_set_tensor_data(ctx_outs[cur_split].get(), name.c_str(), new_data);
+    reader.join();
+    writer.join();
 
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+    if (pipe_failed) {
+        throw std::runtime_error(pipe_error);
     }
-    close_ofstream();
 
     LLAMA_LOG_INFO("%s: model size  = %8.2f MB\n", __func__, total_size_org/1024.0/1024.0);
     LLAMA_LOG_INFO("%s: quant size  = %8.2f MB\n", __func__, total_size_new/1024.0/1024.0);
@@ -1018,6 +1158,7 @@ llama_model_quantize_params llama_model_quantize_default_params() {
         /*.only_copy                   =*/ false,
         /*.pure                        =*/ false,
         /*.keep_split                  =*/ false,
+        /*.split_max_size              =*/ 0,
         /*.imatrix                     =*/ nullptr,
         /*.kv_overrides                =*/ nullptr,
         /*.tensor_type                 =*/ nullptr,
@@ -3,6 +3,8 @@
 #include "llama-impl.h"
 #include "llama-vocab.h"
 #include "llama-grammar.h"
+#include "llama-context.h"
+#include "llama-thread-pool.h"
 
 #include <algorithm>
 #include <cassert>
@@ -12,6 +14,7 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <limits>
 #include <numeric>
 #include <random>
 #include <unordered_map>
@@ -128,36 +131,29 @@ struct ring_buffer {
     std::vector<T> data;
 };
 
+// same as std::discrete_distribution over the probabilities, without building the table of cumulative probabilities
+// the normalization, the accumulation and the draw match libstdc++, so the results for a given seed do not change
 static int llama_sample_dist(llama_token_data_array * cur_p, std::mt19937 & rng) {
-    // iterator for the probabilities
-#ifdef __GNUC__
-    #pragma GCC diagnostic push
-    #pragma GCC diagnostic ignored "-Wunused-local-typedefs"
-#endif
-
-    struct probs_iterator {
-        typedef std::input_iterator_tag iterator_category;
-        typedef float value_type;
-        typedef float * pointer;
-        typedef float & reference;
-        typedef ptrdiff_t difference_type;
-
-        const llama_token_data * data;
+    if (cur_p->size < 2) {
+        return 0;
+    }
 
-        bool operator==(const probs_iterator & other) const { return data == other.data; }
-        bool operator!=(const probs_iterator & other) const { return data != other.data; }
-        const float & operator*() const { return data->p; }
-        probs_iterator & operator++() { ++data; return *this; }
-        probs_iterator operator++(int) { probs_iterator tmp = *this; ++data; return tmp; }
-    };
+    double sum = 0.0;
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        sum += cur_p->data[i].p;
+    }
 
-#ifdef __GNUC__
-    #pragma GCC diagnostic pop
-#endif
+    const double u = std::generate_canonical<double, std::numeric_limits<double>::digits>(rng);
 
-    std::discrete_distribution<int> dist(probs_iterator{cur_p->data}, probs_iterator{cur_p->data + cur_p->size});
+    double cum = 0.0;
+    for (size_t i = 0; i + 1 < cur_p->size; ++i) {
+        cum += cur_p->data[i].p / sum;
+        if (cum >= u) {
+            return i;
+        }
+    }
 
-    return dist(rng);
+    return cur_p->size - 1;
 }
 
 /*
@@ -225,77 +221,139 @@ static void llama_sampler_softmax_impl(llama_token_data_array * cur_p) {
     }
 }
 
-static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k) {
-    // TODO: move bucket sort to separate function so that top_p/typical/softmax first is equally fast
-    // if (k >= (int32_t)cur_p->size) {
-    //     return;
-    // }
+// index of the token in the candidates if they are laid out by token id (e.g. the full vocab), -1 otherwise
+// samplers that modify only a few known tokens use this to avoid scanning all of the candidates
+static inline int64_t llama_token_data_array_find_indexed(const llama_token_data_array * cur_p, llama_token token) {
+    return token >= 0 && (size_t) token < cur_p->size && cur_p->data[token].id == token ? token : -1;
+}
 
-    if (k <= 0) {
+// map a logit to an unsigned integer with the same ordering
+static inline uint32_t llama_logit_key(float x) {
+    uint32_t u;
+    memcpy(&u, &x, sizeof(u));
+
+    return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
+// move the k largest logits to the front of the array, in descending order
+// the order of the rest of the array is unspecified
+//
+// radix select: a histogram of the top bits of the logits determines which elements are certainly in the top k and
+// which bucket contains the k-th element - only that bucket is refined with the next bits, so for large arrays only a
+// few elements are ever compared, and no memory is allocated
+static void llama_token_data_array_partial_sort(llama_token_data_array * cur_p, size_t k) {
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    llama_token_data * data = cur_p->data;
+
+    const size_t n = cur_p->size;
+
+    k = std::min(k, n);
+
+    // the heap selection of std::partial_sort is hard to beat for small arrays or small k
+    if (n < 1024 || k <= 128) {
+        std::partial_sort(data, data + k, data + n, comp);
         return;
     }
 
-    k = std::min(k, (int) cur_p->size);
+    constexpr int bits [3] = { 11, 11, 10 };
+    constexpr int shift[3] = { 21, 10,  0 };
 
-    // Sort scores in descending order
-    if (!cur_p->sorted) {
-        auto comp = [](const llama_token_data & a, const llama_token_data & b) {
-            return a.logit > b.logit;
-        };
-        if (k <= 128) {
-            std::partial_sort(cur_p->data, cur_p->data + k, cur_p->data + cur_p->size, comp);
-        } else {
-            constexpr int   nbuckets     = 128;
-            constexpr float bucket_low   = -10.0f;
-            constexpr float bucket_high  =  10.0f;
-            constexpr float bucket_scale = nbuckets/(bucket_high - bucket_low);
-            constexpr float bucket_inter = -bucket_low * bucket_scale;
-
-            std::vector<int> bucket_idx(cur_p->size);
-            std::vector<int> histo(nbuckets, 0);
-
-            for (int i = 0; i < (int)cur_p->size; ++i) {
-                const float val = cur_p->data[i].logit;
-                int ib = int(bucket_scale * val + bucket_inter); //nbuckets * (val - bucket_low) / (bucket_high - bucket_low);
-                ib = std::max(0, std::min(nbuckets - 1, ib));
-                bucket_idx[i] = ib;
-                ++histo[ib];
-            }
-            int nhave = 0;
-            int ib = nbuckets - 1;
-            for ( ; ib >= 0; --ib) {
-                nhave += histo[ib];
-                if (nhave >= k) {
-                    break;
-                }
-            }
-            std::vector<llama_token_data> tmp_tokens(nhave);
-            auto * ptr = tmp_tokens.data();
-            std::vector<llama_token_data*> bucket_ptrs;
-            bucket_ptrs.reserve(nbuckets - ib);
-            for (int j = nbuckets - 1; j >= ib; --j) {
-                bucket_ptrs.push_back(ptr);
-                ptr += histo[j];
-            }
-            for (int i = 0; i < (int)cur_p->size; ++i) {
-                int j = bucket_idx[i];
-                if (j >= ib) {
-                    *bucket_ptrs[nbuckets - 1 - j]++ = cur_p->data[i];
-                }
-            }
+    uint32_t histo[1 << 11];
 
-            ptr = tmp_tokens.data();
-            int ndone = 0;
-            for (int j = nbuckets - 1; j > ib; --j) {
-                std::sort(ptr, ptr + histo[j], comp);
-                ptr += histo[j];
-                ndone += histo[j];
+    // the elements in [0, lo) are in the top k, the k-th element is in [lo, hi)
+    size_t lo   = 0;
+    size_t hi   = n;
+    size_t need = k;
+
+    for (int l = 0; l < 3 && need > 0 && hi - lo > 256; ++l) {
+        const int      nbins = 1 << bits[l];
+        const int      sh    = shift[l];
+        const uint32_t mask  = nbins - 1;
+
+        std::fill(histo, histo + nbins, 0);
+
+        for (size_t i = lo; i < hi; ++i) {
+            histo[(llama_logit_key(data[i].logit) >> sh) & mask]++;
+        }
+
+        // find the bucket that contains the k-th element, counting from the largest values
+        size_t n_above = 0;
+
+        int ib = nbins - 1;
+        for (; ib > 0; --ib) {
+            if (n_above + histo[ib] >= need) {
+                break;
             }
-            std::partial_sort(ptr, ptr + k - ndone, ptr + histo[ib], comp);
+            n_above += histo[ib];
+        }
+
+        const uint32_t b = ib;
 
-            std::memcpy(cur_p->data, tmp_tokens.data(), k*sizeof(llama_token_data));
+        // move the candidates to the front - usually only a few elements have to be moved
+        auto * end = std::partition(data + lo, data + hi, [sh, mask, b](const llama_token_data & d) {
+            return ((llama_logit_key(d.logit) >> sh) & mask) >= b;
+        });
+
+        auto * mid = std::partition(data + lo, end, [sh, mask, b](const llama_token_data & d) {
+            return ((llama_logit_key(d.logit) >> sh) & mask) > b;
+        });
+
+        GGML_ASSERT((size_t) (mid - data) == lo + n_above);
+
+        lo   += n_above;
+        hi    = lo + histo[ib];
+        need -= n_above;
+    }
+
+    // the elements in [0, lo) are larger than the ones in [lo, hi), so the two ranges can be sorted separately
+    std::sort(data, data + lo, comp);
+    std::partial_sort(data + lo, data + lo + need, data + hi, comp);
+}
 
+// upper bound for the number of most probable candidates needed to cover the probability mass p
+// the probabilities of the candidates must be already computed - they are accumulated in a histogram of the top bits
+// of the logits, so that the array does not have to be sorted
+static size_t llama_token_data_array_n_mass(const llama_token_data_array * cur_p, float p) {
+    constexpr int nbins = 1 << 11;
+
+    uint32_t histo[nbins] = {};
+    double   mass [nbins] = {};
+
+    for (size_t i = 0; i < cur_p->size; ++i) {
+        const uint32_t ib = llama_logit_key(cur_p->data[i].logit) >> 21;
+
+        histo[ib]++;
+        mass [ib] += cur_p->data[i].p;
+    }
+
+    size_t n   = 0;
+    double cum = 0.0;
+
+    for (int ib = nbins - 1; ib >= 0; --ib) {
+        n   += histo[ib];
+        cum += mass[ib];
+
+        if (n > 0 && cum >= p) {
+            break;
         }
+    }
+
+    return n;
+}
+
+static void llama_sampler_top_k_impl(llama_token_data_array * cur_p, int32_t k) {
+    if (k <= 0) {
+        return;
+    }
+
+    k = std::min(k, (int) cur_p->size);
+
+    // Sort scores in descending order
+    if (!cur_p->sorted) {
+        llama_token_data_array_partial_sort(cur_p, k);
         cur_p->sorted = true;
     }
 
@@ -376,39 +434,6 @@ void llama_sampler_free(struct llama_sampler * smpl) {
     delete smpl;
 }
 
-llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
-    const auto * logits = llama_get_logits_ith(ctx, idx);
-
-    const llama_model * model = llama_get_model(ctx);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
-
-    const int n_vocab = llama_vocab_n_tokens(vocab);
-
-    // TODO: do not allocate each time
-    std::vector<llama_token_data> cur;
-    cur.reserve(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-    }
-
-    llama_token_data_array cur_p = {
-        /* .data       = */ cur.data(),
-        /* .size       = */ cur.size(),
-        /* .selected   = */ -1,
-        /* .sorted     = */ false,
-    };
-
-    llama_sampler_apply(smpl, &cur_p);
-
-    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
-
-    auto token = cur_p.data[cur_p.selected].id;
-
-    llama_sampler_accept(smpl, token);
-
-    return token;
-}
-
 // sampler chain
 
 static const char * llama_sampler_chain_name(const struct llama_sampler * /*smpl*/) {
@@ -485,12 +510,114 @@ struct llama_sampler * llama_sampler_chain_init(struct llama_sampler_chain_param
         /* .ctx   = */ new llama_sampler_chain {
             /* .params      = */ params,
             /* .samplers    = */ {},
+            /* .cur         = */ {},
             /* .t_sample_us = */ 0,
             /* .n_sample    = */ 0,
         }
     );
 }
 
+// the logits of one output of the last evaluation
+struct llama_sampler_output {
+    // only the candidates selected in the graph are available (sorted by descending logit)
+    const llama_token * top_k_ids    = nullptr;
+    const float       * top_k_logits = nullptr;
+
+    int32_t n_top_k = 0;
+
+    // otherwise, the logits of all tokens in the vocab
+    const float * logits = nullptr;
+
+    int32_t n_vocab = 0; // set in both cases
+};
+
+static llama_sampler_output llama_sampler_get_output(struct llama_context * ctx, int32_t idx) {
+    llama_sampler_output res;
+
+    const llama_model * model = llama_get_model(ctx);
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    res.n_vocab = llama_vocab_n_tokens(vocab);
+    res.n_top_k = llama_get_logits_top_k_ith(ctx, idx, &res.top_k_ids, &res.top_k_logits);
+
+    if (res.n_top_k == 0) {
+        res.logits = llama_get_logits_ith(ctx, idx);
+    }
+
+    return res;
+}
+
+// fill the candidates with the logits of the output
+static void llama_sampler_output_fill(const llama_sampler_output & out, std::vector<llama_token_data> & cur) {
+    if (out.n_top_k > 0) {
+        cur.resize(out.n_top_k);
+        for (int32_t i = 0; i < out.n_top_k; i++) {
+            cur[i] = llama_token_data{out.top_k_ids[i], out.top_k_logits[i], 0.0f};
+        }
+        return;
+    }
+
+    cur.resize(out.n_vocab);
+    for (llama_token token_id = 0; token_id < out.n_vocab; token_id++) {
+        cur[token_id] = llama_token_data{token_id, out.logits[token_id], 0.0f};
+    }
+}
+
+static bool llama_sampler_has_grammar(const struct llama_sampler * smpl);
+
+// does not access the context, so that different samplers can run concurrently
+static llama_token llama_sampler_sample_output(struct llama_sampler * smpl, const llama_sampler_output & out) {
+    // the candidates are stored in the buffer of the chain, so that sampling does not allocate in the steady state
+    std::vector<llama_token_data> cur_tmp;
+
+    auto & cur = smpl->iface == &llama_sampler_chain_i ? ((llama_sampler_chain *) smpl->ctx)->cur : cur_tmp;
+
+    // the logits of the tokens outside of the top-k candidates are not known, so a grammar that rejects all candidates
+    // could not sample from the rest of the vocab
+    if (out.n_top_k > 0 && llama_sampler_has_grammar(smpl)) {
+        GGML_ABORT("grammar samplers are not supported with n_logits_top_k > 0");
+    }
+
+    llama_sampler_output_fill(out, cur);
+
+    llama_token_data_array cur_p = {
+        /* .data       = */ cur.data(),
+        /* .size       = */ cur.size(),
+        /* .selected   = */ -1,
+        /* .sorted     = */ out.n_top_k > 0,
+    };
+
+    llama_sampler_apply(smpl, &cur_p);
+
+    GGML_ASSERT(cur_p.selected >= 0 && cur_p.selected < (int32_t) cur_p.size);
+
+    auto token = cur_p.data[cur_p.selected].id;
+
+    llama_sampler_accept(smpl, token);
+
+    return token;
+}
+
+llama_token llama_sampler_sample(struct llama_sampler * smpl, struct llama_context * ctx, int32_t idx) {
+    return llama_sampler_sample_output(smpl, llama_sampler_get_output(ctx, idx));
+}
+
+void llama_sampler_sample_batch(struct llama_sampler ** smpls, struct llama_context * ctx, const int32_t * idxs, llama_token * tokens, int32_t n) {
+    if (n <= 0) {
+        return;
+    }
+
+    // the outputs are looked up on this thread - afterwards, the samplers do not touch the context
+    std::vector<llama_sampler_output> outs(n);
+    for (int32_t i = 0; i < n; ++i) {
+        outs[i] = llama_sampler_get_output(ctx, idxs[i]);
+    }
+
+    ctx->get_workers()->parallel_for(n, [&](int64_t i) {
+        tokens[i] = llama_sampler_sample_output(smpls[i], outs[i]);
+    });
+}
+
 void llama_sampler_chain_add(struct llama_sampler * chain, struct llama_sampler * smpl) {
     auto * p = (llama_sampler_chain *) chain->ctx;
     p->samplers.push_back(smpl);
@@ -712,6 +839,55 @@ static void llama_sampler_top_p_apply(struct llama_sampler * smpl, llama_token_d
         return;
     }
 
+    if (!cur_p->sorted) {
+        // compute the probabilities without sorting the candidates
+        float max_l = -INFINITY;
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            max_l = std::max(max_l, cur_p->data[i].logit);
+        }
+
+        // accumulate in double precision - the summation order does not follow the probabilities
+        double sum = 0.0;
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const float p = expf(cur_p->data[i].logit - max_l);
+            cur_p->data[i].p = p;
+            sum += p;
+        }
+
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            cur_p->data[i].p /= sum;
+        }
+
+        // sort only the most probable candidates - if they do not cover p due to rounding, their number is doubled
+        size_t n_sorted = std::min(cur_p->size, std::max<size_t>(ctx->min_keep, llama_token_data_array_n_mass(cur_p, ctx->p)));
+
+        while (true) {
+            llama_token_data_array_partial_sort(cur_p, n_sorted);
+
+            double cum_sum = 0.0;
+
+            for (size_t i = 0; i < n_sorted; ++i) {
+                cum_sum += cur_p->data[i].p;
+
+                if (cum_sum >= ctx->p && i + 1 >= ctx->min_keep) {
+                    cur_p->size   = i + 1;
+                    cur_p->sorted = true;
+                    return;
+                }
+            }
+
+            if (n_sorted == cur_p->size) {
+                break;
+            }
+
+            n_sorted = std::min(cur_p->size, std::max<size_t>(2*n_sorted, 64));
+        }
+
+        cur_p->sorted = true;
+
+        return;
+    }
+
     llama_sampler_softmax_impl(cur_p);
 
     // Compute the cumulative probabilities
@@ -779,54 +955,50 @@ static void llama_sampler_min_p_apply(struct llama_sampler * smpl, llama_token_d
         return;
     }
 
-    bool min_p_applied = false;
-
-    // if the cur_p aren't sorted, try the unsorted implementation first
     if (!cur_p->sorted) {
-        std::vector<llama_token_data> filtered_tokens;
-
         float max_logit = -FLT_MAX;
         for (size_t i = 0; i < cur_p->size; ++i) {
             max_logit = std::max(max_logit, cur_p->data[i].logit);
         }
         const float min_logit = max_logit + logf(ctx->p); // min logit for p_i >= p * p_max
 
+        size_t n_keep = 0;
         for (size_t i = 0; i < cur_p->size; ++i) {
-            if (cur_p->data[i].logit >= min_logit) {
-                filtered_tokens.push_back(cur_p->data[i]);
-            }
+            n_keep += cur_p->data[i].logit >= min_logit;
         }
 
-        // if we have enough values the operation was a success
-        if (!filtered_tokens.empty() && filtered_tokens.size() >= ctx->min_keep) {
-            memcpy(cur_p->data, filtered_tokens.data(), filtered_tokens.size()*sizeof(llama_token_data));
-            cur_p->size = filtered_tokens.size();
-            min_p_applied = true;
-        }
-    }
+        if (n_keep > 0 && n_keep >= ctx->min_keep) {
+            // filter in-place, preserving the order of the candidates
+            size_t j = 0;
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                if (cur_p->data[i].logit >= min_logit) {
+                    cur_p->data[j++] = cur_p->data[i];
+                }
+            }
+            cur_p->size = j;
+        } else {
+            // not enough candidates pass the filter - keep the min_keep most probable ones
+            const size_t n = std::min(cur_p->size, std::max<size_t>(ctx->min_keep, 1));
 
-    // if the cur_p are sorted or the unsorted implementation failed, use this implementation
-    if (!min_p_applied) {
-        // Sort the logits in descending order
-        if (!cur_p->sorted) {
-            std::sort(cur_p->data, cur_p->data + cur_p->size, [](const llama_token_data & a, const llama_token_data & b) {
-                return a.logit > b.logit;
-            });
+            llama_token_data_array_partial_sort(cur_p, n);
+            cur_p->size   = n;
             cur_p->sorted = true;
         }
 
-        const float min_logit = cur_p->data[0].logit + logf(ctx->p); // min logit for p_i >= p * p_max
-        size_t i = 1; // first token always matches
+        return;
+    }
 
-        for (; i < cur_p->size; ++i) {
-            if (cur_p->data[i].logit < min_logit && i >= ctx->min_keep) {
-                break; // prob too small
-            }
-        }
+    const float min_logit = cur_p->data[0].logit + logf(ctx->p); // min logit for p_i >= p * p_max
+    size_t i = 1; // first token always matches
 
-        // Resize the output vector to keep only the matching tokens
-        cur_p->size = i;
+    for (; i < cur_p->size; ++i) {
+        if (cur_p->data[i].logit < min_logit && i >= ctx->min_keep) {
+            break; // prob too small
+        }
     }
+
+    // Resize the output vector to keep only the matching tokens
+    cur_p->size = i;
 }
 
 static struct llama_sampler * llama_sampler_min_p_clone(const struct llama_sampler * smpl) {
@@ -862,6 +1034,11 @@ struct llama_sampler * llama_sampler_init_min_p(float p, size_t min_keep) {
 struct llama_sampler_typical {
     const float  p;
     const size_t min_keep;
+
+    // scratch buffers, reused across calls
+    std::vector<float>            shifted_scores;
+    std::vector<size_t>           indices;
+    std::vector<llama_token_data> cur_p_new;
 };
 
 static const char * llama_sampler_typical_name(const struct llama_sampler * /*smpl*/) {
@@ -869,7 +1046,7 @@ static const char * llama_sampler_typical_name(const struct llama_sampler * /*sm
 }
 
 static void llama_sampler_typical_apply(struct llama_sampler * smpl, llama_token_data_array * cur_p) {
-    const auto * ctx = (llama_sampler_typical *) smpl->ctx;
+    auto * ctx = (llama_sampler_typical *) smpl->ctx;
 
     // Reference implementation:
     // https://github.com/huggingface/transformers/compare/main...cimeister:typical-sampling:typical-pr
@@ -886,14 +1063,15 @@ static void llama_sampler_typical_apply(struct llama_sampler * smpl, llama_token
     }
 
     // Compute the absolute difference between negative log probability and entropy for each candidate
-    std::vector<float> shifted_scores;
+    auto & shifted_scores = ctx->shifted_scores;
+    shifted_scores.resize(cur_p->size);
     for (size_t i = 0; i < cur_p->size; ++i) {
-        float shifted_score = fabsf(-logf(cur_p->data[i].p) - entropy);
-        shifted_scores.push_back(shifted_score);
+        shifted_scores[i] = fabsf(-logf(cur_p->data[i].p) - entropy);
     }
 
     // Sort tokens based on the shifted_scores and their corresponding indices
-    std::vector<size_t> indices(cur_p->size);
+    auto & indices = ctx->indices;
+    indices.resize(cur_p->size);
     std::iota(indices.begin(), indices.end(), 0);
 
     std::sort(indices.begin(), indices.end(), [&](size_t a, size_t b) {
@@ -916,10 +1094,10 @@ static void llama_sampler_typical_apply(struct llama_sampler * smpl, llama_token
     }
 
     // Resize the output vector to keep only the locally typical tokens
-    std::vector<llama_token_data> cur_p_new;
+    auto & cur_p_new = ctx->cur_p_new;
+    cur_p_new.resize(last_idx);
     for (size_t i = 0; i < last_idx; ++i) {
-        size_t idx = indices[i];
-        cur_p_new.push_back(cur_p->data[idx]);
+        cur_p_new[i] = cur_p->data[indices[i]];
     }
 
     // Replace the data in cur_p with the cur_p_new data
@@ -950,8 +1128,11 @@ struct llama_sampler * llama_sampler_init_typical(float p, size_t min_keep) {
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_typical_i,
         /* .ctx   = */ new llama_sampler_typical {
-            /* .p        = */ p,
-            /* .min_keep = */ min_keep,
+            /* .p              = */ p,
+            /* .min_keep       = */ min_keep,
+            /* .shifted_scores = */ {},
+            /* .indices        = */ {},
+            /* .cur_p_new      = */ {},
         }
     );
 }
@@ -1438,6 +1619,14 @@ static void llama_sampler_grammar_apply(struct llama_sampler * smpl, llama_token
     auto * ctx = (llama_sampler_grammar *) smpl->ctx;
     if (ctx->grammar) {
         llama_grammar_apply_impl(*ctx->grammar, cur_p);
+
+        // the rejected tokens are -INFINITY - move them to the end, so that sorted candidates (e.g. the top-k logits
+        // of the graph) remain sorted
+        if (cur_p->sorted) {
+            std::stable_partition(cur_p->data, cur_p->data + cur_p->size, [](const llama_token_data & td) {
+                return td.logit != -INFINITY;
+            });
+        }
     }
 }
 
@@ -1514,6 +1703,23 @@ static struct llama_sampler_i llama_sampler_grammar_i = {
     /* .free   = */ llama_sampler_grammar_free,
 };
 
+// a grammar sampler with a grammar, or a chain that contains one
+static bool llama_sampler_has_grammar(const struct llama_sampler * smpl) {
+    if (smpl->iface == &llama_sampler_grammar_i) {
+        return ((const llama_sampler_grammar *) smpl->ctx)->grammar != nullptr;
+    }
+
+    if (smpl->iface == &llama_sampler_chain_i) {
+        for (const auto * s : ((const llama_sampler_chain *) smpl->ctx)->samplers) {
+            if (llama_sampler_has_grammar(s)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 static struct llama_sampler * llama_sampler_init_grammar_impl(
         const struct llama_vocab * vocab,
                       const char * grammar_str,
@@ -1608,8 +1814,11 @@ struct llama_sampler_penalties {
 
     ring_buffer<llama_token> prev;
 
-    // a frequency map to count token occurrences
-    std::unordered_map<llama_token, int> token_count;
+    // number of occurrences of each token in `prev`, indexed by token id (grows up to the size of the vocab)
+    std::vector<int> token_count;
+
+    // the distinct tokens in `prev`
+    std::vector<llama_token> tokens;
 };
 
 static const char * llama_sampler_penalties_name(const struct llama_sampler * /*smpl*/) {
@@ -1622,15 +1831,24 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
         return;
     }
 
-    ctx->token_count[token]++;
+    GGML_ASSERT(token >= 0);
+
+    if ((size_t) token >= ctx->token_count.size()) {
+        ctx->token_count.resize(token + 1, 0);
+    }
+
+    if (ctx->token_count[token]++ == 0) {
+        ctx->tokens.push_back(token);
+    }
 
     // if the ring buffer is full, remove the oldest token
     if (ctx->prev.size() >= (size_t) ctx->penalty_last_n) {
         const auto old = ctx->prev.front();
 
-        ctx->token_count[old]--;
-        if (ctx->token_count[old] == 0) {
-            ctx->token_count.erase(old);
+        if (--ctx->token_count[old] == 0) {
+            auto it = std::find(ctx->tokens.begin(), ctx->tokens.end(), old);
+            *it = ctx->tokens.back();
+            ctx->tokens.pop_back();
         }
     }
 
@@ -1643,7 +1861,10 @@ static void llama_sampler_penalties_accept(struct llama_sampler * smpl, llama_to
         tmp[ctx->prev.rat(i)]++;
     }
 
-    assert(ctx->token_count == tmp);
+    assert(ctx->tokens.size() == tmp.size());
+    for (const auto & it : tmp) {
+        assert(ctx->token_count[it.first] == it.second);
+    }
 #endif
 }
 
@@ -1655,26 +1876,43 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
         return;
     }
 
-    // Apply frequency and presence penalties to the cur_p
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto token_iter = ctx->token_count.find(cur_p->data[i].id);
-        if (token_iter == ctx->token_count.end()) {
-            continue;
-        }
-
-        const int count = token_iter->second;
-
+    const auto apply = [&](llama_token_data & cur, int count) {
         assert(count > 0 && count <= ctx->penalty_last_n);
 
         // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
         // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (cur_p->data[i].logit <= 0) {
-            cur_p->data[i].logit *= ctx->penalty_repeat;
+        if (cur.logit <= 0) {
+            cur.logit *= ctx->penalty_repeat;
         } else {
-            cur_p->data[i].logit /= ctx->penalty_repeat;
+            cur.logit /= ctx->penalty_repeat;
+        }
+
+        cur.logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+    };
+
+    bool indexed = true;
+    for (const auto token : ctx->tokens) {
+        if (llama_token_data_array_find_indexed(cur_p, token) < 0) {
+            indexed = false;
+            break;
+        }
+    }
+
+    // Apply frequency and presence penalties to the cur_p
+    if (indexed) {
+        // only visit the penalized tokens
+        for (const auto token : ctx->tokens) {
+            apply(cur_p->data[token], ctx->token_count[token]);
         }
+    } else {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const llama_token token = cur_p->data[i].id;
+            if (token < 0 || (size_t) token >= ctx->token_count.size() || ctx->token_count[token] == 0) {
+                continue;
+            }
 
-        cur_p->data[i].logit -= float(count) * ctx->penalty_freq + float(count > 0) * ctx->penalty_present;
+            apply(cur_p->data[i], ctx->token_count[token]);
+        }
     }
 
     cur_p->sorted = false;
@@ -1683,7 +1921,10 @@ static void llama_sampler_penalties_apply(struct llama_sampler * smpl, llama_tok
 static void llama_sampler_penalties_reset(struct llama_sampler * smpl) {
     auto * ctx = (llama_sampler_penalties *) smpl->ctx;
     ctx->prev.clear();
-    ctx->token_count.clear();
+    for (const auto token : ctx->tokens) {
+        ctx->token_count[token] = 0;
+    }
+    ctx->tokens.clear();
 }
 
 static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_sampler * smpl) {
@@ -1698,7 +1939,9 @@ static struct llama_sampler * llama_sampler_penalties_clone(const struct llama_s
     {
         auto * result_ctx = (llama_sampler_penalties *) result->ctx;
 
-        result_ctx->prev = ctx->prev;
+        result_ctx->prev        = ctx->prev;
+        result_ctx->token_count = ctx->token_count;
+        result_ctx->tokens      = ctx->tokens;
     }
 
     return result;
@@ -1724,16 +1967,21 @@ struct llama_sampler * llama_sampler_init_penalties(
         float penalty_present) {
     penalty_last_n = std::max(penalty_last_n, 0);
 
+    auto * ctx = new llama_sampler_penalties {
+        /* .penalty_last_n  = */ penalty_last_n,
+        /* .penalty_repeat  = */ penalty_repeat,
+        /* .penalty_freq    = */ penalty_freq,
+        /* .penalty_present = */ penalty_present,
+        /* .prev            = */ ring_buffer<llama_token>(penalty_last_n),
+        /* .token_count     = */ {},
+        /* .tokens          = */ {},
+    };
+
+    ctx->tokens.reserve(penalty_last_n);
+
     return llama_sampler_init(
         /* .iface = */ &llama_sampler_penalties_i,
-        /* .ctx   = */ new llama_sampler_penalties {
-            /* .penalty_last_n  = */ penalty_last_n,
-            /* .penalty_repeat  = */ penalty_repeat,
-            /* .penalty_freq    = */ penalty_freq,
-            /* .penalty_present = */ penalty_present,
-            /* .prev            = */ ring_buffer<llama_token>(penalty_last_n),
-            /* .token_count     = */ {},
-        }
+        /* .ctx   = */ ctx
     );
 }
 
@@ -1828,7 +2076,7 @@ struct llama_sampler_dry {
 
     std::unordered_multimap<llama_token, std::vector<llama_token>> dry_processed_breakers;
     std::vector<int> dry_repeat_count;
-    std::unordered_map<llama_token, int> dry_max_token_repeat;
+    std::vector<std::pair<llama_token, int>> dry_max_token_repeat; // (token, max repeat length), sorted by token
     ring_buffer<llama_token> last_tokens;
 };
 
@@ -2048,14 +2296,18 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
             // By convention, the value of `repeat_len` only includes the tokens currently
             // in the context, not the new token that would be added.
             llama_token token = ctx->last_tokens.rat(last_n_repeat - 2 - i);
-            // Track the maximum sequence ending in this token.
-            const auto& it = ctx->dry_max_token_repeat.find(token);
-            if (it == ctx->dry_max_token_repeat.end() || it->second < repeat_len) {
-                ctx->dry_max_token_repeat[token] = repeat_len;
-            }
+            ctx->dry_max_token_repeat.emplace_back(token, repeat_len);
         }
     }
 
+    // Track the maximum sequence ending in each token.
+    std::sort(ctx->dry_max_token_repeat.begin(), ctx->dry_max_token_repeat.end(), [](const auto & a, const auto & b) {
+        return a.first < b.first || (a.first == b.first && a.second > b.second);
+    });
+    ctx->dry_max_token_repeat.erase(std::unique(ctx->dry_max_token_repeat.begin(), ctx->dry_max_token_repeat.end(), [](const auto & a, const auto & b) {
+        return a.first == b.first;
+    }), ctx->dry_max_token_repeat.end());
+
     // Step 4: Apply logit penalties based on the maximum repeat length for relevant tokens.
 
     // Prevent floating point overflow in `pow(penalty_base, exponent)` by clamping to `max_exponent`.
@@ -2066,28 +2318,49 @@ static void llama_sampler_dry_apply(struct llama_sampler * smpl, llama_token_dat
         max_exponent = FLOAT_MAX_LOG / std::log(ctx->dry_base);
     }
 
-    for (size_t i = 0; i < cur_p->size; ++i) {
-        const auto& af_kvp = ctx->dry_max_token_repeat.find(cur_p->data[i].id);
-        if (af_kvp != ctx->dry_max_token_repeat.end()) {
-            // Check all sequence breakers starting with this token
-            auto range = ctx->dry_processed_breakers.equal_range(cur_p->data[i].id);
-            bool is_single_token_breaker = false;
-
-            for (auto it = range.first; it != range.second; ++it) {
-                if (it->second.empty()) {
-                    is_single_token_breaker = true;
-                    break;
-                }
+    const auto apply = [&](llama_token_data & cur, int repeat_len) {
+        // Check all sequence breakers starting with this token
+        auto range = ctx->dry_processed_breakers.equal_range(cur.id);
+        bool is_single_token_breaker = false;
+
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.empty()) {
+                is_single_token_breaker = true;
+                break;
             }
+        }
 
-            // Apply penalty only if it's not a single-token sequence breaker
-            if (!is_single_token_breaker) {
-                int repeat_exp = af_kvp->second - ctx->dry_allowed_length;
-                if (max_exponent > 0 && repeat_exp > max_exponent) {
-                    repeat_exp = max_exponent;
-                }
-                float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
-                cur_p->data[i].logit -= penalty;
+        // Apply penalty only if it's not a single-token sequence breaker
+        if (!is_single_token_breaker) {
+            int repeat_exp = repeat_len - ctx->dry_allowed_length;
+            if (max_exponent > 0 && repeat_exp > max_exponent) {
+                repeat_exp = max_exponent;
+            }
+            float penalty = ctx->dry_multiplier * std::pow(ctx->dry_base, repeat_exp);
+            cur.logit -= penalty;
+        }
+    };
+
+    bool indexed = true;
+    for (const auto & it : ctx->dry_max_token_repeat) {
+        if (llama_token_data_array_find_indexed(cur_p, it.first) < 0) {
+            indexed = false;
+            break;
+        }
+    }
+
+    if (indexed) {
+        // only visit the penalized tokens
+        for (const auto & it : ctx->dry_max_token_repeat) {
+            apply(cur_p->data[it.first], it.second);
+        }
+    } else {
+        for (size_t i = 0; i < cur_p->size; ++i) {
+            const auto af_kvp = std::lower_bound(ctx->dry_max_token_repeat.begin(), ctx->dry_max_token_repeat.end(), cur_p->data[i].id, [](const auto & a, llama_token token) {
+                return a.first < token;
+            });
+            if (af_kvp != ctx->dry_max_token_repeat.end() && af_kvp->first == cur_p->data[i].id) {
+                apply(cur_p->data[i], af_kvp->second);
             }
         }
     }
@@ -0,0 +1,204 @@
+#include "llama-thread-pool.h"
+
+#include <algorithm>
+#include <atomic>
+
+//
+// llama_thread_pool::task
+//
+
+void llama_thread_pool::task::run() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (state != PENDING) {
+            return;
+        }
+        state = RUNNING;
+    }
+
+    std::exception_ptr err;
+    try {
+        fn();
+    } catch (...) {
+        err = std::current_exception();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        state = DONE;
+        error = err;
+        fn    = nullptr;
+    }
+
+    cv.notify_all();
+}
+
+bool llama_thread_pool::task::done() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return state == DONE;
+}
+
+//
+// llama_thread_pool
+//
+
+llama_thread_pool::llama_thread_pool(int n_threads) {
+    threads.reserve(std::max(0, n_threads));
+    for (int i = 0; i < n_threads; ++i) {
+        threads.emplace_back(&llama_thread_pool::worker, this);
+    }
+}
+
+llama_thread_pool::~llama_thread_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+
+    cv.notify_all();
+
+    for (auto & t : threads) {
+        t.join();
+    }
+
+    // without workers, the remaining tasks are run here
+    for (auto & fn : queue) {
+        fn();
+    }
+}
+
+int llama_thread_pool::n_threads() const {
+    return (int) threads.size();
+}
+
+void llama_thread_pool::worker() {
+    while (true) {
+        std::function<void()> fn;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stop || !queue.empty(); });
+
+            if (queue.empty()) {
+                return;
+            }
+
+            fn = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        fn();
+    }
+}
+
+llama_thread_pool::task_ptr llama_thread_pool::submit(std::function<void()> fn) {
+    auto t = std::make_shared<task>(std::move(fn));
+
+    if (threads.empty()) {
+        t->run();
+        return t;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.emplace_back([t] { t->run(); });
+    }
+
+    cv.notify_one();
+
+    return t;
+}
+
+void llama_thread_pool::wait(const task_ptr & t) {
+    if (!t) {
+        return;
+    }
+
+    t->run();
+
+    std::unique_lock<std::mutex> lock(t->mutex);
+    t->cv.wait(lock, [&] { return t->state == task::DONE; });
+
+    if (t->error) {
+        std::rethrow_exception(t->error);
+    }
+}
+
+void llama_thread_pool::parallel_for(int64_t n, const std::function<void(int64_t)> & fn, int n_threads_max) {
+    if (n <= 0) {
+        return;
+    }
+
+    int64_t n_helpers = std::min<int64_t>(threads.size(), n - 1);
+    if (n_threads_max > 0) {
+        n_helpers = std::min<int64_t>(n_helpers, n_threads_max - 1);
+    }
+
+    if (n_helpers <= 0) {
+        for (int64_t i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    struct loop_state {
+        std::atomic<int64_t> i_next { 0 };
+        std::atomic<bool>    failed { false };
+
+        std::mutex              mutex;
+        std::condition_variable cv;
+
+        int64_t            n_done = 0;
+        std::exception_ptr error;
+    };
+
+    auto st = std::make_shared<loop_state>();
+
+    // fn is only called for the items that are not yet done, and the calling thread waits for all of them, so a helper
+    // that starts after the loop has returned does not access it
+    const auto * pfn = &fn;
+
+    auto loop = [st, pfn, n]() {
+        int64_t n_local = 0;
+
+        for (int64_t i = st->i_next.fetch_add(1); i < n; i = st->i_next.fetch_add(1)) {
+            if (!st->failed.load(std::memory_order_relaxed)) {
+                try {
+                    (*pfn)(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(st->mutex);
+                    if (!st->error) {
+                        st->error = std::current_exception();
+                    }
+                    st->failed = true;
+                }
+            }
+            n_local++;
+        }
+
+        if (n_local > 0) {
+            std::lock_guard<std::mutex> lock(st->mutex);
+            st->n_done += n_local;
+            if (st->n_done == n) {
+                st->cv.notify_all();
+            }
+        }
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int64_t i = 0; i < n_helpers; ++i) {
+            queue.emplace_back(loop);
+        }
+    }
+
+    cv.notify_all();
+
+    loop();
+
+    std::unique_lock<std::mutex> lock(st->mutex);
+    st->cv.wait(lock, [&] { return st->n_done == n; });
+
+    if (st->error) {
+        std::rethrow_exception(st->error);
+    }
+}
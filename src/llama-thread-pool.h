@@ -0,0 +1,84 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// llama_thread_pool
+//
+
+// a fixed set of worker threads for the CPU work of the library that runs next to the ggml compute threads:
+//  - background tasks (submit/wait), e.g. an asynchronous decode or a KV cache migration
+//  - parallel loops (parallel_for), e.g. batched sampling or state copies
+// the threads are created once and sleep while there is no work
+class llama_thread_pool {
+public:
+    class task;
+
+    using task_ptr = std::shared_ptr<task>;
+
+    // n_threads worker threads, in addition to the threads that call parallel_for()
+    explicit llama_thread_pool(int n_threads);
+
+    // the tasks that were already submitted are completed before the threads exit
+    ~llama_thread_pool();
+
+    llama_thread_pool(const llama_thread_pool &) = delete;
+    llama_thread_pool & operator=(const llama_thread_pool &) = delete;
+
+    int n_threads() const;
+
+    // run fn on one of the worker threads
+    task_ptr submit(std::function<void()> fn);
+
+    // wait until the task is done - runs it on the calling thread if no worker has started it yet, so that waiting
+    // from a worker thread cannot deadlock
+    // rethrows the exception thrown by the task
+    static void wait(const task_ptr & t);
+
+    // run fn(i) for i in [0, n) on the calling thread and up to n_threads_max - 1 worker threads, and return when all
+    // items are done (n_threads_max <= 0: all workers)
+    // the calling thread processes items as well, so the loop completes even if all workers are busy
+    // after the first exception thrown by fn the remaining items are skipped, and the exception is rethrown
+    void parallel_for(int64_t n, const std::function<void(int64_t)> & fn, int n_threads_max = 0);
+
+private:
+    void worker();
+
+    std::vector<std::thread> threads;
+
+    std::mutex                        mutex;
+    std::condition_variable           cv;
+    std::deque<std::function<void()>> queue;
+
+    bool stop = false;
+};
+
+class llama_thread_pool::task {
+public:
+    explicit task(std::function<void()> fn) : fn(std::move(fn)) {}
+
+    // run the task unless another thread has already started it
+    void run();
+
+    bool done();
+
+private:
+    friend class llama_thread_pool;
+
+    std::function<void()> fn;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    enum { PENDING, RUNNING, DONE } state = PENDING;
+
+    std::exception_ptr error;
+};
@@ -4,20 +4,26 @@
 #include "gguf.h"
 #include "llama-impl.h"
 #include "llama-model-loader.h"
+#include "llama-thread-pool.h"
 
 #include "unicode.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cfloat>
 #include <cstdarg>
 #include <cstring>
+#include <exception>
 #include <forward_list>
 #include <limits>
 #include <map>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 
 //
@@ -67,6 +73,11 @@ struct naive_trie {
     llama_token value;
 };
 
+// locale independent
+static bool llama_is_ascii_letter(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
 //
 // tokenizers
 //
@@ -275,168 +286,175 @@ struct llm_bigram_bpe {
     size_t size;
 };
 
+std::vector<std::string> llama_vocab::get_bpe_regex_exprs(enum llama_vocab_pre_type pre_type) {
+    std::vector<std::string> regex_exprs;
+
+    switch (pre_type) {
+        case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                //"(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+
+                // adapted: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2080233989
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_DBRX:
+        case LLAMA_VOCAB_PRE_TYPE_SMAUG:
+            regex_exprs = {
+                // same as llama3
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_LLM:
+            regex_exprs = {
+                "[\r\n]",
+                "\\s?[A-Za-zµÀ-ÖØ-öø-ƺƼ-ƿǄ-ʓʕ-ʯͰ-ͳͶͷͻ-ͽͿΆΈ-ΊΌΎ-ΡΣ-ϵϷ-ҁҊ-ԯԱ-ՖႠ-ჅᎠ-Ᏽᏸ-ᏽᲐ-ᲺᲽ-Ჿᴀ-ᴫᵫ-ᵷᵹ-ᶚḀ-ἕἘ-Ἕἠ-ὅὈ-Ὅὐ-ὗὙὛὝὟ-ώᾀ-ᾴᾶ-ᾼιῂ-ῄῆ-ῌῐ-ΐῖ-Ίῠ-Ῥῲ-ῴῶ-ῼℂℇℊ-ℓℕℙ-ℝℤΩℨK-ℭℯ-ℴℹℼ-ℿⅅ-ⅉⅎↃↄⰀ-ⱻⱾ-ⳤⳫ-ⳮⳲⳳꙀ-ꙭꚀ-ꚛꜢ-ꝯꝱ-ꞇꞋ-ꞎꭰ-ꮿﬀ-ﬆﬓ-ﬗＡ-Ｚａ-ｚ𐐀-𐑏𐒰-𐓓𐓘-𐓻𐲀-𐲲𐳀-𐳲𑢠-𑣟𞤀-𞥃]+",
+                "\\s?[!-/:-~！-／：-～‘-‟　-。]+",
+                "\\s+$",
+                "[一-龥ࠀ-一가-퟿]+",
+                "\\p{N}+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK3_LLM:
+            regex_exprs = {
+                "\\p{N}{1,3}",
+                "[一-龥぀-ゟ゠-ヿ]+",
+                "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_CODER:
+            regex_exprs = {
+                "[\r\n]",
+                "\\s?\\p{L}+",
+                "\\s?\\p{P}+",
+                "[一-龥ࠀ-一가-퟿]+",
+                "\\p{N}",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_FALCON:
+            regex_exprs = {
+                "[\\p{P}\\$\\+<=>\\^~\\|`]+",
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+                "[0-9][0-9][0-9]",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_STARCODER:
+        case LLAMA_VOCAB_PRE_TYPE_REFACT:
+        case LLAMA_VOCAB_PRE_TYPE_COMMAND_R:
+        case LLAMA_VOCAB_PRE_TYPE_SMOLLM:
+        case LLAMA_VOCAB_PRE_TYPE_CODESHELL:
+        case LLAMA_VOCAB_PRE_TYPE_EXAONE:
+        case LLAMA_VOCAB_PRE_TYPE_MINERVA:
+            regex_exprs = {
+                "\\p{N}",
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_GPT2:
+        case LLAMA_VOCAB_PRE_TYPE_MPT:
+        case LLAMA_VOCAB_PRE_TYPE_OLMO:
+        case LLAMA_VOCAB_PRE_TYPE_JAIS:
+        case LLAMA_VOCAB_PRE_TYPE_TRILLION:
+            regex_exprs = {
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_STABLELM2:
+        case LLAMA_VOCAB_PRE_TYPE_QWEN2:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_PORO:
+        case LLAMA_VOCAB_PRE_TYPE_BLOOM:
+        case LLAMA_VOCAB_PRE_TYPE_GPT3_FINNISH:
+            regex_exprs = {
+                " ?[^(\\s|.,!?…。，、।۔،)]+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_CHATGLM4:
+            regex_exprs = {
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_VIKING:
+            regex_exprs = {
+                " ?[^(\\s|.,!?…。，、।۔،)]+",
+                "\\p{N}",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_TEKKEN:
+            // original regex from tokenizer.json
+            // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
+            regex_exprs = {
+                "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_CHAMELEON:
+            // Note: in theory, the special token (sentinel and image token) regex_exprs below
+            // are unnecessary, as they are split in `tokenizer_st_partition` anyway.
+            // However, since the upstream pre-tokenizer uses them, they are also
+            // included here (see https://huggingface.co/facebook/chameleon-7b).
+            regex_exprs = {
+                "<sentinel:[0-9]+>",  // Sentinel tokens
+                "(IMGIMG)((A|B|C|D|E|F|G|H|I){1,4})Z",  // Image tokens
+                "([\\t\\n]|    |  )",  // directly from tokenizer.json
+                "\\p{N}", // Individual digits
+                "[\\p{P}!-/:-@\\[-`{-~]",  // Punctuation, Isolated
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_GPT4O:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+                "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_SUPERBPE:
+            regex_exprs = {
+                "\\p{N}+",
+                "(?=(\\d{3})+(?!\\d))",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_BAILINGMOE:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                // "'(?i:[sdmt]|ll|ve|re)|[^\\r\\n\\p{L}\\p{N}]?+\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]++[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+"
+                // FIXME? Changed possessive quantifiers (?+ and ++) to greedy to avoid errors and imatrix hanging (tried atomic grouping but it's not supported?)
+                "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        case LLAMA_VOCAB_PRE_TYPE_SEED_CODER:
+            regex_exprs = {
+                // original regex from tokenizer.json
+                // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\r\n]+|\\s*[\r\n]+|\\s+(?!\\S)|\\s+"
+                "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            };
+            break;
+        default:
+            // default regex for BPE tokenization pre-processing
+            regex_exprs = {
+                "[\\p{P}\\$\\+<=>\\^~\\|]+",
+                "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
+                "\\p{N}+",
+                "[0-9][0-9][0-9]",
+            };
+            break;
+    }
+
+    return regex_exprs;
+}
+
 struct llm_tokenizer_bpe : llm_tokenizer {
-    llm_tokenizer_bpe(const llama_vocab & vocab) {
+    llm_tokenizer_bpe(const llama_vocab & vocab) : regex_exprs(llama_vocab::get_bpe_regex_exprs(vocab.get_pre_type())) {
         GGML_ASSERT(vocab.get_type() == LLAMA_VOCAB_TYPE_BPE);
-        switch (vocab.get_pre_type()) {
-            case LLAMA_VOCAB_PRE_TYPE_LLAMA3:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    //"(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-
-                    // adapted: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2080233989
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DBRX:
-            case LLAMA_VOCAB_PRE_TYPE_SMAUG:
-                regex_exprs = {
-                    // same as llama3
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_LLM:
-                regex_exprs = {
-                    "[\r\n]",
-                    "\\s?[A-Za-zµÀ-ÖØ-öø-ƺƼ-ƿǄ-ʓʕ-ʯͰ-ͳͶͷͻ-ͽͿΆΈ-ΊΌΎ-ΡΣ-ϵϷ-ҁҊ-ԯԱ-ՖႠ-ჅᎠ-Ᏽᏸ-ᏽᲐ-ᲺᲽ-Ჿᴀ-ᴫᵫ-ᵷᵹ-ᶚḀ-ἕἘ-Ἕἠ-ὅὈ-Ὅὐ-ὗὙὛὝὟ-ώᾀ-ᾴᾶ-ᾼιῂ-ῄῆ-ῌῐ-ΐῖ-Ίῠ-Ῥῲ-ῴῶ-ῼℂℇℊ-ℓℕℙ-ℝℤΩℨK-ℭℯ-ℴℹℼ-ℿⅅ-ⅉⅎↃↄⰀ-ⱻⱾ-ⳤⳫ-ⳮⳲⳳꙀ-ꙭꚀ-ꚛꜢ-ꝯꝱ-ꞇꞋ-ꞎꭰ-ꮿﬀ-ﬆﬓ-ﬗＡ-Ｚａ-ｚ𐐀-𐑏𐒰-𐓓𐓘-𐓻𐲀-𐲲𐳀-𐳲𑢠-𑣟𞤀-𞥃]+",
-                    "\\s?[!-/:-~！-／：-～‘-‟　-。]+",
-                    "\\s+$",
-                    "[一-龥ࠀ-一가-퟿]+",
-                    "\\p{N}+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK3_LLM:
-                regex_exprs = {
-                    "\\p{N}{1,3}",
-                    "[一-龥぀-ゟ゠-ヿ]+",
-                    "[!\"#$%&'()*+,\\-./:;<=>?@\\[\\\\\\]^_`{|}~][A-Za-z]+|[^\r\n\\p{L}\\p{P}\\p{S}]?[\\p{L}\\p{M}]+| ?[\\p{P}\\p{S}]+[\r\n]*|\\s*[\r\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_CODER:
-                regex_exprs = {
-                    "[\r\n]",
-                    "\\s?\\p{L}+",
-                    "\\s?\\p{P}+",
-                    "[一-龥ࠀ-一가-퟿]+",
-                    "\\p{N}",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_FALCON:
-                regex_exprs = {
-                    "[\\p{P}\\$\\+<=>\\^~\\|`]+",
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                    "[0-9][0-9][0-9]",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_STARCODER:
-            case LLAMA_VOCAB_PRE_TYPE_REFACT:
-            case LLAMA_VOCAB_PRE_TYPE_COMMAND_R:
-            case LLAMA_VOCAB_PRE_TYPE_SMOLLM:
-            case LLAMA_VOCAB_PRE_TYPE_CODESHELL:
-            case LLAMA_VOCAB_PRE_TYPE_EXAONE:
-            case LLAMA_VOCAB_PRE_TYPE_MINERVA:
-                regex_exprs = {
-                    "\\p{N}",
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_GPT2:
-            case LLAMA_VOCAB_PRE_TYPE_MPT:
-            case LLAMA_VOCAB_PRE_TYPE_OLMO:
-            case LLAMA_VOCAB_PRE_TYPE_JAIS:
-            case LLAMA_VOCAB_PRE_TYPE_TRILLION:
-                regex_exprs = {
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_STABLELM2:
-            case LLAMA_VOCAB_PRE_TYPE_QWEN2:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_PORO:
-            case LLAMA_VOCAB_PRE_TYPE_BLOOM:
-            case LLAMA_VOCAB_PRE_TYPE_GPT3_FINNISH:
-                regex_exprs = {
-                    " ?[^(\\s|.,!?…。，、।۔،)]+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_CHATGLM4:
-                regex_exprs = {
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_VIKING:
-                regex_exprs = {
-                    " ?[^(\\s|.,!?…。，、।۔،)]+",
-                    "\\p{N}",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_TEKKEN:
-                // original regex from tokenizer.json
-                // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+"
-                regex_exprs = {
-                    "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_CHAMELEON:
-                // Note: in theory, the special token (sentinel and image token) regex_exprs below
-                // are unnecessary, as they are split in `tokenizer_st_partition` anyway.
-                // However, since the upstream pre-tokenizer uses them, they are also
-                // included here (see https://huggingface.co/facebook/chameleon-7b).
-                regex_exprs = {
-                    "<sentinel:[0-9]+>",  // Sentinel tokens
-                    "(IMGIMG)((A|B|C|D|E|F|G|H|I){1,4})Z",  // Image tokens
-                    "([\\t\\n]|    |  )",  // directly from tokenizer.json
-                    "\\p{N}", // Individual digits
-                    "[\\p{P}!-/:-@\\[-`{-~]",  // Punctuation, Isolated
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_GPT4O:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?|[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                    "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_SUPERBPE:
-                regex_exprs = {
-                    "\\p{N}+",
-                    "(?=(\\d{3})+(?!\\d))",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_BAILINGMOE:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "'(?i:[sdmt]|ll|ve|re)|[^\\r\\n\\p{L}\\p{N}]?+\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]++[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+"
-                    // FIXME? Changed possessive quantifiers (?+ and ++) to greedy to avoid errors and imatrix hanging (tried atomic grouping but it's not supported?)
-                    "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            case LLAMA_VOCAB_PRE_TYPE_SEED_CODER:
-                regex_exprs = {
-                    // original regex from tokenizer.json
-                    // "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\r\n]+|\\s*[\r\n]+|\\s+(?!\\S)|\\s+"
-                    "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
-                };
-                break;
-            default:
-                // default regex for BPE tokenization pre-processing
-                regex_exprs = {
-                    "[\\p{P}\\$\\+<=>\\^~\\|]+",
-                    "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)",
-                    "\\p{N}+",
-                    "[0-9][0-9][0-9]",
-                };
-                break;
-        }
     }
 
-    std::vector<std::string> regex_exprs;
+    const std::vector<std::string> regex_exprs;
 };
 
 struct llm_tokenizer_bpe_session {
@@ -480,111 +498,109 @@ struct llm_tokenizer_bpe_session {
     }
 
     void tokenize(const std::string & text, std::vector<llama_token> & output) {
-        int final_prev_index = -1;
         const auto word_collection = unicode_regex_split(text, tokenizer.regex_exprs);
 
-        symbols_final.clear();
-
         for (const auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
-            symbols.clear();
+            // the merges only depend on the word, long texts repeat the same words a lot
+            auto it = cache.find(word);
+            if (it == cache.end()) {
+                if (cache.size() >= MAX_CACHE_SIZE) {
+                    cache.clear();
+                }
+                it = cache.emplace(word, tokenize_word(word)).first;
+            }
 
-            int index = 0;
-            size_t offset = 0;
+            output.insert(output.end(), it->second.begin(), it->second.end());
+        }
+    }
 
-            //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-            if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
-                symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
-                offset = word.size();
-            }
+private:
+    static constexpr size_t MAX_CACHE_SIZE = 65536;
 
-            while (offset < word.size()) {
-                llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = char_len;
-                offset += sym.n;
-                sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
-                index++;
-                symbols.emplace_back(sym);
-            }
-            for (int i = 1; i < (int) symbols.size(); ++i) {
-                add_new_bigram(i - 1, i);
-            }
+    std::vector<llama_token> tokenize_word(const std::string & word) {
+        std::vector<llama_token> output;
+
+        work_queue = llm_bigram_bpe::queue();
+        symbols.clear();
 
-            // build token(s)
-            while (!work_queue.empty()) {
-                auto bigram = work_queue.pop_move();
+        int index = 0;
+        size_t offset = 0;
 
-                auto & left_symbol = symbols[bigram.left];
-                auto & right_symbol = symbols[bigram.right];
+        //if (vocab.tokenizer_ignore_merges && vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
+        if (vocab.get_ignore_merges() && vocab.text_to_token(word) != LLAMA_TOKEN_NULL) {
+            symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+            offset = word.size();
+        }
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
-                    continue;
-                }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
+        while (offset < word.size()) {
+            llm_symbol sym;
+            size_t char_len = std::min(word.size() - offset, (size_t) unicode_len_utf8(word[offset]));
+            sym.text = word.c_str() + offset;
+            sym.n = char_len;
+            offset += sym.n;
+            sym.prev = index - 1;
+            sym.next = offset == word.size() ? -1 : index + 1;
+            index++;
+            symbols.emplace_back(sym);
+        }
+        for (int i = 1; i < (int) symbols.size(); ++i) {
+            add_new_bigram(i - 1, i);
+        }
 
-                // merge the right sym into the left one
-                left_symbol.n += right_symbol.n;
-                right_symbol.n = 0;
+        // build token(s)
+        while (!work_queue.empty()) {
+            auto bigram = work_queue.pop_move();
 
-                // remove the right sym from the chain
-                left_symbol.next = right_symbol.next;
-                if (right_symbol.next >= 0) {
-                    symbols[right_symbol.next].prev = bigram.left;
-                }
+            auto & left_symbol = symbols[bigram.left];
+            auto & right_symbol = symbols[bigram.right];
 
-                add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
-                add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+            if (left_symbol.n == 0 || right_symbol.n == 0) {
+                continue;
+            }
+            std::string left_token = std::string(left_symbol.text, left_symbol.n);
+            std::string right_token = std::string(right_symbol.text, right_symbol.n);
+            if (left_token + right_token != bigram.text) {
+                continue;  // Skip this bigram if it's outdated
             }
 
-            // add the finished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            // merge the right sym into the left one
+            left_symbol.n += right_symbol.n;
+            right_symbol.n = 0;
+
+            // remove the right sym from the chain
+            left_symbol.next = right_symbol.next;
+            if (right_symbol.next >= 0) {
+                symbols[right_symbol.next].prev = bigram.left;
             }
-        }
 
-        symbols = symbols_final;
+            add_new_bigram(left_symbol.prev, bigram.left);  // left side of current symbol
+            add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
+        }
 
-        if (!symbols.empty()) {
-            for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+        for (const auto & symbol : symbols) {
+            if (symbol.n == 0) {
+                continue;
+            }
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.text_to_token(str);
+            const std::string str = std::string(symbol.text, symbol.n);
+            const auto token = vocab.text_to_token(str);
 
-                if (token == LLAMA_TOKEN_NULL) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.text_to_token(byte_str);
-                        if (token_multibyte != LLAMA_TOKEN_NULL) {
-                            output.push_back(token_multibyte);
-                        }
+            if (token == LLAMA_TOKEN_NULL) {
+                for (auto j = str.begin(); j != str.end(); ++j) {
+                    std::string byte_str(1, *j);
+                    auto token_multibyte = vocab.text_to_token(byte_str);
+                    if (token_multibyte != LLAMA_TOKEN_NULL) {
+                        output.push_back(token_multibyte);
                     }
-                } else {
-                    output.push_back(token);
                 }
+            } else {
+                output.push_back(token);
             }
         }
+
+        return output;
     }
 
-private:
     void add_new_bigram(int left, int right) {
         if (left == -1 || right == -1) {
             return;
@@ -615,8 +631,9 @@ private:
     const llm_tokenizer_bpe & tokenizer;
 
     std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
     llm_bigram_bpe::queue work_queue;
+
+    std::unordered_map<std::string, std::vector<llama_token>> cache;
 };
 
 //
@@ -1281,6 +1298,10 @@ struct llama_vocab::impl {
 
     std::vector<llama_token> cache_special_tokens;
     std::vector<std::string> cache_token_to_piece; // llama_token_to_piece(special = true);
+
+    // the raw text can be split before a space between two ASCII letters without changing the tokens
+    bool split_raw_text = false;
+
     struct pair_hash {
         size_t operator()(const std::pair<std::string, std::string> & p) const {
             return std::hash<std::string>{}(p.first) ^  //create some hash for pair
@@ -1296,6 +1317,10 @@ struct llama_vocab::impl {
 
     std::vector<char> precompiled_charsmap;
 
+    // threads of tokenize_batch, see get_pool()
+    mutable std::unique_ptr<llama_thread_pool> pool;
+    mutable std::mutex                         pool_mutex;
+
     impl(const llama_vocab & vocab) : vocab(vocab) {
     }
 
@@ -1321,7 +1346,13 @@ struct llama_vocab::impl {
 
     void init_tokenizer(enum llama_vocab_type type);
 
+    llama_thread_pool & get_pool() const;
+
+    // run fn(ith, i) for each i in [0, n) on the calling thread and up to n_threads - 1 threads of the pool
+    void parallel_for(int32_t n_threads, size_t n, const std::function<void(int, size_t)> & fn) const;
+
     void tokenizer_st_partition(std::forward_list<fragment_buffer_variant> & buffer, bool parse_special) const;
+    void tokenizer_split_raw_text(std::forward_list<fragment_buffer_variant> & buffer, size_t max_length) const;
 
     std::string token_to_piece_for_cache(
                   llama_token   token,
@@ -1341,6 +1372,12 @@ struct llama_vocab::impl {
                          bool   add_special,
                          bool   parse_special) const;
 
+    std::vector<std::vector<llama_token>> tokenize_batch(
+            const std::vector<std::string> & raw_texts,
+                                     bool   add_special,
+                                     bool   parse_special,
+                                  int32_t   n_threads) const;
+
     // does not write null-terminator to buf
     int32_t token_to_piece(
                   llama_token   token,
@@ -1435,7 +1472,9 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
             const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
             for (int i = 0; i < n_merges; i++) {
-                const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
+                size_t len = 0;
+                const char * str = gguf_get_arr_str_n(ctx, merges_keyidx, i, &len);
+                const std::string_view word(str, len);
                 //GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
 
                 std::string first;
@@ -1443,12 +1482,12 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
 
                 const size_t pos = word.find(' ', 1);
 
-                if (pos != std::string::npos) {
+                if (pos != std::string_view::npos) {
                     first  = word.substr(0, pos);
                     second = word.substr(pos + 1);
                 }
 
-                bpe_ranks.emplace(std::make_pair(first, second), i);
+                bpe_ranks.emplace(std::make_pair(std::move(first), std::move(second)), i);
             }
 
             // default special tokens
@@ -1711,7 +1750,10 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
     id_to_token.resize(n_tokens);
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        std::string word = gguf_get_arr_str(ctx, token_idx, i);
+        size_t len = 0;
+        const char * str = gguf_get_arr_str_n(ctx, token_idx, i, &len);
+
+        std::string word(str, len);
         if (word.empty()) {
             LLAMA_LOG_WARN("%s: empty token at index %u\n", __func__, i);
             word = "[EMPTY_" + std::to_string(i) + "]";
@@ -2048,6 +2090,37 @@ void llama_vocab::impl::load(llama_model_loader & ml, const LLM_KV & kv) {
         LLAMA_LOG_INFO("%s: special tokens cache size = %u\n", __func__, (uint32_t) cache_special_tokens.size());
     }
 
+    // check if the raw text can be tokenized in pieces, see tokenizer_split_raw_text()
+    {
+        switch (type) {
+            case LLAMA_VOCAB_TYPE_BPE:
+            case LLAMA_VOCAB_TYPE_WPM:
+                // the pre-tokenizers always end a word at a space that follows a letter
+                split_raw_text = true;
+                break;
+            case LLAMA_VOCAB_TYPE_SPM:
+                // the merges cannot cross an escaped space that follows a letter, unless a token does
+                split_raw_text = true;
+                for (const auto & token_data : id_to_token) {
+                    const auto & text = token_data.text;
+                    for (size_t pos = text.find("\xe2\x96\x81", 1); pos != std::string::npos; pos = text.find("\xe2\x96\x81", pos + 1)) {
+                        if (llama_is_ascii_letter(text[pos - 1])) {
+                            split_raw_text = false;
+                            break;
+                        }
+                    }
+                    if (!split_raw_text) {
+                        break;
+                    }
+                }
+                break;
+            default:
+                // UGM normalizes the whitespace of the whole text, RWKV tokens can contain spaces
+                split_raw_text = false;
+                break;
+        }
+    }
+
     // build token to piece cache
     {
         size_t size_cache = 0;
@@ -2352,6 +2425,60 @@ void llama_vocab::impl::tokenizer_st_partition(std::forward_list<fragment_buffer
     }
 }
 
+// split the raw text fragments that are longer than max_length into pieces that are tokenized independently
+// a piece can only start at a space between two ASCII letters - the pre-tokenizers and the merges never cross it
+void llama_vocab::impl::tokenizer_split_raw_text(std::forward_list<fragment_buffer_variant> & buffer, size_t max_length) const {
+    if (!split_raw_text) {
+        return;
+    }
+
+    auto prev = buffer.before_begin();
+    for (auto it = buffer.begin(); it != buffer.end(); prev = it, ++it) {
+        if (it->type != FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT || it->length <= max_length) {
+            continue;
+        }
+
+        const std::string & raw_text = it->raw_text;
+
+        const size_t end = it->offset + it->length;
+
+        std::vector<size_t> splits;
+
+        for (size_t pos = it->offset + max_length; pos + 1 < end; ) {
+            const char * space = (const char *) memchr(raw_text.data() + pos, ' ', end - 1 - pos);
+            if (space == nullptr) {
+                break;
+            }
+
+            pos = space - raw_text.data();
+
+            if (llama_is_ascii_letter(raw_text[pos - 1]) && llama_is_ascii_letter(raw_text[pos + 1])) {
+                splits.push_back(pos);
+                pos += max_length;
+            } else {
+                pos++;
+            }
+        }
+
+        if (splits.empty()) {
+            continue;
+        }
+
+        // replace the fragment with its pieces
+        auto last = it;
+        size_t offset = it->offset;
+        for (const size_t split : splits) {
+            last = buffer.emplace_after(last, raw_text, offset, split - offset);
+            offset = split;
+        }
+        last = buffer.emplace_after(last, raw_text, offset, end - offset);
+
+        buffer.erase_after(prev);
+
+        it = last;
+    }
+}
+
 // NOTE: avoid ever using this except for building the token_to_piece caches
 std::string llama_vocab::impl::token_to_piece_for_cache(llama_token token, bool special) const {
     std::string piece;
@@ -2401,175 +2528,243 @@ std::vector<llama_token> llama_vocab::impl::tokenize(
         const std::string & raw_text,
         bool add_special,
         bool parse_special) const {
+    return tokenize_batch({ raw_text }, add_special, parse_special, 1)[0];
+}
+
+llama_thread_pool & llama_vocab::impl::get_pool() const {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+
+    // created on the first call with more than one thread, the workers sleep while there are no batches to tokenize
+    if (!pool) {
+        pool = std::make_unique<llama_thread_pool>((int) std::max(1u, std::thread::hardware_concurrency()) - 1);
+    }
+
+    return *pool;
+}
+
+void llama_vocab::impl::parallel_for(int32_t n_threads, size_t n, const std::function<void(int, size_t)> & fn) const {
+    n_threads = (int32_t) std::max<size_t>(1, std::min<size_t>(n_threads, n));
+
+    if (n_threads == 1) {
+        for (size_t i = 0; i < n; ++i) {
+            fn(0, i);
+        }
+        return;
+    }
+
+    // one pool item per thread index, so that fn can keep per-thread state in a vector indexed by ith
+    std::atomic<size_t> next = 0;
+
+    get_pool().parallel_for(n_threads, [&](int64_t ith) {
+        try {
+            for (size_t i = next++; i < n; i = next++) {
+                fn((int) ith, i);
+            }
+        } catch (...) {
+            next = n;
+            throw;
+        }
+    }, n_threads);
+}
+
+std::vector<std::vector<llama_token>> llama_vocab::impl::tokenize_batch(
+        const std::vector<std::string> & raw_texts,
+        bool add_special,
+        bool parse_special,
+        int32_t n_threads) const {
     GGML_ASSERT(tokenizer && "Tokenizer not initialized. Call llama_vocab::init_tokenizer() first.");
 
-    std::vector<llama_token> output;
-    std::forward_list<fragment_buffer_variant> fragment_buffer;
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    const size_t n_texts = raw_texts.size();
 
-    if (!raw_text.empty()) {
-        fragment_buffer.emplace_front(raw_text, 0, raw_text.length());
-        tokenizer_st_partition(fragment_buffer, parse_special);
+    // split the long raw text fragments in a few pieces per thread
+    size_t max_length = std::numeric_limits<size_t>::max();
+    if (n_threads > 1) {
+        size_t n_bytes = 0;
+        for (const auto & raw_text : raw_texts) {
+            n_bytes += raw_text.size();
+        }
+        max_length = std::max<size_t>(32*1024, n_bytes/(4*n_threads));
     }
 
-    switch (get_type()) {
-        case LLAMA_VOCAB_TYPE_SPM:
-            {
-                // OG tokenizer behavior:
-                //
-                // tokenizer.encode('', add_special_tokens=True)  returns [1]
-                // tokenizer.encode('', add_special_tokens=False) returns []
-
-                bool is_prev_special = true;  // prefix with space if first token
-
-                if (add_special && add_bos) {
-                    GGML_ASSERT(special_bos_id != LLAMA_TOKEN_NULL);
-                    output.push_back(special_bos_id);
-                    is_prev_special = true;
-                }
+    std::vector<std::forward_list<fragment_buffer_variant>> fragment_buffers(n_texts);
 
-                for (const auto & fragment : fragment_buffer) {
-                    if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                        std::string text;
+    parallel_for(n_threads, n_texts, [&](int /*ith*/, size_t i) {
+        if (!raw_texts[i].empty()) {
+            fragment_buffers[i].emplace_front(raw_texts[i], 0, raw_texts[i].length());
+            tokenizer_st_partition(fragment_buffers[i], parse_special);
+            tokenizer_split_raw_text(fragment_buffers[i], max_length);
+        }
+    });
 
-                        // prefix with space if previous is special
-                        if (add_space_prefix && is_prev_special) {
-                            text = ' ';
-                        }
+    // the raw text fragments of all texts, in order
+    struct raw_fragment {
+        const fragment_buffer_variant * fragment;
 
-                        text += fragment.raw_text.substr(fragment.offset, fragment.length);
+        bool space_prefix; // SPM: prefix with space if previous is special
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
-#endif
-                        llama_escape_whitespace(text);
-                        llm_tokenizer_spm_session session(vocab);
-                        session.tokenize(text, output);
-                        is_prev_special = false;
-                    } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
-                        output.push_back(fragment.token);
-                        is_prev_special = true;
-                    }
-                }
+        std::vector<llama_token> output;
+    };
 
-                if (add_special && add_bos && output.size() >= 2 && output[1] == special_bos_id) {
-                    LLAMA_LOG_WARN(
-                        "%s: Added a BOS token to the prompt as specified by the model but the prompt "
-                        "also starts with a BOS token. So now the final prompt starts with 2 BOS tokens. "
-                        "Are you sure this is what you want?\n", __FUNCTION__);
-                }
+    std::vector<raw_fragment> raw_fragments;
 
-                if (add_special && add_eos) {
-                    GGML_ASSERT(special_eos_id != LLAMA_TOKEN_NULL);
-                    output.push_back(special_eos_id);
-                }
-            } break;
-        case LLAMA_VOCAB_TYPE_BPE:
-            {
-                llm_tokenizer_bpe_session session(vocab, *static_cast<const llm_tokenizer_bpe *>(tokenizer.get()));
-                // it calls some other methods that are not exist in llm_tokenizer,
-                // here just cast it to bpe tokenizer object
-                if (add_special) {
-                    session.append_bos(output);
-                }
-                for (const auto & fragment : fragment_buffer) {
-                    if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                        std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
+    for (const auto & fragment_buffer : fragment_buffers) {
+        bool is_prev_special = true;  // prefix with space if first token
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
-#endif
-                        session.tokenize(text, output);
-                    } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
-                        session.append(fragment.token, output);
-                    }
-                }
+        for (const auto & fragment : fragment_buffer) {
+            if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+                raw_fragments.push_back({ &fragment, add_space_prefix && is_prev_special, {} });
+                is_prev_special = false;
+            } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
+                is_prev_special = true;
+            }
+        }
+    }
 
-                if (add_special) {
-                    session.append_eos(output);
-                    session.check_double_bos_eos(output);
-                }
-            } break;
-        case LLAMA_VOCAB_TYPE_WPM:
-            {
-                if (add_special) {
-                    GGML_ASSERT(special_bos_id != LLAMA_TOKEN_NULL);
-                    output.push_back(special_bos_id);
-                }
+    // the BPE sessions cache the merges of the words, keep one per thread
+    std::vector<std::unique_ptr<llm_tokenizer_bpe_session>> bpe_sessions(n_threads);
+
+    parallel_for(n_threads, raw_fragments.size(), [&](int ith, size_t i) {
+        const auto & fragment = *raw_fragments[i].fragment;
+        auto & output = raw_fragments[i].output;
+
+        std::string text;
 
-                llm_tokenizer_wpm_session session(vocab);
+        if (get_type() == LLAMA_VOCAB_TYPE_SPM && raw_fragments[i].space_prefix) {
+            text = ' ';
+        }
 
-                for (const auto & fragment : fragment_buffer) {
-                    if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                        std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
+        text += fragment.raw_text.substr(fragment.offset, fragment.length);
 
 #ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
+        LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
 #endif
-                        session.tokenize(text, output);
-                    } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
-                        output.push_back(fragment.token);
+
+        switch (get_type()) {
+            case LLAMA_VOCAB_TYPE_SPM:
+                {
+                    llama_escape_whitespace(text);
+                    llm_tokenizer_spm_session session(vocab);
+                    session.tokenize(text, output);
+                } break;
+            case LLAMA_VOCAB_TYPE_BPE:
+                {
+                    auto & session = bpe_sessions[ith];
+                    if (!session) {
+                        session = std::make_unique<llm_tokenizer_bpe_session>(vocab, *static_cast<const llm_tokenizer_bpe *>(tokenizer.get()));
                     }
-                }
+                    session->tokenize(text, output);
+                } break;
+            case LLAMA_VOCAB_TYPE_WPM:
+                {
+                    llm_tokenizer_wpm_session session(vocab);
+                    session.tokenize(text, output);
+                } break;
+            case LLAMA_VOCAB_TYPE_UGM:
+                {
+                    llm_tokenizer_ugm_session session(vocab, *static_cast<const llm_tokenizer_ugm *>(tokenizer.get()));
+                    session.tokenize(text, output);
+                } break;
+            case LLAMA_VOCAB_TYPE_RWKV:
+                {
+                    llm_tokenizer_rwkv_session session(vocab, *static_cast<const llm_tokenizer_rwkv *>(tokenizer.get()));
+                    session.tokenize(text, output);
+                } break;
+            case LLAMA_VOCAB_TYPE_NONE:
+                GGML_ABORT("fatal error");
+        }
+    });
 
-                if (add_special) {
-                    GGML_ASSERT(special_sep_id != LLAMA_TOKEN_NULL);
-                    output.push_back(special_sep_id);
-                }
-            } break;
-        case LLAMA_VOCAB_TYPE_UGM:
-            {
-                if (add_special && add_bos) {
-                    GGML_ASSERT(special_bos_id != LLAMA_TOKEN_NULL);
-                    output.push_back(special_bos_id);
+    // put the special tokens and the tokens of the raw text fragments together
+    std::vector<std::vector<llama_token>> outputs(n_texts);
+
+    size_t i_raw = 0;
+
+    for (size_t i = 0; i < n_texts; ++i) {
+        auto & output = outputs[i];
+
+        const auto append_fragments = [&]() {
+            for (const auto & fragment : fragment_buffers[i]) {
+                if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+                    const auto & tokens = raw_fragments[i_raw++].output;
+                    output.insert(output.end(), tokens.begin(), tokens.end());
+                } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
+                    output.push_back(fragment.token);
                 }
-                llm_tokenizer_ugm_session session(vocab, *static_cast<const llm_tokenizer_ugm *>(tokenizer.get()));
+            }
+        };
 
-                for (const auto & fragment : fragment_buffer) {
-                    if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                        std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
-#endif
-                        session.tokenize(text, output);
-                    } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
-                        output.push_back(fragment.token);
+        switch (get_type()) {
+            case LLAMA_VOCAB_TYPE_SPM:
+            case LLAMA_VOCAB_TYPE_UGM:
+                {
+                    // OG tokenizer behavior:
+                    //
+                    // tokenizer.encode('', add_special_tokens=True)  returns [1]
+                    // tokenizer.encode('', add_special_tokens=False) returns []
+
+                    if (add_special && add_bos) {
+                        GGML_ASSERT(special_bos_id != LLAMA_TOKEN_NULL);
+                        output.push_back(special_bos_id);
                     }
-                }
 
-                if (add_special && add_bos && output.size() >= 2 && output[1] == special_bos_id) {
-                    LLAMA_LOG_WARN(
-                        "%s: Added a BOS token to the prompt as specified by the model but the prompt "
-                        "also starts with a BOS token. So now the final prompt starts with 2 BOS tokens. "
-                        "Are you sure this is what you want?\n", __FUNCTION__);
-                }
+                    append_fragments();
 
-                if (add_special && add_eos) {
-                    GGML_ASSERT(special_eos_id != LLAMA_TOKEN_NULL);
-                    output.push_back(special_eos_id);
-                }
-            } break;
-        case LLAMA_VOCAB_TYPE_RWKV:
-            {
-                llm_tokenizer_rwkv_session session(vocab, *static_cast<const llm_tokenizer_rwkv *>(tokenizer.get()));
-                for (const auto & fragment : fragment_buffer) {
-                    if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-                        std::string text = fragment.raw_text.substr(fragment.offset, fragment.length);
+                    if (add_special && add_bos && output.size() >= 2 && output[1] == special_bos_id) {
+                        LLAMA_LOG_WARN(
+                            "%s: Added a BOS token to the prompt as specified by the model but the prompt "
+                            "also starts with a BOS token. So now the final prompt starts with 2 BOS tokens. "
+                            "Are you sure this is what you want?\n", __FUNCTION__);
+                    }
 
-#ifdef PRETOKENIZERDEBUG
-                        LLAMA_LOG_WARN("TT: (%ld %ld %ld) '%s'\n", text.length(), fragment.offset, fragment.length, text.c_str());
-#endif
+                    if (add_special && add_eos) {
+                        GGML_ASSERT(special_eos_id != LLAMA_TOKEN_NULL);
+                        output.push_back(special_eos_id);
+                    }
+                } break;
+            case LLAMA_VOCAB_TYPE_BPE:
+                {
+                    llm_tokenizer_bpe_session session(vocab, *static_cast<const llm_tokenizer_bpe *>(tokenizer.get()));
+                    // it calls some other methods that are not exist in llm_tokenizer,
+                    // here just cast it to bpe tokenizer object
+                    if (add_special) {
+                        session.append_bos(output);
+                    }
 
-                        session.tokenize(text, output);
-                    } else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
-                        output.push_back(fragment.token);
+                    append_fragments();
+
+                    if (add_special) {
+                        session.append_eos(output);
+                        session.check_double_bos_eos(output);
                     }
-                }
-            } break;
-        case LLAMA_VOCAB_TYPE_NONE:
-            GGML_ABORT("fatal error");
+                } break;
+            case LLAMA_VOCAB_TYPE_WPM:
+                {
+                    if (add_special) {
+                        GGML_ASSERT(special_bos_id != LLAMA_TOKEN_NULL);
+                        output.push_back(special_bos_id);
+                    }
+
+                    append_fragments();
+
+                    if (add_special) {
+                        GGML_ASSERT(special_sep_id != LLAMA_TOKEN_NULL);
+                        output.push_back(special_sep_id);
+                    }
+                } break;
+            case LLAMA_VOCAB_TYPE_RWKV:
+                {
+                    append_fragments();
+                } break;
+            case LLAMA_VOCAB_TYPE_NONE:
+                GGML_ABORT("fatal error");
+        }
     }
 
-    return output;
+    return outputs;
 }
 
 int32_t llama_vocab::impl::token_to_piece(llama_token token, char * buf, int32_t length, int32_t lstrip, bool special) const {
@@ -3098,6 +3293,54 @@ std::vector<llama_token> llama_vocab::tokenize(
     return pimpl->tokenize(raw_text, add_special, parse_special);
 }
 
+int32_t llama_vocab::tokenize_batch(
+                 const char ** texts,
+              const int32_t  * text_lens,
+                     int32_t   n_texts,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                     int32_t * n_tokens,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) const {
+    std::vector<std::string> raw_texts;
+    raw_texts.reserve(n_texts);
+    for (int32_t i = 0; i < n_texts; ++i) {
+        raw_texts.emplace_back(texts[i], text_lens[i]);
+    }
+
+    const auto res = tokenize_batch(raw_texts, add_special, parse_special, n_threads);
+
+    size_t n_total = 0;
+    for (int32_t i = 0; i < n_texts; ++i) {
+        n_tokens[i] = (int32_t) std::min<size_t>(res[i].size(), std::numeric_limits<int32_t>::max());
+        n_total += res[i].size();
+    }
+
+    if (n_total >= static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+        LLAMA_LOG_ERROR("%s: tokenization result size %zu exceeds int32_t limit\n", __func__, n_total);
+        return std::numeric_limits<int32_t>::min();
+    }
+
+    if (n_tokens_max < (int) n_total) {
+        return -((int) n_total);
+    }
+
+    for (const auto & tokens_i : res) {
+        tokens = std::copy(tokens_i.begin(), tokens_i.end(), tokens);
+    }
+
+    return n_total;
+}
+
+std::vector<std::vector<llama_token>> llama_vocab::tokenize_batch(
+        const std::vector<std::string> & raw_texts,
+        bool add_special,
+        bool parse_special,
+        int32_t n_threads) const {
+    return pimpl->tokenize_batch(raw_texts, add_special, parse_special, n_threads);
+}
+
 const std::string & llama_vocab::token_to_piece(llama_token token) const {
     return pimpl->token_to_piece(token);
 }
@@ -3354,6 +3597,20 @@ int32_t llama_tokenize(
     return vocab->tokenize(text, text_len, tokens, n_tokens_max, add_special, parse_special);
 }
 
+int32_t llama_tokenize_batch(
+    const struct llama_vocab * vocab,
+                 const char ** texts,
+              const int32_t  * text_lens,
+                     int32_t   n_texts,
+                 llama_token * tokens,
+                     int32_t   n_tokens_max,
+                     int32_t * n_tokens,
+                        bool   add_special,
+                        bool   parse_special,
+                     int32_t   n_threads) {
+    return vocab->tokenize_batch(texts, text_lens, n_texts, tokens, n_tokens_max, n_tokens, add_special, parse_special, n_threads);
+}
+
 int32_t llama_token_to_piece(
     const struct llama_vocab * vocab,
                  llama_token   token,
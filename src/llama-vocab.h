@@ -86,6 +86,9 @@ struct llama_vocab {
     int find_bpe_rank(const std::string & token_left, const std::string & token_right) const;
     std::vector<std::string> get_bpe_merges() const;
 
+    // the regexes that split the text into words before the BPE merges
+    static std::vector<std::string> get_bpe_regex_exprs(enum llama_vocab_pre_type pre_type);
+
     std::vector<char> get_precompiled_charsmap() const;
 
     int32_t tokenize(
@@ -101,6 +104,24 @@ struct llama_vocab {
                          bool   add_special,
                          bool   parse_special = false) const;
 
+    // tokenize several texts at once, the long texts are split in pieces that are tokenized on n_threads threads
+    int32_t tokenize_batch(
+                  const char ** texts,
+               const int32_t  * text_lens,
+                      int32_t   n_texts,
+                  llama_token * tokens,
+                      int32_t   n_tokens_max,
+                      int32_t * n_tokens,
+                         bool   add_special,
+                         bool   parse_special,
+                      int32_t   n_threads) const;
+
+    std::vector<std::vector<llama_token>> tokenize_batch(
+            const std::vector<std::string> & raw_texts,
+                                     bool   add_special,
+                                     bool   parse_special,
+                                  int32_t   n_threads) const;
+
     // does not write null-terminator to buf
     int32_t token_to_piece(
                   llama_token   token,
@@ -6,12 +6,16 @@
 #include "unicode-data.h"
 
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <codecvt>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <string>
@@ -220,31 +224,11 @@ static inline std::wstring unicode_wstring_from_utf8(const std::string & s) {
     return conv.from_bytes(s);
 }
 
-static std::vector<std::string> unicode_byte_encoding_process(const std::vector<std::string> & bpe_words) {
-    std::vector<std::string> bpe_encoded_words;
-    for (const auto & word : bpe_words) {
-        std::string text_utf;
-        auto utf_word =  unicode_cpts_from_utf8(word);
-        for (size_t i = 0; i < utf_word.size(); ++i) {
-            text_utf += unicode_cpt_to_utf8(utf_word[i]);
-        }
-
-        std::string encoded_token;
-        for (char & c : text_utf) {
-            encoded_token += unicode_byte_to_utf8(c);
-        }
-        bpe_encoded_words.emplace_back(encoded_token);
-    }
-    return bpe_encoded_words;
-}
-
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
-static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -357,12 +341,10 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(const std::string & t
 }
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
-static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string & text, const std::vector<size_t> & offsets) {
+static std::vector<size_t> unicode_regex_split_custom_llama3(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
     std::vector<size_t> bpe_offsets; // store the offset of each word
     bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
 
-    const auto cpts = unicode_cpts_from_utf8(text);
-
     size_t start = 0;
     for (auto offset : offsets) {
         const size_t offset_ini = start;
@@ -497,6 +479,675 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(const std::string &
     return bpe_offsets;
 }
 
+//
+// splitters on the collapsed text
+//
+
+// the text in which every codepoint is replaced by a single byte, the ASCII codepoints are kept as they are and
+// the others are replaced by their unicode category, the same values are used in the regexes, see k_ucat_cpt
+static char unicode_cpt_collapse(uint32_t cpt) {
+    if (cpt < 128) {
+        return cpt;
+    }
+
+    const auto flags = unicode_cpt_flags_from_cpt(cpt);
+
+    if (flags.is_whitespace) {
+        //NOTE: C++ std::regex \s does not mach 0x85, Rust and Python regex does.
+        //return (char) 0x85;  // <Next Line> as whitespace fallback
+        return (char) 0x0B;    // <vertical tab> as whitespace fallback
+    }
+
+    switch (flags.category_flag()) {
+        case unicode_cpt_flags::NUMBER:      return (char) 0xD1;
+        case unicode_cpt_flags::LETTER:      return (char) 0xD2;
+        case unicode_cpt_flags::PUNCTUATION: return (char) 0xD3;
+        case unicode_cpt_flags::ACCENT_MARK: return (char) 0xD4;
+        case unicode_cpt_flags::SYMBOL:      return (char) 0xD5;
+        default:                             return (char) 0xD0; // fallback
+    }
+}
+
+// the classes of the bytes of the collapsed text as std::regex sees them
+enum {
+    UNICODE_COLLAPSED_SPACE  = 0x01, // \s
+    UNICODE_COLLAPSED_LETTER = 0x02, // \p{L}
+    UNICODE_COLLAPSED_NUMBER = 0x04, // \p{N}
+    UNICODE_COLLAPSED_UPPER  = 0x08, // (?=[\p{L}])([^a-z])
+    UNICODE_COLLAPSED_LOWER  = 0x10, // (?=[\p{L}])([^A-Z])
+};
+
+static const std::array<uint8_t, 256> & unicode_collapsed_classes() {
+    static const std::array<uint8_t, 256> classes = [] {
+        std::array<uint8_t, 256> res = {};
+        for (int c = 0; c < 256; ++c) {
+            if (c == ' ' || ('\t' <= c && c <= '\r')) {
+                res[c] |= UNICODE_COLLAPSED_SPACE;
+            }
+            if ('0' <= c && c <= '9') {
+                res[c] |= UNICODE_COLLAPSED_NUMBER;
+            }
+            if ('A' <= c && c <= 'Z') {
+                res[c] |= UNICODE_COLLAPSED_LETTER | UNICODE_COLLAPSED_UPPER;
+            }
+            if ('a' <= c && c <= 'z') {
+                res[c] |= UNICODE_COLLAPSED_LETTER | UNICODE_COLLAPSED_LOWER;
+            }
+        }
+        res[0xD1] |= UNICODE_COLLAPSED_NUMBER;
+        res[0xD2] |= UNICODE_COLLAPSED_LETTER | UNICODE_COLLAPSED_UPPER | UNICODE_COLLAPSED_LOWER;
+        return res;
+    }();
+
+    return classes;
+}
+
+// split the chunks the same way as unicode_regex_split_stl: match(pos, end) returns the length of the leftmost-first match
+// at pos or 0 if there is none, the codepoints between two matches are kept together
+template <typename F>
+static std::vector<size_t> unicode_regex_split_matches(const std::vector<size_t> & offsets, const F & match) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t prev_end = start;
+        for (size_t pos = start; pos < end; ) {
+            const size_t len = match(pos, end);
+            if (len == 0) {
+                pos++;
+                continue;
+            }
+            if (pos > prev_end) {
+                bpe_offsets.push_back(pos - prev_end);
+            }
+            bpe_offsets.push_back(len);
+            pos += len;
+            prev_end = pos;
+        }
+        if (end > prev_end) {
+            bpe_offsets.push_back(end - prev_end);
+        }
+
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
+// the variants of the LLAMA3 regex used by the other pre-tokenizers:
+// (?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,n}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+
+struct unicode_regex_llama3_like {
+    // leading (?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])
+    bool contractions;
+
+    // the words are split by case:
+    // [^\r\n\p{L}\p{N}]?((?=[\p{L}])([^a-z]))*((?=[\p{L}])([^A-Z]))+|[^\r\n\p{L}\p{N}]?((?=[\p{L}])([^a-z]))+((?=[\p{L}])([^A-Z]))*
+    bool case_split;
+
+    // the case split words are followed by (?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?
+    bool case_contractions;
+
+    // \p{N}{1,n_digits}
+    size_t n_digits;
+
+    // the characters that can follow the punctuation: ?[^\s\p{L}\p{N}]+[punct_suffix]*
+    const char * punct_suffix;
+};
+
+static std::vector<size_t> unicode_regex_split_custom_llama3_like(const std::string & text_collapsed, const std::vector<size_t> & offsets, const unicode_regex_llama3_like & re) {
+    const auto & classes = unicode_collapsed_classes();
+
+    return unicode_regex_split_matches(offsets, [&](const size_t pos, const size_t end) -> size_t {
+        auto _get_chr = [&](const size_t p) -> int {
+            return p < end ? (uint8_t) text_collapsed[p] : -1;
+        };
+        auto _get_cls = [&](const size_t p) -> uint8_t {
+            return p < end ? classes[(uint8_t) text_collapsed[p]] : 0;
+        };
+        auto _is_punct = [&](const size_t p) -> bool {
+            return p < end && !(_get_cls(p) & (UNICODE_COLLAPSED_SPACE | UNICODE_COLLAPSED_LETTER | UNICODE_COLLAPSED_NUMBER));
+        };
+        auto _tolower = [](const int c) -> int {
+            return ('A' <= c && c <= 'Z') ? c + ('a' - 'A') : c;
+        };
+
+        // regex: '[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD]
+        auto _contraction = [&](const size_t p) -> size_t {
+            if (_get_chr(p) != '\'') {
+                return 0;
+            }
+            const int c1 = _tolower(_get_chr(p + 1));
+            if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+                return 2;
+            }
+            const int c2 = _tolower(_get_chr(p + 2));
+            if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+                return 3;
+            }
+            return 0;
+        };
+
+        if (re.contractions) {
+            if (const size_t len = _contraction(pos)) {
+                return len;
+            }
+        }
+
+        // regex: [^\r\n\p{L}\p{N}]?
+        const int    chr = _get_chr(pos);
+        const size_t ini = pos + (chr != '\r' && chr != '\n' && !(_get_cls(pos) & (UNICODE_COLLAPSED_LETTER | UNICODE_COLLAPSED_NUMBER)));
+
+        if (!re.case_split) {
+            // regex: \p{L}+
+            if (_get_cls(ini) & UNICODE_COLLAPSED_LETTER) {
+                size_t p = ini;
+                while (_get_cls(p) & UNICODE_COLLAPSED_LETTER) {
+                    p++;
+                }
+                return p - pos;
+            }
+        } else {
+            // the upper case letters: A-Z and the non-ASCII letters, the lower case letters: a-z and the non-ASCII letters
+            size_t p = ini;
+            while (_get_cls(p) & UNICODE_COLLAPSED_UPPER) {
+                p++;
+            }
+
+            size_t word_end = 0;
+            if (_get_cls(p) & UNICODE_COLLAPSED_LOWER) {
+                // regex: <upper>*<lower>+
+                word_end = p;
+                while (_get_cls(word_end) & UNICODE_COLLAPSED_LOWER) {
+                    word_end++;
+                }
+            } else {
+                // regex: <upper>*<lower>+ backtracks to the last letter that is also lower case, it is the only <lower>
+                for (size_t q = p; q > ini; --q) {
+                    if (_get_cls(q - 1) & UNICODE_COLLAPSED_LOWER) {
+                        word_end = q;
+                        break;
+                    }
+                }
+                // regex: <upper>+<lower>*
+                if (word_end == 0 && p > ini) {
+                    word_end = p;
+                }
+            }
+
+            if (word_end > 0) {
+                if (re.case_contractions) {
+                    word_end += _contraction(word_end);
+                }
+                return word_end - pos;
+            }
+        }
+
+        // regex: \p{N}{1,n_digits}
+        if (_get_cls(pos) & UNICODE_COLLAPSED_NUMBER) {
+            size_t p = pos;
+            while (p - pos < re.n_digits && (_get_cls(p) & UNICODE_COLLAPSED_NUMBER)) {
+                p++;
+            }
+            return p - pos;
+        }
+
+        // regex: <space>?[^\s\p{L}\p{N}]+[punct_suffix]*
+        {
+            size_t p = pos + (chr == ' ' && _is_punct(pos + 1));
+            if (_is_punct(p)) {
+                while (_is_punct(p)) {
+                    p++;
+                }
+                for (int c = _get_chr(p); c > 0 && strchr(re.punct_suffix, c); c = _get_chr(++p)) {
+                }
+                return p - pos;
+            }
+        }
+
+        size_t p = pos;
+        size_t last_end_r_or_n = 0;
+        while (_get_cls(p) & UNICODE_COLLAPSED_SPACE) {
+            const int c = _get_chr(p);
+            if (c == '\r' || c == '\n') {
+                last_end_r_or_n = p + 1;
+            }
+            p++;
+        }
+
+        // regex: \s*[\r\n]+
+        if (last_end_r_or_n > 0) {
+            return last_end_r_or_n - pos;
+        }
+
+        const size_t num_whitespaces = p - pos;
+
+        // regex: \s+(?!\S)
+        if (num_whitespaces > 1 && p < end) {
+            return num_whitespaces - 1;
+        }
+
+        // regex: \s+
+        return num_whitespaces;
+    });
+}
+
+//
+// simple regexes
+//
+
+// a regex of the form  ?X{n,m}, \s?X{n,m} or X{n,m}$, where X is a character class, an \s or an \p{..} and {n,m}
+// can also be + or omitted, a repeated X is the same as X{n}
+struct unicode_regex_simple {
+    enum prefix_type {
+        PREFIX_NONE,
+        PREFIX_SPACE,      // <space>?
+        PREFIX_WHITESPACE, // \s?
+    };
+
+    // the regex uses unicode categories, the std::regex fallback matches it on the collapsed text,
+    // otherwise std::wregex matches it on the codepoints
+    bool collapsed = false;
+
+    prefix_type prefix = PREFIX_NONE;
+
+    size_t n_min = 1;
+    size_t n_max = 1;
+
+    bool anchor_end = false;
+
+    // the character class, bytes contains the collapsed bytes or the ASCII codepoints
+    bool negate = false;
+
+    std::array<bool, 256> bytes = {};
+
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // non-ASCII codepoints
+
+    void add(uint32_t first, uint32_t last) {
+        for (uint32_t c = first; c <= std::min<uint32_t>(last, 127); ++c) {
+            bytes[c] = true;
+        }
+        if (last >= 128) {
+            ranges.emplace_back(std::max<uint32_t>(first, 128), last);
+        }
+    }
+
+    // the codepoint as the std::wregex fallback sees it
+    static uint32_t wchar(uint32_t cpt) {
+        return cpt > 0x7F && unicode_cpt_flags_from_cpt(cpt).is_whitespace ? 0x0B : cpt;
+    }
+
+    bool match_cpt(uint32_t cpt) const {
+        const uint32_t wc = wchar(cpt);
+        if (wc < 128) {
+            return bytes[wc] != negate;
+        }
+        for (const auto & range : ranges) {
+            if (range.first <= wc && wc <= range.second) {
+                return !negate;
+            }
+        }
+        return negate;
+    }
+
+    bool match_collapsed(char c) const {
+        return bytes[(uint8_t) c] != negate;
+    }
+};
+
+// the escapes that can be used in a character class or on their own
+static bool unicode_regex_simple_escape(const std::vector<uint32_t> & cpts, size_t & i, unicode_regex_simple & re, bool & is_char, uint32_t & chr) {
+    // the ASCII codepoints of the unicode categories in the collapsed text, see k_ucat_map
+    static const std::map<uint32_t, std::pair<char, std::string>> k_ucat_collapsed = {
+        { 'N', { (char) 0xD1, "0123456789" } },
+        { 'L', { (char) 0xD2, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz" } },
+        { 'P', { (char) 0xD3, "!\"#%&'()*,-./:;?@[\\]_{}" } },
+        { 'M', { (char) 0xD4, "" } },
+        { 'S', { (char) 0xD5, "$+<=>^`|" } },
+    };
+
+    is_char = false;
+
+    if (i + 1 >= cpts.size()) {
+        return false;
+    }
+
+    const uint32_t c = cpts[i + 1];
+    i += 2;
+
+    switch (c) {
+        case 'p':
+            {
+                if (!re.collapsed || i + 2 >= cpts.size() || cpts[i] != '{' || cpts[i + 2] != '}') {
+                    return false;
+                }
+                const auto it = k_ucat_collapsed.find(cpts[i + 1]);
+                if (it == k_ucat_collapsed.end()) {
+                    return false;
+                }
+                re.bytes[(uint8_t) it->second.first] = true;
+                for (char a : it->second.second) {
+                    re.bytes[(uint8_t) a] = true;
+                }
+                i += 3;
+            } return true;
+        case 's': re.add('\t', '\r'); re.add(' ', ' '); return true;
+        case 'd': re.add('0', '9');                     return true;
+        case 't': chr = '\t'; is_char = true;           return true;
+        case 'n': chr = '\n'; is_char = true;           return true;
+        case 'v': chr = '\v'; is_char = true;           return true;
+        case 'f': chr = '\f'; is_char = true;           return true;
+        case 'r': chr = '\r'; is_char = true;           return true;
+        default:
+            break;
+    }
+
+    // an escaped punctuation character
+    if (c < 128 && !isalnum(c)) {
+        chr = c;
+        is_char = true;
+        return true;
+    }
+
+    return false;
+}
+
+// parse a character class [..], an escape or a single literal into re
+static bool unicode_regex_simple_parse_atom(const std::vector<uint32_t> & cpts, size_t & i, unicode_regex_simple & re) {
+    bool     is_char = false;
+    uint32_t chr     = 0;
+
+    if (cpts[i] == '\\') {
+        if (!unicode_regex_simple_escape(cpts, i, re, is_char, chr)) {
+            return false;
+        }
+        if (is_char) {
+            re.add(chr, chr);
+        }
+        return true;
+    }
+
+    if (cpts[i] != '[') {
+        return false;
+    }
+
+    i++;
+    if (i < cpts.size() && cpts[i] == '^') {
+        re.negate = true;
+        i++;
+    }
+
+    while (i < cpts.size() && cpts[i] != ']') {
+        uint32_t first = cpts[i];
+        if (first == '\\') {
+            if (!unicode_regex_simple_escape(cpts, i, re, is_char, first)) {
+                return false;
+            }
+            if (!is_char) {
+                continue;
+            }
+        } else if (first == '[') {
+            return false;
+        } else {
+            i++;
+        }
+
+        // range
+        if (i + 1 < cpts.size() && cpts[i] == '-' && cpts[i + 1] != ']') {
+            i++;
+            uint32_t last = cpts[i];
+            if (last == '\\') {
+                if (!unicode_regex_simple_escape(cpts, i, re, is_char, last) || !is_char) {
+                    return false;
+                }
+            } else {
+                i++;
+            }
+            if (last < first) {
+                return false;
+            }
+            re.add(first, last);
+        } else {
+            re.add(first, first);
+        }
+    }
+
+    if (i >= cpts.size()) {
+        return false;
+    }
+
+    i++; // ]
+
+    return true;
+}
+
+static bool unicode_regex_simple_parse(const std::string & regex_expr, unicode_regex_simple & re) {
+    for (const char * ucat : { "\\p{N}", "\\p{L}", "\\p{P}", "\\p{M}", "\\p{S}" }) {
+        if (regex_expr.find(ucat) != std::string::npos) {
+            re.collapsed = true;
+        }
+    }
+
+    const auto cpts = unicode_cpts_from_utf8(regex_expr);
+
+    if (re.collapsed) {
+        for (const uint32_t cpt : cpts) {
+            if (cpt >= 128) {
+                return false;
+            }
+        }
+    }
+
+    size_t i = 0;
+
+    if (cpts.size() > 2 && cpts[0] == ' ' && cpts[1] == '?') {
+        re.prefix = unicode_regex_simple::PREFIX_SPACE;
+        i = 2;
+    } else if (cpts.size() > 3 && cpts[0] == '\\' && cpts[1] == 's' && cpts[2] == '?') {
+        re.prefix = unicode_regex_simple::PREFIX_WHITESPACE;
+        i = 3;
+    }
+
+    // the atom, possibly repeated
+    const size_t atom_ini = i;
+    if (i >= cpts.size() || !unicode_regex_simple_parse_atom(cpts, i, re)) {
+        return false;
+    }
+    const size_t atom_len = i - atom_ini;
+
+    size_t n_atoms = 1;
+    while (i + atom_len <= cpts.size() && std::equal(cpts.begin() + atom_ini, cpts.begin() + atom_ini + atom_len, cpts.begin() + i)) {
+        i += atom_len;
+        n_atoms++;
+    }
+
+    re.n_min = n_atoms;
+    re.n_max = n_atoms;
+
+    // the quantifier
+    if (i < cpts.size() && n_atoms == 1) {
+        if (cpts[i] == '+') {
+            re.n_max = SIZE_MAX;
+            i++;
+        } else if (cpts[i] == '{') {
+            size_t n[2] = { 0, 0 };
+            int    k    = 0;
+            bool   open = false;
+            for (i++; i < cpts.size() && cpts[i] != '}'; ++i) {
+                if (cpts[i] == ',' && k == 0) {
+                    k    = 1;
+                    open = true;
+                } else if ('0' <= cpts[i] && cpts[i] <= '9') {
+                    n[k] = 10*n[k] + (cpts[i] - '0');
+                    open = false;
+                } else {
+                    return false;
+                }
+            }
+            if (i >= cpts.size()) {
+                return false;
+            }
+            i++;
+            re.n_min = n[0];
+            re.n_max = k == 0 ? n[0] : (open ? SIZE_MAX : n[1]);
+        }
+    }
+
+    if (i < cpts.size() && cpts[i] == '$') {
+        re.anchor_end = true;
+        i++;
+    }
+
+    return i == cpts.size() && re.n_min > 0 && re.n_min <= re.n_max;
+}
+
+// the parsed simple regex or nullptr if the regex is not simple, parsed once per regex
+static const unicode_regex_simple * unicode_regex_simple_get(const std::string & regex_expr) {
+    static std::mutex mutex;
+    static std::map<std::string, std::unique_ptr<unicode_regex_simple>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = cache.find(regex_expr);
+    if (it == cache.end()) {
+        auto re = std::make_unique<unicode_regex_simple>();
+        if (!unicode_regex_simple_parse(regex_expr, *re)) {
+            re.reset();
+        }
+        it = cache.emplace(regex_expr, std::move(re)).first;
+    }
+
+    return it->second.get();
+}
+
+static std::vector<size_t> unicode_regex_split_custom_simple(const std::vector<uint32_t> & cpts, const std::string & text_collapsed, const std::vector<size_t> & offsets, const unicode_regex_simple & re) {
+    return unicode_regex_split_matches(offsets, [&](const size_t pos, const size_t end) -> size_t {
+        auto _match = [&](const size_t p) -> bool {
+            return re.collapsed ? re.match_collapsed(text_collapsed[p]) : re.match_cpt(cpts[p]);
+        };
+
+        // the longest run of X{n_min,n_max} at p, the match is [pos, p + n)
+        auto _run = [&](const size_t p) -> size_t {
+            size_t n = 0;
+            while (p + n < end && n < re.n_max && _match(p + n)) {
+                n++;
+            }
+            return n >= re.n_min && (!re.anchor_end || p + n == end) ? p + n - pos : 0;
+        };
+
+        if (re.prefix != unicode_regex_simple::PREFIX_NONE && pos + 1 < end) {
+            const uint32_t c = re.collapsed ? (uint8_t) text_collapsed[pos] : unicode_regex_simple::wchar(cpts[pos]);
+            const bool is_prefix = re.prefix == unicode_regex_simple::PREFIX_SPACE ? c == ' ' : (c == ' ' || ('\t' <= c && c <= '\r'));
+            if (is_prefix) {
+                if (const size_t len = _run(pos + 1)) {
+                    return len;
+                }
+            }
+        }
+
+        return _run(pos);
+    });
+}
+
+// (?=(\d{3})+(?!\d)) of SUPERBPE: an empty match before each group of 3 ASCII digits counted from the end of the run, the
+// empty words are kept as std::regex emits them
+static std::vector<size_t> unicode_regex_split_custom_digit_groups(const std::vector<uint32_t> & cpts, const std::vector<size_t> & offsets) {
+    std::vector<size_t> bpe_offsets; // store the offset of each word
+    bpe_offsets.reserve(offsets.size()); // Reserve memory for the approximate size
+
+    auto _is_digit = [&](const size_t p) -> bool {
+        return '0' <= cpts[p] && cpts[p] <= '9';
+    };
+
+    size_t start = 0;
+    for (auto offset : offsets) {
+        const size_t end = start + offset;
+
+        size_t prev_end = start;
+        for (size_t pos = start; pos < end; ) {
+            if (!_is_digit(pos)) {
+                pos++;
+                continue;
+            }
+
+            size_t run_end = pos + 1;
+            while (run_end < end && _is_digit(run_end)) {
+                run_end++;
+            }
+
+            for (size_t p = pos + (run_end - pos) % 3; p + 3 <= run_end; p += 3) {
+                if (p > prev_end) {
+                    bpe_offsets.push_back(p - prev_end);
+                }
+                bpe_offsets.push_back(0);
+                prev_end = p;
+            }
+
+            pos = run_end;
+        }
+        if (end > prev_end) {
+            bpe_offsets.push_back(end - prev_end);
+        }
+
+        start = end;
+    }
+
+    return bpe_offsets;
+}
+
+// split with a custom splitter if there is one for the regex
+static bool unicode_regex_split_custom(const std::vector<uint32_t> & cpts, const std::string & text_collapsed, const std::string & regex_expr, std::vector<size_t> & offsets) {
+    if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
+        offsets = unicode_regex_split_custom_gpt2(cpts, offsets);
+        return true;
+    }
+
+    if (regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
+        regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
+        offsets = unicode_regex_split_custom_llama3(cpts, offsets);
+        return true;
+    }
+
+    // the remaining splitters use the same semantics as the std::regex fallback on the collapsed text
+    static const std::map<std::string, unicode_regex_llama3_like> k_llama3_like = {
+        // QWEN2, STABLELM2
+        { "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            { true,  false, false, 1, "\r\n"  } },
+        // BAILINGMOE, \s*[\r\n] backtracks to the last line break of the whitespaces the same way as \s*[\r\n]+
+        { "'(?:[sSdDmMtT]|[lL][lL]|[vV][eE]|[rR][eE])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]|\\s+(?!\\S)|\\s+",
+            { true,  false, false, 1, "\r\n"  } },
+        // SEED_CODER
+        { "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1}| ?[^\\s\\p{L}\\p{N}\\r\\n]+|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            { true,  false, false, 1, ""      } },
+        // TEKKEN
+        { "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*|\\p{N}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            { false, true,  false, 1, "\r\n/" } },
+        // GPT4O
+        { "[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))*((?=[\\p{L}])([^A-Z]))+(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|[^\\r\\n\\p{L}\\p{N}]?((?=[\\p{L}])([^a-z]))+((?=[\\p{L}])([^A-Z]))*(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])?|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+",
+            { false, true,  true,  3, "\r\n/" } },
+    };
+
+    const auto it = k_llama3_like.find(regex_expr);
+    if (it != k_llama3_like.end()) {
+        offsets = unicode_regex_split_custom_llama3_like(text_collapsed, offsets, it->second);
+        return true;
+    }
+
+    if (regex_expr == "(?=(\\d{3})+(?!\\d))") {
+        offsets = unicode_regex_split_custom_digit_groups(cpts, offsets);
+        return true;
+    }
+
+    if (const auto * re = unicode_regex_simple_get(regex_expr)) {
+        offsets = unicode_regex_split_custom_simple(cpts, text_collapsed, offsets, *re);
+        return true;
+    }
+
+    return false;
+}
+
 // use std::wregex to split the text
 static std::vector<size_t> unicode_regex_split_stl(const std::wstring & wtext, const std::wstring & regex_expr, const std::vector<size_t> & offsets) {
     std::wregex expr(regex_expr);
@@ -557,21 +1208,6 @@ static std::vector<size_t> unicode_regex_split_stl(const std::string & text, con
     return bpe_offsets;
 }
 
-static std::vector<size_t> unicode_regex_split_custom(const std::string & text, const std::string & regex_expr, const std::vector<size_t> & offsets) {
-    std::vector<size_t> bpe_offsets;
-
-    if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| ?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-        bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
-    } else if (
-            regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+" ||
-            regex_expr == "(?:'[sS]|'[tT]|'[rR][eE]|'[vV][eE]|'[mM]|'[lL][lL]|'[dD])|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+") {
-
-        bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
-    }
-
-    return bpe_offsets;
-}
-
 //
 // interface
 //
@@ -623,6 +1259,20 @@ std::vector<uint32_t> unicode_cpts_from_utf8(const std::string & utf8) {
     result.reserve(utf8.size());
     size_t offset = 0;
     while (offset < utf8.size()) {
+        // ASCII fast path, 8 bytes at a time
+        if (offset + 8 <= utf8.size()) {
+            uint64_t chunk;
+            memcpy(&chunk, utf8.data() + offset, sizeof(chunk));
+            if (!(chunk & 0x8080808080808080ULL)) {
+                const size_t n = result.size();
+                result.resize(n + 8);
+                for (size_t i = 0; i < 8; ++i) {
+                    result[n + i] = (uint8_t) utf8[offset + i];
+                }
+                offset += 8;
+                continue;
+            }
+        }
         try {
             result.push_back(unicode_cpt_from_utf8(utf8, offset));
         }
@@ -672,7 +1322,7 @@ uint32_t unicode_tolower(uint32_t cpt) {
     return cpt;  // Return the original code point if no lowercase mapping is found
 }
 
-std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs) {
+std::vector<std::string> unicode_regex_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom) {
     // unicode categories
     static const std::map<std::string, int> k_ucat_enum = {
         { "\\p{N}", unicode_cpt_flags::NUMBER },
@@ -720,23 +1370,7 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         text_collapsed.resize(cpts.size());
 
         for (size_t i = 0; i < cpts.size(); ++i) {
-            // keep single-byte codepoints as is
-            if (cpts[i] < 128) {
-                text_collapsed[i] = cpts[i];
-                continue;
-            }
-
-            const auto flags = unicode_cpt_flags_from_cpt(cpts[i]);
-
-            if (flags.is_whitespace) {
-                //NOTE: C++ std::regex \s does not mach 0x85, Rust and Python regex does.
-                //text_collapsed[i] = (char) 0x85;  // <Next Line> as whitespace fallback
-                text_collapsed[i] = (char) 0x0B;    // <vertical tab> as whitespace fallback
-            } else if (k_ucat_cpt.find(flags.category_flag()) != k_ucat_cpt.end()) {
-                text_collapsed[i] = k_ucat_cpt.at(flags.category_flag());
-            } else {
-                text_collapsed[i] = (char) 0xD0; // fallback
-            }
+            text_collapsed[i] = unicode_cpt_collapse(cpts[i]);
         }
     }
 
@@ -744,10 +1378,7 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
 
     for (const auto & regex_expr : regex_exprs) {
         // first, see if we have an efficient custom regex implementation
-        auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
-
-        if (!tmp.empty()) {
-            bpe_offsets = std::move(tmp);
+        if (use_custom && unicode_regex_split_custom(cpts, text_collapsed, regex_expr, bpe_offsets)) {
             continue;
         }
 
@@ -838,17 +1469,34 @@ std::vector<std::string> unicode_regex_split(const std::string & text, const std
         }
     }
 
+    static const auto byte_to_utf8 = [] {
+        const auto map = unicode_byte_to_utf8_map();
+        std::array<std::string, 256> res;
+        for (int ch = 0; ch < 256; ++ch) {
+            res[ch] = map.at(ch);
+        }
+        return res;
+    }();
+
+    // the words are byte-encoded directly from the codepoints
     std::vector<std::string> bpe_words;
     bpe_words.reserve(bpe_offsets.size()); // reserve memory for the approximate size
 
     size_t start = 0;
     for (size_t & offset : bpe_offsets) {
-        bpe_words.emplace_back();
+        std::string word;
         for (size_t i = start; i < start + offset; ++i) {
-            bpe_words.back() += unicode_cpt_to_utf8(cpts[i]);
+            if (cpts[i] < 0x80) {
+                word += byte_to_utf8[cpts[i]];
+                continue;
+            }
+            for (const char c : unicode_cpt_to_utf8(cpts[i])) {
+                word += byte_to_utf8[(uint8_t) c];
+            }
         }
+        bpe_words.push_back(std::move(word));
         start += offset;
     }
 
-    return unicode_byte_encoding_process(bpe_words);
+    return bpe_words;
 }
@@ -1,9 +1,14 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <random>
+#include <string>
 
 #include "get-model.h"
 
+#include "ggml.h"
+#include "gguf.h"
+
 char * get_model_or_exit(int argc, char *argv[]) {
     char * model_path;
     if (argc > 1) {
@@ -19,3 +24,120 @@ char * get_model_or_exit(int argc, char *argv[]) {
 
     return model_path;
 }
+
+bool make_random_model(const char * vocab_path, const char * path, int n_expert) {
+    gguf_init_params params = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ nullptr,
+    };
+
+    gguf_context * vocab = gguf_init_from_file(vocab_path, params);
+    if (!vocab) {
+        fprintf(stderr, "%s: failed to load the vocab from %s\n", __func__, vocab_path);
+        return false;
+    }
+
+    const int64_t key_tokens = gguf_find_key(vocab, "tokenizer.ggml.tokens");
+    if (key_tokens < 0) {
+        fprintf(stderr, "%s: no tokens in %s\n", __func__, vocab_path);
+        gguf_free(vocab);
+        return false;
+    }
+
+    const int64_t n_vocab = gguf_get_arr_n(vocab, key_tokens);
+
+    // head size 32, so that the KV cache can be quantized
+    const int64_t n_embd    = 64;
+    const int64_t n_head    = 2;
+    const int64_t n_head_kv = 1;
+    const int64_t n_layer   = 2;
+    const int64_t n_ff      = 128;
+
+    const int64_t n_embd_head = n_embd/n_head;
+
+    gguf_context * gguf = gguf_init_empty();
+
+    gguf_set_kv(gguf, vocab);
+    gguf_free(vocab);
+
+    gguf_set_val_str(gguf, "general.architecture", "llama");
+    gguf_set_val_u32(gguf, "general.file_type", 0);
+    gguf_set_val_u32(gguf, "llama.context_length",                   4096);
+    gguf_set_val_u32(gguf, "llama.embedding_length",                 n_embd);
+    gguf_set_val_u32(gguf, "llama.block_count",                      n_layer);
+    gguf_set_val_u32(gguf, "llama.feed_forward_length",              n_ff);
+    gguf_set_val_u32(gguf, "llama.attention.head_count",             n_head);
+    gguf_set_val_u32(gguf, "llama.attention.head_count_kv",          n_head_kv);
+    gguf_set_val_u32(gguf, "llama.rope.dimension_count",             n_embd_head);
+    gguf_set_val_f32(gguf, "llama.attention.layer_norm_rms_epsilon", 1e-5f);
+
+    if (n_expert > 0) {
+        gguf_set_val_u32(gguf, "llama.expert_count",      n_expert);
+        gguf_set_val_u32(gguf, "llama.expert_used_count", 2);
+    }
+
+    // the dense feed-forward is a single expert without router
+    const int64_t n_ff_exp = n_expert > 0 ? n_expert : 1;
+
+    const size_t n_params = 2*n_vocab*n_embd + n_layer*(2*n_embd*n_embd + 2*n_embd*n_embd_head*n_head_kv + 3*n_embd*n_ff*n_ff_exp + n_embd*n_expert + 2*n_embd) + n_embd;
+
+    ggml_init_params params_ctx = {
+        /*.mem_size   =*/ n_params*sizeof(float) + (3 + 10*n_layer)*(ggml_tensor_overhead() + GGML_MEM_ALIGN),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    ggml_context * ctx = ggml_init(params_ctx);
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 0.2f);
+
+    auto add = [&](const std::string & name, int64_t ne0, int64_t ne1, int64_t ne2 = 0) {
+        ggml_tensor * t = ne2 > 0 ? ggml_new_tensor_3d(ctx, GGML_TYPE_F32, ne0, ne1, ne2) :
+                          ne1 > 0 ? ggml_new_tensor_2d(ctx, GGML_TYPE_F32, ne0, ne1) : ggml_new_tensor_1d(ctx, GGML_TYPE_F32, ne0);
+        ggml_set_name(t, name.c_str());
+
+        // norms are initialized to 1
+        float * data = (float *) t->data;
+        for (int64_t i = 0; i < ggml_nelements(t); ++i) {
+            data[i] = ne1 > 0 ? dist(rng) : 1.0f;
+        }
+
+        gguf_add_tensor(gguf, t);
+    };
+
+    add("token_embd.weight",  n_embd, n_vocab);
+    add("output_norm.weight", n_embd, 0);
+    add("output.weight",      n_embd, n_vocab);
+
+    for (int64_t il = 0; il < n_layer; ++il) {
+        const std::string blk = "blk." + std::to_string(il) + ".";
+
+        add(blk + "attn_norm.weight",   n_embd, 0);
+        add(blk + "attn_q.weight",      n_embd, n_embd);
+        add(blk + "attn_k.weight",      n_embd, n_embd_head*n_head_kv);
+        add(blk + "attn_v.weight",      n_embd, n_embd_head*n_head_kv);
+        add(blk + "attn_output.weight", n_embd, n_embd);
+        add(blk + "ffn_norm.weight",    n_embd, 0);
+        if (n_expert == 0) {
+            add(blk + "ffn_gate.weight", n_embd, n_ff);
+            add(blk + "ffn_up.weight",   n_embd, n_ff);
+            add(blk + "ffn_down.weight", n_ff,   n_embd);
+        } else {
+            add(blk + "ffn_gate_inp.weight",  n_embd, n_expert);
+            add(blk + "ffn_gate_exps.weight", n_embd, n_ff,   n_expert);
+            add(blk + "ffn_up_exps.weight",   n_embd, n_ff,   n_expert);
+            add(blk + "ffn_down_exps.weight", n_ff,   n_embd, n_expert);
+        }
+    }
+
+    const bool ok = gguf_write_to_file(gguf, path, false);
+    if (!ok) {
+        fprintf(stderr, "%s: failed to write %s\n", __func__, path);
+    }
+
+    ggml_free(ctx);
+    gguf_free(gguf);
+
+    return ok;
+}
@@ -1,2 +1,7 @@
 #pragma once
 char * get_model_or_exit(int, char*[]);
+
+// write a small llama model with random weights and the vocab of the gguf file vocab_path to path
+// used by the tests that need to run a model, but not a good one
+// with n_expert > 0, the feed-forward layers are MoE layers with 2 experts used per token
+bool make_random_model(const char * vocab_path, const char * path, int n_expert = 0);
@@ -2950,6 +2950,48 @@ struct test_argsort : public test_case {
     }
 };
 
+// GGML_OP_ARGSORT_TOP_K
+struct test_argsort_top_k : public test_case {
+    const ggml_type type;
+    const std::array<int64_t, 4> ne;
+    const int k;
+
+    std::string vars() override {
+        return VARS_TO_STR3(type, ne, k);
+    }
+
+    test_argsort_top_k(ggml_type type = GGML_TYPE_F32,
+            std::array<int64_t, 4> ne = {16, 10, 10, 10},
+            int k = 4)
+        : type(type), ne(ne), k(k) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * a = ggml_new_tensor(ctx, type, 4, ne.data());
+        ggml_set_name(a, "a");
+
+        ggml_tensor * out = ggml_argsort_top_k(ctx, a, k);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+
+    void initialize_tensors(ggml_context * ctx) override {
+        std::random_device rd;
+        std::default_random_engine rng(rd());
+        for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != NULL; t = ggml_get_next_tensor(ctx, t)) {
+            // initialize with unique values to avoid ties
+            for (int64_t r = 0; r < ggml_nrows(t); r++) {
+                std::vector<float> data(t->ne[0]);
+                for (int i = 0; i < t->ne[0]; i++) {
+                    data[i] = i;
+                }
+                std::shuffle(data.begin(), data.end(), rng);
+                ggml_backend_tensor_set(t, data.data(), r * t->nb[1], t->ne[0] * sizeof(float));
+            }
+        }
+    }
+};
+
 // GGML_OP_SUM
 struct test_sum : public test_case {
     const ggml_type type;
@@ -3391,6 +3433,56 @@ struct test_flash_attn_ext : public test_case {
     }
 };
 
+// GGML_OP_FLASH_ATTN_EXT with two KV tiers
+struct test_flash_attn_ext_tiered : public test_case {
+    const int64_t hs; // K/V head size
+    const int64_t nh; // num heads
+    const int64_t kv0; // kv size of the first tier
+    const int64_t kv1; // kv size of the second tier
+    const int64_t nb; // batch size
+
+    const ggml_type type_KV0;
+    const ggml_type type_KV1;
+
+    std::string vars() override {
+        return VARS_TO_STR7(hs, nh, kv0, kv1, nb, type_KV0, type_KV1);
+    }
+
+    double max_nmse_err() override {
+        return 5e-4;
+    }
+
+    test_flash_attn_ext_tiered(int64_t hs = 128, int64_t nh = 4, int64_t kv0 = 512, int64_t kv1 = 256, int64_t nb = 8,
+                               ggml_type type_KV0 = GGML_TYPE_Q8_0, ggml_type type_KV1 = GGML_TYPE_F16)
+        : hs(hs), nh(nh), kv0(kv0), kv1(kv1), nb(nb), type_KV0(type_KV0), type_KV1(type_KV1) {}
+
+    ggml_tensor * build_graph(ggml_context * ctx) override {
+        ggml_tensor * q = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, hs, nb, nh, 1);
+        ggml_set_name(q, "q");
+
+        ggml_tensor * k0 = ggml_new_tensor_4d(ctx, type_KV0, hs, kv0, nh, 1);
+        ggml_set_name(k0, "k0");
+
+        ggml_tensor * v0 = ggml_new_tensor_4d(ctx, type_KV0, hs, kv0, nh, 1);
+        ggml_set_name(v0, "v0");
+
+        ggml_tensor * k1 = ggml_new_tensor_4d(ctx, type_KV1, hs, kv1, nh, 1);
+        ggml_set_name(k1, "k1");
+
+        ggml_tensor * v1 = ggml_new_tensor_4d(ctx, type_KV1, hs, kv1, nh, 1);
+        ggml_set_name(v1, "v1");
+
+        ggml_tensor * m = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, kv0 + kv1, GGML_PAD(nb, GGML_KQ_MASK_PAD), 1, 1);
+        ggml_set_name(m, "m");
+
+        ggml_tensor * out = ggml_flash_attn_ext_tiered(ctx, q, k0, v0, k1, v1, m, 1.0f/sqrtf(hs), 0.0f, 0.0f);
+        ggml_flash_attn_ext_set_prec(out, GGML_PREC_F32);
+        ggml_set_name(out, "out");
+
+        return out;
+    }
+};
+
 // GGML_OP_CROSS_ENTROPY_LOSS
 struct test_cross_entropy_loss : public test_case {
     const ggml_type type;
@@ -4518,6 +4610,10 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         test_cases.emplace_back(new test_argsort(GGML_TYPE_F32, {60, 10, 10, 10}, order)); // qwen
     }
 
+    test_cases.emplace_back(new test_argsort_top_k(GGML_TYPE_F32, {8, 1, 1, 1}, 1));
+    test_cases.emplace_back(new test_argsort_top_k(GGML_TYPE_F32, {16, 10, 10, 10}, 4));
+    test_cases.emplace_back(new test_argsort_top_k(GGML_TYPE_F32, {32000, 4, 1, 1}, 40));
+
     for (ggml_scale_mode mode : {GGML_SCALE_MODE_NEAREST, GGML_SCALE_MODE_BILINEAR}) {
         test_cases.emplace_back(new test_upscale(GGML_TYPE_F32, {512, 512, 3, 2}, 2, mode));
         test_cases.emplace_back(new test_upscale(GGML_TYPE_F32, {512, 512, 3, 2}, 2, mode, true));
@@ -4575,6 +4671,12 @@ static std::vector<std::unique_ptr<test_case>> make_test_cases_eval() {
         }
     }
 
+    for (ggml_type type_KV0 : {GGML_TYPE_Q8_0, GGML_TYPE_Q4_0}) {
+        for (int nb : { 1, 8, 35, }) {
+            test_cases.emplace_back(new test_flash_attn_ext_tiered(128, 4, 512, 256, nb, type_KV0, GGML_TYPE_F16));
+        }
+    }
+
     test_cases.emplace_back(new test_cross_entropy_loss     (GGML_TYPE_F32, {   10, 5, 4, 3}));
     test_cases.emplace_back(new test_cross_entropy_loss     (GGML_TYPE_F32, {30000, 1, 1, 1}));
     test_cases.emplace_back(new test_cross_entropy_loss_back(GGML_TYPE_F32, {   10, 5, 4, 3}));
@@ -0,0 +1,185 @@
+// Check and benchmark the splitting of large multi-sequence batches into ubatches
+
+#include "llama.h"
+#include "ggml.h"
+
+#include "../src/llama-batch.h"
+#include "../src/llama-vocab.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+enum split_type {
+    SPLIT_SIMPLE,
+    SPLIT_EQUAL,
+    SPLIT_SEQ,
+};
+
+static const char * split_type_name(split_type type) {
+    switch (type) {
+        case SPLIT_SIMPLE: return "simple";
+        case SPLIT_EQUAL:  return "equal";
+        case SPLIT_SEQ:    return "seq";
+    }
+    return "?";
+}
+
+// a batch with a prompt shared by all sequences, followed by n_seq_tokens tokens of each sequence, interleaved
+// like the batches of a server with parallel slots
+struct test_batch {
+    test_batch(int n_seq, int n_shared, int n_seq_tokens, int n_embd) {
+        for (int i = 0; i < n_seq; ++i) {
+            seq_all.push_back(i);
+        }
+        for (int i = 0; i < n_seq; ++i) {
+            seq_one.push_back({ i });
+        }
+
+        for (int i = 0; i < n_shared; ++i) {
+            add(i, seq_all.data(), n_seq, false);
+        }
+
+        for (int j = 0; j < n_seq_tokens; ++j) {
+            for (int s = 0; s < n_seq; ++s) {
+                add(n_shared + j, seq_one[s].data(), 1, j == n_seq_tokens - 1);
+            }
+        }
+
+        embd.resize((size_t) pos.size()*n_embd, 0.5f);
+    }
+
+    void add(llama_pos p, llama_seq_id * ids, int n_ids, bool output) {
+        pos     .push_back(p);
+        n_seq_id.push_back(n_ids);
+        seq_id  .push_back(ids);
+        logits  .push_back(output);
+    }
+
+    llama_batch get() {
+        llama_batch res = {};
+
+        res.n_tokens = pos.size();
+        res.embd     = embd.data();
+        res.pos      = pos.data();
+        res.n_seq_id = n_seq_id.data();
+        res.seq_id   = seq_id.data();
+        res.logits   = logits.data();
+
+        return res;
+    }
+
+    std::vector<llama_seq_id>              seq_all;
+    std::vector<std::vector<llama_seq_id>> seq_one;
+
+    std::vector<float>          embd;
+    std::vector<llama_pos>      pos;
+    std::vector<int32_t>        n_seq_id;
+    std::vector<llama_seq_id *> seq_id;
+    std::vector<int8_t>         logits;
+};
+
+// split the whole batch and verify the ubatches, returns the number of ubatches
+static int split_all(llama_batch_allocr & balloc, split_type type, uint32_t n_ubatch) {
+    balloc.split_reset();
+
+    std::vector<llama_pos> pos_last(LLAMA_MAX_SEQ, -1);
+
+    uint32_t n_tokens = 0;
+    int      n_ubatches = 0;
+
+    while (true) {
+        llama_ubatch ubatch = {};
+
+        switch (type) {
+            case SPLIT_SIMPLE: ubatch = balloc.split_simple(n_ubatch); break;
+            case SPLIT_EQUAL:  ubatch = balloc.split_equal (n_ubatch); break;
+            case SPLIT_SEQ:    ubatch = balloc.split_seq   (n_ubatch); break;
+        }
+
+        if (ubatch.n_tokens == 0) {
+            break;
+        }
+
+        assert(ubatch.n_tokens == ubatch.n_seq_tokens*ubatch.n_seqs);
+
+        // the sequence ranges cover the ubatch and match the first sequence id of each token
+        uint32_t i_next = 0;
+        for (uint32_t r = 0; r < ubatch.n_seq_ranges; ++r) {
+            const auto & range = ubatch.seq_ranges[r];
+
+            assert(range.i0 == i_next && range.i0 < range.i1);
+            assert(r == 0 || ubatch.seq_ranges[r - 1].seq_id != range.seq_id);
+
+            for (uint32_t i = range.i0; i < range.i1; ++i) {
+                assert(ubatch.seq_id[i][0] == range.seq_id);
+            }
+
+            i_next = range.i1;
+        }
+        assert(i_next == ubatch.n_tokens);
+
+        // the positions of each sequence keep increasing across the ubatches
+        for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+            for (int32_t s = 0; s < ubatch.n_seq_id[i]; ++s) {
+                const llama_seq_id seq_id = ubatch.seq_id[i][s];
+
+                assert(ubatch.pos[i] > pos_last[seq_id]);
+                pos_last[seq_id] = ubatch.pos[i];
+            }
+        }
+
+        n_tokens += ubatch.n_tokens;
+        n_ubatches++;
+    }
+
+    assert(n_tokens == balloc.get_n_tokens());
+    assert(balloc.get_out_ids().size() == balloc.get_n_outputs());
+
+    return n_ubatches;
+}
+
+int main(void) {
+    const int n_embd = 4;
+    const int n_iter = 20;
+
+    llama_vocab vocab;
+
+    llama_batch_allocr balloc(1);
+
+    printf("%6s %8s %10s %8s %8s %10s %12s\n", "n_seq", "n_shared", "seq_tokens", "split", "n_ubatch", "ubatches", "us/batch");
+
+    for (int n_seq : { 1, 8, 32, LLAMA_MAX_SEQ }) {
+        for (int n_seq_tokens : { 1, 16, 128 }) {
+            for (int n_shared : { 0, 32 }) {
+                test_batch tb(n_seq, n_shared, n_seq_tokens, n_embd);
+
+                for (split_type type : { SPLIT_SIMPLE, SPLIT_EQUAL, SPLIT_SEQ }) {
+                    for (uint32_t n_ubatch : { 64u, 512u }) {
+                        int n_ubatches = 0;
+
+                        const int64_t t_start = ggml_time_us();
+
+                        for (int it = 0; it < n_iter; ++it) {
+                            if (!balloc.init(tb.get(), vocab, nullptr, n_embd, false)) {
+                                fprintf(stderr, "%s: failed to init the batch allocator\n", __func__);
+                                return 1;
+                            }
+
+                            n_ubatches = split_all(balloc, type, n_ubatch);
+                        }
+
+                        const int64_t t_end = ggml_time_us();
+
+                        printf("%6d %8d %10d %8s %8u %10d %12.1f\n",
+                                n_seq, n_shared, n_seq_tokens, split_type_name(type), n_ubatch, n_ubatches, (t_end - t_start)/(double) n_iter);
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,432 @@
+// Check the parts of the context that run on other threads or after the backend synchronizes (the asynchronous
+// decode, the state copies and the scatter of the logits subsets), and the reuse of the graph across ubatches
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#include "../src/llama-io.h"
+#include "../src/llama-thread-pool.h"
+
+#include "ggml-backend.h"
+#include "ggml-cpp.h"
+#include "ggml-cpu.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static void test_thread_pool() {
+    llama_thread_pool pool(3);
+
+    // every item is processed exactly once
+    {
+        std::vector<std::atomic<int>> counts(1000);
+
+        pool.parallel_for(counts.size(), [&](int64_t i) {
+            counts[i]++;
+        });
+
+        for (const auto & c : counts) {
+            assert(c == 1);
+        }
+    }
+
+    // the first exception is rethrown on the calling thread
+    {
+        bool thrown = false;
+
+        try {
+            pool.parallel_for(100, [](int64_t i) {
+                if (i == 42) {
+                    throw std::runtime_error("42");
+                }
+            });
+        } catch (const std::runtime_error &) {
+            thrown = true;
+        }
+
+        assert(thrown);
+    }
+
+    // a task that no worker has started yet runs on the waiting thread
+    {
+        int res = 0;
+
+        auto t = pool.submit([&]() { res = 1; });
+        llama_thread_pool::wait(t);
+
+        assert(t->done());
+        assert(res == 1);
+    }
+}
+
+// the copies from/to host buffers are split by size between the threads - the split must not lose or mix up bytes
+static void test_tensor_copies() {
+    // large enough to be split between all threads (see llama_io_tensor_copies)
+    const std::vector<size_t> sizes = { (3u << 20) + 17, 1, (5u << 20) + 3, 4096, (8u << 20) + 5 };
+
+    ggml_init_params params = {
+        /*.mem_size   =*/ sizes.size()*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ NULL,
+        /*.no_alloc   =*/ true,
+    };
+
+    ggml_context_ptr ctx(ggml_init(params));
+
+    std::vector<ggml_tensor *> tensors;
+    for (const size_t size : sizes) {
+        tensors.push_back(ggml_new_tensor_1d(ctx.get(), GGML_TYPE_I8, size));
+    }
+
+    ggml_backend_buffer_ptr buf(ggml_backend_alloc_ctx_tensors_from_buft(ctx.get(), ggml_backend_cpu_buffer_type()));
+    assert(buf);
+
+    std::mt19937 rng(42);
+
+    // copy a range of each tensor, starting at a small offset
+    std::vector<llama_io_tensor_copy> copies;
+    size_t n_bytes = 0;
+
+    for (auto * t : tensors) {
+        auto * data = (uint8_t *) t->data;
+        for (size_t i = 0; i < ggml_nbytes(t); ++i) {
+            data[i] = rng();
+        }
+
+        const size_t offset = ggml_nbytes(t) > 1 ? 1 : 0;
+
+        copies.push_back({ t, offset, ggml_nbytes(t) - offset, nullptr });
+        n_bytes += ggml_nbytes(t) - offset;
+    }
+
+    std::vector<uint8_t> host(n_bytes);
+
+    {
+        size_t off = 0;
+        for (auto & c : copies) {
+            c.data = host.data() + off;
+            off += c.size;
+        }
+    }
+
+    llama_thread_pool pool(3);
+
+    for (auto * workers : { (llama_thread_pool *) nullptr, &pool }) {
+        // tensor -> host
+        std::fill(host.begin(), host.end(), 0);
+
+        llama_io_tensor_copies(copies, false, workers);
+
+        for (const auto & c : copies) {
+            assert(memcmp(c.data, (const uint8_t *) c.tensor->data + c.offset, c.size) == 0);
+        }
+
+        // host -> tensor
+        for (auto & b : host) {
+            b ^= 0x5a;
+        }
+
+        llama_io_tensor_copies(copies, true, workers);
+
+        for (const auto & c : copies) {
+            assert(memcmp(c.data, (const uint8_t *) c.tensor->data + c.offset, c.size) == 0);
+        }
+    }
+}
+
+static llama_context * make_context(llama_model * model, uint32_t n_ubatch = 64) {
+    llama_context_params cparams = llama_context_default_params();
+
+    cparams.n_ctx           = 256;
+    cparams.n_batch         = 64;
+    cparams.n_ubatch        = n_ubatch;
+    cparams.n_seq_max       = 2;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx);
+
+    return ctx;
+}
+
+static std::vector<float> get_logits(llama_context * ctx) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx)));
+
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    assert(logits);
+
+    return std::vector<float>(logits, logits + n_vocab);
+}
+
+static bool logits_match(const std::vector<float> & logits0, const std::vector<float> & logits1) {
+    for (size_t i = 0; i < logits0.size(); ++i) {
+        if (std::fabs(logits0[i] - logits1[i]) > 1e-3f) {
+            fprintf(stderr, "%s: logits differ at %zu: %f != %f\n", __func__, i, logits0[i], logits1[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// decode n_tokens tokens of the sequence, starting at position p0
+static void decode(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, int n_tokens) {
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+
+    for (int i = 0; i < n_tokens; ++i) {
+        common_batch_add(batch, 100 + p0 + i, p0 + i, { seq_id }, i == n_tokens - 1);
+    }
+
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    llama_batch_free(batch);
+}
+
+// the outputs of the previous decode stay readable until llama_decode_wait(), then the results are the same as with
+// llama_decode()
+static void test_decode_async(llama_model * model) {
+    llama_context * ctx     = make_context(model);
+    llama_context * ctx_ref = make_context(model);
+
+    assert(llama_decode_wait(ctx) == 0);
+
+    decode(ctx,     0, 0, 8);
+    decode(ctx_ref, 0, 0, 8);
+
+    llama_batch batch = llama_batch_init(1, 0, 1);
+
+    for (int i = 0; i < 8; ++i) {
+        const auto logits_prev = get_logits(ctx);
+
+        common_batch_clear(batch);
+        common_batch_add(batch, 200 + i, 8 + i, { 0 }, true);
+
+        assert(llama_decode_async(ctx, batch) == 0);
+
+        // only one decode at a time
+        assert(llama_decode_async(ctx, batch) == -1);
+        assert(llama_decode(ctx, batch) == -1);
+
+        assert(logits_match(get_logits(ctx), logits_prev));
+
+        assert(llama_decode_wait(ctx) == 0);
+
+        assert(llama_decode(ctx_ref, batch) == 0);
+        assert(logits_match(get_logits(ctx), get_logits(ctx_ref)));
+    }
+
+    // a failed decode keeps the outputs of the previous decode
+    {
+        const auto logits_prev = get_logits(ctx);
+
+        common_batch_clear(batch);
+        common_batch_add(batch, 300, 16, { 99 }, true);
+
+        assert(llama_decode_async(ctx, batch) == 0);
+        assert(llama_decode_wait(ctx) == -1);
+
+        assert(logits_match(get_logits(ctx), logits_prev));
+    }
+
+    llama_batch_free(batch);
+
+    llama_free(ctx_ref);
+    llama_free(ctx);
+}
+
+// a sequence restored from a snapshot continues the same as the original
+static void test_state_snapshot(llama_model * model) {
+    llama_context * ctx     = make_context(model);
+    llama_context * ctx_ref = make_context(model);
+
+    decode(ctx,     0, 0, 32);
+    decode(ctx_ref, 0, 0, 32);
+
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, 0));
+    assert(llama_state_seq_get_data(ctx, state.data(), state.size(), 0) == state.size());
+
+    // restore into another sequence of a fresh context
+    llama_free(ctx);
+    ctx = make_context(model);
+
+    assert(llama_state_seq_set_data(ctx, state.data(), state.size(), 1) == state.size());
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    assert(llama_memory_seq_pos_min(mem, 1) == 0);
+    assert(llama_memory_seq_pos_max(mem, 1) == 31);
+
+    decode(ctx,     1, 32, 4);
+    decode(ctx_ref, 0, 32, 4);
+
+    assert(logits_match(get_logits(ctx), get_logits(ctx_ref)));
+
+    llama_free(ctx_ref);
+    llama_free(ctx);
+}
+
+// the logits of the outputs of the sequences with a subset are computed only for the tokens of the subset
+static void test_logits_subset(llama_model * model) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    // 4 ubatches, each with the outputs of one sequence
+    llama_context * ctx     = make_context(model, 8);
+    llama_context * ctx_ref = make_context(model, 8);
+
+    const std::vector<std::vector<llama_token>> subsets = {
+        { 31000, 5, 200, 100 },
+        { 9, 8, 7 },
+    };
+
+    for (llama_seq_id s = 0; s < 2; ++s) {
+        assert(llama_set_logits_subset(ctx, s, subsets[s].data(), subsets[s].size()) == 0);
+    }
+
+    const auto decode_all = [](llama_context * ctx, const std::vector<llama_seq_id> & seq_ids, llama_pos p0, int n_tokens) {
+        llama_batch batch = llama_batch_init(n_tokens*seq_ids.size(), 0, 1);
+
+        for (const llama_seq_id seq_id : seq_ids) {
+            for (int i = 0; i < n_tokens; ++i) {
+                common_batch_add(batch, 100 + 10*seq_id + p0 + i, p0 + i, { seq_id }, true);
+            }
+        }
+
+        const int ret = llama_decode(ctx, batch);
+        assert(ret == 0);
+
+        llama_batch_free(batch);
+    };
+
+    // outputs [i0, i0 + n) of the last batch restricted to the subset (empty: all tokens)
+    const auto check = [&](int i0, int n, const std::vector<llama_token> & subset) {
+        for (int i = i0; i < i0 + n; ++i) {
+            const float * logits     = llama_get_logits_ith(ctx,     i);
+            const float * logits_ref = llama_get_logits_ith(ctx_ref, i);
+
+            for (llama_token t = 0; t < n_vocab; ++t) {
+                if (subset.empty() || std::find(subset.begin(), subset.end(), t) != subset.end()) {
+                    assert(std::fabs(logits[t] - logits_ref[t]) < 1e-3f);
+                } else {
+                    assert(logits[t] == -INFINITY);
+                }
+            }
+        }
+    };
+
+    decode_all(ctx,     { 0, 1 }, 0, 16);
+    decode_all(ctx_ref, { 0, 1 }, 0, 16);
+
+    check( 0, 16, subsets[0]);
+    check(16, 16, subsets[1]);
+
+    // the subset is cleared with the cells of the sequence
+    for (auto * c : { ctx, ctx_ref }) {
+        assert(llama_memory_seq_rm(llama_get_memory(c), 0, -1, -1));
+    }
+
+    decode_all(ctx,     { 0, 1 }, 16, 4);
+    decode_all(ctx_ref, { 0, 1 }, 16, 4);
+
+    check(0, 4, {});
+    check(4, 4, subsets[1]);
+
+    assert(llama_set_logits_subset(ctx, 0, subsets[0].data(), subsets[0].size()) == 0);
+
+    for (auto * c : { ctx, ctx_ref }) {
+        llama_memory_seq_keep(llama_get_memory(c), 0);
+    }
+
+    decode_all(ctx,     { 0, 1 }, 20, 4);
+    decode_all(ctx_ref, { 0, 1 }, 20, 4);
+
+    check(0, 4, subsets[0]);
+    check(4, 4, {});
+
+    for (auto * c : { ctx, ctx_ref }) {
+        llama_memory_clear(llama_get_memory(c), true);
+    }
+
+    decode_all(ctx,     { 0 }, 0, 4);
+    decode_all(ctx_ref, { 0 }, 0, 4);
+
+    check(0, 4, {});
+
+    llama_free(ctx_ref);
+    llama_free(ctx);
+}
+
+// a decode that reuses the graph of the previous ubatch gives the same logits as a decode with a freshly built graph
+static void test_graph_reuse(llama_model * model) {
+// skip on windows, because setenv is not supported
+#ifdef _WIN32
+    GGML_UNUSED(model);
+#else
+    llama_context * ctx = make_context(model);
+
+    setenv("LLAMA_GRAPH_REUSE_DISABLE", "1", true);
+    llama_context * ctx_ref = make_context(model);
+    unsetenv("LLAMA_GRAPH_REUSE_DISABLE");
+
+    // same shape for all ubatches, alternating between the sequences so that the KV stores move around
+    decode(ctx,     0, 0, 8);
+    decode(ctx_ref, 0, 0, 8);
+
+    for (int i = 0; i < 8; ++i) {
+        const llama_seq_id seq_id = i % 2;
+        const llama_pos    p0     = seq_id == 0 ? 8 + 4*(i/2) : 4*(i/2);
+
+        decode(ctx,     seq_id, p0, 4);
+        decode(ctx_ref, seq_id, p0, 4);
+
+        assert(logits_match(get_logits(ctx), get_logits(ctx_ref)));
+    }
+
+    assert(llama_perf_context(ctx).n_reused     > 0);
+    assert(llama_perf_context(ctx_ref).n_reused == 0);
+
+    llama_free(ctx_ref);
+    llama_free(ctx);
+#endif
+}
+
+int main(int argc, char ** argv) {
+    const char * vocab_path = get_model_or_exit(argc, argv);
+
+    test_thread_pool();
+    test_tensor_copies();
+
+    const std::string model_path = (std::filesystem::temp_directory_path() / ("test-context-" + std::to_string(std::random_device{}()) + ".gguf")).string();
+
+    if (!make_random_model(vocab_path, model_path.c_str())) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+    std::filesystem::remove(model_path);
+    assert(model);
+
+    test_decode_async(model);
+    test_state_snapshot(model);
+    test_logits_subset(model);
+    test_graph_reuse(model);
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
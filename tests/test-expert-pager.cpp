@@ -0,0 +1,125 @@
+// Check that paging the MoE experts in and out of memory with a small expert budget does not change the logits,
+// using a small MoE model with random weights
+
+#include "llama.h"
+#include "get-model.h"
+
+#include "../src/llama-expert-pager.h"
+#include "../src/llama-model.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+static const int n_expert = 8;
+
+// the logits of the last token after a prompt and after each of the generated tokens
+static std::vector<float> eval(llama_model * model) {
+    llama_context_params cparams = llama_context_default_params();
+
+    cparams.n_ctx           = 64;
+    cparams.n_batch         = 64;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    std::vector<float> res;
+
+    std::vector<llama_token> tokens;
+    for (int i = 0; i < 16; ++i) {
+        tokens.push_back(100 + 7*i);
+    }
+
+    int ret = llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size()));
+    assert(ret == 0);
+
+    for (int i = 0; i < 16; ++i) {
+        const float * logits = llama_get_logits_ith(ctx, -1);
+        res.insert(res.end(), logits, logits + n_vocab);
+
+        // a different token each time, so that the router selects different experts
+        llama_token token = 200 + 13*i;
+
+        ret = llama_decode(ctx, llama_batch_get_one(&token, 1));
+        assert(ret == 0);
+    }
+
+    llama_free(ctx);
+
+    return res;
+}
+
+int main(int argc, char ** argv) {
+    const char * vocab_path = get_model_or_exit(argc, argv);
+
+    const std::string model_path = (std::filesystem::temp_directory_path() / ("test-expert-pager-" + std::to_string(std::random_device{}()) + ".gguf")).string();
+
+    if (!make_random_model(vocab_path, model_path.c_str(), n_expert)) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    std::vector<float> logits_ref;
+    {
+        llama_model * model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+        assert(model);
+        assert(model->get_expert_pager() == nullptr);
+
+        logits_ref = eval(model);
+
+        llama_model_free(model);
+    }
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.use_mmap = true;
+
+    // the gate, up and down slices of 2 experts of one layer, so that every layer evicts the experts of the previous one
+    mparams.expert_budget = 2*3*64*128*sizeof(float);
+
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), mparams);
+    assert(model);
+
+    const llama_expert_pager * pager = model->get_expert_pager();
+    if (!llama_expert_pager::SUPPORTED) {
+        fprintf(stderr, "%s: expert paging is not supported on this platform - skipped\n", __func__);
+        assert(pager == nullptr);
+    } else {
+        assert(pager != nullptr);
+        assert(pager->n_tensors() == 3*2);
+    }
+
+    // the released pages are read again from the model file, so the logits are bitwise equal
+    assert(eval(model) == logits_ref);
+
+    if (pager) {
+        const auto stats = pager->get_stats();
+
+        fprintf(stderr, "%s: budget = %zu, resident = %zu, page in = %llu, evict = %llu\n", __func__,
+                stats.budget, stats.size_resident, (unsigned long long) stats.n_page_in, (unsigned long long) stats.n_evict);
+
+        assert(stats.n_page_in > 0);
+        assert(stats.n_evict   > 0);
+
+        // the last decode used 2 experts per layer, only the ones of the last layer are still resident
+        assert(stats.size_resident <= stats.budget);
+    }
+
+    llama_model_free(model);
+
+    std::filesystem::remove(model_path);
+
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
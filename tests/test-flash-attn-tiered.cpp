@@ -0,0 +1,141 @@
+// Check the CPU implementation of ggml_flash_attn_ext_tiered against ggml_flash_attn_ext over the concatenated K/V
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static std::mt19937 rng(42);
+
+static std::vector<float> rand_data(int64_t n) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    std::vector<float> res(n);
+    for (auto & x : res) {
+        x = dist(rng);
+    }
+
+    return res;
+}
+
+// store the values in t and return them as they are after the conversion to the type of t
+static std::vector<float> set_data(ggml_tensor * t, const std::vector<float> & data) {
+    const int64_t n_per_row = t->ne[0];
+    const int64_t n_rows    = ggml_nelements(t)/n_per_row;
+
+    ggml_quantize_chunk(t->type, data.data(), t->data, 0, n_rows, n_per_row, nullptr);
+
+    std::vector<float> res(data.size());
+    ggml_get_type_traits(t->type)->to_float(t->data, res.data(), ggml_nelements(t));
+
+    return res;
+}
+
+// copy the rows [0, ne1) of a [ne0, ne1, ne2] tensor to the rows [i1, i1 + ne1) of a [ne0, n1, ne2] F16 tensor
+static void copy_rows(ggml_tensor * dst, int64_t i1, const std::vector<float> & src, int64_t ne0, int64_t ne1, int64_t ne2) {
+    for (int64_t i2 = 0; i2 < ne2; ++i2) {
+        for (int64_t i = 0; i < ne1; ++i) {
+            ggml_fp16_t * row = (ggml_fp16_t *) ((char *) dst->data + (i1 + i)*dst->nb[1] + i2*dst->nb[2]);
+            ggml_fp32_to_fp16_row(src.data() + (i2*ne1 + i)*ne0, row, ne0);
+        }
+    }
+}
+
+static double nmse(const float * a, const float * b, int64_t n) {
+    double err = 0.0;
+    double ref = 0.0;
+
+    for (int64_t i = 0; i < n; ++i) {
+        err += (a[i] - b[i])*(a[i] - b[i]);
+        ref += b[i]*b[i];
+    }
+
+    return err/ref;
+}
+
+static bool test(int64_t hs, int64_t nh, int64_t nh_kv, int64_t kv0, int64_t kv1, int64_t nb, ggml_type type0, ggml_type type1) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 64*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    ggml_context * ctx = ggml_init(params);
+
+    const int64_t n_kv = kv0 + kv1;
+
+    ggml_tensor * q  = ggml_new_tensor_4d(ctx, GGML_TYPE_F32, hs, nb, nh, 1);
+    ggml_tensor * k0 = ggml_new_tensor_4d(ctx, type0, hs, kv0, nh_kv, 1);
+    ggml_tensor * v0 = ggml_new_tensor_4d(ctx, type0, hs, kv0, nh_kv, 1);
+    ggml_tensor * k1 = ggml_new_tensor_4d(ctx, type1, hs, kv1, nh_kv, 1);
+    ggml_tensor * v1 = ggml_new_tensor_4d(ctx, type1, hs, kv1, nh_kv, 1);
+    ggml_tensor * k  = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, hs, n_kv, nh_kv, 1);
+    ggml_tensor * v  = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, hs, n_kv, nh_kv, 1);
+    ggml_tensor * m  = ggml_new_tensor_4d(ctx, GGML_TYPE_F16, n_kv, GGML_PAD(nb, GGML_KQ_MASK_PAD), 1, 1);
+
+    {
+        const auto data = rand_data(ggml_nelements(q));
+        memcpy(q->data, data.data(), ggml_nbytes(q));
+    }
+
+    // the reference uses the values of both tiers after their conversion
+    copy_rows(k, 0,   set_data(k0, rand_data(ggml_nelements(k0))), hs, kv0, nh_kv);
+    copy_rows(v, 0,   set_data(v0, rand_data(ggml_nelements(v0))), hs, kv0, nh_kv);
+    copy_rows(k, kv0, set_data(k1, rand_data(ggml_nelements(k1))), hs, kv1, nh_kv);
+    copy_rows(v, kv0, set_data(v1, rand_data(ggml_nelements(v1))), hs, kv1, nh_kv);
+
+    // causal mask, the tokens of the batch are the last ones of the cache
+    for (int64_t i1 = 0; i1 < m->ne[1]; ++i1) {
+        ggml_fp16_t * row = (ggml_fp16_t *) ((char *) m->data + i1*m->nb[1]);
+        for (int64_t i0 = 0; i0 < n_kv; ++i0) {
+            row[i0] = ggml_fp32_to_fp16(i1 < nb && i0 > n_kv - nb + i1 ? -INFINITY : 0.0f);
+        }
+    }
+
+    const float scale = 1.0f/sqrtf(hs);
+
+    ggml_tensor * out = ggml_flash_attn_ext_tiered(ctx, q, k0, v0, k1, v1, m, scale, 0.0f, 0.0f);
+    ggml_tensor * ref = ggml_flash_attn_ext       (ctx, q, k,  v,          m, scale, 0.0f, 0.0f);
+    ggml_flash_attn_ext_set_prec(out, GGML_PREC_F32);
+    ggml_flash_attn_ext_set_prec(ref, GGML_PREC_F32);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+    ggml_build_forward_expand(gf, ref);
+
+    ggml_graph_compute_with_ctx(ctx, gf, 1);
+
+    // the dot products with a quantized K tier are computed on the quantized Q, as with a non-tiered quantized cache
+    const double err     = nmse((const float *) out->data, (const float *) ref->data, ggml_nelements(out));
+    const double err_max = type0 == GGML_TYPE_F16 && type1 == GGML_TYPE_F16 ? 1e-10 : 5e-4;
+
+    const bool ok = err < err_max;
+
+    printf("%s: hs = %3lld, nh = %lld/%lld, kv = %3lld + %3lld, nb = %2lld, types = %s/%s: nmse = %.3e %s\n", __func__,
+            (long long) hs, (long long) nh, (long long) nh_kv, (long long) kv0, (long long) kv1, (long long) nb,
+            ggml_type_name(type0), ggml_type_name(type1), err, ok ? "OK" : "FAILED");
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    ggml_cpu_init();
+
+    bool ok = true;
+
+    for (ggml_type type1 : { GGML_TYPE_F16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0 }) {
+        for (int64_t nb : { 1, 7, 32 }) {
+            ok = test(64, 2, 2, 96,  160, nb, GGML_TYPE_F16, type1) && ok;
+            ok = test(64, 4, 1, 256, 33,  nb, GGML_TYPE_F16, type1) && ok;
+            ok = test(64, 2, 2, 3,   64,  nb, type1, GGML_TYPE_F16) && ok;
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -789,6 +789,39 @@ static std::pair<int, int> test_handcrafted_file(const unsigned int seed) {
             ntest++;
         }
 
+        // parse the same file in place from a mapping
+        {
+            struct ggml_context * ctx_mmap = nullptr;
+            struct gguf_init_params gguf_params_mmap = {
+                /*no_alloc =*/ false,
+                /*ctx      =*/ hft >= offset_has_data ? &ctx_mmap : nullptr,
+            };
+
+            struct gguf_context * gguf_ctx_mmap = gguf_init_from_file_mmap_impl(file, gguf_params_mmap);
+
+            bool ok = bool(gguf_ctx_mmap) == bool(gguf_ctx);
+            if (ok && gguf_ctx_mmap) {
+                ok = ok && handcrafted_check_header(gguf_ctx_mmap, seed, hft >= offset_has_kv, hft >= offset_has_tensors, alignment_defined);
+                ok = ok && (hft < offset_has_kv      || handcrafted_check_kv(gguf_ctx_mmap, seed, hft >= offset_has_tensors, alignment_defined));
+                ok = ok && (hft < offset_has_tensors || handcrafted_check_tensors(gguf_ctx_mmap, seed));
+                ok = ok && (hft < offset_has_data    || handcrafted_check_tensor_data(gguf_ctx_mmap, seed, file));
+            }
+
+            printf("%s:   - same_result_mmap: ", __func__);
+            if (ok) {
+                printf("\033[1;32mOK\033[0m\n");
+                npass++;
+            } else {
+                printf("\033[1;31mFAIL\033[0m\n");
+            }
+            ntest++;
+
+            if (gguf_ctx_mmap) {
+                ggml_free(ctx_mmap);
+                gguf_free(gguf_ctx_mmap);
+            }
+        }
+
         fclose(file);
         if (gguf_ctx) {
             ggml_free(ctx);
@@ -1188,6 +1221,28 @@ static std::pair<int, int> test_roundtrip(ggml_backend_dev_t dev, const unsigned
         ntest++;
     }
 
+    {
+        struct ggml_context * ctx_2 = nullptr;
+        struct gguf_init_params gguf_params_mmap = {
+            /*no_alloc =*/ false,
+            /*ctx      =*/ only_meta ? nullptr : &ctx_2,
+        };
+        struct gguf_context * gguf_ctx_2 = gguf_init_from_file_mmap_impl(file, gguf_params_mmap);
+
+        printf("%s: same_kv_and_tensors_mmap: ", __func__);
+        if (gguf_ctx_2 && all_kv_in_other(gguf_ctx_0, gguf_ctx_2) && all_kv_in_other(gguf_ctx_2, gguf_ctx_0) &&
+                all_tensors_in_other(gguf_ctx_0, gguf_ctx_2) && (only_meta || same_tensor_data(ctx_0, ctx_2))) {
+            printf("\033[1;32mOK\033[0m\n");
+            npass++;
+        } else {
+            printf("\033[1;31mFAIL\033[0m\n");
+        }
+        ntest++;
+
+        ggml_free(ctx_2);
+        gguf_free(gguf_ctx_2);
+    }
+
     ggml_backend_buffer_free(bbuf);
     ggml_free(ctx_0);
     ggml_free(ctx_1);
@@ -2,6 +2,7 @@
 #undef NDEBUG
 #endif
 
+#include "llama.h"
 #include "json-schema-to-grammar.h"
 
 #include "../src/unicode.h"
@@ -9,7 +10,10 @@
 
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -1295,7 +1299,212 @@ static void test_json_schema() {
     );
 }
 
-int main() {
+static void test_mask_cache() {
+    fprintf(stderr, "⚫ Testing the eviction of the token masks\n");
+
+    // distinct stacks to use as keys
+    std::vector<llama_grammar_element> elems(LLAMA_GRAMMAR_MAX_MASKS + 1);
+    auto key = [&](size_t i) { return llama_grammar_stacks { { &elems[i] } }; };
+
+    llama_grammar_mask_cache cache;
+
+    for (size_t i = 0; i < LLAMA_GRAMMAR_MAX_MASKS; ++i) {
+        cache.put(key(i), { (uint32_t) i });
+    }
+    assert(cache.size() == LLAMA_GRAMMAR_MAX_MASKS);
+
+    // key 0 becomes the most recently used one, so key 1 is evicted
+    assert(cache.get(key(0)) != nullptr);
+    cache.put(key(LLAMA_GRAMMAR_MAX_MASKS), { 42 });
+
+    assert(cache.size() == LLAMA_GRAMMAR_MAX_MASKS);
+    assert(cache.get(key(1)) == nullptr);
+    assert(cache.get(key(0)) != nullptr && cache.get(key(0))->at(0) == 0);
+    assert(cache.get(key(2)) != nullptr && cache.get(key(2))->at(0) == 2);
+    assert(cache.get(key(LLAMA_GRAMMAR_MAX_MASKS))->at(0) == 42);
+
+    fprintf(stderr, "  ✅︎\n");
+}
+
+static std::string token_piece(const llama_vocab * vocab, llama_token id) {
+    std::string piece(32, '\0');
+    int32_t n = llama_token_to_piece(vocab, id, &piece[0], piece.size(), 0, true);
+    if (n < 0) {
+        piece.resize(-n);
+        n = llama_token_to_piece(vocab, id, &piece[0], piece.size(), 0, true);
+    }
+    piece.resize(std::max(0, n));
+    return piece;
+}
+
+// true if the piece is not a complete, valid UTF-8 string: it ends in the middle of a sequence, or has stray bytes
+static bool piece_is_partial_utf8(const std::string & piece) {
+    static const int lookup[] = { 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 2, 2, 3, 4 };
+    for (size_t i = 0; i < piece.size();) {
+        const int len = lookup[static_cast<uint8_t>(piece[i]) >> 4];
+        if (len == 0 || i + len > piece.size()) {
+            return true;
+        }
+        for (int k = 1; k < len; ++k) {
+            if ((static_cast<uint8_t>(piece[i + k]) >> 6) != 2) {
+                return true;
+            }
+        }
+        i += len;
+    }
+    return false;
+}
+
+// the ids of the candidates that the grammar allows
+static std::vector<llama_token> grammar_allowed(llama_grammar & grammar, const std::vector<llama_token> & ids) {
+    std::vector<llama_token_data> data;
+    data.reserve(ids.size());
+    for (llama_token id : ids) {
+        data.push_back({ id, 0.0f, 0.0f });
+    }
+
+    llama_token_data_array cur_p = { data.data(), data.size(), -1, false };
+    llama_grammar_apply_impl(grammar, &cur_p);
+
+    std::vector<llama_token> allowed;
+    for (const auto & td : data) {
+        if (td.logit != -INFINITY) {
+            allowed.push_back(td.id);
+        }
+    }
+    return allowed;
+}
+
+static void check_allowed(const llama_vocab * vocab, const std::vector<llama_token> & allowed, const std::vector<llama_token> & expected, int step) {
+    if (allowed == expected) {
+        return;
+    }
+
+    fprintf(stderr, "  ❌ step %d: %zu allowed tokens, expected %zu\n", step, allowed.size(), expected.size());
+    for (size_t i = 0; i < std::max(allowed.size(), expected.size()); ++i) {
+        const llama_token a = i < allowed.size()  ? allowed[i]  : -1;
+        const llama_token e = i < expected.size() ? expected[i] : -1;
+        if (a != e) {
+            fprintf(stderr, "     first difference: allowed %d '%s', expected %d '%s'\n",
+                    a, a < 0 ? "" : token_piece(vocab, a).c_str(), e, e < 0 ? "" : token_piece(vocab, e).c_str());
+            break;
+        }
+    }
+    assert(false);
+}
+
+// random walk over the tokens of a real vocab, comparing at each step the tokens allowed through the token trie (with
+// the masks computed or cached for the stacks) with the tokens allowed when checking the candidates one by one
+static void test_token_masks(const llama_vocab * vocab) {
+    fprintf(stderr, "⚫ Testing the token masks against the candidates one by one\n");
+
+    // strings accept any character, including the multi-byte sequences split across byte tokens
+    const std::string grammar_str = R"""(
+        root ::= item (", " item)*
+        item ::= [a-zA-Z0-9]+ | "\"" [^"]* "\"" | "日本語" | "é"+
+    )""";
+
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab);
+
+    std::vector<llama_token> all(n_vocab);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        all[id] = id;
+    }
+
+    std::vector<bool> partial(n_vocab);
+    for (llama_token id = 0; id < n_vocab; ++id) {
+        partial[id] = piece_is_partial_utf8(token_piece(vocab, id));
+    }
+
+    auto init = [&](bool with_trie) {
+        llama_grammar * grammar = llama_grammar_init_impl(vocab, grammar_str.c_str(), "root", false, nullptr, 0, nullptr, 0);
+        assert(grammar != nullptr);
+        assert(grammar->trie != nullptr);
+        if (!with_trie) {
+            grammar->trie.reset();
+        }
+        return grammar;
+    };
+
+    llama_grammar * grammar = init(true);
+    llama_grammar * ref     = init(false);
+
+    std::mt19937 rng(1234);
+
+    int n_partial = 0;
+    int n_eog     = 0;
+    int n_cached  = 0;
+
+    const int n_steps = 256;
+
+    for (int step = 0; step < n_steps; ++step) {
+        // the whole vocab goes through the trie
+        const auto allowed = grammar_allowed(*grammar, all);
+        check_allowed(vocab, allowed, grammar_allowed(*ref, all), step);
+        assert(!allowed.empty());
+
+        // a few candidates use the cached mask if there is one, and are checked one by one otherwise
+        {
+            std::vector<llama_token> few(64);
+            for (auto & id : few) {
+                id = std::uniform_int_distribution<llama_token>(0, n_vocab - 1)(rng);
+            }
+            check_allowed(vocab, grammar_allowed(*grammar, few), grammar_allowed(*ref, few), step);
+        }
+
+        n_cached += grammar->masks.size() > 0;
+
+        std::vector<llama_token> allowed_eog;
+        std::vector<llama_token> allowed_partial;
+        for (llama_token id : allowed) {
+            if (llama_vocab_is_eog(vocab, id)) {
+                allowed_eog.push_back(id);
+            } else if (partial[id]) {
+                allowed_partial.push_back(id);
+            }
+        }
+
+        n_eog += !allowed_eog.empty();
+
+        const int r = std::uniform_int_distribution<int>(0, 7)(rng);
+
+        // end of generation: start over - the new grammar is created first so that it shares the trie of the old one
+        if (!allowed_eog.empty() && r == 0) {
+            llama_grammar * grammar_new = init(true);
+            llama_grammar_free_impl(grammar);
+            llama_grammar_free_impl(ref);
+            grammar = grammar_new;
+            ref     = init(false);
+            continue;
+        }
+
+        // favor the tokens that leave the grammar in the middle of a UTF-8 sequence, they are rare in the vocab
+        const auto & pool = !allowed_partial.empty() && r < 4 ? allowed_partial : allowed;
+
+        llama_token id;
+        do {
+            id = pool[std::uniform_int_distribution<size_t>(0, pool.size() - 1)(rng)];
+        } while (llama_vocab_is_eog(vocab, id));
+
+        llama_grammar_accept_impl(*grammar, id);
+        llama_grammar_accept_impl(*ref,     id);
+
+        n_partial += grammar->partial_utf8.n_remain > 0;
+    }
+
+    llama_grammar_free_impl(grammar);
+    llama_grammar_free_impl(ref);
+
+    fprintf(stderr, "  %d steps: %d in a partial UTF-8 sequence, %d allowing EOG, %d with cached masks\n", n_steps, n_partial, n_eog, n_cached);
+
+    assert(n_partial > 0);
+    assert(n_eog     > 0);
+    assert(n_cached  > 0);
+
+    fprintf(stderr, "  ✅︎\n");
+}
+
+int main(int argc, char ** argv) {
     fprintf(stdout, "Running grammar integration tests...\n");
     test_simple_grammar();
     test_complex_grammar();
@@ -1305,6 +1514,32 @@ int main() {
     test_failure_missing_reference();
     test_failure_left_recursion();
     test_json_schema();
+    test_mask_cache();
+
+    // the token masks are tested with the vocabs given as arguments
+    if (argc > 1) {
+        llama_backend_init();
+
+        for (int i = 1; i < argc; ++i) {
+            fprintf(stderr, "reading vocab from: '%s'\n", argv[i]);
+
+            auto mparams = llama_model_default_params();
+            mparams.vocab_only = true;
+
+            llama_model * model = llama_model_load_from_file(argv[i], mparams);
+            if (model == nullptr) {
+                fprintf(stderr, "error: failed to load vocab '%s'\n", argv[i]);
+                return 1;
+            }
+
+            test_token_masks(llama_model_get_vocab(model));
+
+            llama_model_free(model);
+        }
+
+        llama_backend_free();
+    }
+
     fprintf(stdout, "All tests passed.\n");
     return 0;
 }
@@ -0,0 +1,358 @@
+// Check the operations on the KV cache of a context, using a small model with random weights
+
+#include "llama.h"
+#include "common.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+static llama_context_params make_cparams(uint32_t n_ctx, uint32_t n_seq_max) {
+    llama_context_params cparams = llama_context_default_params();
+
+    cparams.n_ctx           = n_ctx;
+    cparams.n_batch         = 64;
+    cparams.n_ubatch        = 64;
+    cparams.n_seq_max       = n_seq_max;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    return cparams;
+}
+
+static llama_context * make_context(llama_model * model, const llama_context_params & cparams) {
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx);
+
+    return ctx;
+}
+
+// decode n_tokens tokens of the sequence, starting at position p0
+static void decode(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, int n_tokens) {
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+
+    for (int i = 0; i < n_tokens; ++i) {
+        common_batch_add(batch, 100 + (p0 + i) % 1000, p0 + i, { seq_id }, i == n_tokens - 1);
+    }
+
+    const int ret = llama_decode(ctx, batch);
+    assert(ret == 0);
+
+    llama_batch_free(batch);
+}
+
+// decode the sequence in chunks of n_batch tokens
+static void decode_chunked(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, int n_tokens) {
+    const int n_batch = llama_n_batch(ctx);
+
+    for (int i = 0; i < n_tokens; i += n_batch) {
+        decode(ctx, seq_id, p0 + i, std::min(n_batch, n_tokens - i));
+    }
+}
+
+static bool logits_match(llama_context * ctx0, llama_context * ctx1) {
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(llama_get_model(ctx0)));
+
+    const float * logits0 = llama_get_logits_ith(ctx0, -1);
+    const float * logits1 = llama_get_logits_ith(ctx1, -1);
+
+    for (int i = 0; i < n_vocab; ++i) {
+        if (std::fabs(logits0[i] - logits1[i]) > 1e-3f) {
+            fprintf(stderr, "%s: logits differ at %d: %f != %f\n", __func__, i, logits0[i], logits1[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// the llama_memory_* ops must not leave stale state of the spilled sequences behind
+static void test_spill(llama_model * model) {
+    llama_context * ctx = make_context(model, make_cparams(256, 2));
+    llama_memory_t  mem = llama_get_memory(ctx);
+
+    decode(ctx, 0, 0, 16);
+
+    if (!llama_state_seq_spill(ctx, 0)) {
+        fprintf(stderr, "%s: spilling is not supported - skipped\n", __func__);
+        llama_free(ctx);
+        return;
+    }
+
+    // clear drops the spilled state - the next decode starts from an empty cache
+    assert(llama_state_seq_is_spilled(ctx, 0));
+    llama_memory_clear(mem, true);
+    assert(!llama_state_seq_is_spilled(ctx, 0));
+
+    decode(ctx, 0, 0, 4);
+    assert(llama_memory_seq_pos_min(mem, 0) == 0);
+    assert(llama_memory_seq_pos_max(mem, 0) == 3);
+    assert(llama_memory_seq_pos_max(mem, 1) == -1);
+
+    // removing the whole sequence drops the spilled state
+    decode(ctx, 1, 0, 8);
+    assert(llama_state_seq_spill(ctx, 1));
+    llama_memory_seq_rm(mem, 1, -1, -1);
+    assert(!llama_state_seq_is_spilled(ctx, 1));
+
+    decode(ctx, 1, 0, 2);
+    assert(llama_memory_seq_pos_min(mem, 1) == 0);
+    assert(llama_memory_seq_pos_max(mem, 1) == 1);
+
+    // copying restores the spilled source
+    llama_memory_seq_rm(mem, 1, -1, -1);
+    assert(llama_state_seq_spill(ctx, 0));
+    llama_memory_seq_cp(mem, 0, 1, -1, -1);
+    assert(!llama_state_seq_is_spilled(ctx, 0));
+    assert(llama_memory_seq_pos_max(mem, 0) == 3);
+    assert(llama_memory_seq_pos_max(mem, 1) == 3);
+
+    // keeping a sequence drops the spilled state of the others
+    assert(llama_state_seq_spill(ctx, 1));
+    llama_memory_seq_keep(mem, 0);
+    assert(!llama_state_seq_is_spilled(ctx, 1));
+    assert(llama_memory_seq_pos_max(mem, 1) == -1);
+    assert(llama_memory_seq_pos_max(mem, 0) == 3);
+
+    // removing a part of the sequence restores the rest
+    assert(llama_state_seq_spill(ctx, 0));
+    llama_memory_seq_rm(mem, 0, 2, -1);
+    assert(!llama_state_seq_is_spilled(ctx, 0));
+    assert(llama_memory_seq_pos_min(mem, 0) == 0);
+    assert(llama_memory_seq_pos_max(mem, 0) == 1);
+
+    decode(ctx, 0, 2, 2);
+    assert(llama_memory_seq_pos_max(mem, 0) == 3);
+
+    llama_free(ctx);
+}
+
+// the decode after a restore must give the same logits as a sequence that was never spilled
+static void test_spill_restore(llama_model * model) {
+    const auto dir = std::filesystem::temp_directory_path() / ("test-kv-cache-spill-" + std::to_string(std::random_device{}()));
+    std::filesystem::create_directory(dir);
+
+    const std::string dir_str = dir.string();
+
+    llama_context_params cparams = make_cparams(256, 2);
+    cparams.kv_spill_dir = dir_str.c_str();
+
+    llama_context * ctx     = make_context(model, cparams);
+    llama_context * ctx_ref = make_context(model, make_cparams(256, 2));
+
+    decode(ctx,     0, 0, 32);
+    decode(ctx_ref, 0, 0, 32);
+
+    if (!llama_state_seq_spill(ctx, 0)) {
+        fprintf(stderr, "%s: spilling is not supported - skipped\n", __func__);
+    } else {
+        // the scratch file is removed as soon as it is created
+        assert(std::filesystem::is_empty(dir));
+
+        // another sequence uses the cells in the meantime
+        decode(ctx, 1, 0, 16);
+        llama_memory_seq_rm(llama_get_memory(ctx), 1, -1, -1);
+
+        // restored by the decode
+        decode(ctx,     0, 32, 4);
+        decode(ctx_ref, 0, 32, 4);
+
+        assert(!llama_state_seq_is_spilled(ctx, 0));
+        assert(logits_match(ctx, ctx_ref));
+
+        // explicit prefetch and restore
+        assert(llama_state_seq_spill(ctx, 0));
+        llama_state_seq_prefetch(ctx, 0);
+        assert(llama_state_seq_restore(ctx, 0));
+
+        decode(ctx,     0, 36, 1);
+        decode(ctx_ref, 0, 36, 1);
+
+        assert(logits_match(ctx, ctx_ref));
+    }
+
+    llama_free(ctx_ref);
+    llama_free(ctx);
+
+    std::filesystem::remove_all(dir);
+}
+
+// the defrag must preserve the KV data and the positions of the moved cells
+static void test_defrag(llama_model * model) {
+    // note: contexts smaller than 2048 cells are not defragmented
+    llama_context_params cparams = make_cparams(4096, 2);
+    cparams.defrag_thold = 0.1f;
+
+    llama_context * ctx = make_context(model, cparams);
+    llama_memory_t  mem = llama_get_memory(ctx);
+
+    // the reference, without holes
+    llama_context * ctx_ref = make_context(model, make_cparams(4096, 1));
+
+    const int n_past = 1100;
+
+    // the removal of sequence 0 leaves a hole in front of the cells of sequence 1
+    decode_chunked(ctx, 0, 0, 1024);
+    decode_chunked(ctx, 1, 0, n_past);
+    llama_memory_seq_rm(mem, 0, -1, -1);
+    assert(llama_memory_fragmentation(mem) > 0.1f);
+
+    decode_chunked(ctx_ref, 0, 0, n_past);
+
+    // the first decode starts the defrag, the removal from the empty sequence waits for it
+    for (int i = 0; i < 4; ++i) {
+        decode(ctx,     1, n_past + i, 1);
+        decode(ctx_ref, 0, n_past + i, 1);
+
+        assert(logits_match(ctx, ctx_ref));
+        assert(llama_memory_seq_pos_min(mem, 1) == 0);
+        assert(llama_memory_seq_pos_max(mem, 1) == n_past + i);
+
+        llama_memory_seq_rm(mem, 0, -1, -1);
+    }
+
+    assert(llama_memory_fragmentation(mem) < 0.1f);
+
+    llama_free(ctx_ref);
+    llama_free(ctx);
+}
+
+// the streaming cache evicts the old tokens, so the decode can continue past n_ctx with bounded positions
+static void test_stream(llama_model * model) {
+    const int n_ctx    = 256;
+    const int n_sink   = 4;
+    const int n_window = 64;
+    const int n_tokens = 16;
+
+    llama_context_params cparams = make_cparams(n_ctx, 1);
+    cparams.n_stream_sink   = n_sink;
+    cparams.n_stream_window = n_window;
+
+    llama_context * ctx = make_context(model, cparams);
+    llama_memory_t  mem = llama_get_memory(ctx);
+
+    // the reference, without eviction
+    llama_context * ctx_ref = make_context(model, make_cparams(n_ctx, 1));
+
+    llama_pos pos_max  = -1;
+    int       n_shifts = 0;
+
+    for (int i = 0; i < 4*n_ctx/n_tokens; ++i) {
+        std::vector<llama_token> tokens(n_tokens);
+        for (int j = 0; j < n_tokens; ++j) {
+            tokens[j] = 100 + (i*n_tokens + j) % 1000;
+        }
+
+        // a batch without positions continues after the compacted positions
+        const int ret = llama_decode(ctx, llama_batch_get_one(tokens.data(), n_tokens));
+        assert(ret == 0);
+
+        const llama_pos pos_max_new = llama_memory_seq_pos_max(mem, 0);
+
+        // the sinks stay in place, the window positions are moved down once the gap reaches n_window/2
+        assert(llama_memory_seq_pos_min(mem, 0) == 0);
+        assert(pos_max_new <= pos_max + n_tokens);
+        assert(pos_max_new <  n_sink + n_window + n_window/2 + n_tokens);
+
+        if (pos_max_new < pos_max + n_tokens) {
+            n_shifts++;
+        }
+
+        pos_max = pos_max_new;
+
+        const float * logits = llama_get_logits_ith(ctx, -1);
+        for (int j = 0; j < llama_vocab_n_tokens(llama_model_get_vocab(model)); ++j) {
+            assert(std::isfinite(logits[j]));
+        }
+
+        // nothing is evicted yet - the outputs are the same as without streaming
+        if ((i + 1)*n_tokens <= n_sink + n_window) {
+            const int ret_ref = llama_decode(ctx_ref, llama_batch_get_one(tokens.data(), n_tokens));
+            assert(ret_ref == 0);
+
+            assert(logits_match(ctx, ctx_ref));
+        }
+    }
+
+    assert(n_shifts > 0);
+
+    llama_free(ctx_ref);
+    llama_free(ctx);
+}
+
+// with the cold types equal to the hot types, the migration of the older cells to the cold tier only moves the data, so
+// the attention over both tiers must give the same logits as a cache without tiers
+static void test_tiered(llama_model * model) {
+    const int n_ctx    = 512;
+    const int n_kv_hot = 64;
+
+    // the new tokens are placed in the hot cells freed by the migration, so the attention visits the cells in another
+    // order than in the reference - with a quantized V cache the CPU flash attention accumulates in FP32 instead of
+    // FP16, so that the order does not change the result beyond the tolerance
+    llama_context_params cparams_ref = make_cparams(n_ctx, 1);
+    cparams_ref.flash_attn = true;
+    cparams_ref.type_v     = GGML_TYPE_Q8_0;
+
+    llama_context_params cparams = cparams_ref;
+    cparams.n_kv_hot    = n_kv_hot;
+    cparams.type_k_cold = cparams.type_k;
+    cparams.type_v_cold = cparams.type_v;
+
+    llama_context * ctx     = make_context(model, cparams);
+    llama_context * ctx_ref = make_context(model, cparams_ref);
+
+    // the prompt does not fit in the hot tier
+    const int n_past = 4*n_kv_hot;
+
+    decode_chunked(ctx,     0, 0, n_past);
+    decode_chunked(ctx_ref, 0, 0, n_past);
+
+    assert(logits_match(ctx, ctx_ref));
+
+    // the older cells are migrated in the background while the generation continues
+    for (int i = 0; i < n_kv_hot; ++i) {
+        decode(ctx,     0, n_past + i, 1);
+        decode(ctx_ref, 0, n_past + i, 1);
+
+        assert(logits_match(ctx, ctx_ref));
+    }
+
+    llama_free(ctx_ref);
+    llama_free(ctx);
+}
+
+int main(int argc, char ** argv) {
+    const char * vocab_path = get_model_or_exit(argc, argv);
+
+    const std::string model_path = (std::filesystem::temp_directory_path() / ("test-kv-cache-" + std::to_string(std::random_device{}()) + ".gguf")).string();
+
+    if (!make_random_model(vocab_path, model_path.c_str())) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    llama_model * model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+    std::filesystem::remove(model_path);
+    assert(model);
+
+    test_spill(model);
+    test_spill_restore(model);
+    test_defrag(model);
+    test_stream(model);
+    test_tiered(model);
+
+    llama_model_free(model);
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
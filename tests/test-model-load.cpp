@@ -0,0 +1,155 @@
+// Check that the different ways of loading the tensor data give the same model, using a small model with random weights
+
+#include "llama.h"
+#include "get-model.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+// the logits of the last token of a fixed prompt
+static std::vector<float> eval(llama_model * model) {
+    llama_context_params cparams = llama_context_default_params();
+
+    cparams.n_ctx           = 64;
+    cparams.n_batch         = 64;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    assert(ctx);
+
+    std::vector<llama_token> tokens;
+    for (int i = 0; i < 16; ++i) {
+        tokens.push_back(100 + i);
+    }
+
+    const int ret = llama_decode(ctx, llama_batch_get_one(tokens.data(), tokens.size()));
+    assert(ret == 0);
+
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+
+    const float * logits = llama_get_logits_ith(ctx, -1);
+
+    std::vector<float> res(logits, logits + n_vocab);
+
+    llama_free(ctx);
+
+    return res;
+}
+
+static std::vector<float> load_and_eval(const std::string & path, const llama_model_params & mparams) {
+    llama_model * model = llama_model_load_from_file(path.c_str(), mparams);
+    assert(model);
+
+    const auto res = eval(model);
+
+    llama_model_free(model);
+
+    return res;
+}
+
+// without mmap, the tensors are read by a pool of LLAMA_LOAD_THREADS threads
+static void test_load_threads(const std::string & path, const std::vector<float> & logits_ref) {
+#ifdef _WIN32
+    fprintf(stderr, "%s: setenv is not available - skipped\n", __func__);
+    (void) path;
+    (void) logits_ref;
+#else
+    llama_model_params mparams = llama_model_default_params();
+    mparams.use_mmap = false;
+
+    for (const char * n_threads : { "0", "1", "4" }) {
+        setenv("LLAMA_LOAD_THREADS", n_threads, 1);
+
+        // the data is the same, so the logits are bitwise equal
+        assert(load_and_eval(path, mparams) == logits_ref);
+    }
+
+    unsetenv("LLAMA_LOAD_THREADS");
+#endif
+}
+
+// the huge page modes fall back to regular pages when no huge pages are available, and ignore use_mmap = false
+static void test_hugepages(const std::string & path, const std::vector<float> & logits_ref) {
+    for (auto hugepages : { LLAMA_HUGEPAGES_TYPE_FILE, LLAMA_HUGEPAGES_TYPE_ANON }) {
+        for (bool use_mmap : { true, false }) {
+            llama_model_params mparams = llama_model_default_params();
+            mparams.use_mmap  = use_mmap;
+            mparams.hugepages = hugepages;
+
+            assert(load_and_eval(path, mparams) == logits_ref);
+        }
+    }
+}
+
+// a model stored in the repacked CPU layout by llama-repack is loaded in the CPU_REPACKED buffer type without converting
+// the data, and must give the same logits as the original model repacked at load time
+static void test_repack(const std::string & path, const char * repack_path) {
+    if (!repack_path) {
+        fprintf(stderr, "%s: no llama-repack - skipped\n", __func__);
+        return;
+    }
+
+    const std::string path_q4 = path + ".q4_0.gguf";
+    const std::string path_rp = path + ".repacked.gguf";
+
+    // the repacked layouts exist for the quantized types
+    llama_model_quantize_params qparams = llama_model_quantize_default_params();
+    qparams.ftype   = LLAMA_FTYPE_MOSTLY_Q4_0;
+    qparams.nthread = 1;
+
+    const uint32_t ret = llama_model_quantize(path.c_str(), path_q4.c_str(), &qparams);
+    assert(ret == 0);
+
+    const std::string cmd = std::string(repack_path) + " " + path_q4 + " " + path_rp;
+    if (std::system(cmd.c_str()) != 0) {
+        fprintf(stderr, "%s: no tensor can be repacked on this machine - skipped\n", __func__);
+        std::filesystem::remove(path_q4);
+        return;
+    }
+
+    const auto logits_ref = load_and_eval(path_q4, llama_model_default_params());
+
+    for (bool use_mmap : { true, false }) {
+        llama_model_params mparams = llama_model_default_params();
+        mparams.use_mmap = use_mmap;
+
+        // the same kernels run on the same data
+        assert(load_and_eval(path_rp, mparams) == logits_ref);
+    }
+
+    std::filesystem::remove(path_q4);
+    std::filesystem::remove(path_rp);
+}
+
+int main(int argc, char ** argv) {
+    const char * vocab_path = get_model_or_exit(argc, argv);
+
+    const std::string model_path = (std::filesystem::temp_directory_path() / ("test-model-load-" + std::to_string(std::random_device{}()) + ".gguf")).string();
+
+    if (!make_random_model(vocab_path, model_path.c_str())) {
+        return 1;
+    }
+
+    llama_backend_init();
+
+    const auto logits_ref = load_and_eval(model_path, llama_model_default_params());
+
+    test_load_threads(model_path, logits_ref);
+    test_hugepages(model_path, logits_ref);
+    test_repack(model_path, argc > 2 ? argv[2] : nullptr);
+
+    std::filesystem::remove(model_path);
+
+    llama_backend_free();
+
+    fprintf(stderr, "%s: OK\n", __func__);
+
+    return 0;
+}
@@ -1,5 +1,8 @@
 #include "ggml.h"
 #include "llama.h"
+#include "common.h"
+#include "get-model.h"
+#include "sampling.h"
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -7,6 +10,8 @@
 
 #include <algorithm>
 #include <cmath>
+#include <filesystem>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -136,6 +141,28 @@ static void test_typical(const std::vector<float> & probs, const std::vector<flo
     tester.check();
 }
 
+// apply a copy of the sampler to the candidates in reverse order - the samplers that look up the candidates by token id
+// must give the same logits as for the candidates in token id order
+static std::vector<llama_token_data> apply_reversed(const llama_sampler * sampler, const llama_token_data_array * cur_p) {
+    std::vector<llama_token_data> cur(cur_p->data, cur_p->data + cur_p->size);
+    std::reverse(cur.begin(), cur.end());
+
+    llama_token_data_array cur_rev = { cur.data(), cur.size(), -1, false };
+
+    auto * clone = llama_sampler_clone(sampler);
+    llama_sampler_apply(clone, &cur_rev);
+    llama_sampler_free(clone);
+
+    return cur;
+}
+
+static void check_reversed(const std::vector<llama_token_data> & cur_rev, const llama_token_data_array * cur_p) {
+    for (const auto & td : cur_rev) {
+        GGML_ASSERT(cur_p->data[td.id].id == td.id);
+        GGML_ASSERT(cur_p->data[td.id].logit == td.logit);
+    }
+}
+
 static void test_penalties(
     const std::vector<float> & probs, const std::vector<llama_token> & last_tokens,
     const std::vector<float> & probs_expected, float repeat_penalty, float alpha_frequency, float alpha_presence
@@ -150,8 +177,11 @@ static void test_penalties(
         llama_sampler_accept(sampler, last_tokens[i]);
     }
 
+    const auto cur_rev = apply_reversed(sampler, &tester.cur_p);
+
     DUMP(&tester.cur_p);
     tester.apply(sampler);
+    check_reversed(cur_rev, &tester.cur_p);
     tester.apply(llama_sampler_init_dist(0));
     DUMP(&tester.cur_p);
 
@@ -174,8 +204,11 @@ static void test_dry(
         llama_sampler_accept(sampler, last_tokens[i]);
     }
 
+    const auto cur_rev = apply_reversed(sampler, &tester.cur_p);
+
     DUMP(&tester.cur_p);
     tester.apply(sampler);
+    check_reversed(cur_rev, &tester.cur_p);
     tester.apply(llama_sampler_init_dist(0));
     DUMP(&tester.cur_p);
     tester.check();
@@ -267,6 +300,88 @@ static void test_sampler_queue(const size_t n_vocab, const std::string & sampler
            samplers_sequence.c_str(), n_vocab, top_k, top_p, min_p);
 }
 
+// compare the selection of top-k/top-p/min-p on large unsorted arrays with a full sort
+static void test_select_large(const size_t n_vocab, const float stddev) {
+    std::mt19937 rng(1234);
+    std::normal_distribution<float> dist(0.0f, stddev);
+
+    std::vector<llama_token_data> data(n_vocab);
+    for (size_t i = 0; i < n_vocab; i++) {
+        data[i] = llama_token_data{(llama_token) i, dist(rng), 0.0f};
+    }
+
+    std::vector<llama_token_data> sorted = data;
+    std::sort(sorted.begin(), sorted.end(), [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    auto run = [&](llama_sampler * smpl) {
+        std::vector<llama_token_data> cur = data;
+        llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+        llama_sampler_apply(smpl, &cur_p);
+        llama_sampler_free(smpl);
+        return std::vector<llama_token_data>(cur_p.data, cur_p.data + cur_p.size);
+    };
+
+    for (int k : {1, 40, 1000, (int) n_vocab}) {
+        const auto res = run(llama_sampler_init_top_k(k));
+
+        GGML_ASSERT(res.size() == std::min<size_t>(k, n_vocab));
+        for (size_t i = 0; i < res.size(); i++) {
+            GGML_ASSERT(res[i].logit == sorted[i].logit);
+        }
+    }
+
+    for (float p : {0.5f, 0.9f, 0.999f}) {
+        const auto res = run(llama_sampler_init_top_p(p, 1));
+
+        double sum = 0.0;
+        for (const auto & d : sorted) {
+            sum += exp(d.logit - sorted[0].logit);
+        }
+
+        // the number of candidates needed to reach p (up to rounding differences)
+        size_t n_expected = 0;
+        double cum = 0.0;
+        while (n_expected < n_vocab && cum < p) {
+            cum += exp(sorted[n_expected++].logit - sorted[0].logit)/sum;
+        }
+
+        GGML_ASSERT(res.size() + 1 >= n_expected && res.size() <= n_expected + 1);
+        for (size_t i = 0; i < res.size(); i++) {
+            GGML_ASSERT(res[i].logit == sorted[i].logit);
+        }
+    }
+
+    for (float p : {0.05f, 0.5f}) {
+        const auto res = run(llama_sampler_init_min_p(p, 1));
+
+        const float min_logit = sorted[0].logit + logf(p);
+
+        size_t n_expected = 0;
+        while (n_expected < n_vocab && sorted[n_expected].logit >= min_logit) {
+            n_expected++;
+        }
+
+        GGML_ASSERT(res.size() == n_expected);
+        for (const auto & d : res) {
+            GGML_ASSERT(d.logit >= min_logit);
+        }
+    }
+
+    // min_keep larger than the number of candidates that pass the filter
+    {
+        const auto res = run(llama_sampler_init_min_p(0.999f, 100));
+
+        GGML_ASSERT(res.size() == 100);
+        for (size_t i = 0; i < res.size(); i++) {
+            GGML_ASSERT(res[i].logit == sorted[i].logit);
+        }
+    }
+
+    printf("Select large OK with n_vocab=%zu stddev=%f\n", n_vocab, stddev);
+}
+
 static void bench(llama_sampler * cnstr, const char * cnstr_name, const std::vector<llama_token_data> & data, int n_iter) {
     std::vector<llama_token_data> cur(data.size());
     std::copy(data.begin(), data.end(), cur.begin());
@@ -299,13 +414,180 @@ static void test_perf() {
     }
 
     BENCH(llama_sampler_init_top_k  (40),                     data, 32);
+    BENCH(llama_sampler_init_top_k  (1000),                   data, 32);
     BENCH(llama_sampler_init_top_p  (0.8f, 1),                data, 32);
     BENCH(llama_sampler_init_min_p  (0.2f, 1),                data, 32);
     BENCH(llama_sampler_init_typical(0.5f, 1),                data, 32);
     BENCH(llama_sampler_init_xtc    (1.0f, 0.1f, 1, 1),       data, 32);
+
+    // logits of a large vocabulary, with a more realistic distribution
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 3.0f);
+
+    const int n_vocab_large = 151936;
+
+    data.clear();
+    for (int i = 0; i < n_vocab_large; i++) {
+        data.emplace_back(llama_token_data{i, dist(rng), 0.0f});
+    }
+
+    BENCH(llama_sampler_init_top_k  (40),                     data, 32);
+    BENCH(llama_sampler_init_top_p  (0.95f, 1),               data, 32);
+    BENCH(llama_sampler_init_min_p  (0.05f, 1),               data, 32);
+}
+
+static llama_sampler * make_chain(uint32_t seed) {
+    llama_sampler * smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+
+    llama_sampler_chain_add(smpl, llama_sampler_init_top_k(40));
+    llama_sampler_chain_add(smpl, llama_sampler_init_temp(1.5f));
+    llama_sampler_chain_add(smpl, llama_sampler_init_dist(seed));
+
+    return smpl;
 }
 
-int main(void) {
+// llama_sampler_sample_batch() must give the same tokens as llama_sampler_sample() for each output
+static void test_sample_batch(llama_model * model) {
+    const int n_seq = 8;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 256;
+    cparams.n_seq_max       = n_seq;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    GGML_ASSERT(ctx);
+
+    // one output per sequence
+    llama_batch batch = llama_batch_init(4*n_seq, 0, 1);
+    for (int s = 0; s < n_seq; ++s) {
+        for (int i = 0; i < 4; ++i) {
+            const int j = batch.n_tokens++;
+
+            batch.token[j]     = 100 + 10*s + i;
+            batch.pos[j]       = i;
+            batch.n_seq_id[j]  = 1;
+            batch.seq_id[j][0] = s;
+            batch.logits[j]    = i == 3;
+        }
+    }
+
+    GGML_ASSERT(llama_decode(ctx, batch) == 0);
+
+    // the batch is decoded with a single thread, the samplers run on the worker threads of the context
+    // note: the workers are created on first use
+    llama_set_n_threads(ctx, 1, 4);
+
+    std::vector<llama_sampler *> smpls;
+    std::vector<llama_sampler *> smpls_ref;
+    std::vector<int32_t>         idxs;
+
+    for (int s = 0; s < n_seq; ++s) {
+        smpls    .push_back(make_chain(1234 + s));
+        smpls_ref.push_back(make_chain(1234 + s));
+        idxs.push_back(4*s + 3);
+    }
+
+    // the second round checks that the samplers have accepted the tokens of the first one
+    for (int round = 0; round < 2; ++round) {
+        std::vector<llama_token> tokens(n_seq);
+        llama_sampler_sample_batch(smpls.data(), ctx, idxs.data(), tokens.data(), n_seq);
+
+        for (int s = 0; s < n_seq; ++s) {
+            GGML_ASSERT(tokens[s] == llama_sampler_sample(smpls_ref[s], ctx, idxs[s]));
+        }
+    }
+
+    for (int s = 0; s < n_seq; ++s) {
+        llama_sampler_free(smpls[s]);
+        llama_sampler_free(smpls_ref[s]);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+}
+
+// with n_logits_top_k > 0, the full logits rows are built from the candidates, and the samplers only see the candidates
+// (grammars are not supported)
+static void test_logits_top_k(llama_model * model) {
+    const llama_vocab * vocab = llama_model_get_vocab(model);
+
+    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const int n_top_k = 8;
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx           = 256;
+    cparams.n_threads       = 1;
+    cparams.n_threads_batch = 1;
+
+    llama_context * ctx_ref = llama_init_from_model(model, cparams);
+    GGML_ASSERT(ctx_ref);
+
+    cparams.n_logits_top_k = n_top_k;
+
+    llama_context * ctx = llama_init_from_model(model, cparams);
+    GGML_ASSERT(ctx);
+
+    llama_batch batch = llama_batch_init(8, 0, 1);
+    for (int i = 0; i < 8; ++i) {
+        common_batch_add(batch, 100 + i, i, { 0 }, i == 7);
+    }
+
+    GGML_ASSERT(llama_decode(ctx_ref, batch) == 0);
+    GGML_ASSERT(llama_decode(ctx,     batch) == 0);
+
+    const float * logits_ref = llama_get_logits_ith(ctx_ref, -1);
+
+    const llama_token * ids    = nullptr;
+    const float       * values = nullptr;
+    GGML_ASSERT(llama_get_logits_top_k_ith(ctx, -1, &ids, &values) == n_top_k);
+
+    // the candidates are the largest logits, the other tokens are -INFINITY
+    const float * logits = llama_get_logits_ith(ctx, -1);
+    GGML_ASSERT(logits != nullptr);
+    GGML_ASSERT(llama_get_logits(ctx) == logits);
+
+    std::vector<bool> is_top_k(n_vocab, false);
+    for (int i = 0; i < n_top_k; ++i) {
+        GGML_ASSERT(std::fabs(values[i] - logits_ref[ids[i]]) < 1e-3f);
+        GGML_ASSERT(logits[ids[i]] == values[i]);
+        is_top_k[ids[i]] = true;
+    }
+
+    for (llama_token t = 0; t < n_vocab; ++t) {
+        if (!is_top_k[t]) {
+            GGML_ASSERT(logits[t] == -INFINITY);
+            GGML_ASSERT(logits_ref[t] <= values[n_top_k - 1] + 1e-3f);
+        }
+    }
+
+    // the samplers only see the candidates
+    {
+        llama_sampler * smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler_chain_add(smpl, llama_sampler_init_dist(42));
+
+        GGML_ASSERT(is_top_k[llama_sampler_sample(smpl, ctx, -1)]);
+
+        llama_sampler_free(smpl);
+    }
+
+    // the grammar sampler of common_sampler has no grammar
+    for (const bool grammar_first : { false, true }) {
+        common_sampler * gsmpl = common_sampler_init(model, common_params_sampling());
+        GGML_ASSERT(gsmpl);
+
+        GGML_ASSERT(is_top_k[common_sampler_sample(gsmpl, ctx, -1, grammar_first)]);
+
+        common_sampler_free(gsmpl);
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    llama_free(ctx_ref);
+}
+
+int main(int argc, char ** argv) {
     ggml_time_init();
 
     test_temp({0.1f, 0.2f, 0.3f, 0.4f}, {0.4f, 0.3f, 0.2f, 0.1f}, 1.0f);
@@ -392,6 +674,29 @@ int main(void) {
     test_sampler_queue(10000, "mkp", 100, 0.8f, 0.1f);
     test_sampler_queue(10000, "mpk", 100, 0.8f, 0.1f);
 
+    test_select_large(200, 1.0f);
+    test_select_large(151936, 0.1f);
+    test_select_large(151936, 3.0f);
+
+    // the batched sampling and the top-k logits need a context
+    if (argc > 1) {
+        const std::string model_path = (std::filesystem::temp_directory_path() / ("test-sampling-" + std::to_string(std::random_device{}()) + ".gguf")).string();
+
+        GGML_ASSERT(make_random_model(argv[1], model_path.c_str()));
+
+        llama_backend_init();
+
+        llama_model * model = llama_model_load_from_file(model_path.c_str(), llama_model_default_params());
+        std::filesystem::remove(model_path);
+        GGML_ASSERT(model);
+
+        test_sample_batch(model);
+        test_logits_top_k(model);
+
+        llama_model_free(model);
+        llama_backend_free();
+    }
+
     printf("OK\n");
 
     test_perf();
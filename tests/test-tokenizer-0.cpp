@@ -252,6 +252,41 @@ int main(int argc, char **argv) {
         threads[i].join();
     }
 
+    // batched tokenization must give the same tokens, also when a long text is split in pieces
+    if (!k_tests.empty()) {
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        std::vector<std::string> texts;
+        for (const auto & test_kv : k_tests) {
+            texts.push_back(test_kv.first);
+        }
+
+        const auto res = common_tokenize_batch(vocab, texts, add_special, false, 4);
+
+        size_t i = 0;
+        for (const auto & test_kv : k_tests) {
+            if (res[i++] != test_kv.second) {
+                fprintf(stderr, "%s : failed batched test: '%s'\n", __func__, test_kv.first.c_str());
+                success = false;
+            }
+        }
+
+        std::string text_long;
+        while (text_long.size() < 512*1024) {
+            for (const auto & text : texts) {
+                text_long += text + " and ";
+            }
+        }
+
+        const auto res_long   = common_tokenize(vocab, text_long, true, false);
+        const auto res_long_4 = common_tokenize_batch(vocab, { text_long }, true, false, 4)[0];
+
+        if (res_long != res_long_4) {
+            fprintf(stderr, "%s : failed batched test of a long text, %zu tokens instead of %zu\n", __func__, res_long_4.size(), res_long.size());
+            success = false;
+        }
+    }
+
     // single threaded tokenization
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());
@@ -0,0 +1,185 @@
+// Benchmark the BPE pre-tokenizer regexes on synthetic text and check the custom splitters against std::regex
+
+#include "llama.h"
+
+#include "../src/llama-vocab.h"
+#include "../src/unicode.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct pre_type_info {
+    llama_vocab_pre_type type;
+    const char *         name;
+};
+
+// one entry per distinct set of regexes
+static const pre_type_info k_pre_types[] = {
+    { LLAMA_VOCAB_PRE_TYPE_DEFAULT,        "default"        },
+    { LLAMA_VOCAB_PRE_TYPE_LLAMA3,         "llama3"         },
+    { LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_LLM,   "deepseek-llm"   },
+    { LLAMA_VOCAB_PRE_TYPE_DEEPSEEK_CODER, "deepseek-coder" },
+    { LLAMA_VOCAB_PRE_TYPE_DEEPSEEK3_LLM,  "deepseek3-llm"  },
+    { LLAMA_VOCAB_PRE_TYPE_FALCON,         "falcon"         },
+    { LLAMA_VOCAB_PRE_TYPE_STARCODER,      "starcoder"      },
+    { LLAMA_VOCAB_PRE_TYPE_GPT2,           "gpt2"           },
+    { LLAMA_VOCAB_PRE_TYPE_QWEN2,          "qwen2"          },
+    { LLAMA_VOCAB_PRE_TYPE_PORO,           "poro"           },
+    { LLAMA_VOCAB_PRE_TYPE_VIKING,         "viking"         },
+    { LLAMA_VOCAB_PRE_TYPE_TEKKEN,         "tekken"         },
+    { LLAMA_VOCAB_PRE_TYPE_CHAMELEON,      "chameleon"      },
+    { LLAMA_VOCAB_PRE_TYPE_GPT4O,          "gpt-4o"         },
+    { LLAMA_VOCAB_PRE_TYPE_SUPERBPE,       "superbpe"       },
+    { LLAMA_VOCAB_PRE_TYPE_BAILINGMOE,     "bailingmoe"     },
+    { LLAMA_VOCAB_PRE_TYPE_SEED_CODER,     "seed-coder"     },
+};
+
+// fragments that exercise the corner cases of the regexes: contractions, letter case, digit runs,
+// line breaks, non-ASCII letters, digits, punctuation and whitespace, combining marks, unassigned codepoints
+static const char * k_fragments[] = {
+    "the", "The", "THE", "quick", "Brown", "fOX", "jumps", "over", "lazy", "dog", "McDonald", "iPhone", "HTTPServer",
+    "'s", "'t", "'re", "'ve", "'m", "'ll", "'d", "'S", "'LL", "'Re", "'x", "'", "y'all", "don't", "I'M",
+    "0", "1", "42", "123", "2024", "31415926", "0x1F",
+    ".", ",", "!", "?", "...", "--", "->", "==", "/", "//", "\\", "(", ")", "[]", "{}", "<>", "#", "$", "%", "&", "*",
+    "+", "@", "^", "_", "`", "|", "~", ";", ":", "\"", "'",
+    " ", " ", " ", "  ", "   ", "\t", "\n", "\n", "\r\n", "\n\n", " \n", "\n ", " \r\n ", "\v", "\f",
+    "é", "straße", "Ärger", "Привет", "ΑΒΓ", "ǅ", "µ", "日本語", "中文", "한국어", "ひらがな", "カタカナ", "ไทย",
+    "١٢٣", "١٢٣٤٥", "１２３", "Ⅻ", "！", "，", "。", "…", "「", "」", "‘", "’", "“", "”", "€", "±",
+    "\xc2\xa0", "\xe3\x80\x80", "\xe2\x80\x89", "\xe2\x80\x8b", "\xc2\x85", "\xe2\x80\xa8",
+    "e\xcc\x81", "\xcc\x81", "🦙", "😁", "İ", "K", "ſ", "\xcd\xb8", "\x01", "\x7f", "\xff", "\xe0\xa0",
+};
+
+static std::string generate_text(size_t size, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<size_t> dist_frag(0, sizeof(k_fragments)/sizeof(k_fragments[0]) - 1);
+    std::uniform_int_distribution<int>    dist_space(0, 3);
+
+    std::string text;
+    text.reserve(size + 64);
+    while (text.size() < size) {
+        text += k_fragments[dist_frag(rng)];
+        if (dist_space(rng) == 0) {
+            text += ' ';
+        }
+    }
+
+    return text;
+}
+
+static double time_split(const std::string & text, const std::vector<std::string> & regex_exprs, bool use_custom,
+                         int n_iter, std::vector<std::string> & words) {
+    const auto t_start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < n_iter; ++i) {
+        words = unicode_regex_split(text, regex_exprs, use_custom);
+    }
+    const auto t_end = std::chrono::high_resolution_clock::now();
+
+    return std::chrono::duration<double>(t_end - t_start).count() / n_iter;
+}
+
+static void usage(const char * executable) {
+    printf("usage: %s [options]\n", executable);
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help            show this help message and exit\n");
+    printf("  -f FILE               benchmark on the contents of FILE instead of synthetic text\n");
+    printf("  -s SIZE               size in KiB of the synthetic text (default: 64)\n");
+    printf("  -i N                  number of iterations of the custom splitters (default: 4)\n");
+    printf("  -p NAME               only run the pre-tokenizer NAME\n");
+}
+
+int main(int argc, char ** argv) {
+    std::string fname;
+    std::string only;
+    size_t      size   = 64*1024;
+    int         n_iter = 4;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            usage(argv[0]);
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: missing value for %s\n", arg.c_str());
+            usage(argv[0]);
+            return 1;
+        }
+        if (arg == "-f") {
+            fname = argv[++i];
+        } else if (arg == "-s") {
+            size = std::strtoull(argv[++i], nullptr, 10)*1024;
+        } else if (arg == "-i") {
+            n_iter = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "-p") {
+            only = argv[++i];
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::string text;
+    if (!fname.empty()) {
+        std::ifstream f(fname, std::ios::binary);
+        if (!f) {
+            fprintf(stderr, "error: failed to open %s\n", fname.c_str());
+            return 1;
+        }
+        std::stringstream ss;
+        ss << f.rdbuf();
+        text = ss.str();
+    } else {
+        text = generate_text(size, 1234);
+    }
+
+    const double mb = text.size()/1e6;
+
+    printf("text size: %zu bytes\n\n", text.size());
+    printf("| %-16s | %12s | %12s | %8s | %8s |\n", "pre-tokenizer", "custom MB/s", "regex MB/s", "speedup", "words");
+    printf("| %-16s | %12s | %12s | %8s | %8s |\n", "---", "---:", "---:", "---:", "---:");
+
+    int n_fail = 0;
+
+    for (const auto & pre : k_pre_types) {
+        if (!only.empty() && only != pre.name) {
+            continue;
+        }
+
+        const auto regex_exprs = llama_vocab::get_bpe_regex_exprs(pre.type);
+
+        std::vector<std::string> words_custom;
+        std::vector<std::string> words_regex;
+
+        const double t_custom = time_split(text, regex_exprs, true,  n_iter, words_custom);
+        const double t_regex  = time_split(text, regex_exprs, false, 1,      words_regex);
+
+        printf("| %-16s | %12.2f | %12.2f | %7.1fx | %8zu |\n", pre.name, mb/t_custom, mb/t_regex, t_regex/t_custom, words_custom.size());
+
+        if (words_custom != words_regex) {
+            size_t i = 0;
+            while (i < words_custom.size() && i < words_regex.size() && words_custom[i] == words_regex[i]) {
+                ++i;
+            }
+            fprintf(stderr, "%s: %s: the custom splitter differs from std::regex at word %zu: '%s' != '%s'\n", __func__, pre.name, i,
+                    i < words_custom.size() ? words_custom[i].c_str() : "", i < words_regex.size() ? words_regex[i].c_str() : "");
+            n_fail++;
+        }
+    }
+
+    if (n_fail > 0) {
+        fprintf(stderr, "\n%s: %d pre-tokenizers failed\n", __func__, n_fail);
+        return 1;
+    }
+
+    return 0;
+}
@@ -2,16 +2,22 @@
 #include "gguf.h"
 #include "llama.h"
 #include "common.h"
+#include "thread-pool.h"
 
 #include <algorithm>
 #include <cinttypes>
 #include <climits>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <exception>
 #include <stdexcept>
 #include <cstring>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #if defined(_WIN32)
@@ -20,6 +26,9 @@
         #define PATH_MAX MAX_PATH
     #endif
     #include <io.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
 #endif
 
 enum split_operation : uint8_t {
@@ -41,6 +50,7 @@ struct split_params {
     int n_split_tensors = 128;
     std::string input;
     std::string output;
+    int n_threads = std::max(1u, std::thread::hardware_concurrency());
     bool no_tensor_first_split = false;
     bool dry_run = false;
 };
@@ -61,6 +71,7 @@ static void split_print_usage(const char * executable) {
     printf("  --split-max-size N(M|G) max size per split\n");
     printf("  --no-tensor-first-split do not add tensors to the first split (disabled by default)\n");
     printf("  --dry-run               only print out a split plan and exit, without writing any new files\n");
+    printf("  --threads N             number of shards written or read in parallel (default: %d)\n", default_params.n_threads);
     printf("\n");
 }
 
@@ -143,6 +154,16 @@ static void split_params_parse_ex(int argc, const char ** argv, split_params & p
             }
             params.mode = MODE_SIZE;
             params.n_bytes_split = split_str_to_n_bytes(argv[arg_idx]);
+        } else if (arg == "--threads") {
+            if (++arg_idx >= argc) {
+                invalid_param = true;
+                break;
+            }
+            arg_found = true;
+            params.n_threads = atoi(argv[arg_idx]);
+            if (params.n_threads <= 0) {
+                throw std::invalid_argument("error: the number of threads must be a positive value");
+            }
         }
 
         if (!arg_found) {
@@ -184,16 +205,169 @@ static bool split_params_parse(int argc, const char ** argv, split_params & para
     return result;
 }
 
-static void zeros(std::ofstream & file, size_t n) {
-    char zero = 0;
-    for (size_t i = 0; i < n; ++i) {
-        file.write(&zero, 1);
+// a file that is read and written at explicit offsets, so that several threads can use it at the same time
+struct split_file {
+#if defined(_WIN32)
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+    std::string path;
+
+    split_file(const std::string & path, bool write) : path(path) {
+#if defined(_WIN32)
+        handle = CreateFileA(path.c_str(), write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+                write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (handle == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("failed to open " + path);
+        }
+#else
+        fd = write ? open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("failed to open " + path + ": " + strerror(errno));
+        }
+#endif
+    }
+
+    ~split_file() {
+#if defined(_WIN32)
+        CloseHandle(handle);
+#else
+        close(fd);
+#endif
+    }
+
+    split_file(const split_file &) = delete;
+    split_file & operator=(const split_file &) = delete;
+
+    // set the final size of the file up front, the gaps that are not written (the padding of the tensors) read as zeros
+    void allocate(size_t size) const {
+#if defined(_WIN32)
+        LARGE_INTEGER li;
+        li.QuadPart = (LONGLONG) size;
+        if (!SetFilePointerEx(handle, li, NULL, FILE_BEGIN) || !SetEndOfFile(handle)) {
+            throw std::runtime_error("failed to resize " + path);
+        }
+#else
+#if defined(__linux__)
+        // reserve the blocks, so that running out of disk space is detected before any data is copied
+        const int err = posix_fallocate(fd, 0, size);
+        if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+            throw std::runtime_error("failed to allocate " + std::to_string(size) + " bytes for " + path + ": " + strerror(err));
+        }
+#endif
+        if (ftruncate(fd, size) != 0) {
+            throw std::runtime_error("failed to resize " + path + ": " + strerror(errno));
+        }
+#endif
+    }
+
+    void read_at(void * dst, size_t size, size_t offset) const {
+        char * ptr = (char *) dst;
+        while (size > 0) {
+#if defined(_WIN32)
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) (offset & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            DWORD n = 0;
+            if (!ReadFile(handle, ptr, (DWORD) std::min<size_t>(size, 1u << 30), &n, &ov) || n == 0) {
+                throw std::runtime_error("failed to read " + path);
+            }
+#else
+            const ssize_t n = pread(fd, ptr, size, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error("failed to read " + path + ": " + (n == 0 ? "unexpected end of file" : strerror(errno)));
+            }
+#endif
+            ptr    += n;
+            size   -= n;
+            offset += n;
+        }
+    }
+
+    void write_at(const void * src, size_t size, size_t offset) const {
+        const char * ptr = (const char *) src;
+        while (size > 0) {
+#if defined(_WIN32)
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) (offset & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            DWORD n = 0;
+            if (!WriteFile(handle, ptr, (DWORD) std::min<size_t>(size, 1u << 30), &n, &ov) || n == 0) {
+                throw std::runtime_error("failed to write " + path);
+            }
+#else
+            const ssize_t n = pwrite(fd, ptr, size, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                throw std::runtime_error("failed to write " + path + ": " + strerror(errno));
+            }
+#endif
+            ptr    += n;
+            size   -= n;
+            offset += n;
+        }
+    }
+};
+
+// copy a range of bytes between two files
+// on Linux the data is copied by the kernel with copy_file_range(), without going through a user space buffer and,
+// on file systems that support it, by sharing the extents; otherwise it goes through buf in large chunks
+static void split_copy_range(const split_file & f_in, size_t in_offset, const split_file & f_out, size_t out_offset, size_t len, std::vector<uint8_t> & buf) {
+#if defined(__linux__)
+    while (len > 0) {
+        off64_t off_in  = in_offset;
+        off64_t off_out = out_offset;
+        const ssize_t n = copy_file_range(f_in.fd, &off_in, f_out.fd, &off_out, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == EPERM)) {
+            // not supported between these files, the remaining part is copied through the buffer
+            break;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("failed to copy " + f_in.path + " to " + f_out.path + ": " + (n == 0 ? "unexpected end of file" : strerror(errno)));
+        }
+        in_offset  += n;
+        out_offset += n;
+        len        -= n;
+    }
+#endif
+
+    const size_t chunk_size = 64u*1024*1024;
+
+    while (len > 0) {
+        const size_t n = std::min(len, chunk_size);
+        if (buf.size() < n) {
+            buf.resize(n);
+        }
+        f_in.read_at(buf.data(), n, in_offset);
+        f_out.write_at(buf.data(), n, out_offset);
+        in_offset  += n;
+        out_offset += n;
+        len        -= n;
+    }
+}
+
+// size of a GGUF file with the given metadata size, each tensor is padded to the alignment
+static size_t split_file_size(const struct gguf_context * ctx, size_t meta_size) {
+    const int64_t n_tensors = gguf_get_n_tensors(ctx);
+    if (n_tensors == 0) {
+        return meta_size;
     }
+    return meta_size + gguf_get_tensor_offset(ctx, n_tensors - 1) +
+        GGML_PAD(gguf_get_tensor_size(ctx, n_tensors - 1), gguf_get_alignment(ctx));
 }
 
 struct split_strategy {
     const split_params params;
-    std::ifstream & f_input;
+    const split_file & f_input;
     struct gguf_context * ctx_gguf;
     struct ggml_context * ctx_meta = NULL;
     const int n_tensors;
@@ -201,11 +375,8 @@ struct split_strategy {
     // one ctx_out per one output file
     std::vector<struct gguf_context *> ctx_outs;
 
-    // temporary buffer for reading in tensor data
-    std::vector<uint8_t> read_buf;
-
     split_strategy(const split_params & params,
-            std::ifstream & f_input,
+            const split_file & f_input,
             struct gguf_context * ctx_gguf,
             struct ggml_context * ctx_meta) :
         params(params),
@@ -303,61 +474,52 @@ struct split_strategy {
         }
     }
 
-    void write() {
-        int i_split = 0;
-        int n_split = ctx_outs.size();
-        for (auto & ctx_out : ctx_outs) {
+    // the output files are independent, so they are written in parallel
+    void write(common_thread_pool & pool) {
+        const int n_split = ctx_outs.size();
+
+        pool.parallel_for(n_split, [&](int64_t i) {
+            const int i_split = i;
+
+            struct gguf_context * ctx_out = ctx_outs[i_split];
+
             // construct file path
             char split_path[PATH_MAX] = {0};
             llama_split_path(split_path, sizeof(split_path), params.output.c_str(), i_split, n_split);
 
-            // open the output file
-            printf("Writing file %s ... ", split_path);
-            fflush(stdout);
-            std::ofstream fout = std::ofstream(split_path, std::ios::binary);
-            fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-
-            // write metadata
+            // metadata
             std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
             gguf_get_meta_data(ctx_out, data.data());
-            fout.write((const char *)data.data(), data.size());
+
+            const size_t data_offset = data.size();
+
+            split_file fout(split_path, true);
+            fout.allocate(split_file_size(ctx_out, data_offset));
+            fout.write_at(data.data(), data.size(), 0);
+
+            // temporary buffer for the copies that cannot be done by the kernel
+            std::vector<uint8_t> buf;
 
             // write tensors
             for (int i = 0; i < gguf_get_n_tensors(ctx_out); ++i) {
-                // read tensor meta and prepare buffer
                 const char * t_name = gguf_get_tensor_name(ctx_out, i);
                 struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
-                auto n_bytes = ggml_nbytes(t);
-                read_buf.resize(n_bytes);
 
                 // calculate offset
                 auto i_tensor_in = gguf_find_tensor(ctx_gguf, t_name); // idx of tensor in the input file
                 auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor_in);
 
-                // copy tensor from input to output file
-                copy_file_to_file(f_input, fout, offset, n_bytes);
-                zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
+                // copy tensor from input to output file, the padding is already zero
+                split_copy_range(f_input, offset, fout, data_offset + gguf_get_tensor_offset(ctx_out, i), ggml_nbytes(t), buf);
             }
 
-            printf("done\n");
-            // close the file
-            fout.close();
-            i_split++;
-        }
-    }
-
-    void copy_file_to_file(std::ifstream & f_in, std::ofstream & f_out, const size_t in_offset, const size_t len) {
-        // TODO: detect OS and use copy_file_range() here for better performance
-        if (read_buf.size() < len) {
-            read_buf.resize(len);
-        }
-        f_in.seekg(in_offset);
-        f_in.read((char *)read_buf.data(), len);
-        f_out.write((const char *)read_buf.data(), len);
+            printf("Writing file %s ... done\n", split_path);
+            fflush(stdout);
+        });
     }
 };
 
-static void gguf_split(const split_params & split_params) {
+static void gguf_split(const split_params & split_params, common_thread_pool & pool) {
     struct ggml_context * ctx_meta = NULL;
 
     struct gguf_init_params params = {
@@ -365,9 +527,11 @@ static void gguf_split(const split_params & split_params) {
         /*.ctx      = */ &ctx_meta,
     };
 
-    std::ifstream f_input(split_params.input.c_str(), std::ios::binary);
-    if (!f_input.is_open()) {
-        fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_params.input.c_str());
+    std::unique_ptr<split_file> f_input;
+    try {
+        f_input.reset(new split_file(split_params.input, false));
+    } catch (const std::exception & e) {
+        fprintf(stderr, "%s:  failed to open input GGUF from %s: %s\n", __func__, split_params.input.c_str(), e.what());
         exit(EXIT_FAILURE);
     }
 
@@ -378,24 +542,29 @@ static void gguf_split(const split_params & split_params) {
     }
 
     // prepare the strategy
-    split_strategy strategy(split_params, f_input, ctx_gguf, ctx_meta);
+    split_strategy strategy(split_params, *f_input, ctx_gguf, ctx_meta);
     int n_split = strategy.ctx_outs.size();
     strategy.print_info();
 
     if (!split_params.dry_run) {
         // write all output splits
-        strategy.write();
+        try {
+            strategy.write(pool);
+        } catch (const std::exception & e) {
+            fprintf(stderr, "%s: error: %s\n", __func__, e.what());
+            exit(EXIT_FAILURE);
+        }
     }
 
     // done, clean up
     gguf_free(ctx_gguf);
-    f_input.close();
+    f_input.reset();
 
     fprintf(stderr, "%s: %d gguf split written with a total of %d tensors.\n",
             __func__, n_split, strategy.n_tensors);
 }
 
-static void gguf_merge(const split_params & split_params) {
+static void gguf_merge(const split_params & split_params, common_thread_pool & pool) {
     fprintf(stderr, "%s: %s -> %s\n",
             __func__, split_params.input.c_str(),
             split_params.output.c_str());
@@ -411,7 +580,6 @@ static void gguf_merge(const split_params & split_params) {
 
     auto * ctx_out = gguf_init_empty();
 
-    std::vector<uint8_t> read_data;
     std::vector<ggml_context *> ctx_metas;
     std::vector<gguf_context *> ctx_ggufs;
 
@@ -495,70 +663,57 @@ static void gguf_merge(const split_params & split_params) {
 
         fprintf(stderr, "\033[3Ddone\n");
     }
-    std::ofstream fout;
     if (!split_params.dry_run) {
-        fout.open(split_params.output.c_str(), std::ios::binary);
-        fout.exceptions(std::ofstream::failbit); // fail fast on write errors
-        // placeholder for the meta data
-        auto meta_size = gguf_get_meta_size(ctx_out);
-        ::zeros(fout, meta_size);
-    }
+        // the output is preallocated and every split copies its tensors directly to their final offsets, in parallel
+        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
+        gguf_get_meta_data(ctx_out, data.data());
 
-    // Write tensors data
-    for (int i_split = 0; i_split < n_split; i_split++) {
-        llama_split_path(split_path, sizeof(split_path), split_prefix, i_split, n_split);
-        std::ifstream f_input(split_path, std::ios::binary);
-        if (!f_input.is_open()) {
-            fprintf(stderr, "%s:  failed to open input GGUF from %s\n", __func__, split_path);
-            for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
-                gguf_free(ctx_ggufs[i]);
-                ggml_free(ctx_metas[i]);
-            }
-            gguf_free(ctx_out);
-            if (!split_params.dry_run) {
-                fout.close();
-            }
-            exit(EXIT_FAILURE);
+        const size_t data_offset = data.size();
+
+        // the tensors were added to ctx_out in the order of the splits
+        std::vector<int64_t> i_tensor_out(n_split, 0);
+        for (int i_split = 1; i_split < n_split; i_split++) {
+            i_tensor_out[i_split] = i_tensor_out[i_split - 1] + gguf_get_n_tensors(ctx_ggufs[i_split - 1]);
         }
-        fprintf(stderr, "%s: writing tensors %s ...", __func__, split_path);
 
-        auto * ctx_gguf = ctx_ggufs[i_split];
-        auto * ctx_meta = ctx_metas[i_split];
+        try {
+            split_file fout(split_params.output, true);
+            fout.allocate(split_file_size(ctx_out, data_offset));
+            fout.write_at(data.data(), data.size(), 0);
 
-        auto n_tensors = gguf_get_n_tensors(ctx_gguf);
-        for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++) {
-            const char * t_name = gguf_get_tensor_name(ctx_gguf, i_tensor);
-            struct ggml_tensor * t = ggml_get_tensor(ctx_meta, t_name);
+            pool.parallel_for(n_split, [&, func = __func__](int64_t i) {
+                const int i_split = i;
 
-            auto n_bytes = ggml_nbytes(t);
+                char path[PATH_MAX] = {0};
+                llama_split_path(path, sizeof(path), split_prefix, i_split, n_split);
 
-            if (read_data.size() < n_bytes) {
-                read_data.resize(n_bytes);
-            }
+                split_file f_input(path, false);
 
-            auto offset = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
-            f_input.seekg(offset);
-            f_input.read((char *)read_data.data(), n_bytes);
-            if (!split_params.dry_run) {
-                // write tensor data + padding
-                fout.write((const char *)read_data.data(), n_bytes);
-                zeros(fout, GGML_PAD(n_bytes, GGUF_DEFAULT_ALIGNMENT) - n_bytes);
-            }
-        }
+                auto * ctx_gguf = ctx_ggufs[i_split];
 
-        gguf_free(ctx_gguf);
-        ggml_free(ctx_meta);
-        f_input.close();
-        fprintf(stderr, "\033[3Ddone\n");
+                // temporary buffer for the copies that cannot be done by the kernel
+                std::vector<uint8_t> buf;
+
+                auto n_tensors = gguf_get_n_tensors(ctx_gguf);
+                for (int i_tensor = 0; i_tensor < n_tensors; i_tensor++) {
+                    auto offset     = gguf_get_data_offset(ctx_gguf) + gguf_get_tensor_offset(ctx_gguf, i_tensor);
+                    auto offset_out = data_offset + gguf_get_tensor_offset(ctx_out, i_tensor_out[i_split] + i_tensor);
+
+                    // the padding is already zero
+                    split_copy_range(f_input, offset, fout, offset_out, gguf_get_tensor_size(ctx_gguf, i_tensor), buf);
+                }
+
+                fprintf(stderr, "%s: writing tensors %s ... done\n", func, path);
+            });
+        } catch (const std::exception & e) {
+            fprintf(stderr, "%s: error: %s\n", __func__, e.what());
+            exit(EXIT_FAILURE);
+        }
     }
 
-    if (!split_params.dry_run) {
-        // go back to beginning of file and write the updated metadata
-        fout.seekp(0);
-        std::vector<uint8_t> data(gguf_get_meta_size(ctx_out));
-        gguf_get_meta_data(ctx_out, data.data());
-        fout.write((const char *)data.data(), data.size());
-        fout.close();
+    for (uint32_t i = 0; i < ctx_ggufs.size(); i++) {
+        gguf_free(ctx_ggufs[i]);
+        ggml_free(ctx_metas[i]);
     }
     gguf_free(ctx_out);
 
@@ -570,10 +725,13 @@ int main(int argc, const char ** argv) {
     split_params params;
     split_params_parse(argc, argv, params);
 
+    // the shards are written or read by the calling thread and n_threads - 1 workers
+    common_thread_pool pool(params.n_threads - 1);
+
     switch (params.operation) {
-        case OP_SPLIT: gguf_split(params);
+        case OP_SPLIT: gguf_split(params, pool);
             break;
-        case OP_MERGE: gguf_merge(params);
+        case OP_MERGE: gguf_merge(params, pool);
             break;
         default: split_print_usage(argv[0]);
             exit(EXIT_FAILURE);
@@ -2,12 +2,16 @@
 #include "common.h"
 #include "log.h"
 #include "llama.h"
+#include "thread-pool.h"
 
 #include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <filesystem>
+#include <functional>
+#include <memory>
 #include <thread>
 #include <mutex>
 #include <vector>
@@ -38,17 +42,24 @@ struct Stats {
 class IMatrixCollector {
 public:
     IMatrixCollector() = default;
-    void set_params(common_params params) { m_params = std::move(params); }
+    ~IMatrixCollector();
+    void set_params(common_params params);
     bool collect_imatrix(struct ggml_tensor * t, bool ask, void * user_data);
-    void save_imatrix(int ncall = -1) const;
+    void save_imatrix(int ncall = -1);
+    void wait_saved();
     bool load_imatrix(const char * fname);
 private:
+    void check_finite(const Stats & e, const std::string & wname, size_t i0, size_t i1) const;
+    void run(const std::function<void(int ith, int nth)> & fn);
+
     std::unordered_map<std::string, Stats> m_stats;
     common_params                          m_params;
     std::mutex                             m_mutex;
     int                                    m_last_call = 0;
     std::vector<char>                      m_src1_data;
     std::vector<char>                      m_ids; // the expert ids from ggml_mul_mat_id
+    std::unique_ptr<common_thread_pool>    m_pool; // sums the columns of a tensor in parallel
+    std::thread                            m_writer; // writes the last saved imatrix to disk
 };
 
 // remove any prefix and suffixes from the name
@@ -70,6 +81,59 @@ static std::string filter_tensor_name(const char * name) {
     return wname;
 }
 
+// values[j] += x[j]*x[j], simple enough for the compiler to vectorize
+static void imatrix_add_sqr(float * GGML_RESTRICT values, const float * GGML_RESTRICT x, int64_t n) {
+    for (int64_t j = 0; j < n; ++j) {
+        values[j] += x[j]*x[j];
+    }
+}
+
+// the columns [j0, j1) of thread ith, the values of each column are summed by a single thread in the original order
+static void imatrix_thread_cols(int64_t n_cols, int ith, int nth, int64_t & j0, int64_t & j1) {
+    // keep the ranges aligned to the cache lines
+    const int64_t n_blocks = (n_cols + 15)/16;
+
+    j0 = std::min(n_cols, 16*((n_blocks*ith)/nth));
+    j1 = std::min(n_cols, 16*((n_blocks*(ith + 1))/nth));
+}
+
+IMatrixCollector::~IMatrixCollector() {
+    wait_saved();
+}
+
+void IMatrixCollector::set_params(common_params params) {
+    m_params = std::move(params);
+
+    if (!m_pool) {
+        m_pool = std::make_unique<common_thread_pool>(std::max(1, m_params.cpuparams_batch.n_threads) - 1);
+    }
+}
+
+void IMatrixCollector::check_finite(const Stats & e, const std::string & wname, size_t i0, size_t i1) const {
+    // the sums of squares only grow, a non-finite value stays non-finite - only the values updated by the last call
+    // need to be checked
+    for (size_t i = i0; i < i1; ++i) {
+        const float v = e.values[i];
+        if (!std::isfinite(v)) {
+            LOG("\n");
+            LOG_ERR("%f detected in %s\n", v, wname.c_str());
+            exit(1);
+        }
+    }
+}
+
+// fn(ith, nth) for ith in [0, nth), the split of the work only depends on nth, so the result does not depend on which
+// thread runs which part
+void IMatrixCollector::run(const std::function<void(int ith, int nth)> & fn) {
+    const int nth = m_pool ? m_pool->n_threads() + 1 : 1;
+    if (nth == 1) {
+        fn(0, 1);
+        return;
+    }
+
+    m_pool->parallel_for(nth, [&](int64_t ith) { fn(ith, nth); });
+}
+
 bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void * user_data) {
     GGML_UNUSED(user_data);
 
@@ -102,6 +166,8 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
     const char * data = is_host ? (const char *) src1->data : m_src1_data.data();
     GGML_ASSERT(src1->nb[0] == ggml_element_size(src1));
 
+    const int64_t n_cols = src1->ne[0];
+
     // this has been adapted to the new format of storing merged experts in a single 3d tensor
     // ref: https://github.com/ggml-org/llama.cpp/pull/6387
     if (t->op == GGML_OP_MUL_MAT_ID) {
@@ -125,74 +191,117 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
         ++e.ncall;
 
         if (e.values.empty()) {
-            e.values.resize(src1->ne[0]*n_as, 0);
-            e.counts.resize(src1->ne[0]*n_as, 0);
+            e.values.resize(n_cols*n_as, 0);
+            e.counts.resize(n_cols*n_as, 0);
         }
-        else if (e.values.size() != (size_t)src1->ne[0]*n_as) {
-            LOG_ERR("%s: inconsistent size for %s (%d vs %d)\n", __func__, wname.c_str(), (int)e.values.size(), (int)src1->ne[0]*n_as);
+        else if (e.values.size() != (size_t)n_cols*n_as) {
+            LOG_ERR("%s: inconsistent size for %s (%d vs %d)\n", __func__, wname.c_str(), (int)e.values.size(), (int)n_cols*n_as);
             exit(1); //GGML_ABORT("fatal error");
         }
-        LOG_DBGV(2, "%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[2], (int)src1->type);
-        // loop over all possible experts, regardless if they are used or not in the batch
-        for (int ex = 0; ex < n_as; ++ex) {
-            size_t e_start = ex*src1->ne[0];
+        LOG_DBGV(2, "%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)n_cols, (int)src1->ne[2], (int)src1->type);
 
-            for (int idx = 0; idx < n_ids; ++idx) {
-                for (int row = 0; row < (int)src1->ne[2]; ++row) {
-                    const int excur = *(const int32_t *) (m_ids.data() + row*ids->nb[1] + idx*ids->nb[0]);
+        const int n_rows = src1->ne[2];
+
+        // the number of rows routed to each expert
+        std::vector<int> n_rows_ex(n_as, 0);
+        for (int idx = 0; idx < n_ids; ++idx) {
+            for (int row = 0; row < n_rows; ++row) {
+                const int excur = *(const int32_t *) (m_ids.data() + row*ids->nb[1] + idx*ids->nb[0]);
+
+                GGML_ASSERT(excur >= 0 && excur < n_as); // sanity check
+
+                n_rows_ex[excur]++;
+            }
+        }
 
-                    GGML_ASSERT(excur >= 0 && excur < n_as); // sanity check
+        // a single pass over the rows, each thread sums its columns of all experts
+        const auto compute = [&](int ith, int nth) {
+            int64_t j0, j1;
+            imatrix_thread_cols(n_cols, ith, nth, j0, j1);
+            if (j0 >= j1) {
+                return;
+            }
 
-                    if (excur != ex) continue;
+            for (int idx = 0; idx < n_ids; ++idx) {
+                for (int row = 0; row < n_rows; ++row) {
+                    const int excur = *(const int32_t *) (m_ids.data() + row*ids->nb[1] + idx*ids->nb[0]);
 
                     const int64_t i11 = idx % src1->ne[1];
                     const int64_t i12 = row;
                     const float * x = (const float *)(data + i11*src1->nb[1] + i12*src1->nb[2]);
 
-                    for (int j = 0; j < (int)src1->ne[0]; ++j) {
-                        e.values[e_start + j] += x[j]*x[j];
-                        e.counts[e_start + j]++;
-                        if (!std::isfinite(e.values[e_start + j])) {
-                            LOG("\n");
-                            LOG_ERR("%f detected in %s\n", e.values[e_start + j], wname.c_str());
-                            exit(1);
-                        }
-                    }
+                    imatrix_add_sqr(e.values.data() + excur*n_cols + j0, x + j0, j1 - j0);
                 }
             }
-            if (e.ncall > m_last_call) {
-                m_last_call = e.ncall;
-                if (m_last_call % m_params.n_out_freq == 0) {
-                    save_imatrix();
-                }
-                if (m_params.n_save_freq > 0 && m_last_call%m_params.n_save_freq == 0) {
-                    save_imatrix(m_last_call);
-                }
+        };
+
+        if (n_cols*n_ids*n_rows >= (1 << 16)) {
+            run(compute);
+        } else {
+            compute(0, 1);
+        }
+
+        for (int ex = 0; ex < n_as; ++ex) {
+            if (n_rows_ex[ex] == 0) {
+                continue;
+            }
+
+            for (int64_t j = 0; j < n_cols; ++j) {
+                e.counts[ex*n_cols + j] += n_rows_ex[ex];
+            }
+
+            check_finite(e, wname, ex*n_cols, (ex + 1)*n_cols);
+        }
+
+        if (e.ncall > m_last_call) {
+            m_last_call = e.ncall;
+            if (m_last_call % m_params.n_out_freq == 0) {
+                save_imatrix();
+            }
+            if (m_params.n_save_freq > 0 && m_last_call%m_params.n_save_freq == 0) {
+                save_imatrix(m_last_call);
             }
         }
     } else {
         auto & e = m_stats[wname];
         if (e.values.empty()) {
-            e.values.resize(src1->ne[0], 0);
-            e.counts.resize(src1->ne[0], 0);
+            e.values.resize(n_cols, 0);
+            e.counts.resize(n_cols, 0);
         }
-        else if (e.values.size() != (size_t)src1->ne[0]) {
-            LOG_ERR("%s: inconsistent size for %s (%d vs %d)\n", __func__, wname.c_str(), (int)e.values.size(), (int)src1->ne[0]);
+        else if (e.values.size() != (size_t)n_cols) {
+            LOG_ERR("%s: inconsistent size for %s (%d vs %d)\n", __func__, wname.c_str(), (int)e.values.size(), (int)n_cols);
             exit(1); //GGML_ABORT("fatal error");
         }
         ++e.ncall;
-        LOG_DBGV(2, "%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)src1->ne[0], (int)src1->ne[1], (int)src1->type);
-        for (int row = 0; row < (int)src1->ne[1]; ++row) {
-            const float * x = (const float *) (data + row * src1->nb[1]);
-            for (int j = 0; j < (int)src1->ne[0]; ++j) {
-                e.values[j] += x[j]*x[j];
-                e.counts[j]++;
-                if (!std::isfinite(e.values[j])) {
-                    LOG_ERR("%f detected in %s\n", e.values[j], wname.c_str());
-                    exit(1);
-                }
+        LOG_DBGV(2, "%s[%d]: %32s, %s, %5d x %5d, %d\n", __func__, m_last_call, wname.c_str(), ggml_op_name(t->op), (int)n_cols, (int)src1->ne[1], (int)src1->type);
+
+        const int n_rows = src1->ne[1];
+
+        const auto compute = [&](int ith, int nth) {
+            int64_t j0, j1;
+            imatrix_thread_cols(n_cols, ith, nth, j0, j1);
+            if (j0 >= j1) {
+                return;
             }
+
+            for (int row = 0; row < n_rows; ++row) {
+                const float * x = (const float *) (data + row * src1->nb[1]);
+                imatrix_add_sqr(e.values.data() + j0, x + j0, j1 - j0);
+            }
+        };
+
+        if (n_cols*n_rows >= (1 << 16)) {
+            run(compute);
+        } else {
+            compute(0, 1);
         }
+
+        for (int64_t j = 0; j < n_cols; ++j) {
+            e.counts[j] += n_rows;
+        }
+
+        check_finite(e, wname, 0, n_cols);
+
         if (e.ncall > m_last_call) {
             m_last_call = e.ncall;
             if (m_last_call % m_params.n_out_freq == 0) {
@@ -207,7 +316,7 @@ bool IMatrixCollector::collect_imatrix(struct ggml_tensor * t, bool ask, void *
     return true;
 }
 
-void IMatrixCollector::save_imatrix(int ncall) const {
+void IMatrixCollector::save_imatrix(int ncall) {
     auto fname = m_params.out_file;
 
     if (ncall > 0) {
@@ -259,37 +368,71 @@ void IMatrixCollector::save_imatrix(int ncall) const {
         LOG_WRN("%s: storing only %zu out of %zu entries\n", __func__, to_store.size(), m_stats.size());
     }
 
-    std::ofstream out(fname, std::ios::binary);
-    out.write((const char *) &n_entries, sizeof(n_entries));
+    // serialize the data here, the file is written in the background while the computation continues
+    std::string out;
+    const auto write = [&out](const void * src, size_t size) {
+        out.append((const char *) src, size);
+    };
+
+    write(&n_entries, sizeof(n_entries));
     for (const auto & name : to_store) {
         const auto & stat = m_stats.at(name);
         int len = name.size();
-        out.write((const char *) &len, sizeof(len));
-        out.write(name.c_str(), len);
-        out.write((const char *) &stat.ncall, sizeof(stat.ncall));
+        write(&len, sizeof(len));
+        write(name.c_str(), len);
+        write(&stat.ncall, sizeof(stat.ncall));
         int nval = stat.values.size();
-        out.write((const char *) &nval, sizeof(nval));
+        write(&nval, sizeof(nval));
         if (nval > 0) {
             std::vector<float> tmp(nval);
             for (int i = 0; i < nval; i++) {
                 tmp[i] = (stat.values[i] / static_cast<float>(stat.counts[i])) * static_cast<float>(stat.ncall);
             }
-            out.write((const char*)tmp.data(), nval*sizeof(float));
+            write(tmp.data(), nval*sizeof(float));
         }
     }
 
     // Write the number of call the matrix was computed with
-    out.write((const char *) &m_last_call, sizeof(m_last_call));
+    write(&m_last_call, sizeof(m_last_call));
 
     // Write the input filename at the end of the file to later on specify it in quantize
     {
         int len = m_params.prompt_file.size();
-        out.write((const char *) &len, sizeof(len));
-        out.write(m_params.prompt_file.c_str(), len);
-    }
+        write(&len, sizeof(len));
+        write(m_params.prompt_file.c_str(), len);
+    }
+
+    // only one file is written at a time
+    wait_saved();
+
+    m_writer = std::thread([fname, out = std::move(out), last_call = m_last_call, func = __func__]() {
+        // write to a temporary file first, so that an interrupted run never leaves a truncated imatrix behind
+        const std::string fname_tmp = fname + ".tmp";
+        {
+            std::ofstream fout(fname_tmp, std::ios::binary);
+            fout.write(out.data(), out.size());
+            if (!fout) {
+                LOG_ERR("%s: failed to write %s\n", func, fname_tmp.c_str());
+                return;
+            }
+        }
 
-    LOGV(1, "\n");
-    LOG_DBGV(1, "%s: stored collected data after %d chunks in %s\n", __func__, m_last_call, fname.c_str());
+        std::error_code ec;
+        std::filesystem::rename(fname_tmp, fname, ec);
+        if (ec) {
+            LOG_ERR("%s: failed to rename %s to %s: %s\n", func, fname_tmp.c_str(), fname.c_str(), ec.message().c_str());
+            return;
+        }
+
+        LOGV(1, "\n");
+        LOG_DBGV(1, "%s: stored collected data after %d chunks in %s\n", func, last_call, fname.c_str());
+    });
+}
+
+void IMatrixCollector::wait_saved() {
+    if (m_writer.joinable()) {
+        m_writer.join();
+    }
 }
 
 bool IMatrixCollector::load_imatrix(const char * fname) {
@@ -440,7 +583,7 @@ static bool compute_imatrix(llama_context * ctx, const common_params & params) {
     auto tim1 = std::chrono::high_resolution_clock::now();
     LOG_INF("%s: tokenizing the input ..\n", __func__);
 
-    std::vector<llama_token> tokens = common_tokenize(ctx, params.prompt, true, params.parse_special);
+    std::vector<llama_token> tokens = common_tokenize_batch(vocab, { params.prompt }, true, params.parse_special, params.cpuparams_batch.n_threads)[0];
 
     auto tim2 = std::chrono::high_resolution_clock::now();
     LOG_INF("%s: tokenization took %g ms\n",__func__,1e-3*std::chrono::duration_cast<std::chrono::microseconds>(tim2-tim1).count());
@@ -609,6 +752,7 @@ int main(int argc, char ** argv) {
     if (params.in_files.size() > 1) {
         LOG_INF("%s : saving combined imatrix to '%s'\n", __func__, params.out_file.c_str());
         g_collector.save_imatrix();
+        g_collector.wait_saved();
     }
 
     llama_backend_init();
@@ -657,6 +801,7 @@ int main(int argc, char ** argv) {
 
 
     g_collector.save_imatrix();
+    g_collector.wait_saved();
 
     LOG("\n");
     llama_perf_context_print(ctx);
@@ -22,6 +22,12 @@
 #include "ggml.h"
 #include "llama.h"
 
+#ifdef __linux__
+#    include <linux/perf_event.h>
+#    include <sys/ioctl.h>
+#    include <sys/syscall.h>
+#    include <unistd.h>
+#endif
 
 
 // utils
@@ -117,6 +123,58 @@ static std::string get_cpu_info() {
     return join(cpu_list, ", ");
 }
 
+// counts the data TLB load misses of the calling thread, which is also one of the compute threads of the CPU backend
+struct tlb_miss_counter {
+    int fd = -1;
+
+    tlb_miss_counter() {
+#ifdef __linux__
+        perf_event_attr attr = {};
+        attr.type           = PERF_TYPE_HW_CACHE;
+        attr.size           = sizeof(attr);
+        attr.config         = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled       = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~tlb_miss_counter() {
+#ifdef __linux__
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+
+    bool available() const { return fd >= 0; }
+
+    void start() {
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    uint64_t stop() {
+        uint64_t count = 0;
+#ifdef __linux__
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+                count = 0;
+            }
+        }
+#endif
+        return count;
+    }
+};
+
 static std::string get_gpu_info() {
     std::vector<std::string> gpu_list;
     for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
@@ -183,6 +241,19 @@ static const char * split_mode_str(llama_split_mode mode) {
     }
 }
 
+static const char * hugepages_str(llama_hugepages_type type) {
+    switch (type) {
+        case LLAMA_HUGEPAGES_TYPE_NONE:
+            return "none";
+        case LLAMA_HUGEPAGES_TYPE_FILE:
+            return "file";
+        case LLAMA_HUGEPAGES_TYPE_ANON:
+            return "anon";
+        default:
+            GGML_ABORT("invalid hugepages type");
+    }
+}
+
 static std::string pair_str(const std::pair<int, int> & p) {
     static char buf[32];
     snprintf(buf, sizeof(buf), "%d,%d", p.first, p.second);
@@ -253,6 +324,7 @@ struct cmd_params {
     std::vector<std::vector<float>>  tensor_split;
     std::vector<std::vector<llama_model_tensor_buft_override>> tensor_buft_overrides;
     std::vector<bool>                use_mmap;
+    std::vector<llama_hugepages_type> hugepages;
     std::vector<bool>                embeddings;
     std::vector<bool>                no_op_offload;
     ggml_numa_strategy               numa;
@@ -290,6 +362,7 @@ static const cmd_params cmd_params_defaults = {
     /* tensor_split         */ { std::vector<float>(llama_max_devices(), 0.0f) },
     /* tensor_buft_overrides*/ { std::vector<llama_model_tensor_buft_override>{ { nullptr, nullptr } } },
     /* use_mmap             */ { true },
+    /* hugepages            */ { LLAMA_HUGEPAGES_TYPE_NONE },
     /* embeddings           */ { false },
     /* no_op_offload        */ { false },
     /* numa                 */ GGML_NUMA_STRATEGY_DISABLED,
@@ -365,6 +438,8 @@ static void print_usage(int /* argc */, char ** argv) {
            join(cmd_params_defaults.flash_attn, ",").c_str());
     printf("  -mmp, --mmap <0|1>                        (default: %s)\n",
            join(cmd_params_defaults.use_mmap, ",").c_str());
+    printf("  -hp, --hugepages <none|file|anon>         (default: %s)\n",
+           join(transform_to_str(cmd_params_defaults.hugepages, hugepages_str), ",").c_str());
     printf("  -embd, --embeddings <0|1>                 (default: %s)\n",
            join(cmd_params_defaults.embeddings, ",").c_str());
     printf("  -ts, --tensor-split <ts0/ts1/..>          (default: 0)\n");
@@ -644,6 +719,32 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
                 }
                 auto p = string_split<bool>(argv[i], split_delim);
                 params.use_mmap.insert(params.use_mmap.end(), p.begin(), p.end());
+            } else if (arg == "-hp" || arg == "--hugepages") {
+                if (++i >= argc) {
+                    invalid_param = true;
+                    break;
+                }
+                auto p = string_split<std::string>(argv[i], split_delim);
+
+                std::vector<llama_hugepages_type> types;
+                for (const auto & h : p) {
+                    llama_hugepages_type type;
+                    if (h == "none") {
+                        type = LLAMA_HUGEPAGES_TYPE_NONE;
+                    } else if (h == "file") {
+                        type = LLAMA_HUGEPAGES_TYPE_FILE;
+                    } else if (h == "anon") {
+                        type = LLAMA_HUGEPAGES_TYPE_ANON;
+                    } else {
+                        invalid_param = true;
+                        break;
+                    }
+                    types.push_back(type);
+                }
+                if (invalid_param) {
+                    break;
+                }
+                params.hugepages.insert(params.hugepages.end(), types.begin(), types.end());
             } else if (arg == "-embd" || arg == "--embeddings") {
                 if (++i >= argc) {
                     invalid_param = true;
@@ -873,6 +974,9 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.use_mmap.empty()) {
         params.use_mmap = cmd_params_defaults.use_mmap;
     }
+    if (params.hugepages.empty()) {
+        params.hugepages = cmd_params_defaults.hugepages;
+    }
     if (params.embeddings.empty()) {
         params.embeddings = cmd_params_defaults.embeddings;
     }
@@ -918,6 +1022,7 @@ struct cmd_params_instance {
     std::vector<float> tensor_split;
     std::vector<llama_model_tensor_buft_override> tensor_buft_overrides;
     bool               use_mmap;
+    llama_hugepages_type hugepages;
     bool               embeddings;
     bool               no_op_offload;
 
@@ -961,6 +1066,7 @@ struct cmd_params_instance {
         mparams.main_gpu     = main_gpu;
         mparams.tensor_split = tensor_split.data();
         mparams.use_mmap     = use_mmap;
+        mparams.hugepages    = hugepages;
 
         if (tensor_buft_overrides.empty()) {
             mparams.tensor_buft_overrides = nullptr;
@@ -975,6 +1081,7 @@ struct cmd_params_instance {
     bool equal_mparams(const cmd_params_instance & other) const {
         return model == other.model && n_gpu_layers == other.n_gpu_layers && rpc_servers_str == other.rpc_servers_str &&
                split_mode == other.split_mode && main_gpu == other.main_gpu && use_mmap == other.use_mmap &&
+               hugepages == other.hugepages &&
                tensor_split == other.tensor_split && vec_tensor_buft_override_equal(tensor_buft_overrides, other.tensor_buft_overrides);
     }
 
@@ -1010,6 +1117,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
     for (const auto & ts : params.tensor_split)
     for (const auto & ot : params.tensor_buft_overrides)
     for (const auto & mmp : params.use_mmap)
+    for (const auto & hp : params.hugepages)
     for (const auto & embd : params.embeddings)
     for (const auto & nopo : params.no_op_offload)
     for (const auto & nb : params.n_batch)
@@ -1051,6 +1159,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .tensor_split = */ ts,
                 /* .tensor_buft_overrides = */ ot,
                 /* .use_mmap     = */ mmp,
+                /* .hugepages    = */ hp,
                 /* .embeddings   = */ embd,
                 /* .no_op_offload= */ nopo,
             };
@@ -1084,6 +1193,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .tensor_split = */ ts,
                 /* .tensor_buft_overrides = */ ot,
                 /* .use_mmap     = */ mmp,
+                /* .hugepages    = */ hp,
                 /* .embeddings   = */ embd,
                 /* .no_op_offload= */ nopo,
             };
@@ -1117,6 +1227,7 @@ static std::vector<cmd_params_instance> get_cmd_params_instances(const cmd_param
                 /* .tensor_split = */ ts,
                 /* .tensor_buft_overrides = */ ot,
                 /* .use_mmap     = */ mmp,
+                /* .hugepages    = */ hp,
                 /* .embeddings   = */ embd,
                 /* .no_op_offload= */ nopo,
             };
@@ -1154,6 +1265,7 @@ struct test {
     std::vector<float>       tensor_split;
     std::vector<llama_model_tensor_buft_override> tensor_buft_overrides;
     bool                     use_mmap;
+    llama_hugepages_type     hugepages;
     bool                     embeddings;
     bool                     no_op_offload;
     int                      n_prompt;
@@ -1161,6 +1273,7 @@ struct test {
     int                      n_depth;
     std::string              test_time;
     std::vector<uint64_t>    samples_ns;
+    std::vector<uint64_t>    samples_tlb_misses;
 
     test(const cmd_params_instance & inst, const llama_model * lmodel, const llama_context * ctx) :
         cpu_info(get_cpu_info()),
@@ -1189,6 +1302,7 @@ struct test {
         tensor_split   = inst.tensor_split;
         tensor_buft_overrides = inst.tensor_buft_overrides;
         use_mmap       = inst.use_mmap;
+        hugepages      = inst.hugepages;
         embeddings     = inst.embeddings;
         no_op_offload  = inst.no_op_offload;
         n_prompt       = inst.n_prompt;
@@ -1218,6 +1332,12 @@ struct test {
 
     double stdev_ts() const { return ::stdev(get_ts()); }
 
+    // dTLB load misses of the main thread per token, 0 if the counter is not available
+    double avg_tlb_misses() const {
+        int n_tokens = n_prompt + n_gen;
+        return ::avg(samples_tlb_misses) / (double) n_tokens;
+    }
+
     static std::string get_backend() {
         std::vector<std::string> backends;
         for (size_t i = 0; i < ggml_backend_reg_count(); i++) {
@@ -1237,8 +1357,8 @@ struct test {
             "cpu_mask",     "cpu_strict",   "poll",           "type_k",     "type_v",       "n_gpu_layers",
             "split_mode",   "main_gpu",     "no_kv_offload",  "flash_attn", "tensor_split", "tensor_buft_overrides",
             "defrag_thold",
-            "use_mmap",     "embeddings",   "no_op_offload",   "n_prompt",       "n_gen",      "n_depth",      "test_time",
-            "avg_ns",       "stddev_ns",    "avg_ts",         "stddev_ts",
+            "use_mmap",     "hugepages",    "embeddings",   "no_op_offload",   "n_prompt",       "n_gen",      "n_depth",      "test_time",
+            "avg_ns",       "stddev_ns",    "avg_ts",         "stddev_ts",      "avg_tlb_misses",
         };
         return fields;
     }
@@ -1256,7 +1376,7 @@ struct test {
             field == "use_mmap" || field == "embeddings") {
             return BOOL;
         }
-        if (field == "avg_ts" || field == "stddev_ts" || field == "defrag_thold") {
+        if (field == "avg_ts" || field == "stddev_ts" || field == "defrag_thold" || field == "avg_tlb_misses") {
             return FLOAT;
         }
         return STRING;
@@ -1325,6 +1445,7 @@ struct test {
                                             tensor_buft_overrides_str,
                                             std::to_string(defrag_thold),
                                             std::to_string(use_mmap),
+                                            hugepages_str(hugepages),
                                             std::to_string(embeddings),
                                             std::to_string(no_op_offload),
                                             std::to_string(n_prompt),
@@ -1334,7 +1455,8 @@ struct test {
                                             std::to_string(avg_ns()),
                                             std::to_string(stdev_ns()),
                                             std::to_string(avg_ts()),
-                                            std::to_string(stdev_ts()) };
+                                            std::to_string(stdev_ts()),
+                                            std::to_string(avg_tlb_misses()) };
         return values;
     }
 
@@ -1506,6 +1628,12 @@ struct markdown_printer : public printer {
         if (field == "use_mmap") {
             return 4;
         }
+        if (field == "hugepages") {
+            return 4;
+        }
+        if (field == "avg_tlb_misses") {
+            return 12;
+        }
         if (field == "test") {
             return 15;
         }
@@ -1540,6 +1668,12 @@ struct markdown_printer : public printer {
         if (field == "use_mmap") {
             return "mmap";
         }
+        if (field == "hugepages") {
+            return "hp";
+        }
+        if (field == "avg_tlb_misses") {
+            return "dTLB miss/t";
+        }
         if (field == "embeddings") {
             return "embd";
         }
@@ -1614,6 +1748,9 @@ struct markdown_printer : public printer {
         if (params.use_mmap.size() > 1 || params.use_mmap != cmd_params_defaults.use_mmap) {
             fields.emplace_back("use_mmap");
         }
+        if (params.hugepages.size() > 1 || params.hugepages != cmd_params_defaults.hugepages) {
+            fields.emplace_back("hugepages");
+        }
         if (params.embeddings.size() > 1 || params.embeddings != cmd_params_defaults.embeddings) {
             fields.emplace_back("embeddings");
         }
@@ -1622,6 +1759,9 @@ struct markdown_printer : public printer {
         }
         fields.emplace_back("test");
         fields.emplace_back("t/s");
+        if (params.hugepages.size() > 1 || params.hugepages != cmd_params_defaults.hugepages) {
+            fields.emplace_back("avg_tlb_misses");
+        }
 
         fprintf(fout, "|");
         for (const auto & field : fields) {
@@ -1677,6 +1817,13 @@ struct markdown_printer : public printer {
             } else if (field == "t/s") {
                 snprintf(buf, sizeof(buf), "%.2f ± %.2f", t.avg_ts(), t.stdev_ts());
                 value = buf;
+            } else if (field == "avg_tlb_misses") {
+                if (t.samples_tlb_misses.empty()) {
+                    value = "n/a";
+                } else {
+                    snprintf(buf, sizeof(buf), "%.0f", t.avg_tlb_misses());
+                    value = buf;
+                }
             } else if (vmap.find(field) != vmap.end()) {
                 value = vmap.at(field);
             } else {
@@ -1867,6 +2014,8 @@ int main(int argc, char ** argv) {
 
     std::vector<cmd_params_instance> params_instances = get_cmd_params_instances(params);
 
+    tlb_miss_counter tlb_misses;
+
     llama_model *               lmodel    = nullptr;
     const cmd_params_instance * prev_inst = nullptr;
 
@@ -1964,6 +2113,8 @@ int main(int argc, char ** argv) {
                 }
             }
 
+            tlb_misses.start();
+
             uint64_t t_start = get_time_ns();
 
             if (t.n_prompt > 0) {
@@ -1991,6 +2142,11 @@ int main(int argc, char ** argv) {
 
             uint64_t t_ns = get_time_ns() - t_start;
             t.samples_ns.push_back(t_ns);
+
+            const uint64_t n_tlb_misses = tlb_misses.stop();
+            if (tlb_misses.available()) {
+                t.samples_tlb_misses.push_back(n_tlb_misses);
+            }
         }
 
         if (p) {
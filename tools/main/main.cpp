@@ -149,6 +149,15 @@ int main(int argc, char ** argv) {
 
     auto * mem = llama_get_memory(ctx);
 
+    if (!params.sampling.logits_subset.empty()) {
+        const auto & subset = params.sampling.logits_subset;
+
+        if (llama_set_logits_subset(ctx, 0, subset.data(), subset.size()) != 0) {
+            LOG_ERR("%s: error: failed to set the logits subset\n", __func__);
+            return 1;
+        }
+    }
+
     const llama_vocab * vocab = llama_model_get_vocab(model);
     auto chat_templates = common_chat_templates_init(model, params.chat_template);
 
@@ -234,6 +243,11 @@ int main(int argc, char ** argv) {
     }
 
     std::string path_session = params.path_prompt_cache;
+
+    if (params.n_stream_window > 0 && !path_session.empty()) {
+        LOG_WRN("%s: prompt cache is not supported with the streaming KV cache - disabled\n", __func__);
+        path_session.clear();
+    }
     std::vector<llama_token> session_tokens;
 
     if (!path_session.empty()) {
@@ -585,7 +599,8 @@ int main(int argc, char ** argv) {
                 // - take the n_keep first tokens from the original prompt (via n_past)
                 // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in batches
 
-                if (n_past + (int) embd.size() >= n_ctx) {
+                // the streaming KV cache evicts the old tokens by itself
+                if (params.n_stream_window == 0 && n_past + (int) embd.size() >= n_ctx) {
                     if (!params.ctx_shift){
                         LOG_DBG("\n\n%s: context full and context shift is disabled => stopping\n", __func__);
                         break;
@@ -675,6 +690,11 @@ int main(int argc, char ** argv) {
 
                 n_past += n_eval;
 
+                if (params.n_stream_window > 0) {
+                    // the streaming KV cache compacts the positions of the cached tokens
+                    n_past = llama_memory_seq_pos_max(mem, 0) + 1;
+                }
+
                 LOG_DBG("n_past = %d\n", n_past);
                 // Display total tokens alongside total time
                 if (params.n_print > 0 && n_past % params.n_print == 0) {
@@ -305,7 +305,7 @@ static results_perplexity perplexity_v2(llama_context * ctx, const common_params
 
     LOG_INF("%s: tokenizing the input ..\n", __func__);
 
-    std::vector<llama_token> tokens = common_tokenize(ctx, params.prompt, true);
+    std::vector<llama_token> tokens = common_tokenize_batch(vocab, { params.prompt }, true, false, params.cpuparams_batch.n_threads)[0];
 
     const int n_ctx = llama_n_ctx(ctx);
 
@@ -469,7 +469,7 @@ static results_perplexity perplexity(llama_context * ctx, const common_params &
     auto tim1 = std::chrono::high_resolution_clock::now();
     LOG_INF("%s: tokenizing the input ..\n", __func__);
 
-    std::vector<llama_token> tokens = common_tokenize(ctx, params.prompt, true);
+    std::vector<llama_token> tokens = common_tokenize_batch(vocab, { params.prompt }, true, false, params.cpuparams_batch.n_threads)[0];
 
     auto tim2 = std::chrono::high_resolution_clock::now();
     LOG_INF("%s: tokenization took %g ms\n",__func__,1e-3*std::chrono::duration_cast<std::chrono::microseconds>(tim2-tim1).count());
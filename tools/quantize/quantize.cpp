@@ -110,7 +110,7 @@ static bool try_parse_ftype(const std::string & ftype_str_in, llama_ftype & ftyp
 [[noreturn]]
 static void usage(const char * executable) {
     printf("usage: %s [--help] [--allow-requantize] [--leave-output-tensor] [--pure] [--imatrix] [--include-weights]\n", executable);
-    printf("       [--exclude-weights] [--output-tensor-type] [--token-embedding-type] [--tensor-type] [--prune-layers] [--keep-split] [--override-kv]\n");
+    printf("       [--exclude-weights] [--output-tensor-type] [--token-embedding-type] [--tensor-type] [--prune-layers] [--keep-split] [--split-max-size] [--override-kv]\n");
     printf("       model-f32.gguf [model-quant.gguf] type [nthreads]\n\n");
     printf("  --allow-requantize: Allows requantizing tensors that have already been quantized. Warning: This can severely reduce quality compared to quantizing from 16bit or 32bit\n");
     printf("  --leave-output-tensor: Will leave output.weight un(re)quantized. Increases model size but may also increase quality, especially when requantizing\n");
@@ -125,6 +125,7 @@ static void usage(const char * executable) {
     printf("  --prune-layers L0,L1,L2...comma-separated list of layer numbers to prune from the model\n");
     printf("      Advanced option to remove all tensors from the given layers\n");
     printf("  --keep-split: will generate quantized model in the same shards as input\n");
+    printf("  --split-max-size N(M|G): split the quantized model in shards of at most N megabytes or gigabytes\n");
     printf("  --override-kv KEY=TYPE:VALUE\n");
     printf("      Advanced option to override model metadata by key in the quantized model. May be specified multiple times.\n");
     printf("Note: --include-weights and --exclude-weights cannot be used together\n");
@@ -312,6 +313,23 @@ static bool parse_layer_prune(const char * data, std::vector<int> & prune_layers
     return true;
 }
 
+// same format as gguf-split, e.g. "500M" or "4G"
+static bool parse_split_max_size(const char * data, uint64_t & n_bytes) {
+    const std::string str = data;
+    int n = 0;
+    try {
+        n = std::stoi(str);
+    } catch (...) {
+        n = 0;
+    }
+    if (n <= 0 || (str.back() != 'M' && str.back() != 'G')) {
+        printf("\n%s: invalid split size '%s', expected a positive number of megabytes (M) or gigabytes (G)\n\n", __func__, data);
+        return false;
+    }
+    n_bytes = (uint64_t) n * 1000 * 1000 * (str.back() == 'G' ? 1000 : 1);
+    return true;
+}
+
 int main(int argc, char ** argv) {
     if (argc < 3) {
         usage(argv[0]);
@@ -383,6 +401,10 @@ int main(int argc, char ** argv) {
             }
         } else if (strcmp(argv[arg_idx], "--keep-split") == 0) {
             params.keep_split = true;
+        } else if (strcmp(argv[arg_idx], "--split-max-size") == 0) {
+            if (arg_idx == argc-1 || !parse_split_max_size(argv[++arg_idx], params.split_max_size)) {
+                usage(argv[0]);
+            }
         } else {
             usage(argv[0]);
         }
@@ -464,7 +486,7 @@ int main(int argc, char ** argv) {
 
         // export as [inp path]/ggml-model-[ftype]. Only add extension if there is no splitting
         fname_out = fpath + "ggml-model-" + ftype_str;
-        if (!params.keep_split) {
+        if (!params.keep_split && params.split_max_size == 0) {
             fname_out += suffix;
         }
         arg_idx++;
@@ -473,7 +495,7 @@ int main(int argc, char ** argv) {
         }
     } else {
         fname_out = argv[arg_idx];
-        if (params.keep_split && fname_out.find(suffix) != std::string::npos) {
+        if ((params.keep_split || params.split_max_size > 0) && fname_out.find(suffix) != std::string::npos) {
             fname_out = fname_out.substr(0, fname_out.length() - suffix.length());
         }
         arg_idx++;
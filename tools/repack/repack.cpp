@@ -0,0 +1,266 @@
+#include "ggml.h"
+#include "ggml-backend.h"
+#include "ggml-cpp.h"
+#include "ggml-cpu.h"
+#include "gguf.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <regex>
+#include <string>
+#include <vector>
+
+// keep in sync with LLM_KV_REPACK_* in src/llama-arch.cpp
+static const char * const KV_REPACK_TENSORS = "repack.tensors";
+static const char * const KV_REPACK_LAYOUTS = "repack.layouts";
+
+struct repack_params {
+    std::string input;
+    std::string output;
+    // tensors used with other ops than matrix multiplication, e.g. GET_ROWS for the embeddings
+    std::string exclude = "(token_embd|position_embd|token_types)\\.";
+    bool dry_run = false;
+};
+
+static void repack_print_usage(const char * executable) {
+    const repack_params default_params;
+    printf("\n");
+    printf("usage: %s [options] GGUF_IN GGUF_OUT\n", executable);
+    printf("\n");
+    printf("Store the weights of GGUF_IN in the interleaved layout used by the CPU backend on this machine,\n");
+    printf("so that loading GGUF_OUT skips the repacking and can map the weights directly.\n");
+    printf("GGUF_OUT can only be used on CPUs that select the same layouts.\n");
+    printf("\n");
+    printf("options:\n");
+    printf("  -h, --help              show this help message and exit\n");
+    printf("  --exclude REGEX         do not repack the tensors whose name matches REGEX (default: %s)\n", default_params.exclude.c_str());
+    printf("  --dry-run               only print the layout of each tensor, do not write GGUF_OUT\n");
+    printf("\n");
+}
+
+static bool repack_params_parse(int argc, const char ** argv, repack_params & params) {
+    int arg_idx = 1;
+    for (; arg_idx < argc && strncmp(argv[arg_idx], "--", 2) == 0; arg_idx++) {
+        const std::string arg = argv[arg_idx];
+
+        if (arg == "-h" || arg == "--help") {
+            repack_print_usage(argv[0]);
+            exit(0);
+        } else if (arg == "--exclude") {
+            if (++arg_idx >= argc) {
+                return false;
+            }
+            params.exclude = argv[arg_idx];
+        } else if (arg == "--dry-run") {
+            params.dry_run = true;
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return false;
+        }
+    }
+
+    if (argc - arg_idx != (params.dry_run ? 1 : 2)) {
+        return false;
+    }
+
+    params.input = argv[arg_idx++];
+    if (!params.dry_run) {
+        params.output = argv[arg_idx++];
+    }
+
+    return true;
+}
+
+// the padding is shorter than the alignment, write it in one call
+static void zeros(std::ofstream & file, size_t n) {
+    const std::vector<char> zero(n, 0);
+    file.write(zero.data(), n);
+}
+
+int main(int argc, const char ** argv) {
+    repack_params params;
+
+    if (!repack_params_parse(argc, argv, params)) {
+        repack_print_usage(argv[0]);
+        return 1;
+    }
+
+    ggml_backend_load_all();
+
+    ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpu_dev) {
+        fprintf(stderr, "%s: no CPU backend found\n", __func__);
+        return 1;
+    }
+
+    ggml_backend_reg_t cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
+
+    auto * buft_repack_fn = (ggml_backend_cpu_repack_buffer_type_t) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_repack_buffer_type");
+    auto * repack_layout_fn = (ggml_backend_cpu_repack_layout_t) ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_cpu_repack_layout");
+    if (!buft_repack_fn || !repack_layout_fn) {
+        fprintf(stderr, "%s: the CPU backend was built without repacking support (GGML_CPU_REPACK)\n", __func__);
+        return 1;
+    }
+
+    ggml_context * ctx_meta = nullptr;
+
+    gguf_init_params init_params = {
+        /*.no_alloc = */ true,
+        /*.ctx      = */ &ctx_meta,
+    };
+
+    gguf_context_ptr ctx_in { gguf_init_from_file(params.input.c_str(), init_params) };
+    if (!ctx_in) {
+        fprintf(stderr, "%s: failed to load input GGUF from %s\n", __func__, params.input.c_str());
+        return 1;
+    }
+    ggml_context_ptr ctx_meta_ptr { ctx_meta };
+
+    if (gguf_find_key(ctx_in.get(), KV_REPACK_TENSORS) >= 0) {
+        fprintf(stderr, "%s: %s is already repacked\n", __func__, params.input.c_str());
+        return 1;
+    }
+
+    const std::regex exclude(params.exclude);
+
+    const int64_t n_tensors = gguf_get_n_tensors(ctx_in.get());
+
+    // select the tensors and their layouts
+    std::vector<const char *> layouts(n_tensors, nullptr);
+
+    std::vector<const char *> repack_names;
+    std::vector<const char *> repack_layouts;
+
+    size_t size_max    = 0;
+    size_t size_repack = 0;
+
+    for (int64_t i = 0; i < n_tensors; ++i) {
+        const char  * name = gguf_get_tensor_name(ctx_in.get(), i);
+        ggml_tensor * t    = ggml_get_tensor(ctx_meta, name);
+
+        const int n_dims = ggml_n_dims(t);
+        if ((n_dims != 2 && n_dims != 3) || std::regex_search(name, exclude)) {
+            continue;
+        }
+
+        layouts[i] = repack_layout_fn(t);
+        if (!layouts[i]) {
+            continue;
+        }
+
+        repack_names  .push_back(name);
+        repack_layouts.push_back(layouts[i]);
+
+        size_max     = std::max(size_max, ggml_nbytes(t));
+        size_repack += ggml_nbytes(t);
+
+        printf("%s: %-48s %-8s -> %s\n", __func__, name, ggml_type_name(t->type), layouts[i]);
+    }
+
+    printf("%s: %zu/%" PRId64 " tensors (%.2f MiB) in the repacked layout\n", __func__,
+            repack_names.size(), n_tensors, size_repack/1024.0/1024.0);
+
+    if (params.dry_run) {
+        return 0;
+    }
+
+    if (repack_names.empty()) {
+        fprintf(stderr, "%s: no tensor can be repacked on this machine\n", __func__);
+        return 1;
+    }
+
+    // same metadata and tensors, the repacked data has the same size as the original one
+    gguf_context_ptr ctx_out { gguf_init_empty() };
+    gguf_set_kv(ctx_out.get(), ctx_in.get());
+    gguf_set_arr_str(ctx_out.get(), KV_REPACK_TENSORS, repack_names.data(),   repack_names.size());
+    gguf_set_arr_str(ctx_out.get(), KV_REPACK_LAYOUTS, repack_layouts.data(), repack_layouts.size());
+
+    for (int64_t i = 0; i < n_tensors; ++i) {
+        gguf_add_tensor(ctx_out.get(), ggml_get_tensor(ctx_meta, gguf_get_tensor_name(ctx_in.get(), i)));
+    }
+
+    std::ifstream f_in(params.input, std::ios::binary);
+    if (!f_in) {
+        fprintf(stderr, "%s: failed to open %s\n", __func__, params.input.c_str());
+        return 1;
+    }
+
+    std::ofstream f_out(params.output, std::ios::binary);
+    if (!f_out) {
+        fprintf(stderr, "%s: failed to open %s for writing\n", __func__, params.output.c_str());
+        return 1;
+    }
+
+    {
+        std::vector<uint8_t> meta(gguf_get_meta_size(ctx_out.get()));
+        gguf_get_meta_data(ctx_out.get(), meta.data());
+        f_out.write((const char *) meta.data(), meta.size());
+    }
+
+    // the repack buffer type interleaves the data in set_tensor
+    ggml_backend_buffer_ptr buf_repack { ggml_backend_buft_alloc_buffer(buft_repack_fn(), size_max) };
+    if (!buf_repack) {
+        fprintf(stderr, "%s: failed to allocate the repack buffer\n", __func__);
+        return 1;
+    }
+
+    const size_t data_offset = gguf_get_data_offset(ctx_in.get());
+    const size_t alignment   = gguf_get_alignment(ctx_out.get());
+
+    std::vector<uint8_t> data;
+
+    for (int64_t i = 0; i < n_tensors; ++i) {
+        const char  * name    = gguf_get_tensor_name(ctx_in.get(), i);
+        ggml_tensor * t       = ggml_get_tensor(ctx_meta, name);
+        const size_t  n_bytes = ggml_nbytes(t);
+
+        data.resize(n_bytes);
+
+        f_in.seekg(data_offset + gguf_get_tensor_offset(ctx_in.get(), i));
+        f_in.read((char *) data.data(), n_bytes);
+        if (!f_in) {
+            fprintf(stderr, "%s: failed to read the data of tensor %s\n", __func__, name);
+            return 1;
+        }
+
+        const uint8_t * src = data.data();
+
+        if (layouts[i]) {
+            ggml_init_params ctx_params = {
+                /*.mem_size   =*/ ggml_tensor_overhead(),
+                /*.mem_buffer =*/ NULL,
+                /*.no_alloc   =*/ true,
+            };
+            ggml_context_ptr ctx { ggml_init(ctx_params) };
+
+            ggml_tensor * cur = ggml_dup_tensor(ctx.get(), t);
+            ggml_set_name(cur, name);
+
+            if (ggml_backend_tensor_alloc(buf_repack.get(), cur, ggml_backend_buffer_get_base(buf_repack.get())) != GGML_STATUS_SUCCESS) {
+                fprintf(stderr, "%s: failed to allocate tensor %s in the repack buffer\n", __func__, name);
+                return 1;
+            }
+            ggml_backend_tensor_set(cur, data.data(), 0, n_bytes);
+
+            // the repack buffer lives in host memory but does not implement get_tensor
+            src = (const uint8_t *) cur->data;
+        }
+
+        f_out.write((const char *) src, n_bytes);
+        zeros(f_out, GGML_PAD(n_bytes, alignment) - n_bytes);
+    }
+
+    f_out.close();
+    if (!f_out) {
+        fprintf(stderr, "%s: failed to write %s\n", __func__, params.output.c_str());
+        return 1;
+    }
+
+    printf("%s: wrote %s\n", __func__, params.output.c_str());
+
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include "log.h"
 #include "sampling.h"
 #include "speculative.h"
+#include "thread-pool.h"
 #include "mtmd.h"
 #include "mtmd-helper.h"
 
@@ -189,6 +190,7 @@ struct slot_params {
             {"ignore_eos",                sampling.ignore_eos},
             {"stream",                    stream},
             {"logit_bias",                format_logit_bias(sampling.logit_bias)},
+            {"logits_subset",             sampling.logits_subset},
             {"n_probs",                   sampling.n_probs},
             {"min_keep",                  sampling.min_keep},
             {"grammar",                   sampling.grammar},
@@ -474,6 +476,28 @@ struct server_task {
             }
         }
 
+        {
+            params.sampling.logits_subset.clear();
+
+            const auto & logits_subset = data.find("logits_subset");
+            if (logits_subset != data.end() && logits_subset->is_array()) {
+                const int n_vocab = llama_vocab_n_tokens(vocab);
+                for (const auto & el : *logits_subset) {
+                    if (el.is_number_integer()) {
+                        const llama_token tok = el.get<llama_token>();
+                        if (tok < 0 || tok >= n_vocab) {
+                            throw std::runtime_error("Error: invalid token in logits_subset");
+                        }
+                        params.sampling.logits_subset.push_back(tok);
+                    } else if (el.is_string()) {
+                        for (const auto tok : common_tokenize(vocab, el.get<std::string>(), false)) {
+                            params.sampling.logits_subset.push_back(tok);
+                        }
+                    }
+                }
+            }
+        }
+
         {
             params.antiprompt.clear();
 
@@ -527,6 +551,9 @@ struct result_timings {
     double predicted_per_token_ms;
     double predicted_per_second;
 
+    // longest time the prompt was pending without progress
+    double prompt_wait_max_ms = 0.0;
+
     // Optional speculative metrics - only included when > 0
     int32_t draft_n = 0;
     int32_t draft_n_accepted = 0;
@@ -542,6 +569,8 @@ struct result_timings {
             {"predicted_ms",           predicted_ms},
             {"predicted_per_token_ms", predicted_per_token_ms},
             {"predicted_per_second",   predicted_per_second},
+
+            {"prompt_wait_max_ms",     prompt_wait_max_ms},
         };
 
         if (draft_n > 0) {
@@ -1159,6 +1188,18 @@ struct server_task_result_metrics : server_task_result {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    uint64_t n_sched_iterations_total     = 0;
+    uint64_t n_sched_decode_tokens_total  = 0;
+    uint64_t n_sched_prefill_tokens_total = 0;
+    uint64_t n_sched_budget_total         = 0;
+
+    int32_t n_sched_decode_tokens  = 0;
+    int32_t n_sched_prefill_tokens = 0;
+    int32_t n_sched_waiting        = 0;
+    int64_t t_sched_wait_max       = 0;
+
+    float kv_cache_fragmentation = 0.0f;
+
     // while we can also use std::vector<server_slot> this requires copying the slot object which can be quite messy
     // therefore, we use json to temporarily store the slot.to_json() result
     json slots_data = json::array();
@@ -1183,6 +1224,17 @@ struct server_task_result_metrics : server_task_result {
             { "n_decode_total",                  n_decode_total },
             { "n_busy_slots_total",              n_busy_slots_total },
 
+            { "n_sched_iterations_total",        n_sched_iterations_total },
+            { "n_sched_decode_tokens_total",     n_sched_decode_tokens_total },
+            { "n_sched_prefill_tokens_total",    n_sched_prefill_tokens_total },
+            { "n_sched_budget_total",            n_sched_budget_total },
+            { "n_sched_decode_tokens",           n_sched_decode_tokens },
+            { "n_sched_prefill_tokens",          n_sched_prefill_tokens },
+            { "n_sched_waiting",                 n_sched_waiting },
+            { "t_sched_wait_max",                t_sched_wait_max },
+
+            { "kv_cache_fragmentation",          kv_cache_fragmentation },
+
             { "slots",                           slots_data },
         };
     }
@@ -1267,6 +1319,10 @@ struct server_slot {
     // used to determine the slot that has been used the longest
     int64_t t_last_used = -1;
 
+    // the last time the prompt of the slot made progress (or the time the task was assigned), used by the scheduler
+    int64_t t_sched = 0;
+    int64_t t_sched_wait_max = 0; // longest time the prompt did not make progress (us)
+
     // generation props
     int32_t n_ctx       = 0;  // context size per slot
     int32_t n_past      = 0;
@@ -1390,6 +1446,16 @@ struct server_slot {
         return state != SLOT_STATE_IDLE;
     }
 
+    // the prompt of the slot still has tokens to be added to a batch
+    bool is_pending_prompt() const {
+        return state == SLOT_STATE_STARTED || state == SLOT_STATE_PROCESSING_PROMPT;
+    }
+
+    // estimate of the number of prompt tokens left to process (the cached prefix is not known before the prompt is started)
+    int32_t n_prompt_remaining() const {
+        return state == SLOT_STATE_STARTED ? (int32_t) prompt_tokens.size() : n_prompt_tokens - n_past;
+    }
+
     bool can_speculate() const {
         return ctx_dft && params.speculative.n_max > 0 && params.cache_prompt;
     }
@@ -1425,6 +1491,8 @@ struct server_slot {
         timings.predicted_per_token_ms = t_token_generation / n_decoded;
         timings.predicted_per_second = 1e3 / t_token_generation * n_decoded;
 
+        timings.prompt_wait_max_ms = t_sched_wait_max / 1e3;
+
         // Add speculative metrics
         if (n_draft_total > 0) {
             timings.draft_n = n_draft_total;
@@ -1543,6 +1611,18 @@ struct server_metrics {
     uint64_t n_decode_total     = 0;
     uint64_t n_busy_slots_total = 0;
 
+    // scheduler
+    uint64_t n_sched_iterations_total     = 0;
+    uint64_t n_sched_decode_tokens_total  = 0;
+    uint64_t n_sched_prefill_tokens_total = 0;
+    uint64_t n_sched_budget_total         = 0;
+
+    // last iteration
+    int32_t n_sched_decode_tokens  = 0;
+    int32_t n_sched_prefill_tokens = 0;
+    int32_t n_sched_waiting        = 0; // prompts that were pending at the start of the iteration
+    int64_t t_sched_wait_max       = 0; // longest time a pending prompt had not made progress (us)
+
     void init() {
         t_start = ggml_time_us();
     }
@@ -1570,6 +1650,18 @@ struct server_metrics {
         }
     }
 
+    void on_scheduled(int32_t n_budget, int32_t n_decode, int32_t n_prefill, int32_t n_waiting, int64_t t_wait_max) {
+        n_sched_iterations_total++;
+        n_sched_decode_tokens_total  += n_decode;
+        n_sched_prefill_tokens_total += n_prefill;
+        n_sched_budget_total         += n_budget;
+
+        n_sched_decode_tokens  = n_decode;
+        n_sched_prefill_tokens = n_prefill;
+        n_sched_waiting        = n_waiting;
+        t_sched_wait_max       = t_wait_max;
+    }
+
     void reset_bucket() {
         n_prompt_tokens_processed = 0;
         t_prompt_processing       = 0;
@@ -1589,6 +1681,9 @@ struct server_queue {
     std::mutex mutex_tasks;
     std::condition_variable condition_tasks;
 
+    // if > 0, wake up and update the slots every t_poll_s seconds even if there are no new tasks
+    int32_t t_poll_s = -1;
+
     // callback functions
     std::function<void(server_task &&)> callback_new_task;
     std::function<void(void)>           callback_update_slots;
@@ -1720,9 +1815,14 @@ struct server_queue {
                     return;
                 }
                 if (queue_tasks.empty()) {
-                    condition_tasks.wait(lock, [&]{
+                    const auto has_work = [&]{
                         return (!queue_tasks.empty() || !running);
-                    });
+                    };
+                    if (t_poll_s > 0) {
+                        condition_tasks.wait_for(lock, std::chrono::seconds(t_poll_s), has_work);
+                    } else {
+                        condition_tasks.wait(lock, has_work);
+                    }
                 }
             }
         }
@@ -1896,9 +1996,17 @@ struct server_context {
 
     llama_batch batch {};
 
+    // runs the samplers of the slots concurrently, see common_sampler_sample_batch
+    std::unique_ptr<common_thread_pool> pool_sampling;
+
     bool clean_kv_cache = true;
     bool add_bos_token  = true;
     bool has_eos_token  = false;
+    bool all_slots_idle = false; // the idle state is logged only when it is entered (the spill poll wakes up the loop)
+
+    // the streaming KV cache compacts the positions of the cached tokens: the batches use automatic positions and
+    // slot.n_past only counts the tokens
+    bool kv_streaming = false;
 
     int32_t n_ctx; // total context for all clients / slots
 
@@ -2035,6 +2143,30 @@ struct server_context {
             }
         }
 
+        kv_streaming = params_base.n_stream_window > 0;
+
+        if (kv_streaming) {
+            if (mctx) {
+                SRV_ERR("%s\n", "err: the streaming KV cache is not supported by multimodal");
+                return false;
+            }
+
+            if (!params_base.speculative.model.path.empty()) {
+                SRV_ERR("%s\n", "err: the streaming KV cache is not supported with speculative decoding");
+                return false;
+            }
+
+            if (params_base.ctx_shift) {
+                params_base.ctx_shift = false;
+                SRV_INF("%s\n", "the streaming KV cache evicts the old tokens, ctx_shift will be disabled");
+            }
+
+            if (params_base.n_cache_reuse) {
+                params_base.n_cache_reuse = 0;
+                SRV_WRN("%s\n", "cache_reuse is not supported by the streaming KV cache, it will be disabled");
+            }
+        }
+
         if (!llama_memory_can_shift(llama_get_memory(ctx))) {
             if (params_base.ctx_shift) {
                 params_base.ctx_shift = false;
@@ -2104,6 +2236,8 @@ struct server_context {
             batch = llama_batch_init(std::max(n_batch, params_base.n_parallel), 0, 1);
         }
 
+        pool_sampling = std::make_unique<common_thread_pool>(std::max(1, std::min(params_base.n_parallel, llama_n_threads_batch(ctx))) - 1);
+
         metrics.init();
 
         oai_parser_opt = {
@@ -2208,6 +2342,9 @@ struct server_context {
             send_error(task, "Prompt contains invalid tokens", ERROR_TYPE_INVALID_REQUEST);
             return false;
         }
+
+        slot_unspill(slot);
+
         SLT_DBG(slot, "launching slot : %s\n", safe_json_to_str(slot.to_json()).c_str());
 
         if (slot.n_predict > 0 && slot.params.n_predict > slot.n_predict) {
@@ -2223,6 +2360,13 @@ struct server_context {
         {
             if (slot.smpl != nullptr) {
                 common_sampler_free(slot.smpl);
+                slot.smpl = nullptr;
+            }
+
+            // only the top-k candidates leave the graph, the rest of the vocab cannot be sampled from
+            if (params_base.n_logits_top_k > 0 && !slot.params.sampling.grammar.empty()) {
+                send_error(task, "Grammars are not supported with --logits-top-k", ERROR_TYPE_NOT_SUPPORTED);
+                return false;
             }
 
             slot.smpl = common_sampler_init(model, slot.params.sampling);
@@ -2239,19 +2383,74 @@ struct server_context {
             slot.batch_spec = llama_batch_init(slot.params.speculative.n_max + 1, 0, 1);
         }
 
-        slot.state = SLOT_STATE_STARTED;
+        slot.state   = SLOT_STATE_STARTED;
+        slot.t_sched = ggml_time_us();
+        slot.t_sched_wait_max = 0;
 
         SLT_INF(slot, "%s", "processing task\n");
 
         return true;
     }
 
+    // move the KV state of the slots that have been idle for more than --kv-spill-idle seconds to disk
+    void slots_spill_idle() {
+        if (params_base.kv_spill_idle < 0) {
+            return;
+        }
+
+        const int64_t t_now = ggml_time_us();
+
+        for (auto & slot : slots) {
+            if (slot.is_processing() || slot.cache_tokens.empty() || llama_state_seq_is_spilled(ctx, slot.id)) {
+                continue;
+            }
+
+            const double t_idle_s = (t_now - slot.t_last_used) / 1e6;
+            if (t_idle_s < params_base.kv_spill_idle) {
+                continue;
+            }
+
+            if (!llama_state_seq_spill(ctx, slot.id)) {
+                SRV_WRN("%s", "failed to spill the KV state of an idle slot, disabling KV spilling\n");
+                params_base.kv_spill_idle = -1;
+                queue_tasks.t_poll_s      = -1;
+                return;
+            }
+
+            SLT_INF(slot, "spilled KV state of %d tokens to disk after %.1f s idle\n", (int) slot.cache_tokens.size(), t_idle_s);
+        }
+    }
+
+    // bring the KV state of the slot back from disk, if it has been spilled
+    void slot_unspill(server_slot & slot) {
+        if (!llama_state_seq_is_spilled(ctx, slot.id)) {
+            return;
+        }
+
+        const int64_t t_start = ggml_time_us();
+
+        llama_state_seq_prefetch(ctx, slot.id);
+
+        if (!llama_state_seq_restore(ctx, slot.id)) {
+            SLT_WRN(slot, "%s", "failed to restore the spilled KV state, the prompt will be reprocessed\n");
+            slot.cache_tokens.clear();
+            return;
+        }
+
+        SLT_INF(slot, "restored spilled KV state of %d tokens in %.2f ms\n", (int) slot.cache_tokens.size(), (ggml_time_us() - t_start) / 1e3);
+    }
+
     void kv_cache_clear() {
         SRV_DBG("%s", "clearing KV cache\n");
 
         // clear the entire KV cache
+        // note: this also discards the spilled state of the slots
         llama_memory_clear(llama_get_memory(ctx), true);
         clean_kv_cache = false;
+
+        for (auto & slot : slots) {
+            slot.cache_tokens.clear();
+        }
     }
 
     bool process_token(completion_token_output & result, server_slot & slot) {
@@ -2307,7 +2506,7 @@ struct server_context {
         }
 
         // if context shifting is disabled, make sure that we don't run out of context
-        if (!params_base.ctx_shift && slot.n_past + 1 >= slot.n_ctx) {
+        if (!params_base.ctx_shift && !kv_streaming && slot.n_past + 1 >= slot.n_ctx) {
             slot.stop           = STOP_TYPE_LIMIT;
             slot.has_next_token = false;
 
@@ -2372,7 +2571,7 @@ struct server_context {
         }
 
         // if context shift is disabled, we stop when it reaches the context limit
-        if (slot.n_past >= slot.n_ctx) {
+        if (!kv_streaming && slot.n_past >= slot.n_ctx) {
             slot.truncated      = true;
             slot.stop           = STOP_TYPE_LIMIT;
             slot.has_next_token = false;
@@ -2826,6 +3025,18 @@ struct server_context {
                     res->n_decode_total          = metrics.n_decode_total;
                     res->n_busy_slots_total      = metrics.n_busy_slots_total;
 
+                    res->n_sched_iterations_total     = metrics.n_sched_iterations_total;
+                    res->n_sched_decode_tokens_total  = metrics.n_sched_decode_tokens_total;
+                    res->n_sched_prefill_tokens_total = metrics.n_sched_prefill_tokens_total;
+                    res->n_sched_budget_total         = metrics.n_sched_budget_total;
+
+                    res->n_sched_decode_tokens  = metrics.n_sched_decode_tokens;
+                    res->n_sched_prefill_tokens = metrics.n_sched_prefill_tokens;
+                    res->n_sched_waiting        = metrics.n_sched_waiting;
+                    res->t_sched_wait_max       = metrics.t_sched_wait_max;
+
+                    res->kv_cache_fragmentation  = llama_memory_fragmentation(llama_get_memory(ctx));
+
                     if (task.metrics_reset_bucket) {
                         metrics.reset_bucket();
                     }
@@ -2850,6 +3061,8 @@ struct server_context {
                         break;
                     }
 
+                    slot_unspill(*slot);
+
                     const size_t token_count = slot->cache_tokens.size();
                     const int64_t t_start = ggml_time_us();
 
@@ -2888,6 +3101,8 @@ struct server_context {
                         break;
                     }
 
+                    slot_unspill(*slot);
+
                     const int64_t t_start = ggml_time_us();
 
                     std::string filename = task.slot_action.filename;
@@ -2935,6 +3150,8 @@ struct server_context {
                         break;
                     }
 
+                    slot_unspill(*slot);
+
                     // Erase token cache
                     const size_t n_erased = slot->cache_tokens.size();
                     llama_memory_seq_rm(llama_get_memory(ctx), slot->id, -1, -1);
@@ -2957,7 +3174,55 @@ struct server_context {
         }
     }
 
+    // order in which the slots are visited when filling the batch with prompt tokens
+    // the pending prompts are sorted by the scheduling policy, prompts that have been waiting for more than
+    // sched_max_wait ms go first
+    std::vector<server_slot *> sched_order(int64_t t_now) {
+        const int64_t t_max_wait = params_base.sched_max_wait >= 0 ? 1000*(int64_t) params_base.sched_max_wait : -1;
+
+        const auto is_starved = [&](const server_slot & slot) {
+            return t_max_wait >= 0 && t_now - slot.t_sched > t_max_wait;
+        };
+
+        std::vector<server_slot *> res;
+        std::vector<server_slot *> pending;
+
+        for (auto & slot : slots) {
+            if (slot.is_pending_prompt()) {
+                pending.push_back(&slot);
+            } else {
+                res.push_back(&slot);
+            }
+        }
+
+        std::stable_sort(pending.begin(), pending.end(), [&](const server_slot * a, const server_slot * b) {
+            const bool starved_a = is_starved(*a);
+            const bool starved_b = is_starved(*b);
+
+            if (starved_a != starved_b) {
+                return starved_a;
+            }
+
+            if (starved_a) {
+                return a->t_sched < b->t_sched;
+            }
+
+            if (params_base.sched_policy == COMMON_SCHED_POLICY_SJF && a->n_prompt_remaining() != b->n_prompt_remaining()) {
+                return a->n_prompt_remaining() < b->n_prompt_remaining();
+            }
+
+            // task ids are increasing, so this is the order of arrival
+            return a->id_task < b->id_task;
+        });
+
+        res.insert(res.end(), pending.begin(), pending.end());
+
+        return res;
+    }
+
     void update_slots() {
+        slots_spill_idle();
+
         // check if all slots are idle
         {
             bool all_idle = true;
@@ -2970,13 +3235,18 @@ struct server_context {
             }
 
             if (all_idle) {
-                SRV_INF("%s", "all slots are idle\n");
+                if (!all_slots_idle) {
+                    SRV_INF("%s", "all slots are idle\n");
+                    all_slots_idle = true;
+                }
                 if (clean_kv_cache) {
                     kv_cache_clear();
                 }
 
                 return;
             }
+
+            all_slots_idle = false;
         }
 
         {
@@ -2990,7 +3260,7 @@ struct server_context {
         // apply context-shift if needed
         // TODO: simplify and improve
         for (server_slot & slot : slots) {
-            if (slot.is_processing() && slot.n_past + 1 >= slot.n_ctx) {
+            if (slot.is_processing() && !kv_streaming && slot.n_past + 1 >= slot.n_ctx) {
                 if (!params_base.ctx_shift) {
                     // this check is redundant (for good)
                     // we should never get here, because generation should already stopped in process_token()
@@ -3071,9 +3341,37 @@ struct server_context {
         int32_t n_batch  = llama_n_batch(ctx);
         int32_t n_ubatch = llama_n_ubatch(ctx);
 
-        // next, batch any pending prompts without exceeding n_batch
+        // token budget of this iteration - the tokens of the generating slots are already in the batch and the rest
+        // of the budget is filled with chunks of the pending prompts, so a long prompt cannot stall the generation
+        const int32_t n_decode = batch.n_tokens;
+        const int32_t n_budget = std::max(n_decode, params_base.n_sched_budget > 0 ? std::min(params_base.n_sched_budget, n_batch) : n_batch);
+
+        const int64_t t_now = ggml_time_us();
+
+        int32_t n_waiting  = 0;
+        int64_t t_wait_max = 0;
+
+        for (const auto & slot : slots) {
+            if (slot.is_pending_prompt()) {
+                n_waiting++;
+                t_wait_max = std::max(t_wait_max, t_now - slot.t_sched);
+            }
+        }
+
+        // max number of prompt tokens of a single slot in this iteration (0 = no limit)
+        int32_t n_chunk_max = params_base.n_prefill_chunk;
+
+        if (params_base.sched_policy == COMMON_SCHED_POLICY_FAIR && n_waiting > 0) {
+            const int32_t n_share = std::max(1, (n_budget - n_decode + n_waiting - 1)/n_waiting);
+
+            n_chunk_max = n_chunk_max > 0 ? std::min(n_chunk_max, n_share) : n_share;
+        }
+
+        // next, batch any pending prompts without exceeding the budget
         if (params_base.cont_batching || batch.n_tokens == 0) {
-            for (auto & slot : slots) {
+            for (server_slot * slot_ptr : sched_order(t_now)) {
+                auto & slot = *slot_ptr;
+
                 // check if we can batch this slot with the previous one
                 if (slot.is_processing()) {
                     if (!slot_batched) {
@@ -3141,7 +3439,7 @@ struct server_context {
                                 continue;
                             }
                         } else {
-                            if (!params_base.ctx_shift) {
+                            if (!params_base.ctx_shift && !kv_streaming) {
                                 // if context shift is disabled, we make sure prompt size is smaller than KV size
                                 // TODO: there should be a separate parameter that control prompt truncation
                                 //       context shift should be applied only during the generation phase
@@ -3157,7 +3455,8 @@ struct server_context {
                             slot.params.n_keep = std::min(slot.n_ctx - 4, slot.params.n_keep);
 
                             // if input prompt is too big, truncate it
-                            if (slot.n_prompt_tokens >= slot.n_ctx) {
+                            // (the streaming KV cache evicts the old prompt tokens instead)
+                            if (!kv_streaming && slot.n_prompt_tokens >= slot.n_ctx) {
                                 if (mctx) {
                                     // we should never reach this
                                     GGML_ABORT("not supported by multimodal");
@@ -3188,7 +3487,8 @@ struct server_context {
                                 GGML_ASSERT(slot.n_prompt_tokens < slot.n_ctx);
                             }
 
-                            if (slot.params.cache_prompt) {
+                            // the evicted tokens of the streaming KV cache cannot be reused
+                            if (slot.params.cache_prompt && !kv_streaming) {
                                 // reuse any previously computed tokens that are common with the new prompt
                                 slot.n_past = slot.cache_tokens.get_common_prefix(prompt_tokens);
 
@@ -3289,6 +3589,16 @@ struct server_context {
 
                     SLT_INF(slot, "kv cache rm [%d, end)\n", slot.n_past);
 
+                    // note: the logits subset of the slot is cleared when all of its cells are removed, so it is set
+                    //       after the cache has been trimmed
+                    {
+                        const auto & subset = slot.params.sampling.logits_subset;
+
+                        if (llama_set_logits_subset(ctx, slot.id, subset.data(), subset.size()) != 0 && !subset.empty()) {
+                            SLT_WRN(slot, "%s", "the logits subset is not supported by this context, ignoring it\n");
+                        }
+                    }
+
                     // remove the non-common part from the cache
                     slot.cache_tokens.keep_first(slot.n_past);
 
@@ -3316,8 +3626,15 @@ struct server_context {
                         slot.n_prompt_tokens_processed += n_pos;
                     }
 
+                    // prompts that cannot be split are processed at once, regardless of the budget
+                    const int32_t n_tokens_max =
+                        !slot.can_split() ? n_batch :
+                        n_chunk_max > 0   ? std::min(n_budget, batch.n_tokens + n_chunk_max) : n_budget;
+
+                    const int32_t n_tokens_prev = batch.n_tokens;
+
                     // add prompt tokens for processing in the current batch
-                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_batch) {
+                    while (slot.n_past < slot.n_prompt_tokens && batch.n_tokens < n_tokens_max) {
                         // get next token to process
                         llama_token cur_tok = slot.prompt_tokens[slot.n_past];
                         if (cur_tok == LLAMA_TOKEN_NULL) {
@@ -3334,6 +3651,11 @@ struct server_context {
                         slot.n_past++;
                     }
 
+                    if (batch.n_tokens > n_tokens_prev) {
+                        slot.t_sched_wait_max = std::max(slot.t_sched_wait_max, t_now - slot.t_sched);
+                        slot.t_sched          = t_now;
+                    }
+
                     // SLT_INF(slot, "new cache_tokens: %s\n", slot.cache_tokens.str().c_str());
 
                     SLT_INF(slot, "prompt processing progress, n_past = %d, n_tokens = %d, progress = %f\n", slot.n_past, batch.n_tokens, (float) slot.n_prompt_tokens_processed / slot.n_prompt_tokens);
@@ -3365,7 +3687,7 @@ struct server_context {
                     }
                 }
 
-                if (batch.n_tokens >= n_batch) {
+                if (batch.n_tokens >= n_budget) {
                     break;
                 }
             }
@@ -3376,6 +3698,10 @@ struct server_context {
             return;
         }
 
+        metrics.on_scheduled(n_budget, n_decode, batch.n_tokens - n_decode, n_waiting, t_wait_max);
+
+        SRV_DBG("scheduled batch, n_budget = %d, n_decode = %d, n_prefill = %d, n_waiting = %d\n", n_budget, n_decode, batch.n_tokens - n_decode, n_waiting);
+
         SRV_DBG("decoding batch, n_tokens = %d\n", batch.n_tokens);
 
         if (slot_batched) {
@@ -3385,68 +3711,15 @@ struct server_context {
             llama_set_embeddings(ctx, slot_batched->need_embd());
         }
 
-        int32_t i_next = 0;
-
-        // process the created batch of tokens
-        for (int32_t i = 0; i < batch.n_tokens; i = i_next) {
-            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
-
-            llama_batch batch_view = {
-                n_tokens,
-                batch.token    + i,
-                nullptr,
-                batch.pos      + i,
-                batch.n_seq_id + i,
-                batch.seq_id   + i,
-                batch.logits   + i,
-            };
-
-            const int ret = llama_decode(ctx, batch_view);
-
-            metrics.on_decoded(slots);
-
-            if (ret != 0) {
-                {
-                    std::string err;
-
-                    if (n_batch == 1 && ret == 1) {
-                        err = "Context size has been exceeded.";
-                    }
-
-                    if (ret == -1) {
-                        err = "Invalid input batch.";
-                    }
-
-                    if (ret < -1) {
-                        err = "Compute error.";
-                    }
-
-                    if (!err.empty()) {
-                        SRV_ERR("%s, i = %d, n_batch = %d, ret = %d\n", err.c_str(), i, n_batch, ret);
-                        for (auto & slot : slots) {
-                            slot.release();
-                            send_error(slot, err);
-                        }
-                        break;
-                    }
-                }
-
-                // retry with half the batch size to try to find a free slot in the KV cache
-                n_batch /= 2;
-
-                SRV_WRN("failed to find free space in the KV cache, retrying with smaller batch size, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
-
-                continue; // continue loop of n_batch
-            }
-
-            // move the head of the batch forward with the number of tokens we just processed
-            i_next = i + n_tokens;
-
-            // on successful decode, restore the original batch size
-            n_batch = llama_n_batch(ctx);
+        // sample the slots that have an output in the chunk of the batch starting at token i and process the results
+        const auto process_outputs = [&](int32_t i, const llama_batch & batch_view) {
+            // the slots that sample a token from this batch
+            std::vector<server_slot *>    slots_sample;
+            std::vector<common_sampler *> smpls_sample;
+            std::vector<int>              idxs_sample;
 
             for (auto & slot : slots) {
-                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + n_tokens)) {
+                if (slot.i_batch < (int) i || slot.i_batch >= (int) (i + batch_view.n_tokens)) {
                     continue; // continue loop of slots
                 }
 
@@ -3472,9 +3745,20 @@ struct server_context {
                     continue; // continue loop of slots
                 }
 
-                const int tok_idx = slot.i_batch - i;
+                slots_sample.push_back(&slot);
+                smpls_sample.push_back(slot.smpl);
+                idxs_sample .push_back(slot.i_batch - i);
+            }
+
+            // sample all sequences at once - the samplers of the slots run concurrently
+            const auto ids_sample = common_sampler_sample_batch(*pool_sampling, smpls_sample, ctx, idxs_sample);
+
+            for (size_t k = 0; k < slots_sample.size(); ++k) {
+                auto & slot = *slots_sample[k];
 
-                llama_token id = common_sampler_sample(slot.smpl, ctx, tok_idx);
+                const int tok_idx = idxs_sample[k];
+
+                llama_token id = ids_sample[k];
 
                 slot.i_batch = -1;
 
@@ -3510,6 +3794,105 @@ struct server_context {
                     continue;
                 }
             }
+        };
+
+        // pipelined decode: when the batch is split in several chunks, the outputs of a chunk are processed while the next
+        // chunk is being computed (not with speculative decoding, which uses the context after each chunk)
+        // only the chunked prompt processing is overlapped - a batch that fits in one chunk, such as the steady-state
+        // generation, needs the sampled tokens of all slots before it can be submitted, so it is decoded synchronously
+        const bool pipeline = std::none_of(slots.begin(), slots.end(), [](const server_slot & slot) {
+            return slot.can_speculate();
+        });
+
+        // the chunk whose outputs have not been processed yet
+        bool        has_prev   = false;
+        int32_t     i_prev     = 0;
+        llama_batch batch_prev = {};
+
+        int32_t i_next = 0;
+
+        // process the created batch of tokens
+        for (int32_t i = 0; i < batch.n_tokens; i = i_next) {
+            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+
+            llama_batch batch_view = {
+                n_tokens,
+                batch.token    + i,
+                nullptr,
+                kv_streaming ? nullptr : batch.pos + i,
+                batch.n_seq_id + i,
+                batch.seq_id   + i,
+                batch.logits   + i,
+            };
+
+            int ret = 0;
+
+            if (has_prev) {
+                ret = llama_decode_async(ctx, batch_view);
+                if (ret == 0) {
+                    process_outputs(i_prev, batch_prev);
+                    has_prev = false;
+
+                    ret = llama_decode_wait(ctx);
+                }
+            } else {
+                ret = llama_decode(ctx, batch_view);
+            }
+
+            metrics.on_decoded(slots);
+
+            if (ret != 0) {
+                if (has_prev) {
+                    process_outputs(i_prev, batch_prev);
+                    has_prev = false;
+                }
+
+                {
+                    std::string err;
+
+                    if (n_batch == 1 && ret == 1) {
+                        err = "Context size has been exceeded.";
+                    }
+
+                    if (ret == -1) {
+                        err = "Invalid input batch.";
+                    }
+
+                    if (ret < -1) {
+                        err = "Compute error.";
+                    }
+
+                    if (!err.empty()) {
+                        SRV_ERR("%s, i = %d, n_batch = %d, ret = %d\n", err.c_str(), i, n_batch, ret);
+                        for (auto & slot : slots) {
+                            slot.release();
+                            send_error(slot, err);
+                        }
+                        break;
+                    }
+                }
+
+                // retry with half the batch size to try to find a free slot in the KV cache
+                n_batch /= 2;
+
+                SRV_WRN("failed to find free space in the KV cache, retrying with smaller batch size, i = %d, n_batch = %d, ret = %d\n", i, n_batch, ret);
+
+                continue; // continue loop of n_batch
+            }
+
+            // move the head of the batch forward with the number of tokens we just processed
+            i_next = i + n_tokens;
+
+            // on successful decode, restore the original batch size
+            n_batch = llama_n_batch(ctx);
+
+            if (pipeline && i_next < batch.n_tokens) {
+                has_prev   = true;
+                i_prev     = i;
+                batch_prev = batch_view;
+            } else {
+                process_outputs(i, batch_view);
+            }
 
             // do speculative decoding
             for (auto & slot : slots) {
@@ -3940,6 +4323,18 @@ int main(int argc, char ** argv) {
                     {"name",  "n_busy_slots_per_decode"},
                     {"help",  "Average number of busy slots per llama_decode() call"},
                     {"value",  (float) res_metrics->n_busy_slots_total / std::max((float) res_metrics->n_decode_total, 1.f)}
+            }, {
+                    {"name",  "sched_iterations_total"},
+                    {"help",  "Number of scheduler iterations (batches submitted)."},
+                    {"value",  res_metrics->n_sched_iterations_total}
+            }, {
+                    {"name",  "sched_decode_tokens_total"},
+                    {"help",  "Number of generation tokens scheduled."},
+                    {"value",  res_metrics->n_sched_decode_tokens_total}
+            }, {
+                    {"name",  "sched_prefill_tokens_total"},
+                    {"help",  "Number of prompt tokens scheduled."},
+                    {"value",  res_metrics->n_sched_prefill_tokens_total}
             }}},
             {"gauge", {{
                     {"name",  "prompt_tokens_seconds"},
@@ -3957,6 +4352,30 @@ int main(int argc, char ** argv) {
                     {"name",  "requests_deferred"},
                     {"help",  "Number of requests deferred."},
                     {"value",  (uint64_t) res_metrics->n_tasks_deferred}
+            },{
+                    {"name",  "kv_cache_fragmentation"},
+                    {"help",  "Fraction of the KV cache cells below the last used cell that are empty."},
+                    {"value",  res_metrics->kv_cache_fragmentation}
+            },{
+                    {"name",  "sched_budget_usage_ratio"},
+                    {"help",  "Fraction of the token budget of the scheduler iterations that was used."},
+                    {"value",  (float) (res_metrics->n_sched_decode_tokens_total + res_metrics->n_sched_prefill_tokens_total) / std::max((float) res_metrics->n_sched_budget_total, 1.f)}
+            },{
+                    {"name",  "sched_decode_tokens"},
+                    {"help",  "Number of generation tokens in the last scheduler iteration."},
+                    {"value",  res_metrics->n_sched_decode_tokens}
+            },{
+                    {"name",  "sched_prefill_tokens"},
+                    {"help",  "Number of prompt tokens in the last scheduler iteration."},
+                    {"value",  res_metrics->n_sched_prefill_tokens}
+            },{
+                    {"name",  "sched_prompts_waiting"},
+                    {"help",  "Number of pending prompts at the start of the last scheduler iteration."},
+                    {"value",  res_metrics->n_sched_waiting}
+            },{
+                    {"name",  "sched_prompt_wait_seconds_max"},
+                    {"help",  "Longest time a pending prompt had not made progress, at the start of the last scheduler iteration."},
+                    {"value",  res_metrics->t_sched_wait_max / 1.e6}
             }}}
         };
 
@@ -4937,6 +5356,11 @@ int main(int argc, char ** argv) {
         ctx_server.update_slots();
     });
 
+    if (ctx_server.params_base.kv_spill_idle >= 0) {
+        // make sure that idle slots are spilled even if no new requests arrive
+        ctx_server.queue_tasks.t_poll_s = std::max(1, ctx_server.params_base.kv_spill_idle);
+    }
+
     shutdown_handler = [&](int) {
         // this will unblock start_loop()
         ctx_server.queue_tasks.terminate();
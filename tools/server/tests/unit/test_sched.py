@@ -0,0 +1,96 @@
+import pytest
+import requests
+from utils import *
+
+server = ServerPreset.tinyllama2()
+
+
+LONG_TEXT = """
+Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.
+Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip ex ea commodo consequat.
+Duis aute irure dolor in reprehenderit in voluptate velit esse cillum dolore eu fugiat nulla pariatur.
+""".strip()
+
+
+@pytest.fixture(scope="module", autouse=True)
+def create_server():
+    global server
+    server = ServerPreset.tinyllama2()
+    server.n_ctx = 1024
+    server.n_slots = 2
+    server.server_metrics = True
+    server.sched_budget = 32
+    server.prefill_chunk = 16
+
+
+def get_metrics() -> dict[str, float]:
+    res = requests.get(f"http://{server.server_host}:{server.server_port}/metrics")
+    assert res.status_code == 200
+    metrics = {}
+    for line in res.text.splitlines():
+        if line.startswith("#") or not line.strip():
+            continue
+        name, value = line.split(" ")
+        metrics[name] = float(value)
+    return metrics
+
+
+@pytest.mark.parametrize("policy", ["fifo", "sjf", "fair"])
+def test_sched_chunked_prefill(policy: str):
+    global server
+    server.sched_policy = policy
+    server.start()
+    tasks = []
+    for prompt in [LONG_TEXT, "I believe the meaning of life is"]:
+        tasks.append((server.make_request, ("POST", "/completion", {
+            "prompt": prompt,
+            "n_predict": 8,
+            "cache_prompt": False,
+        })))
+    results = parallel_function_calls(tasks)
+    for res in results:
+        assert res.status_code == 200
+        assert res.body["timings"]["predicted_n"] == 8
+
+    n_prompt = sum(res.body["timings"]["prompt_n"] for res in results)
+
+    metrics = get_metrics()
+    # the long prompt does not fit in a single iteration
+    assert metrics["llamacpp:sched_iterations_total"] > n_prompt / 32
+    assert metrics["llamacpp:sched_prefill_tokens_total"] == n_prompt
+    assert metrics["llamacpp:sched_decode_tokens_total"] > 0
+    assert 0 < metrics["llamacpp:sched_budget_usage_ratio"] <= 1
+
+
+def test_sched_max_wait():
+    global server
+    max_wait_ms = 10
+    # one token of the budget for the generation of the other slot, one for a prompt, no chunk limit: without
+    # --sched-max-wait, the longer prompt waits for the whole prefill of the shorter one
+    server.sched_policy = "sjf"
+    server.sched_max_wait = max_wait_ms
+    server.sched_budget = 2
+    server.prefill_chunk = None
+    server.start()
+    tasks = []
+    for prompt in [LONG_TEXT, LONG_TEXT + " " + LONG_TEXT]:
+        tasks.append((server.make_request, ("POST", "/completion", {
+            "prompt": prompt,
+            "n_predict": 4,
+            "cache_prompt": False,
+        })))
+    res_short, res_long = parallel_function_calls(tasks)
+    assert res_short.status_code == 200
+    assert res_long.status_code == 200
+
+    # the waits are checked at the start of each scheduler iteration
+    max_wait_bound_ms = max_wait_ms + 20
+    if res_short.body["timings"]["prompt_ms"] <= max_wait_bound_ms:
+        pytest.skip("the competing prefill is too fast to starve the other prompt")
+
+    # the starved prompt starts, and keeps making progress, within --sched-max-wait of its last progress
+    assert res_long.body["timings"]["prompt_n"] > res_short.body["timings"]["prompt_n"]
+    assert res_long.body["timings"]["prompt_wait_max_ms"] <= max_wait_bound_ms
+
+    metrics = get_metrics()
+    assert metrics["llamacpp:sched_prompts_waiting"] == 0
@@ -67,6 +67,10 @@ class ServerProcess:
     id_slot: int | None = None
     cache_prompt: bool | None = None
     n_slots: int | None = None
+    sched_budget: int | None = None
+    prefill_chunk: int | None = None
+    sched_policy: Literal['fifo', 'sjf', 'fair'] | None = None
+    sched_max_wait: int | None = None
     ctk: str | None = None
     ctv: str | None = None
     fa: bool | None = None
@@ -159,6 +163,14 @@ class ServerProcess:
             server_args.extend(["--ctx-size", self.n_ctx])
         if self.n_slots:
             server_args.extend(["--parallel", self.n_slots])
+        if self.sched_budget:
+            server_args.extend(["--sched-budget", self.sched_budget])
+        if self.prefill_chunk:
+            server_args.extend(["--prefill-chunk", self.prefill_chunk])
+        if self.sched_policy is not None:
+            server_args.extend(["--sched-policy", self.sched_policy])
+        if self.sched_max_wait is not None:
+            server_args.extend(["--sched-max-wait", self.sched_max_wait])
         if self.ctk:
             server_args.extend(["-ctk", self.ctk])
         if self.ctv:
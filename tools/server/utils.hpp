@@ -982,16 +982,29 @@ static std::string safe_json_to_str(const json & data) {
 
 static std::vector<llama_token_data> get_token_probabilities(llama_context * ctx, int idx) {
     std::vector<llama_token_data> cur;
-    const auto * logits = llama_get_logits_ith(ctx, idx);
 
-    const llama_model * model = llama_get_model(ctx);
-    const llama_vocab * vocab = llama_model_get_vocab(model);
+    // with n_logits_top_k, the probabilities are relative to the selected candidates
+    const llama_token * top_k_ids    = nullptr;
+    const float       * top_k_logits = nullptr;
 
-    const int n_vocab = llama_vocab_n_tokens(vocab);
+    const int32_t n_top_k = llama_get_logits_top_k_ith(ctx, idx, &top_k_ids, &top_k_logits);
+    if (n_top_k > 0) {
+        cur.resize(n_top_k);
+        for (int32_t i = 0; i < n_top_k; i++) {
+            cur[i] = llama_token_data{top_k_ids[i], top_k_logits[i], 0.0f};
+        }
+    } else {
+        const auto * logits = llama_get_logits_ith(ctx, idx);
 
-    cur.resize(n_vocab);
-    for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-        cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        const llama_model * model = llama_get_model(ctx);
+        const llama_vocab * vocab = llama_model_get_vocab(model);
+
+        const int n_vocab = llama_vocab_n_tokens(vocab);
+
+        cur.resize(n_vocab);
+        for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
+            cur[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+        }
     }
 
     // sort tokens by logits